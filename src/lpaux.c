@@ -3,10 +3,21 @@
 ** 
 */
 
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdatomic.h>
+
+#include <lauxlib.h>
+
 #include "lpaux.h"
 
 #define NSINSEC 1000000000
 
+/* nanoseconds of the virtual clock, negative when the real clocks are
+   used */
+static atomic_llong virtualns = -1;
+
 /* compare times */
 int lpaux_time_cmp (timespec* t1, timespec* t2)
 {
@@ -42,7 +53,87 @@ void lpaux_time_dec (timespec* t, timespec* diff)
 timespec lpaux_time_period (double sec)
 {
   timespec t;
-  t.tv_sec = (int) sec;
+  t.tv_sec = (time_t) sec;
   t.tv_nsec = (int) ((sec - t.tv_sec) * 1E9);
   return t;
 }
+
+/* read the virtual clock, return false if it is not used */
+static int lpaux_time_virtual (timespec *t)
+{
+  long long ns = atomic_load( &virtualns );
+  if ( ns < 0 ) {
+    return 0;
+  }
+  t->tv_sec = (time_t)( ns / NSINSEC );
+  t->tv_nsec = (long)( ns % NSINSEC );
+  return 1;
+}
+
+/* current time (TIME_UTC) */
+void lpaux_time_utc (timespec *t)
+{
+  if ( !lpaux_time_virtual( t )) {
+    timespec_get( t, TIME_UTC );
+  }
+}
+
+/* current time (TIME_UTC) in seconds */
+double lpaux_time_now (void)
+{
+  timespec t;
+  lpaux_time_utc( &t );
+  return t.tv_sec + t.tv_nsec * 1E-9;
+}
+
+/* current time of the monotonic clock */
+void lpaux_time_mono (timespec *t)
+{
+  if ( !lpaux_time_virtual( t )) {
+    clock_gettime( CLOCK_MONOTONIC, t );
+  }
+}
+
+/* replace both clocks with a virtual one set to 't', which only moves when
+   set again; NULL gives the real clocks back */
+void lpaux_time_set (timespec *t)
+{
+  atomic_store( &virtualns, ( t == NULL ) ? -1 :
+    (long long)t->tv_sec * NSINSEC + t->tv_nsec );
+}
+
+/* sleep until an absolute time of the monotonic clock, busy-waiting for
+   the last 'spin' part of the sleep (if not NULL) */
+void lpaux_time_sleep_until (timespec *deadline, timespec *spin)
+{
+  timespec t = *deadline;
+  if ( spin != NULL ) {
+    lpaux_time_dec( &t, spin );
+  }
+  while ( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL ) == EINTR )
+    ;
+  if ( spin != NULL ) {
+    do {
+      clock_gettime( CLOCK_MONOTONIC, &t );
+    } while ( lpaux_time_cmp( &t, deadline ) < 0 );
+  }
+}
+
+/* replace an optional timeout at 'idx' by its absolute deadline */
+int lpaux_deadline (lua_State *L, int idx)
+{
+  if ( lua_isnoneornil( L, idx )) {
+    lua_settop( L, idx - 1 );
+    return 0;
+  }
+  double timeout = luaL_checknumber( L, idx );
+  lua_settop( L, idx - 1 );
+  lua_pushnumber( L, lpaux_time_now() + timeout );
+  return idx;
+}
+
+/* return true if the deadline at 'idx' has passed */
+int lpaux_expired (lua_State *L, int idx)
+{
+  return idx != 0 && lpaux_time_now() >= lua_tonumber( L, idx );
+}
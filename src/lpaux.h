@@ -7,6 +7,7 @@
 #define _LUA_LUAPROC_AUX_H_
 
 #include <time.h>
+#include <lua.h>
 
 typedef struct timespec timespec;
 
@@ -22,4 +23,29 @@ void lpaux_time_dec (timespec* t, timespec* diff);
 /* split to seconds and nanoseconds */
 timespec lpaux_time_period (double sec);
 
+/* current time (TIME_UTC) */
+void lpaux_time_utc (timespec *t);
+
+/* current time (TIME_UTC) in seconds */
+double lpaux_time_now (void);
+
+/* current time of the monotonic clock */
+void lpaux_time_mono (timespec *t);
+
+/* replace both clocks with a virtual one set to 't', which only moves when
+   set again; NULL gives the real clocks back */
+void lpaux_time_set (timespec *t);
+
+/* sleep until an absolute time of the monotonic clock, busy-waiting for
+   the last 'spin' part of the sleep (if not NULL) */
+void lpaux_time_sleep_until (timespec *deadline, timespec *spin);
+
+/* replace an optional timeout at 'idx' by its absolute deadline (TIME_UTC
+   seconds) and drop the arguments after it, so that it stays on the stack
+   for a continuation; return 'idx' or 0 if there is no timeout */
+int lpaux_deadline (lua_State *L, int idx);
+
+/* return true if the deadline at 'idx' has passed; 0 is no deadline */
+int lpaux_expired (lua_State *L, int idx);
+
 #endif 
@@ -0,0 +1,190 @@
+/*
+** compatibility layer for building luaproc against luajit 2.1
+** See Copyright Notice in luaproc.h
+*/
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "lpcompat.h"
+
+#ifdef LUAPROC_LUAJIT
+
+#define LPCOMPAT_WRAPPER "LUAPROC_COMPAT_WRAPPER"
+
+/* continuation left on the stack by a yielding c function */
+typedef struct stlpcont {
+  lua_KFunction k;
+  lua_KContext ctx;
+} lpcont;
+
+/* its address marks the top of a frame with a pending continuation */
+static const char lpcompat_pending = 0;
+#define PENDING ((void *)&lpcompat_pending)
+
+/* lua wrapper of a c function: while the function returns a frame with a
+   pending continuation, that is, it has yielded and was resumed, let
+   'finish' run the continuation */
+static const char lpcompat_wrapper[] =
+  "local finish, pending = ...\n"
+  "local select = select\n"
+  "local function loop( ... )\n"
+  "  local n = select( '#', ... )\n"
+  "  if n > 0 and select( n, ... ) == pending then\n"
+  "    return loop( finish( ... ))\n"
+  "  end\n"
+  "  return ...\n"
+  "end\n"
+  "return function( f )\n"
+  "  return function( ... ) return loop( f( ... )) end\n"
+  "end\n";
+
+/*********************
+ * integers and misc *
+ *********************/
+
+/* return true if the value at idx is a number with an integral value */
+int lpcompat_isinteger (lua_State *L, int idx)
+{
+  if ( lua_type( L, idx ) != LUA_TNUMBER ) {
+    return 0;
+  }
+  lua_Number n = lua_tonumber( L, idx );
+  lua_Integer i;
+  return lua_numbertointeger( n, &i ) && (lua_Number)i == n;
+}
+
+/* rotate the values between idx and the top n positions up */
+void lpcompat_rotate (lua_State *L, int idx, int n)
+{
+  if ( idx < 0 ) {
+    idx = lua_gettop( L ) + idx + 1;
+  }
+  for ( ; n > 0; n-- ) {
+    lua_insert( L, idx );
+  }
+  for ( ; n < 0; n++ ) {
+    lua_pushvalue( L, idx );
+    lua_remove( L, idx );
+  }
+}
+
+/* open a library once and keep it in _LOADED (and in a global if glob) */
+void lpcompat_requiref (lua_State *L, const char *modname, lua_CFunction f,
+                        int glob)
+{
+  lua_getfield( L, LUA_REGISTRYINDEX, "_LOADED" );
+  lua_getfield( L, -1, modname );
+  if ( !lua_toboolean( L, -1 )) {
+    lua_pop( L, 1 );
+    lua_pushcfunction( L, f );
+    lua_pushstring( L, modname );
+    lua_call( L, 1, 1 );
+    lua_pushvalue( L, -1 );
+    lua_setfield( L, -3, modname );
+  }
+  lua_remove( L, -2 );
+  if ( glob ) {
+    lua_pushvalue( L, -1 );
+    lua_setglobal( L, modname );
+  }
+}
+
+/* start a buffer of n bytes */
+char *lpcompat_buffinitsize (lua_State *L, luaL_Buffer *B, size_t n)
+{
+  luaL_buffinit( L, B );
+  return (char *)lua_newuserdata( L, n );
+}
+
+/* push the first n bytes of a buffer started by lpcompat_buffinitsize */
+void lpcompat_pushresultsize (luaL_Buffer *B, size_t n)
+{
+  lua_State *L = B->L;
+  lua_pushlstring( L, (const char *)lua_touserdata( L, -1 ), n );
+  lua_remove( L, -2 );
+}
+
+/*****************
+ * continuations *
+ *****************/
+
+/* resume a coroutine; a pending continuation gets the whole frame back */
+int lpcompat_resume (lua_State *L, int nargs, int *nres)
+{
+  if ( lua_status( L ) == LUA_YIELD && lua_gettop( L ) >= nargs + 2 &&
+       lua_touserdata( L, -( nargs + 1 )) == PENDING ) {
+    /* move the continuation over the values for the continued function */
+    lpcompat_rotate( L, -( nargs + 2 ), -2 );
+    nargs = lua_gettop( L );
+  }
+  int status = ( lua_resume )( L, nargs );
+  *nres = lua_gettop( L );
+  return status;
+}
+
+/* yield a c function called through a wrapper; k continues it. the values
+   of its frame are yielded with it, so no other values can be yielded */
+int lpcompat_yieldk (lua_State *L, int nresults, lua_KContext ctx,
+                     lua_KFunction k)
+{
+  if ( k == NULL ) {
+    return lua_yield( L, nresults );
+  }
+  lpcont *c = (lpcont *)lua_newuserdata( L, sizeof( lpcont ));
+  c->k = k;
+  c->ctx = ctx;
+  lua_pushlightuserdata( L, PENDING );
+  return lua_yield( L, lua_gettop( L ));
+}
+
+/* run the continuation on top of the frame of a resumed function */
+static int lpcompat_finish (lua_State *L)
+{
+  lpcont c = *(lpcont *)lua_touserdata( L, -2 );
+  lua_pop( L, 2 );
+  return c.k( L, LUA_YIELD, c.ctx );
+}
+
+/* replace the c function on top of the stack with a wrapper that runs its
+   continuations */
+void lpcompat_wrap (lua_State *L)
+{
+  /* wrapper factory is created once for each lua state */
+  lua_getfield( L, LUA_REGISTRYINDEX, LPCOMPAT_WRAPPER );
+  if ( lua_isnil( L, -1 )) {
+    lua_pop( L, 1 );
+    if ( luaL_loadbuffer( L, lpcompat_wrapper, sizeof( lpcompat_wrapper ) - 1,
+                          "=luaproc" ) != 0 ) {
+      lua_error( L );
+    }
+    lua_pushcfunction( L, lpcompat_finish );
+    lua_pushlightuserdata( L, PENDING );
+    lua_call( L, 2, 1 );
+    lua_pushvalue( L, -1 );
+    lua_setfield( L, LUA_REGISTRYINDEX, LPCOMPAT_WRAPPER );
+  }
+  lua_insert( L, -2 );
+  lua_call( L, 1, 1 );
+}
+
+/* wrap the c functions of the table at idx */
+void lpcompat_wrapfuncs (lua_State *L, int idx)
+{
+  if ( idx < 0 ) {
+    idx = lua_gettop( L ) + idx + 1;
+  }
+  lua_pushnil( L );
+  while ( lua_next( L, idx ) != 0 ) {
+    if ( lua_iscfunction( L, -1 )) {
+      lpcompat_wrap( L );
+      lua_pushvalue( L, -2 );
+      lua_insert( L, -2 );
+      lua_rawset( L, idx );  /* replacing an existing field keeps the walk */
+    } else {
+      lua_pop( L, 1 );
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,100 @@
+/*
+** compatibility layer for building luaproc against luajit 2.1
+** See Copyright Notice in luaproc.h
+*/
+
+#ifndef _LUA_LUAPROC_COMPAT_H_
+#define _LUA_LUAPROC_COMPAT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+/* luajit implements the lua 5.1 api with a few 5.2 additions */
+#if (LUA_VERSION_NUM == 501)
+
+#define LUAPROC_LUAJIT
+
+#ifndef LUA_OK
+#define LUA_OK 0
+#endif
+
+#define LUA_OPEQ 0
+
+typedef intptr_t lua_KContext;
+typedef int ( *lua_KFunction )( lua_State *L, int status, lua_KContext ctx );
+typedef size_t lua_Unsigned;
+
+#ifndef LUA_MAXINTEGER
+#define LUA_MAXINTEGER PTRDIFF_MAX
+#define LUA_MININTEGER PTRDIFF_MIN
+#endif
+
+/* integers are doubles with an integral value */
+#define lua_numbertointeger( n, p ) \
+  (( n ) >= (lua_Number)PTRDIFF_MIN && ( n ) < -(lua_Number)PTRDIFF_MIN && \
+    ( *( p ) = (lua_Integer)( n ), 1 ))
+
+#define lua_isinteger( L, idx )    lpcompat_isinteger( L, idx )
+#define lua_rawlen( L, idx )       lua_objlen( L, idx )
+#define lua_compare( L, a, b, op ) lua_equal( L, a, b )
+#define lua_pushglobaltable( L )   lua_pushvalue( L, LUA_GLOBALSINDEX )
+#define lua_rotate( L, idx, n )    lpcompat_rotate( L, idx, n )
+#define lua_dump( L, w, d, s )     lua_dump( L, w, d )
+#define luaL_requiref( L, m, f, g ) lpcompat_requiref( L, m, f, g )
+
+/* the buffer of a single read is a userdata on the stack */
+#define luaL_buffinitsize( L, B, n ) lpcompat_buffinitsize( L, B, n )
+#define luaL_pushresultsize( B, n )  lpcompat_pushresultsize( B, n )
+
+/* continuations are emulated: a yielding function leaves its continuation on
+   the stack and the lua wrapper made by lpcompat_wrapfuncs calls it after
+   the resume. functions called with lua_callk cannot yield */
+#define lua_resume( L, from, n, nres ) lpcompat_resume( L, n, nres )
+#define lua_yieldk( L, n, ctx, k )     lpcompat_yieldk( L, n, ctx, k )
+#define lua_callk( L, n, r, ctx, k )   lua_call( L, n, r )
+
+/***********************
+ * function prototypes *
+ **********************/
+
+/* return true if the value at idx is a number with an integral value */
+int lpcompat_isinteger( lua_State *L, int idx );
+
+/* rotate the values between idx and the top n positions up */
+void lpcompat_rotate( lua_State *L, int idx, int n );
+
+/* open a library once and keep it in _LOADED (and in a global if glob) */
+void lpcompat_requiref( lua_State *L, const char *modname, lua_CFunction f,
+                        int glob );
+
+/* start a buffer of n bytes */
+char *lpcompat_buffinitsize( lua_State *L, luaL_Buffer *B, size_t n );
+
+/* push the first n bytes of a buffer started by lpcompat_buffinitsize */
+void lpcompat_pushresultsize( luaL_Buffer *B, size_t n );
+
+/* resume a coroutine; a pending continuation gets the whole frame back */
+int lpcompat_resume( lua_State *L, int nargs, int *nres );
+
+/* yield a c function called through a wrapper; k continues it */
+int lpcompat_yieldk( lua_State *L, int nresults, lua_KContext ctx,
+                     lua_KFunction k );
+
+/* replace the c function on top of the stack with a wrapper that runs its
+   continuations */
+void lpcompat_wrap( lua_State *L );
+
+/* wrap the c functions of the table at idx */
+void lpcompat_wrapfuncs( lua_State *L, int idx );
+
+#else
+
+/* lua 5.3 and 5.4 have continuations */
+#define lpcompat_wrap( L ) ((void)0)
+#define lpcompat_wrapfuncs( L, idx ) ((void)0)
+
+#endif
+
+#endif
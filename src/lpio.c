@@ -0,0 +1,751 @@
+/*
+** non-blocking input/output of lua processes
+** See Copyright Notice in luaproc.h
+*/
+
+#define _GNU_SOURCE
+
+#include <threads.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "lpcompat.h"
+#include "luaproc.h"
+#include "lpaux.h"
+#include "lpobj.h"
+#include "lpio.h"
+
+#define FALSE 0
+#define TRUE  !FALSE
+
+/*******************
+ * structure types *
+ ******************/
+
+/* non-blocking file descriptor watched by the reactor */
+typedef struct stiofile {
+  lpobject obj;
+  waitq wq;               /* also protects the fields below */
+  int fd;
+  int closed;
+  int busy;               /* system calls in progress */
+  unsigned int events;    /* number of reactor notifications */
+  struct stiofile *zombie;  /* next destroyed file to be freed */
+} iofile;
+
+/********************
+ * global variables *
+ *******************/
+
+/* protects reactor state and the registration of files */
+static mtx_t mutex_io;
+
+/* reactor thread */
+static thrd_t reactor;
+static int reactor_running = FALSE;
+static int reactor_stopping = FALSE;
+static int epollfd = -1;
+static int stopfd = -1;
+
+/* destroyed files, freed after the reactor handled their pending events */
+static iofile *zombies = NULL;
+
+/***********************
+ * register prototypes *
+ ***********************/
+
+static int lpio_pipe( lua_State *L );
+static int lpio_wrap( lua_State *L );
+static int lpio_listen( lua_State *L );
+static int lpio_connect( lua_State *L );
+static int lpio_read( lua_State *L );
+static int lpio_write( lua_State *L );
+static int lpio_accept( lua_State *L );
+static int lpio_close_file( lua_State *L );
+static int lpio_getfd( lua_State *L );
+static int lpio_port( lua_State *L );
+static void lpio_destroy( lpobject *obj );
+
+/* functions of the luaproc.io table */
+const luaL_Reg lpio_funcs[] = {
+  { "pipe", lpio_pipe },
+  { "wrap", lpio_wrap },
+  { "listen", lpio_listen },
+  { "connect", lpio_connect },
+  { "read", lpio_read },
+  { "write", lpio_write },
+  { "accept", lpio_accept },
+  { "close", lpio_close_file },
+  { NULL, NULL }
+};
+
+/* file methods */
+static const luaL_Reg lpio_file_funcs[] = {
+  { "read", lpio_read },
+  { "write", lpio_write },
+  { "accept", lpio_accept },
+  { "close", lpio_close_file },
+  { "fd", lpio_getfd },
+  { "port", lpio_port },
+  { NULL, NULL }
+};
+
+/* file type */
+static const lpobject_type lpio_file_type = {
+  "luaproc.file", lpio_file_funcs, lpio_destroy
+};
+
+/*********************
+ * reactor functions *
+ *********************/
+
+/* free a destroyed file */
+static void lpio_free (iofile *f)
+{
+  waitq_destroy( &f->wq );
+  free( f );
+}
+
+/* free destroyed files; mutex_io must be locked */
+static void lpio_free_zombies (void)
+{
+  while ( zombies != NULL ) {
+    iofile *f = zombies;
+    zombies = f->zombie;
+    lpio_free( f );
+  }
+}
+
+/* reactor thread: wake processes waiting on files with new events */
+static int lpio_reactor (void *arg)
+{
+  struct epoll_event ev[LUAPROC_IO_MAX_EVENTS];
+
+  for (;;) {
+    int n = epoll_wait( epollfd, ev, LUAPROC_IO_MAX_EVENTS, -1 );
+    if ( n < 0 && errno != EINTR ) {
+      break;
+    }
+    mtx_lock( &mutex_io );
+    if ( reactor_stopping ) {
+      mtx_unlock( &mutex_io );
+      break;
+    }
+    for ( int i = 0; i < n; i++ ) {
+      iofile *f = (iofile *)ev[i].data.ptr;
+      /* closed files may still have events returned before they were
+         removed, they are not freed until the end of this loop */
+      if ( f != NULL && !f->closed ) {
+        mtx_lock( &f->wq.mutex );
+        f->events++;
+        waitq_wake( &f->wq );
+        mtx_unlock( &f->wq.mutex );
+      }
+    }
+    lpio_free_zombies();
+    mtx_unlock( &mutex_io );
+  }
+  return 0;
+}
+
+/* start reactor thread if it is not running; mutex_io must be locked */
+static int lpio_start (void)
+{
+  if ( reactor_running ) {
+    return TRUE;
+  }
+  epollfd = epoll_create1( EPOLL_CLOEXEC );
+  stopfd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+  if ( epollfd >= 0 && stopfd >= 0 ) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if ( epoll_ctl( epollfd, EPOLL_CTL_ADD, stopfd, &ev ) == 0 &&
+         thrd_create( &reactor, lpio_reactor, NULL ) == thrd_success ) {
+      reactor_running = TRUE;
+      return TRUE;
+    }
+  }
+  if ( epollfd >= 0 ) {
+    close( epollfd );
+  }
+  if ( stopfd >= 0 ) {
+    close( stopfd );
+  }
+  epollfd = stopfd = -1;
+  return FALSE;
+}
+
+/* mark a file as closed, stop watching it and wake its waiting processes;
+   the descriptor is closed now or by the last system call in progress;
+   mutex_io must be locked */
+static void lpio_shut (iofile *f)
+{
+  mtx_lock( &f->wq.mutex );
+  if ( !f->closed ) {
+    f->closed = TRUE;
+    epoll_ctl( epollfd, EPOLL_CTL_DEL, f->fd, NULL );
+    if ( f->busy == 0 ) {
+      close( f->fd );
+      f->fd = -1;
+    }
+    waitq_wake( &f->wq );
+  }
+  mtx_unlock( &f->wq.mutex );
+}
+
+/* destroy a file when it is not referenced anymore */
+static void lpio_destroy (lpobject *obj)
+{
+  iofile *f = (iofile *)obj;
+  mtx_lock( &mutex_io );
+  lpio_shut( f );
+  if ( reactor_running ) {  /* the reactor may still hold an event */
+    f->zombie = zombies;
+    zombies = f;
+  } else {
+    lpio_free( f );
+  }
+  mtx_unlock( &mutex_io );
+}
+
+/******************
+ * file functions *
+ ******************/
+
+/* push nil and the message of errno */
+static int lpio_error (lua_State *L, int err)
+{
+  lua_pushnil( L );
+  lua_pushstring( L, strerror( err ));
+  return 2;
+}
+
+/* push a file watching a descriptor; the descriptor is closed if failed */
+static int lpio_push (lua_State *L, int fd)
+{
+  int flags = fcntl( fd, F_GETFL );
+  if ( flags < 0 || fcntl( fd, F_SETFL, flags | O_NONBLOCK ) < 0 ) {
+    int err = errno;
+    close( fd );
+    return lpio_error( L, err );
+  }
+
+  iofile *f = (iofile *)malloc( sizeof( iofile ));
+  if ( f == NULL ) {
+    close( fd );
+    return lpio_error( L, ENOMEM );
+  }
+  lpobj_init( &f->obj, &lpio_file_type );
+  waitq_init( &f->wq );
+  f->fd = fd;
+  f->closed = FALSE;
+  f->busy = 0;
+  f->events = 0;
+  f->zombie = NULL;
+
+  /* edge triggered: the reactor only reports new readiness, so every
+     operation tries the system call first */
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.ptr = f;
+  mtx_lock( &mutex_io );
+  int err = 0;
+  if ( !lpio_start()) {
+    err = errno;
+  } else if ( epoll_ctl( epollfd, EPOLL_CTL_ADD, fd, &ev ) != 0 ) {
+    err = errno;
+  }
+  mtx_unlock( &mutex_io );
+  if ( err != 0 ) {
+    close( fd );
+    lpio_free( f );
+    return lpio_error( L, err );
+  }
+
+  lpobj_push( L, &f->obj );
+  lpobj_release( &f->obj );
+  return 1;
+}
+
+/* start a system call on a file; return FALSE if it is closed */
+static int lpio_enter (iofile *f, unsigned int *events)
+{
+  mtx_lock( &f->wq.mutex );
+  int ok = !f->closed;
+  if ( ok ) {
+    f->busy++;
+    *events = f->events;
+  }
+  mtx_unlock( &f->wq.mutex );
+  return ok;
+}
+
+/* finish a system call on a file; close the descriptor if the file was
+   closed meanwhile */
+static void lpio_leave (iofile *f)
+{
+  mtx_lock( &f->wq.mutex );
+  if ( --f->busy == 0 && f->closed && f->fd >= 0 ) {
+    close( f->fd );
+    f->fd = -1;
+  }
+  mtx_unlock( &f->wq.mutex );
+}
+
+/* wait for new events after a system call would block; return 0 if the
+   caller should try again (the file got events meanwhile), or the number of
+   results pushed (nil and an error message) */
+static int lpio_wait (lua_State *L, iofile *f, unsigned int events,
+  int deadline, lua_KContext ctx, lua_KFunction k, int *blocked)
+{
+  *blocked = FALSE;
+  mtx_lock( &f->wq.mutex );
+  if ( f->closed ) {
+    mtx_unlock( &f->wq.mutex );
+    lua_pushnil( L );
+    lua_pushstring( L, "closed" );
+    return 2;
+  }
+  if ( f->events != events ) {
+    mtx_unlock( &f->wq.mutex );
+    return 0;
+  }
+  if ( lpaux_expired( L, deadline )) {
+    mtx_unlock( &f->wq.mutex );
+    lua_pushnil( L );
+    lua_pushstring( L, "timeout" );
+    return 2;
+  }
+  *blocked = TRUE;
+  return luaproc_block( L, &f->wq, deadline, ctx, k );
+}
+
+/* remove the caller from the wait queue of a file after it was woken */
+static iofile *lpio_resume (lua_State *L)
+{
+  iofile *f = (iofile *)lpobj_test( L, 1 );
+  mtx_lock( &f->wq.mutex );
+  luaproc_unblock( L, &f->wq );
+  mtx_unlock( &f->wq.mutex );
+  return f;
+}
+
+/* continue reading up to n bytes */
+static int lpio_read_k (lua_State *L, int status, lua_KContext ctx)
+{
+  iofile *f = lpio_resume( L );
+  size_t n = (size_t)lua_tointeger( L, 2 );
+  int deadline = ( lua_gettop( L ) >= 3 ) ? 3 : 0;
+
+  for (;;) {
+    unsigned int events;
+    if ( !lpio_enter( f, &events )) {
+      lua_pushnil( L );
+      lua_pushstring( L, "closed" );
+      return 2;
+    }
+    int top = lua_gettop( L );
+    luaL_Buffer b;
+    char *p = luaL_buffinitsize( L, &b, n );
+    ssize_t r = read( f->fd, p, n );
+    int err = errno;
+    lpio_leave( f );
+
+    if ( r > 0 ) {
+      luaL_pushresultsize( &b, (size_t)r );
+      return 1;
+    }
+    lua_settop( L, top );  /* drop buffer */
+    if ( r == 0 ) {
+      lua_pushnil( L );
+      lua_pushstring( L, "eof" );
+      return 2;
+    }
+    if ( err != EAGAIN && err != EWOULDBLOCK && err != EINTR ) {
+      return lpio_error( L, err );
+    }
+    int blocked;
+    int nres = lpio_wait( L, f, events, deadline, ctx, lpio_read_k, &blocked );
+    if ( blocked || nres != 0 ) {
+      return nres;
+    }
+  }
+}
+
+/* read up to n bytes, waiting until some are available or the timeout
+   expires; return them, or nil and "eof" at the end of the stream, or nil and
+   an error message */
+static int lpio_read (lua_State *L)
+{
+  lpobj_check( L, 1, &lpio_file_type );
+  lua_Integer n = luaL_optinteger( L, 2, LUAL_BUFFERSIZE );
+  luaL_argcheck( L, n > 0, 2, "size must be positive" );
+  lua_pushinteger( L, n );
+  lua_replace( L, 2 );
+  lpaux_deadline( L, 3 );
+  return lpio_read_k( L, LUA_OK, 0 );
+}
+
+/* continue writing a string, 'ctx' holds the number of bytes written */
+static int lpio_write_k (lua_State *L, int status, lua_KContext ctx)
+{
+  iofile *f = lpio_resume( L );
+  size_t len;
+  const char *s = lua_tolstring( L, 2, &len );
+  size_t done = (size_t)ctx;
+  int deadline = ( lua_gettop( L ) >= 3 ) ? 3 : 0;
+
+  while ( done < len ) {
+    unsigned int events;
+    if ( !lpio_enter( f, &events )) {
+      lua_pushnil( L );
+      lua_pushstring( L, "closed" );
+      return 2;
+    }
+    ssize_t r = write( f->fd, s + done, len - done );
+    int err = errno;
+    lpio_leave( f );
+
+    if ( r >= 0 ) {
+      done += (size_t)r;
+      continue;
+    }
+    if ( err != EAGAIN && err != EWOULDBLOCK && err != EINTR ) {
+      return lpio_error( L, err );
+    }
+    int blocked;
+    int nres = lpio_wait( L, f, events, deadline, (lua_KContext)done,
+      lpio_write_k, &blocked );
+    if ( blocked || nres != 0 ) {
+      return nres;
+    }
+  }
+  lua_pushinteger( L, (lua_Integer)len );
+  return 1;
+}
+
+/* write a whole string, waiting while the descriptor is full; return the
+   number of bytes written or nil and an error message */
+static int lpio_write (lua_State *L)
+{
+  lpobj_check( L, 1, &lpio_file_type );
+  luaL_checkstring( L, 2 );
+  lpaux_deadline( L, 3 );
+  return lpio_write_k( L, LUA_OK, 0 );
+}
+
+/* continue accepting a connection */
+static int lpio_accept_k (lua_State *L, int status, lua_KContext ctx)
+{
+  iofile *f = lpio_resume( L );
+  int deadline = ( lua_gettop( L ) >= 2 ) ? 2 : 0;
+
+  for (;;) {
+    unsigned int events;
+    if ( !lpio_enter( f, &events )) {
+      lua_pushnil( L );
+      lua_pushstring( L, "closed" );
+      return 2;
+    }
+    int fd = accept4( f->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC );
+    int err = errno;
+    lpio_leave( f );
+
+    if ( fd >= 0 ) {
+      return lpio_push( L, fd );
+    }
+    if ( err != EAGAIN && err != EWOULDBLOCK && err != EINTR &&
+         err != ECONNABORTED ) {
+      return lpio_error( L, err );
+    }
+    int blocked;
+    int nres = lpio_wait( L, f, events, deadline, ctx, lpio_accept_k,
+      &blocked );
+    if ( blocked || nres != 0 ) {
+      return nres;
+    }
+  }
+}
+
+/* accept a connection of a listening socket, waiting until there is one or
+   the timeout expires; return a new file or nil and an error message */
+static int lpio_accept (lua_State *L)
+{
+  lpobj_check( L, 1, &lpio_file_type );
+  lpaux_deadline( L, 2 );
+  return lpio_accept_k( L, LUA_OK, 0 );
+}
+
+/* continue connecting a socket */
+static int lpio_connect_k (lua_State *L, int status, lua_KContext ctx)
+{
+  iofile *f = lpio_resume( L );
+  int deadline = ( lua_gettop( L ) >= 2 ) ? 2 : 0;
+
+  for (;;) {
+    unsigned int events;
+    if ( !lpio_enter( f, &events )) {
+      lua_pushnil( L );
+      lua_pushstring( L, "closed" );
+      return 2;
+    }
+    int err = 0;
+    socklen_t len = sizeof( err );
+    struct sockaddr_storage sa;
+    socklen_t salen = sizeof( sa );
+    if ( getsockopt( f->fd, SOL_SOCKET, SO_ERROR, &err, &len ) != 0 ) {
+      err = errno;
+    }
+    /* no error and no peer means the connection is in progress */
+    int connected = ( err == 0 &&
+      getpeername( f->fd, (struct sockaddr *)&sa, &salen ) == 0 );
+    lpio_leave( f );
+
+    if ( err != 0 ) {
+      return lpio_error( L, err );
+    }
+    if ( connected ) {
+      lua_settop( L, 1 );
+      return 1;
+    }
+    int blocked;
+    int nres = lpio_wait( L, f, events, deadline, ctx, lpio_connect_k,
+      &blocked );
+    if ( blocked || nres != 0 ) {
+      return nres;
+    }
+  }
+}
+
+/* resolve an address for a stream socket; push nil and an error message if
+   failed */
+static struct addrinfo *lpio_resolve (lua_State *L, const char *host,
+  const char *port, int passive)
+{
+  struct addrinfo hints, *res = NULL;
+  memset( &hints, 0, sizeof( hints ));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = passive ? AI_PASSIVE : 0;
+  int r = getaddrinfo( host, port, &hints, &res );
+  if ( r != 0 ) {
+    lua_pushnil( L );
+    lua_pushstring( L, gai_strerror( r ));
+    return NULL;
+  }
+  return res;
+}
+
+/* connect to a host and port, waiting until connected or the timeout
+   expires; return a new file or nil and an error message */
+static int lpio_connect (lua_State *L)
+{
+  const char *host = luaL_checkstring( L, 1 );
+  const char *port = luaL_checkstring( L, 2 );
+  struct addrinfo *res = lpio_resolve( L, host, port, FALSE );
+  if ( res == NULL ) {
+    return 2;
+  }
+
+  int fd = -1, err = 0;
+  for ( struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next ) {
+    fd = socket( ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK |
+      SOCK_CLOEXEC, ai->ai_protocol );
+    if ( fd < 0 ) {
+      err = errno;
+      continue;
+    }
+    if ( connect( fd, ai->ai_addr, ai->ai_addrlen ) == 0 ||
+         errno == EINPROGRESS ) {
+      break;
+    }
+    err = errno;
+    close( fd );
+    fd = -1;
+  }
+  freeaddrinfo( res );
+  if ( fd < 0 ) {
+    return lpio_error( L, err );
+  }
+
+  /* keep the file and the deadline on the stack for the continuation */
+  lpaux_deadline( L, 3 );
+  if ( lpio_push( L, fd ) != 1 ) {
+    return 2;
+  }
+  lua_replace( L, 1 );
+  lua_remove( L, 2 );
+  return lpio_connect_k( L, LUA_OK, 0 );
+}
+
+/* create a socket listening on a host ("*" or nil for any) and port (0 for
+   any); return a new file or nil and an error message */
+static int lpio_listen (lua_State *L)
+{
+  const char *host = luaL_optstring( L, 1, "*" );
+  const char *port = luaL_checkstring( L, 2 );
+  int backlog = (int)luaL_optinteger( L, 3, LUAPROC_IO_DEFAULT_BACKLOG );
+  struct addrinfo *res = lpio_resolve( L, strcmp( host, "*" ) ? host : NULL,
+    port, TRUE );
+  if ( res == NULL ) {
+    return 2;
+  }
+
+  int fd = -1, err = 0, one = 1;
+  for ( struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next ) {
+    fd = socket( ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK |
+      SOCK_CLOEXEC, ai->ai_protocol );
+    if ( fd < 0 ) {
+      err = errno;
+      continue;
+    }
+    setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ));
+    if ( bind( fd, ai->ai_addr, ai->ai_addrlen ) == 0 &&
+         listen( fd, backlog ) == 0 ) {
+      break;
+    }
+    err = errno;
+    close( fd );
+    fd = -1;
+  }
+  freeaddrinfo( res );
+  if ( fd < 0 ) {
+    return lpio_error( L, err );
+  }
+  return lpio_push( L, fd );
+}
+
+/* create a pipe; return files for its read and write ends or nil and an
+   error message */
+static int lpio_pipe (lua_State *L)
+{
+  int fds[2];
+  if ( pipe2( fds, O_NONBLOCK | O_CLOEXEC ) != 0 ) {
+    return lpio_error( L, errno );
+  }
+  if ( lpio_push( L, fds[0] ) != 1 ) {
+    close( fds[1] );
+    return 2;
+  }
+  /* both files, or nil and an error message */
+  lpio_push( L, fds[1] );
+  return 2;
+}
+
+/* create a file for a copy of an existing descriptor; note that it makes
+   the descriptor non-blocking for all its users */
+static int lpio_wrap (lua_State *L)
+{
+  int fd = (int)luaL_checkinteger( L, 1 );
+  int dup = fcntl( fd, F_DUPFD_CLOEXEC, 0 );
+  if ( dup < 0 ) {
+    return lpio_error( L, errno );
+  }
+  return lpio_push( L, dup );
+}
+
+/* close a file, waking the processes waiting on it */
+static int lpio_close_file (lua_State *L)
+{
+  iofile *f = (iofile *)lpobj_check( L, 1, &lpio_file_type );
+  mtx_lock( &mutex_io );
+  lpio_shut( f );
+  mtx_unlock( &mutex_io );
+  lua_pushboolean( L, TRUE );
+  return 1;
+}
+
+/* return the descriptor of a file or nil if it is closed */
+static int lpio_getfd (lua_State *L)
+{
+  iofile *f = (iofile *)lpobj_check( L, 1, &lpio_file_type );
+  mtx_lock( &f->wq.mutex );
+  int fd = f->closed ? -1 : f->fd;
+  mtx_unlock( &f->wq.mutex );
+  if ( fd < 0 ) {
+    lua_pushnil( L );
+  } else {
+    lua_pushinteger( L, fd );
+  }
+  return 1;
+}
+
+/* return the local port of a socket or nil and an error message */
+static int lpio_port (lua_State *L)
+{
+  iofile *f = (iofile *)lpobj_check( L, 1, &lpio_file_type );
+  unsigned int events;
+  if ( !lpio_enter( f, &events )) {
+    lua_pushnil( L );
+    lua_pushstring( L, "closed" );
+    return 2;
+  }
+  struct sockaddr_storage sa;
+  socklen_t len = sizeof( sa );
+  int r = getsockname( f->fd, (struct sockaddr *)&sa, &len );
+  int err = errno;
+  lpio_leave( f );
+  if ( r != 0 ) {
+    return lpio_error( L, err );
+  }
+  if ( sa.ss_family == AF_INET ) {
+    lua_pushinteger( L, ntohs( ((struct sockaddr_in *)&sa)->sin_port ));
+  } else if ( sa.ss_family == AF_INET6 ) {
+    lua_pushinteger( L, ntohs( ((struct sockaddr_in6 *)&sa)->sin6_port ));
+  } else {
+    lua_pushnil( L );
+    lua_pushstring( L, "not an internet socket" );
+    return 2;
+  }
+  return 1;
+}
+
+/**********************
+ * exported functions *
+ **********************/
+
+/* initialize reactor state (the reactor thread starts on first use) */
+void lpio_init (void)
+{
+  mtx_init( &mutex_io, mtx_plain );
+}
+
+/* stop reactor thread; mutex_io is kept, because files of lua states closed
+   later are still destroyed through it */
+void lpio_close (void)
+{
+  mtx_lock( &mutex_io );
+  int running = reactor_running;
+  if ( running ) {
+    uint64_t one = 1;
+    reactor_stopping = TRUE;
+    ssize_t r = write( stopfd, &one, sizeof( one ));
+    (void)r;  /* the counter can not overflow with a single write */
+  }
+  mtx_unlock( &mutex_io );
+  if ( !running ) {
+    return;
+  }
+
+  thrd_join( reactor, NULL );
+  mtx_lock( &mutex_io );
+  reactor_running = FALSE;
+  reactor_stopping = FALSE;
+  lpio_free_zombies();
+  close( epollfd );
+  close( stopfd );
+  epollfd = stopfd = -1;
+  mtx_unlock( &mutex_io );
+}
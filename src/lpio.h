@@ -0,0 +1,31 @@
+/*
+** non-blocking input/output of lua processes
+** See Copyright Notice in luaproc.h
+*/
+
+#ifndef _LUA_LUAPROC_IO_H_
+#define _LUA_LUAPROC_IO_H_
+
+#include <lua.h>
+#include <lauxlib.h>
+
+/* maximum number of events the reactor handles per wakeup */
+#define LUAPROC_IO_MAX_EVENTS 64
+
+/* default length of the queue of pending connections */
+#define LUAPROC_IO_DEFAULT_BACKLOG 128
+
+/* functions of the luaproc.io table */
+extern const luaL_Reg lpio_funcs[];
+
+/***********************
+ * function prototypes *
+ **********************/
+
+/* initialize reactor state (the reactor thread starts on first use) */
+void lpio_init( void );
+
+/* stop reactor thread */
+void lpio_close( void );
+
+#endif
@@ -0,0 +1,272 @@
+/*
+** memory mapped files shared between lua processes
+** See Copyright Notice in luaproc.h
+*/
+
+#define _GNU_SOURCE
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "lpcompat.h"
+#include "lpobj.h"
+#include "lpmapfile.h"
+
+/*******************
+ * structure types *
+ ******************/
+
+/* read only mapping of a whole file */
+typedef struct {
+  lpobject obj;
+  const char *base;
+  size_t size;
+  atomic_size_t cursor;  /* start of the next chunk */
+} mapfile;
+
+/***********************
+ * register prototypes *
+ ***********************/
+
+static int lpmapfile_open( lua_State *L );
+static int lpmapfile_next( lua_State *L );
+static int lpmapfile_rewind( lua_State *L );
+static int lpmapfile_read( lua_State *L );
+static int lpmapfile_find( lua_State *L );
+static int lpmapfile_count( lua_State *L );
+static int lpmapfile_lines( lua_State *L );
+static int lpmapfile_size( lua_State *L );
+static void lpmapfile_destroy( lpobject *obj );
+
+/* mapped file functions of the luaproc library */
+const luaL_Reg lpmapfile_funcs[] = {
+  { "mapfile", lpmapfile_open },
+  { NULL, NULL }
+};
+
+/* mapped file methods */
+static const luaL_Reg lpmapfile_file_funcs[] = {
+  { "next", lpmapfile_next },
+  { "rewind", lpmapfile_rewind },
+  { "read", lpmapfile_read },
+  { "find", lpmapfile_find },
+  { "count", lpmapfile_count },
+  { "lines", lpmapfile_lines },
+  { "size", lpmapfile_size },
+  { NULL, NULL }
+};
+
+/* mapped file type */
+static const lpobject_type lpmapfile_type = {
+  "luaproc.mapfile", lpmapfile_file_funcs, lpmapfile_destroy
+};
+
+/***********************
+ * auxiliary functions *
+ ***********************/
+
+/* unmap a file when it is not referenced anymore */
+static void lpmapfile_destroy (lpobject *obj)
+{
+  mapfile *m = (mapfile *)obj;
+  if ( m->size > 0 ) {
+    munmap( (void *)m->base, m->size );
+  }
+  free( m );
+}
+
+/* check the view (offset and length, the rest of the file by default) at
+   'arg' and 'arg'+1; return its start */
+static const char *lpmapfile_view (lua_State *L, mapfile *m, int arg,
+  size_t *len)
+{
+  lua_Integer off = luaL_optinteger( L, arg, 0 );
+  luaL_argcheck( L, off >= 0 && (lua_Unsigned)off <= m->size, arg,
+    "offset out of range" );
+  lua_Integer n = luaL_optinteger( L, arg + 1, m->size - off );
+  luaL_argcheck( L, n >= 0 && (lua_Unsigned)n <= m->size - off, arg + 1,
+    "length out of range" );
+  *len = (size_t)n;
+  return m->base + off;
+}
+
+/*********************
+ * mapfile functions *
+ *********************/
+
+/* map a whole file for reading; return a mapped file or nil and an error
+   message */
+static int lpmapfile_open (lua_State *L)
+{
+  const char *path = luaL_checkstring( L, 1 );
+
+  int fd = open( path, O_RDONLY | O_CLOEXEC );
+  if ( fd < 0 ) {
+    lua_pushnil( L );
+    lua_pushfstring( L, "%s: %s", path, strerror( errno ));
+    return 2;
+  }
+  struct stat st;
+  void *base = NULL;
+  int err = 0;
+  if ( fstat( fd, &st ) != 0 ) {
+    err = errno;
+  } else if ( st.st_size > 0 ) {
+    base = mmap( NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    if ( base == MAP_FAILED ) {
+      err = errno;
+    } else {
+      /* chunks are usually scanned from start to end */
+      madvise( base, (size_t)st.st_size, MADV_SEQUENTIAL );
+    }
+  }
+  close( fd );  /* the mapping keeps the file */
+  mapfile *m = ( err == 0 ) ? (mapfile *)malloc( sizeof( mapfile )) : NULL;
+  if ( m == NULL ) {
+    if ( err == 0 ) {
+      err = ENOMEM;
+      if ( base != NULL ) {
+        munmap( base, (size_t)st.st_size );
+      }
+    }
+    lua_pushnil( L );
+    lua_pushfstring( L, "%s: %s", path, strerror( err ));
+    return 2;
+  }
+
+  lpobj_init( &m->obj, &lpmapfile_type );
+  m->base = (const char *)base;
+  m->size = ( base != NULL ) ? (size_t)st.st_size : 0;
+  atomic_init( &m->cursor, 0 );
+  lpobj_push( L, &m->obj );
+  lpobj_release( &m->obj );
+  return 1;
+}
+
+/* take the next chunk of about 'n' bytes extended to the end of its last
+   line; return its offset and length, or nil when the file is exhausted.
+   processes sharing the file take different chunks */
+static int lpmapfile_next (lua_State *L)
+{
+  mapfile *m = (mapfile *)lpobj_check( L, 1, &lpmapfile_type );
+  lua_Integer n = luaL_optinteger( L, 2, LUAPROC_MAPFILE_DEFAULT_CHUNK );
+  luaL_argcheck( L, n > 0, 2, "chunk size must be positive" );
+
+  size_t start = atomic_load( &m->cursor );
+  size_t end;
+  do {
+    if ( start >= m->size ) {
+      lua_pushnil( L );
+      return 1;
+    }
+    end = ( (lua_Unsigned)n >= m->size - start ) ? m->size : start + n;
+    if ( end < m->size ) {
+      const char *nl = memchr( m->base + end - 1, '\n', m->size - end + 1 );
+      end = ( nl != NULL ) ? (size_t)( nl - m->base ) + 1 : m->size;
+    }
+  } while ( !atomic_compare_exchange_weak( &m->cursor, &start, end ));
+
+  lua_pushinteger( L, (lua_Integer)start );
+  lua_pushinteger( L, (lua_Integer)( end - start ));
+  return 2;
+}
+
+/* start taking chunks from the beginning again */
+static int lpmapfile_rewind (lua_State *L)
+{
+  mapfile *m = (mapfile *)lpobj_check( L, 1, &lpmapfile_type );
+  atomic_store( &m->cursor, 0 );
+  return 0;
+}
+
+/* return the bytes of a view as a string */
+static int lpmapfile_read (lua_State *L)
+{
+  mapfile *m = (mapfile *)lpobj_check( L, 1, &lpmapfile_type );
+  size_t len;
+  const char *p = lpmapfile_view( L, m, 2, &len );
+  lua_pushlstring( L, p, len );
+  return 1;
+}
+
+/* find a plain string in a view; return the offset of its first occurrence
+   in the file or nil */
+static int lpmapfile_find (lua_State *L)
+{
+  mapfile *m = (mapfile *)lpobj_check( L, 1, &lpmapfile_type );
+  size_t slen, len;
+  const char *s = luaL_checklstring( L, 2, &slen );
+  const char *p = lpmapfile_view( L, m, 3, &len );
+  const char *found = memmem( p, len, s, slen );
+  if ( found == NULL ) {
+    lua_pushnil( L );
+  } else {
+    lua_pushinteger( L, (lua_Integer)( found - m->base ));
+  }
+  return 1;
+}
+
+/* count the occurrences of a byte ("\n" by default) in a view */
+static int lpmapfile_count (lua_State *L)
+{
+  mapfile *m = (mapfile *)lpobj_check( L, 1, &lpmapfile_type );
+  size_t clen, len;
+  const char *c = luaL_optlstring( L, 2, "\n", &clen );
+  luaL_argcheck( L, clen == 1, 2, "single byte expected" );
+  const char *p = lpmapfile_view( L, m, 3, &len );
+  const char *end = p + len;
+  lua_Integer n = 0;
+  while (( p = memchr( p, *c, end - p )) != NULL ) {
+    n++;
+    p++;
+  }
+  lua_pushinteger( L, n );
+  return 1;
+}
+
+/* iterator over the lines of a view */
+static int lpmapfile_lines_iter (lua_State *L)
+{
+  mapfile *m = (mapfile *)lpobj_test( L, lua_upvalueindex( 1 ));
+  size_t pos = (size_t)lua_tointeger( L, lua_upvalueindex( 2 ));
+  size_t end = (size_t)lua_tointeger( L, lua_upvalueindex( 3 ));
+  if ( pos >= end ) {
+    return 0;
+  }
+  const char *p = m->base + pos;
+  const char *nl = memchr( p, '\n', end - pos );
+  size_t len = ( nl != NULL ) ? (size_t)( nl - p ) : end - pos;
+  lua_pushinteger( L, (lua_Integer)( pos + len + 1 ));
+  lua_replace( L, lua_upvalueindex( 2 ));
+  lua_pushlstring( L, p, len );
+  return 1;
+}
+
+/* return an iterator over the lines of a view, without newlines */
+static int lpmapfile_lines (lua_State *L)
+{
+  mapfile *m = (mapfile *)lpobj_check( L, 1, &lpmapfile_type );
+  size_t len;
+  const char *p = lpmapfile_view( L, m, 2, &len );
+  lua_settop( L, 1 );
+  lua_pushinteger( L, (lua_Integer)( p - m->base ));
+  lua_pushinteger( L, (lua_Integer)( p - m->base + len ));
+  lua_pushcclosure( L, lpmapfile_lines_iter, 3 );
+  return 1;
+}
+
+/* return the size of the file */
+static int lpmapfile_size (lua_State *L)
+{
+  mapfile *m = (mapfile *)lpobj_check( L, 1, &lpmapfile_type );
+  lua_pushinteger( L, (lua_Integer)m->size );
+  return 1;
+}
@@ -0,0 +1,18 @@
+/*
+** memory mapped files shared between lua processes
+** See Copyright Notice in luaproc.h
+*/
+
+#ifndef _LUA_LUAPROC_MAPFILE_H_
+#define _LUA_LUAPROC_MAPFILE_H_
+
+#include <lua.h>
+#include <lauxlib.h>
+
+/* default number of bytes of a chunk taken by next */
+#define LUAPROC_MAPFILE_DEFAULT_CHUNK ( 1 << 20 )
+
+/* mapped file functions of the luaproc library */
+extern const luaL_Reg lpmapfile_funcs[];
+
+#endif
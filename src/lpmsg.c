@@ -0,0 +1,462 @@
+/*
+** encoded messages shared between lua processes
+** See Copyright Notice in luaproc.h
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+
+#include "lpcompat.h"
+#include "lpmsg.h"
+
+/*
+  every value is a tag byte followed by its data; integers, floats and
+  string lengths take 8 bytes in little endian order, so the encoding does
+  not depend on the host
+*/
+#define TAG_NIL     'n'
+#define TAG_FALSE   'f'
+#define TAG_TRUE    't'
+#define TAG_INTEGER 'i'
+#define TAG_FLOAT   'd'
+#define TAG_STRING  's'
+
+/*
+  the compact encoding keeps the tags but stores integers in zigzag order and
+  string lengths as variable length integers of 7 bits per byte, lowest
+  first; floats keep their 8 bytes
+*/
+#define VAR_MAXLEN 10
+
+/* store 64 bits in little endian order */
+static void msg_put64 (char *p, uint64_t v)
+{
+  for ( int i = 0; i < 8; i++ ) {
+    p[i] = (char)( v >> ( 8 * i ));
+  }
+}
+
+/* load 64 bits in little endian order */
+static uint64_t msg_get64 (const char *p)
+{
+  uint64_t v = 0;
+  for ( int i = 0; i < 8; i++ ) {
+    v |= (uint64_t)(unsigned char)p[i] << ( 8 * i );
+  }
+  return v;
+}
+
+/* store a variable length integer, return its number of bytes */
+static size_t msg_putvar (char *p, uint64_t v)
+{
+  size_t n = 0;
+  while ( v >= 0x80 ) {
+    p[n++] = (char)( v | 0x80 );
+    v >>= 7;
+  }
+  p[n++] = (char)v;
+  return n;
+}
+
+/* return the number of bytes of a variable length integer */
+static size_t msg_varsize (uint64_t v)
+{
+  size_t n = 1;
+  while ( v >= 0x80 ) {
+    v >>= 7;
+    n++;
+  }
+  return n;
+}
+
+/* load a variable length integer of at most 'size' bytes, return its number
+   of bytes or 0 if it is malformed */
+static size_t msg_getvar (const char *p, size_t size, uint64_t *v)
+{
+  *v = 0;
+  for ( size_t n = 0; n < size && n < VAR_MAXLEN; n++ ) {
+    *v |= (uint64_t)( (unsigned char)p[n] & 0x7f ) << ( 7 * n );
+    if ( ( (unsigned char)p[n] & 0x80 ) == 0 ) {
+      return n + 1;
+    }
+  }
+  return 0;
+}
+
+/* map signed integers to unsigned ones with small absolute values first */
+static uint64_t msg_zigzag (uint64_t v)
+{
+  return ( v << 1 ) ^ ( ( v >> 63 ) ? UINT64_MAX : 0 );
+}
+
+static uint64_t msg_unzigzag (uint64_t v)
+{
+  return ( v >> 1 ) ^ ( ( v & 1 ) ? UINT64_MAX : 0 );
+}
+
+/* return the encoded size of a value or 0 if its type is not supported */
+static size_t msg_valuesize (lua_State *L, int i)
+{
+  size_t len;
+  switch ( lua_type( L, i )) {
+    case LUA_TNIL:
+    case LUA_TBOOLEAN:
+      return 1;
+    case LUA_TNUMBER:
+      return 1 + 8;
+    case LUA_TSTRING:
+      lua_tolstring( L, i, &len );
+      return 1 + 8 + len;
+    default:
+      return 0;
+  }
+}
+
+/* allocate a message for 'size' bytes of encoded values */
+static lpmsg *msg_alloc (size_t size)
+{
+  lpmsg *msg = (lpmsg *)malloc( sizeof( lpmsg ) + size );
+  if ( msg != NULL ) {
+    atomic_init( &msg->refs, 1 );
+    msg->count = 0;
+    msg->size = size;
+  }
+  return msg;
+}
+
+/* encode stack values first..last into a new message */
+lpmsg *lpmsg_encode (lua_State *L, int first, int last, int *bad)
+{
+  size_t size = 0;
+  for ( int i = first; i <= last; i++ ) {
+    size_t vs = msg_valuesize( L, i );
+    if ( vs == 0 ) {
+      *bad = i;
+      return NULL;
+    }
+    size += vs;
+  }
+
+  lpmsg *msg = msg_alloc( size );
+  if ( msg == NULL ) {
+    *bad = 0;
+    return NULL;
+  }
+
+  char *p = msg->data;
+  for ( int i = first; i <= last; i++ ) {
+    const char *str;
+    size_t len;
+    switch ( lua_type( L, i )) {
+      case LUA_TNIL:
+        *p++ = TAG_NIL;
+        break;
+      case LUA_TBOOLEAN:
+        *p++ = lua_toboolean( L, i ) ? TAG_TRUE : TAG_FALSE;
+        break;
+      case LUA_TNUMBER:
+        if ( lua_isinteger( L, i )) {
+          *p++ = TAG_INTEGER;
+          msg_put64( p, (uint64_t)lua_tointeger( L, i ));
+        } else {
+          double d = lua_tonumber( L, i );
+          uint64_t v;
+          memcpy( &v, &d, sizeof( v ));
+          *p++ = TAG_FLOAT;
+          msg_put64( p, v );
+        }
+        p += 8;
+        break;
+      case LUA_TSTRING:
+        str = lua_tolstring( L, i, &len );
+        *p++ = TAG_STRING;
+        msg_put64( p, len );
+        memcpy( p + 8, str, len );
+        p += 8 + len;
+        break;
+    }
+  }
+  msg->count = last - first + 1;
+  return msg;
+}
+
+/* create a message from encoded values */
+lpmsg *lpmsg_new (const char *data, size_t size)
+{
+  /* validate and count values */
+  int count = 0;
+  size_t pos = 0;
+  while ( pos < size ) {
+    switch ( data[pos++] ) {
+      case TAG_NIL:
+      case TAG_FALSE:
+      case TAG_TRUE:
+        break;
+      case TAG_INTEGER:
+      case TAG_FLOAT:
+        if ( size - pos < 8 ) {
+          return NULL;
+        }
+        pos += 8;
+        break;
+      case TAG_STRING: {
+        if ( size - pos < 8 ) {
+          return NULL;
+        }
+        uint64_t len = msg_get64( data + pos );
+        pos += 8;
+        if ( size - pos < len ) {
+          return NULL;
+        }
+        pos += len;
+        break;
+      }
+      default:
+        return NULL;
+    }
+    count++;
+  }
+
+  lpmsg *msg = msg_alloc( size );
+  if ( msg != NULL ) {
+    memcpy( msg->data, data, size );
+    msg->count = count;
+  }
+  return msg;
+}
+
+/* return the size of the compact encoding of a message */
+size_t lpmsg_packsize (const lpmsg *msg)
+{
+  size_t size = 0;
+  const char *p = msg->data;
+  for ( int i = 0; i < msg->count; i++ ) {
+    uint64_t v;
+    switch ( *p++ ) {
+      case TAG_INTEGER:
+        size += 1 + msg_varsize( msg_zigzag( msg_get64( p )));
+        p += 8;
+        break;
+      case TAG_FLOAT:
+        size += 1 + 8;
+        p += 8;
+        break;
+      case TAG_STRING:
+        v = msg_get64( p );
+        size += 1 + msg_varsize( v ) + v;
+        p += 8 + v;
+        break;
+      default:
+        size += 1;
+        break;
+    }
+  }
+  return size;
+}
+
+/* write the compact encoding of a message */
+size_t lpmsg_pack (const lpmsg *msg, char *buf)
+{
+  const char *p = msg->data;
+  char *q = buf;
+  for ( int i = 0; i < msg->count; i++ ) {
+    uint64_t v;
+    char tag = *p++;
+    *q++ = tag;
+    switch ( tag ) {
+      case TAG_INTEGER:
+        q += msg_putvar( q, msg_zigzag( msg_get64( p )));
+        p += 8;
+        break;
+      case TAG_FLOAT:
+        memcpy( q, p, 8 );
+        q += 8;
+        p += 8;
+        break;
+      case TAG_STRING:
+        v = msg_get64( p );
+        q += msg_putvar( q, v );
+        memcpy( q, p + 8, v );
+        q += v;
+        p += 8 + v;
+        break;
+    }
+  }
+  return (size_t)( q - buf );
+}
+
+/* create a message from its compact encoding */
+lpmsg *lpmsg_unpack (const char *data, size_t size)
+{
+  /* validate and measure the values */
+  size_t msgsize = 0, pos = 0, n;
+  uint64_t v;
+  while ( pos < size ) {
+    switch ( data[pos++] ) {
+      case TAG_NIL:
+      case TAG_FALSE:
+      case TAG_TRUE:
+        msgsize += 1;
+        break;
+      case TAG_INTEGER:
+        if (( n = msg_getvar( data + pos, size - pos, &v )) == 0 ) {
+          return NULL;
+        }
+        pos += n;
+        msgsize += 1 + 8;
+        break;
+      case TAG_FLOAT:
+        if ( size - pos < 8 ) {
+          return NULL;
+        }
+        pos += 8;
+        msgsize += 1 + 8;
+        break;
+      case TAG_STRING:
+        if (( n = msg_getvar( data + pos, size - pos, &v )) == 0
+          || size - pos - n < v )
+        {
+          return NULL;
+        }
+        pos += n + v;
+        msgsize += 1 + 8 + v;
+        break;
+      default:
+        return NULL;
+    }
+  }
+
+  lpmsg *msg = msg_alloc( msgsize );
+  if ( msg == NULL ) {
+    return NULL;
+  }
+  char *q = msg->data;
+  pos = 0;
+  while ( pos < size ) {
+    char tag = data[pos++];
+    *q++ = tag;
+    switch ( tag ) {
+      case TAG_INTEGER:
+        pos += msg_getvar( data + pos, size - pos, &v );
+        msg_put64( q, msg_unzigzag( v ));
+        q += 8;
+        break;
+      case TAG_FLOAT:
+        memcpy( q, data + pos, 8 );
+        pos += 8;
+        q += 8;
+        break;
+      case TAG_STRING:
+        pos += msg_getvar( data + pos, size - pos, &v );
+        msg_put64( q, v );
+        memcpy( q + 8, data + pos, v );
+        pos += v;
+        q += 8 + v;
+        break;
+    }
+    msg->count++;
+  }
+  return msg;
+}
+
+/* push the values of a message */
+int lpmsg_decode (lua_State *L, const lpmsg *msg)
+{
+  if ( lua_checkstack( L, msg->count ) == 0 ) {
+    return -1;
+  }
+
+  const char *p = msg->data;
+  for ( int i = 0; i < msg->count; i++ ) {
+    uint64_t v;
+    double d;
+    switch ( *p++ ) {
+      case TAG_NIL:
+        lua_pushnil( L );
+        break;
+      case TAG_FALSE:
+        lua_pushboolean( L, 0 );
+        break;
+      case TAG_TRUE:
+        lua_pushboolean( L, 1 );
+        break;
+      case TAG_INTEGER:
+        lua_pushinteger( L, (lua_Integer)msg_get64( p ));
+        p += 8;
+        break;
+      case TAG_FLOAT:
+        v = msg_get64( p );
+        memcpy( &d, &v, sizeof( d ));
+        lua_pushnumber( L, d );
+        p += 8;
+        break;
+      case TAG_STRING:
+        v = msg_get64( p );
+        lua_pushlstring( L, p + 8, (size_t)v );
+        p += 8 + v;
+        break;
+    }
+  }
+  return msg->count;
+}
+
+/* compare two messages of one value */
+int lpmsg_equal (const lpmsg *a, const lpmsg *b)
+{
+  lua_Integer ia, ib;
+  lua_Number na, nb;
+  int ta = lpmsg_tonumber( a, &ia, &na );
+  int tb = lpmsg_tonumber( b, &ib, &nb );
+
+  if ( ta == 0 || tb == 0 ) {  /* same encoding */
+    return a->size == b->size && memcmp( a->data, b->data, a->size ) == 0;
+  } else if ( ta == 1 && tb == 1 ) {
+    return ia == ib;
+  } else if ( ta == 2 && tb == 2 ) {
+    return na == nb;
+  }
+  /* integer and float are equal if the float has the exact integer value */
+  lua_Integer fi;
+  if ( ta == 1 ) {
+    return lua_numbertointeger( nb, &fi ) && fi == ia;
+  }
+  return lua_numbertointeger( na, &fi ) && fi == ib;
+}
+
+/* get the first value of a message if it is a number */
+int lpmsg_tonumber (const lpmsg *msg, lua_Integer *i, lua_Number *n)
+{
+  if ( msg->count == 0 ) {
+    return 0;
+  }
+  uint64_t v;
+  double d;
+  switch ( msg->data[0] ) {
+    case TAG_INTEGER:
+      *i = (lua_Integer)msg_get64( msg->data + 1 );
+      return 1;
+    case TAG_FLOAT:
+      v = msg_get64( msg->data + 1 );
+      memcpy( &d, &v, sizeof( d ));
+      *n = d;
+      return 2;
+    default:
+      return 0;
+  }
+}
+
+/* add a reference */
+void lpmsg_retain (lpmsg *msg)
+{
+  atomic_fetch_add( &msg->refs, 1 );
+}
+
+/* remove a reference, free message when it was the last one */
+void lpmsg_release (lpmsg *msg)
+{
+  if ( atomic_fetch_sub( &msg->refs, 1 ) == 1 ) {
+    free( msg );
+  }
+}
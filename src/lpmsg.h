@@ -0,0 +1,67 @@
+/*
+** encoded messages shared between lua processes
+** See Copyright Notice in luaproc.h
+*/
+
+#ifndef _LUA_LUAPROC_MSG_H_
+#define _LUA_LUAPROC_MSG_H_
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <lua.h>
+
+/*******************
+ * structure types *
+ ******************/
+
+/* reference counted tuple of nil, boolean, number and string values */
+typedef struct stlpmsg {
+  atomic_int refs;
+  int count;      /* number of values */
+  size_t size;    /* size of the encoded values */
+  char data[];    /* encoded values (see lpmsg.c) */
+} lpmsg;
+
+/***********************
+ * function prototypes *
+ **********************/
+
+/* encode stack values first..last into a new message with one reference;
+   return NULL and set 'bad' to the index of a value of unsupported type, or
+   to zero if memory is exhausted */
+lpmsg *lpmsg_encode( lua_State *L, int first, int last, int *bad );
+
+/* create a message from encoded values (eg, received from elsewhere);
+   return NULL if they are malformed or memory is exhausted */
+lpmsg *lpmsg_new( const char *data, size_t size );
+
+/* return the size of the compact encoding of a message (see lpmsg.c), used
+   to send it over the network */
+size_t lpmsg_packsize( const lpmsg *msg );
+
+/* write the compact encoding of a message into 'buf', which must hold
+   lpmsg_packsize bytes; return the number of bytes written */
+size_t lpmsg_pack( const lpmsg *msg, char *buf );
+
+/* create a message from its compact encoding; return NULL if it is
+   malformed or memory is exhausted */
+lpmsg *lpmsg_unpack( const char *data, size_t size );
+
+/* push the values of a message, return their number or -1 if the stack
+   can not grow */
+int lpmsg_decode( lua_State *L, const lpmsg *msg );
+
+/* compare two messages of one value like raw equality of lua does */
+int lpmsg_equal( const lpmsg *a, const lpmsg *b );
+
+/* get the first value of a message if it is a number; return 0 if it is not,
+   1 for an integer (stored in 'i') or 2 for a float (stored in 'n') */
+int lpmsg_tonumber( const lpmsg *msg, lua_Integer *i, lua_Number *n );
+
+/* add a reference */
+void lpmsg_retain( lpmsg *msg );
+
+/* remove a reference, free message when it was the last one */
+void lpmsg_release( lpmsg *msg );
+
+#endif
@@ -0,0 +1,1416 @@
+/*
+** channels between luaproc nodes over tcp and unix domain sockets
+** See Copyright Notice in luaproc.h
+*/
+
+#define _GNU_SOURCE
+
+#include <threads.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "lpcompat.h"
+#include "luaproc.h"
+#include "lpaux.h"
+#include "lpobj.h"
+#include "lpmsg.h"
+#include "lpnode.h"
+
+#define FALSE 0
+#define TRUE  !FALSE
+#define LUAPROC_NODE_TABLE "nodetb"
+#define LUAPROC_CONN_TABLE "conntb"
+
+/* first bytes sent on a connection */
+#define NODE_MAGIC "LPN1"
+
+/*
+  a frame is its length in 4 bytes (big endian, not counting themselves), a
+  type byte and a channel id as a variable length integer of 7 bits per
+  byte; a bind frame carries the name of the remote channel given to the id
+  and a message frame the compact encoding of a message (see lpmsg.c)
+*/
+#define FRAME_BIND 'b'
+#define FRAME_MSG  'm'
+
+/* largest header of a frame */
+#define FRAME_HEADER ( 4 + 1 + 5 )
+
+/* frames taken by the writer of a connection at once */
+#define NODE_WRITE_BATCH 256
+
+/* bytes a reader asks for at once */
+#define NODE_READ_SIZE 65536
+
+/*******************
+ * structure types *
+ ******************/
+
+/* message, or name of a channel being bound, for channel 'id' */
+typedef struct {
+  uint32_t id;
+  lpmsg *msg;
+  char *name;
+} nodeitem;
+
+/* bounded queue of messages */
+typedef struct {
+  nodeitem *items;
+  int cap;
+  int first;
+  int count;
+} nodequeue;
+
+/* connection to another node, opened and written by its own thread; the
+   thread is started again on the next use after the connection failed */
+typedef struct {
+  waitq wq;              /* processes waiting for room or for the connection,
+                            protects the rest */
+  cnd_t cond;            /* wakes the writer */
+  nodequeue out;
+  int err;               /* error that stopped the writer, or 0 */
+  int gaierr;            /* resolver error that stopped the writer, or 0 */
+  int connected;         /* the writer is connected */
+  int running;           /* the writer has not exited */
+  int started;           /* the writer must be joined */
+  int stop;              /* writer must flush and exit */
+  char **names;          /* remote channels bound to the ids */
+  uint32_t nnames;
+  uint32_t bound;        /* ids bound on the current connection */
+  int fd;                /* -1 while not connected */
+  thrd_t writer;
+  char *address;
+} nodeconn;
+
+/* channel of this node: exported channels queue the messages that arrive
+   from other nodes, imported ones send through a connection */
+typedef struct {
+  lpobject obj;
+  waitq wq;              /* waiting lua processes, protects the rest */
+  nodequeue in;          /* messages of an exported channel */
+  int closed;            /* destroyed with delchannel */
+  nodeconn *conn;        /* connection of an imported channel or NULL */
+  uint32_t id;           /* id of an imported channel on its connection */
+} nodechan;
+
+/* connection accepted from another node, read by its own thread */
+typedef struct stnodepeer {
+  struct stnodepeer *next;
+  int fd;                /* -1 once the reader closed it */
+  thrd_t reader;
+} nodepeer;
+
+/* socket accepting connections from other nodes */
+typedef struct stnodelistener {
+  struct stnodelistener *next;
+  int fd;
+  thrd_t acceptor;
+  char *path;            /* unix domain socket to remove at exit or NULL */
+} nodelistener;
+
+/********************
+ * global variables *
+ *******************/
+
+/* mutex of the tables, listeners and peers */
+static mtx_t mutex_node_list;
+
+/* lua_State used to store channels and connections hash tables */
+static lua_State *nodels = NULL;
+
+/* sockets accepting connections and connections accepted */
+static nodelistener *listeners = NULL;
+static nodepeer *peers = NULL;
+
+/* set when luaproc exits, no more connections are accepted */
+static int nodeclosing = FALSE;
+
+/***********************
+ * register prototypes *
+ ***********************/
+
+static int lpnode_listen( lua_State *L );
+static void lpnode_chan_destroy( lpobject *obj );
+
+const luaL_Reg lpnode_funcs[] = {
+  { "node", lpnode_listen },
+  { NULL, NULL }
+};
+
+static const luaL_Reg lpnode_chan_funcs[] = {
+  { NULL, NULL }
+};
+
+static const lpobject_type lpnode_chan_type = {
+  "luaproc.nodechannel", lpnode_chan_funcs, lpnode_chan_destroy
+};
+
+/******************
+ * message queues *
+ ******************/
+
+/* allocate room for 'cap' messages; return false if memory is exhausted */
+static int queue_init (nodequeue *q, int cap)
+{
+  q->items = NULL;
+  q->cap = cap;
+  q->first = 0;
+  q->count = 0;
+  if ( cap > 0 ) {
+    q->items = (nodeitem *)malloc( cap * sizeof( nodeitem ));
+  }
+  return cap == 0 || q->items != NULL;
+}
+
+static void queue_push (nodequeue *q, uint32_t id, lpmsg *msg)
+{
+  nodeitem *it = &q->items[( q->first + q->count ) % q->cap];
+  it->id = id;
+  it->msg = msg;
+  it->name = NULL;
+  q->count++;
+}
+
+static nodeitem queue_pop (nodequeue *q)
+{
+  nodeitem it = q->items[q->first];
+  q->first = ( q->first + 1 ) % q->cap;
+  q->count--;
+  return it;
+}
+
+/* release the message of an item, names belong to their connection */
+static void item_free (nodeitem *it)
+{
+  if ( it->msg != NULL ) {
+    lpmsg_release( it->msg );
+  }
+}
+
+/* release queued messages and free the queue */
+static void queue_free (nodequeue *q)
+{
+  while ( q->count > 0 ) {
+    nodeitem it = queue_pop( q );
+    item_free( &it );
+  }
+  free( q->items );
+}
+
+/***********
+ * sockets *
+ ***********/
+
+/* store a variable length integer, return its number of bytes */
+static size_t node_putvar (char *p, uint32_t v)
+{
+  size_t n = 0;
+  while ( v >= 0x80 ) {
+    p[n++] = (char)( v | 0x80 );
+    v >>= 7;
+  }
+  p[n++] = (char)v;
+  return n;
+}
+
+/* load a variable length integer of at most 'size' bytes, return its number
+   of bytes or 0 if it is malformed */
+static size_t node_getvar (const char *p, size_t size, uint32_t *v)
+{
+  *v = 0;
+  for ( size_t n = 0; n < size && n < 5; n++ ) {
+    *v |= (uint32_t)( (unsigned char)p[n] & 0x7f ) << ( 7 * n );
+    if ( ( (unsigned char)p[n] & 0x80 ) == 0 ) {
+      return n + 1;
+    }
+  }
+  return 0;
+}
+
+/* write a frame of an item at 'p', return its size */
+static size_t node_frame (char *p, const nodeitem *it)
+{
+  char *q = p + 4;
+  *q++ = ( it->msg != NULL ) ? FRAME_MSG : FRAME_BIND;
+  q += node_putvar( q, it->id );
+  if ( it->msg != NULL ) {
+    q += lpmsg_pack( it->msg, q );
+  } else {
+    size_t len = strlen( it->name );
+    memcpy( q, it->name, len );
+    q += len;
+  }
+  uint32_t len = (uint32_t)( q - p - 4 );
+  for ( int i = 0; i < 4; i++ ) {
+    p[i] = (char)( len >> ( 8 * ( 3 - i )));
+  }
+  return (size_t)( q - p );
+}
+
+/* write all bytes of a buffer; return 0 or an error number */
+static int node_write (int fd, const char *buf, size_t len)
+{
+  while ( len > 0 ) {
+    ssize_t n = send( fd, buf, len, MSG_NOSIGNAL );
+    if ( n < 0 ) {
+      if ( errno == EINTR ) {
+        continue;
+      }
+      return errno;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* fill a unix domain socket address from "unix:path"; return false if the
+   path is too long */
+static int node_unixaddr (struct sockaddr_un *sa, const char *address)
+{
+  const char *path = address + 5;
+  memset( sa, 0, sizeof( *sa ));
+  sa->sun_family = AF_UNIX;
+  if ( strlen( path ) >= sizeof( sa->sun_path )) {
+    return FALSE;
+  }
+  strcpy( sa->sun_path, path );
+  return TRUE;
+}
+
+/* resolve "host:port" ("*" or no host for any address when listening);
+   return NULL with the resolver error in 'gaierr', or 0 if the address is
+   malformed */
+static struct addrinfo *node_getaddr (const char *address, int passive,
+  int *gaierr)
+{
+  *gaierr = 0;
+  const char *colon = strrchr( address, ':' );
+  if ( colon == NULL ) {
+    return NULL;
+  }
+  /* copy the host without the brackets of an ipv6 address */
+  char host[NI_MAXHOST];
+  const char *h = address;
+  size_t hostlen = colon - address;
+  if ( hostlen >= 2 && h[0] == '[' && h[hostlen - 1] == ']' ) {
+    h++;
+    hostlen -= 2;
+  }
+  if ( hostlen >= sizeof( host )) {
+    return NULL;
+  }
+  memcpy( host, h, hostlen );
+  host[hostlen] = '\0';
+  const char *node = host;
+  if ( host[0] == '\0' || strcmp( host, "*" ) == 0 ) {
+    node = passive ? NULL : "localhost";
+  }
+
+  struct addrinfo hints, *res = NULL;
+  memset( &hints, 0, sizeof( hints ));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = passive ? AI_PASSIVE : 0;
+  int r = getaddrinfo( node, colon + 1, &hints, &res );
+  if ( r != 0 ) {
+    *gaierr = r;
+    return NULL;
+  }
+  return res;
+}
+
+/* resolve an address to listen on; push nil and an error message if
+   failed */
+static struct addrinfo *node_resolve (lua_State *L, const char *address)
+{
+  int gaierr;
+  struct addrinfo *res = node_getaddr( address, TRUE, &gaierr );
+  if ( res == NULL ) {
+    lua_pushnil( L );
+    if ( gaierr == 0 ) {
+      lua_pushfstring( L, "bad node address '%s'", address );
+    } else {
+      lua_pushfstring( L, "cannot resolve '%s': %s", address,
+        gai_strerror( gaierr ));
+    }
+  }
+  return res;
+}
+
+/* set the socket of a connection, closing the previous one; -1 only closes
+   it. The socket is changed under the lock so that it can be shut down */
+static void node_conn_setfd (nodeconn *c, int fd)
+{
+  mtx_lock( &c->wq.mutex );
+  if ( c->fd >= 0 ) {
+    close( c->fd );
+  }
+  c->fd = fd;
+  mtx_unlock( &c->wq.mutex );
+}
+
+/* connect a connection to its node, from its writer; return 0 or an error
+   number, with a resolver error in 'gaierr' */
+static int node_connect (nodeconn *c, int *gaierr)
+{
+  const char *address = c->address;
+  int fd = -1, err = 0;
+  *gaierr = 0;
+  if ( strncmp( address, "unix:", 5 ) == 0 ) {
+    struct sockaddr_un sa;
+    if ( !node_unixaddr( &sa, address )) {
+      err = ENAMETOOLONG;
+    } else if (( fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 )) < 0 ) {
+      err = errno;
+    } else {
+      node_conn_setfd( c, fd );
+      if ( connect( fd, (struct sockaddr *)&sa, sizeof( sa )) != 0 ) {
+        err = errno;
+        node_conn_setfd( c, -1 );
+        fd = -1;
+      }
+    }
+  } else {
+    struct addrinfo *res = node_getaddr( address, FALSE, gaierr );
+    if ( res == NULL ) {
+      return ( *gaierr == 0 ) ? EINVAL : 0;
+    }
+    for ( struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next ) {
+      fd = socket( ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+        ai->ai_protocol );
+      if ( fd < 0 ) {
+        err = errno;
+        continue;
+      }
+      node_conn_setfd( c, fd );
+      if ( connect( fd, ai->ai_addr, ai->ai_addrlen ) == 0 ) {
+        /* frames are batched by the writer, do not delay them further */
+        int one = 1;
+        setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ));
+        err = 0;
+        break;
+      }
+      err = errno;
+      node_conn_setfd( c, -1 );
+      fd = -1;
+    }
+    freeaddrinfo( res );
+  }
+
+  if ( fd >= 0 && ( err = node_write( fd, NODE_MAGIC, 4 )) != 0 ) {
+    node_conn_setfd( c, -1 );
+  }
+  return err;
+}
+
+/*****************
+ * node channels *
+ *****************/
+
+/* return a referenced channel (if not found, return null) */
+static nodechan *node_get (const char *name)
+{
+  mtx_lock( &mutex_node_list );
+  lua_getglobal( nodels, LUAPROC_NODE_TABLE );
+  lua_getfield( nodels, -1, name );
+  nodechan *c = (nodechan *)lua_touserdata( nodels, -1 );
+  lua_pop( nodels, 2 );
+  if ( c != NULL ) {
+    lpobj_retain( &c->obj );
+  }
+  mtx_unlock( &mutex_node_list );
+  return c;
+}
+
+/* return the wait queue guarding a channel */
+static waitq *node_waitq (nodechan *c)
+{
+  return ( c->conn != NULL ) ? &c->conn->wq : &c->wq;
+}
+
+/* close a channel removed from the channels table and wake its waiters */
+static void node_close (nodechan *c)
+{
+  waitq *q = node_waitq( c );
+  mtx_lock( &q->mutex );
+  c->closed = TRUE;
+  waitq_wake( q );
+  mtx_unlock( &q->mutex );
+  lpobj_release( &c->obj );  /* reference of the channels table */
+}
+
+/* destroy a channel when it is not referenced anymore */
+static void lpnode_chan_destroy (lpobject *obj)
+{
+  nodechan *c = (nodechan *)obj;
+  queue_free( &c->in );
+  waitq_destroy( &c->wq );
+  free( c );
+}
+
+/* queue a message of another node on an exported channel, waiting for room;
+   return false if the channel is destroyed */
+static int node_deliver (nodechan *c, lpmsg *msg)
+{
+  mtx_lock( &c->wq.mutex );
+  while ( !c->closed && c->in.count == c->in.cap ) {
+    cnd_wait( &c->wq.cond, &c->wq.mutex );
+  }
+  if ( c->closed ) {
+    mtx_unlock( &c->wq.mutex );
+    return FALSE;
+  }
+  queue_push( &c->in, 0, msg );
+  if ( c->in.count == 1 ) {  /* receivers wait only on an empty queue */
+    waitq_wake( &c->wq );
+  }
+  mtx_unlock( &c->wq.mutex );
+  return TRUE;
+}
+
+/* return the exported channel named 'name' referenced or NULL */
+static nodechan *node_get_exported (const char *name)
+{
+  nodechan *c = node_get( name );
+  if ( c != NULL && c->conn != NULL ) {  /* imported here */
+    lpobj_release( &c->obj );
+    c = NULL;
+  }
+  return c;
+}
+
+/***********
+ * threads *
+ ***********/
+
+/* connect, then write the frames queued on a connection in batches until
+   it stops or fails; the channels bound to the connection are bound again
+   on every new connection */
+static int node_writer (void *arg)
+{
+  nodeconn *c = (nodeconn *)arg;
+  nodeitem batch[NODE_WRITE_BATCH];
+  char *buf = NULL;
+  size_t cap = 0;
+
+  /* resolve and connect here, not on the thread of the first sender */
+  int gaierr;
+  int err = node_connect( c, &gaierr );
+
+  mtx_lock( &c->wq.mutex );
+  if ( err == 0 && gaierr == 0 ) {
+    c->connected = TRUE;
+    c->bound = 0;
+  }
+  /* wake processes waiting for the connection */
+  waitq_wake( &c->wq );
+  while ( c->connected ) {
+    while ( c->out.count == 0 && c->bound == c->nnames && !c->stop ) {
+      cnd_wait( &c->cond, &c->wq.mutex );
+    }
+    if ( c->out.count == 0 && c->bound == c->nnames ) {  /* flushed */
+      break;
+    }
+    /* ids bound since the last batch go first */
+    int n = 0;
+    while ( n < NODE_WRITE_BATCH && c->bound < c->nnames ) {
+      batch[n].id = c->bound;
+      batch[n].msg = NULL;
+      batch[n++].name = c->names[c->bound++];
+    }
+    while ( n < NODE_WRITE_BATCH && c->out.count > 0 ) {
+      batch[n++] = queue_pop( &c->out );
+    }
+    /* wake senders waiting for room */
+    waitq_wake( &c->wq );
+    mtx_unlock( &c->wq.mutex );
+
+    /* pipeline the frames of the batch in as few writes as possible */
+    size_t len = 0;
+    for ( int i = 0; i < n && err == 0; i++ ) {
+      size_t size = FRAME_HEADER + (( batch[i].msg != NULL ) ?
+        lpmsg_packsize( batch[i].msg ) : strlen( batch[i].name ));
+      if ( len + size > cap && len > 0 ) {
+        err = node_write( c->fd, buf, len );
+        len = 0;
+      }
+      if ( err == 0 && size > cap ) {
+        size_t newcap = ( size > NODE_READ_SIZE ) ? size : NODE_READ_SIZE;
+        char *newbuf = (char *)realloc( buf, newcap );
+        if ( newbuf == NULL ) {
+          err = ENOMEM;
+        } else {
+          buf = newbuf;
+          cap = newcap;
+        }
+      }
+      if ( err == 0 ) {
+        len += node_frame( buf + len, &batch[i] );
+      }
+    }
+    if ( err == 0 && len > 0 ) {
+      err = node_write( c->fd, buf, len );
+    }
+    for ( int i = 0; i < n; i++ ) {
+      item_free( &batch[i] );
+    }
+
+    mtx_lock( &c->wq.mutex );
+    if ( err != 0 ) {
+      c->connected = FALSE;
+    }
+  }
+
+  if ( !c->connected ) {
+    /* fail the queued messages; the next use connects again */
+    c->err = ( err != 0 || gaierr != 0 ) ? err : ECONNRESET;
+    c->gaierr = gaierr;
+    while ( c->out.count > 0 ) {
+      nodeitem it = queue_pop( &c->out );
+      item_free( &it );
+    }
+    if ( c->fd >= 0 ) {
+      close( c->fd );
+      c->fd = -1;
+    }
+  }
+  c->running = FALSE;
+  waitq_wake( &c->wq );
+  mtx_unlock( &c->wq.mutex );
+  free( buf );
+  return 0;
+}
+
+/* read the frames of a connection from another node and deliver their
+   messages until the connection is closed */
+static int node_reader (void *arg)
+{
+  nodepeer *p = (nodepeer *)arg;
+  char *buf = (char *)malloc( NODE_READ_SIZE );
+  size_t cap = NODE_READ_SIZE, len = 0, pos = 0;
+  int magic = FALSE;
+  /* names and channels bound to the ids of the connection */
+  char **names = NULL;
+  nodechan **chans = NULL;
+  uint32_t nids = 0;
+
+  while ( buf != NULL ) {
+    ssize_t r = recv( p->fd, buf + len, cap - len, 0 );
+    if ( r < 0 && errno == EINTR ) {
+      continue;
+    }
+    if ( r <= 0 ) {
+      break;
+    }
+    len += r;
+
+    if ( !magic ) {
+      if ( len < 4 ) {
+        continue;
+      }
+      if ( memcmp( buf, NODE_MAGIC, 4 ) != 0 ) {
+        break;
+      }
+      magic = TRUE;
+      pos = 4;
+    }
+
+    /* handle every complete frame */
+    int bad = FALSE;
+    while ( len - pos >= 4 ) {
+      const unsigned char *h = (const unsigned char *)buf + pos;
+      uint32_t flen = ( (uint32_t)h[0] << 24 ) | ( (uint32_t)h[1] << 16 ) |
+        ( (uint32_t)h[2] << 8 ) | h[3];
+      if ( flen < 2 || flen > LUAPROC_NODE_MAX_FRAME ) {
+        bad = TRUE;
+        break;
+      }
+      if ( len - pos - 4 < flen ) {
+        break;
+      }
+      const char *f = buf + pos + 4;
+      uint32_t id;
+      size_t idlen = node_getvar( f + 1, flen - 1, &id );
+      const char *data = f + 1 + idlen;
+      size_t size = flen - 1 - idlen;
+      pos += 4 + flen;
+
+      if ( idlen == 0 ) {
+        bad = TRUE;
+      } else if ( f[0] == FRAME_BIND && id == nids ) {
+        char **nn = (char **)realloc( names, ( nids + 1 ) * sizeof( char * ));
+        if ( nn != NULL ) {
+          names = nn;
+        }
+        nodechan **nc = (nodechan **)realloc( chans,
+          ( nids + 1 ) * sizeof( nodechan * ));
+        if ( nc != NULL ) {
+          chans = nc;
+        }
+        if ( nn == NULL || nc == NULL
+          || ( names[nids] = strndup( data, size )) == NULL )
+        {
+          bad = TRUE;
+        } else {
+          chans[nids++] = NULL;
+        }
+      } else if ( f[0] == FRAME_MSG && id < nids ) {
+        lpmsg *msg = lpmsg_unpack( data, size );
+        if ( msg == NULL ) {
+          bad = TRUE;
+        } else {
+          /* look the channel up again if it was destroyed, it may have been
+             created anew; messages to missing channels are dropped */
+          if ( chans[id] == NULL ) {
+            chans[id] = node_get_exported( names[id] );
+          }
+          if ( chans[id] != NULL && !node_deliver( chans[id], msg )) {
+            lpobj_release( &chans[id]->obj );
+            chans[id] = node_get_exported( names[id] );
+            if ( chans[id] != NULL && !node_deliver( chans[id], msg )) {
+              lpobj_release( &chans[id]->obj );
+              chans[id] = NULL;
+            }
+          }
+          if ( chans[id] == NULL ) {
+            lpmsg_release( msg );
+          }
+        }
+      } else {
+        bad = TRUE;
+      }
+      if ( bad ) {
+        break;
+      }
+    }
+    if ( bad ) {
+      break;
+    }
+
+    /* keep the partial frame at the start of the buffer */
+    memmove( buf, buf + pos, len - pos );
+    len -= pos;
+    pos = 0;
+    if ( len >= 4 ) {
+      const unsigned char *h = (const unsigned char *)buf;
+      size_t need = 4 + (( (size_t)h[0] << 24 ) | ( (size_t)h[1] << 16 ) |
+        ( (size_t)h[2] << 8 ) | h[3] );
+      if ( need > cap && need <= 4 + LUAPROC_NODE_MAX_FRAME ) {
+        char *nb = (char *)realloc( buf, need );
+        if ( nb == NULL ) {
+          break;
+        }
+        buf = nb;
+        cap = need;
+      }
+    }
+  }
+
+  for ( uint32_t i = 0; i < nids; i++ ) {
+    if ( chans[i] != NULL ) {
+      lpobj_release( &chans[i]->obj );
+    }
+    free( names[i] );
+  }
+  free( names );
+  free( chans );
+  free( buf );
+
+  mtx_lock( &mutex_node_list );
+  close( p->fd );
+  p->fd = -1;
+  mtx_unlock( &mutex_node_list );
+  return 0;
+}
+
+/* join the readers of connections closed by other nodes; mutex_node_list
+   must be locked */
+static void node_reap_peers (void)
+{
+  nodepeer **pp = &peers;
+  while ( *pp != NULL ) {
+    nodepeer *p = *pp;
+    if ( p->fd < 0 ) {  /* the reader is exiting */
+      *pp = p->next;
+      thrd_join( p->reader, NULL );
+      free( p );
+    } else {
+      pp = &p->next;
+    }
+  }
+}
+
+/* accept connections from other nodes, each one read by its own thread */
+static int node_acceptor (void *arg)
+{
+  nodelistener *l = (nodelistener *)arg;
+  for (;;) {
+    int fd = accept4( l->fd, NULL, NULL, SOCK_CLOEXEC );
+    if ( fd < 0 ) {
+      if ( errno == EINTR || errno == ECONNABORTED ) {
+        continue;
+      }
+      break;  /* socket shut down */
+    }
+    nodepeer *p = (nodepeer *)malloc( sizeof( nodepeer ));
+    if ( p == NULL ) {
+      close( fd );
+      continue;
+    }
+    p->fd = fd;
+    mtx_lock( &mutex_node_list );
+    node_reap_peers();
+    if ( nodeclosing || thrd_create( &p->reader, node_reader, p )
+      != thrd_success )
+    {
+      mtx_unlock( &mutex_node_list );
+      close( fd );
+      free( p );
+      continue;
+    }
+    p->next = peers;
+    peers = p;
+    mtx_unlock( &mutex_node_list );
+  }
+  return 0;
+}
+
+/***************
+ * connections *
+ ***************/
+
+/* free a connection after its writer exited */
+static void node_conn_free (nodeconn *c)
+{
+  queue_free( &c->out );
+  if ( c->fd >= 0 ) {
+    close( c->fd );
+  }
+  for ( uint32_t i = 0; i < c->nnames; i++ ) {
+    free( c->names[i] );
+  }
+  free( c->names );
+  cnd_destroy( &c->cond );
+  waitq_destroy( &c->wq );
+  free( c->address );
+  free( c );
+}
+
+/* return the connection to a node, created if there is none, or NULL if
+   memory is exhausted; its writer is started by 'node_conn_start' */
+static nodeconn *node_conn_get (const char *address)
+{
+  mtx_lock( &mutex_node_list );
+  lua_getglobal( nodels, LUAPROC_CONN_TABLE );
+  lua_getfield( nodels, -1, address );
+  nodeconn *c = (nodeconn *)lua_touserdata( nodels, -1 );
+  lua_pop( nodels, 1 );
+  if ( c == NULL ) {
+    c = (nodeconn *)malloc( sizeof( nodeconn ));
+    char *a = strdup( address );
+    if ( c == NULL || a == NULL || !queue_init( &c->out,
+      LUAPROC_NODE_QUEUE_MAX ))
+    {
+      free( c );
+      free( a );
+      c = NULL;
+    } else {
+      waitq_init( &c->wq );
+      cnd_init( &c->cond );
+      c->err = 0;
+      c->gaierr = 0;
+      c->connected = FALSE;
+      c->running = FALSE;
+      c->started = FALSE;
+      c->stop = FALSE;
+      c->names = NULL;
+      c->nnames = 0;
+      c->bound = 0;
+      c->fd = -1;
+      c->address = a;
+      lua_pushlightuserdata( nodels, c );
+      lua_setfield( nodels, -2, address );
+    }
+  }
+  lua_pop( nodels, 1 );
+  mtx_unlock( &mutex_node_list );
+  return c;
+}
+
+/* start the writer of a connection unless it is running, joining the one
+   that failed; return false if it could not start. The connection must be
+   locked */
+static int node_conn_start (nodeconn *c)
+{
+  if ( c->running ) {
+    return TRUE;
+  }
+  if ( c->started ) {
+    thrd_join( c->writer, NULL );  /* exited after the failure */
+    c->started = FALSE;
+  }
+  if ( c->stop ) {
+    c->err = ESHUTDOWN;
+    return FALSE;
+  }
+  c->err = 0;
+  c->gaierr = 0;
+  if ( thrd_create( &c->writer, node_writer, c ) != thrd_success ) {
+    c->err = EAGAIN;
+    return FALSE;
+  }
+  c->started = TRUE;
+  c->running = TRUE;
+  return TRUE;
+}
+
+/* return the error that stopped the writer of a connection */
+static const char *node_conn_strerror (nodeconn *c)
+{
+  return ( c->gaierr != 0 ) ? gai_strerror( c->gaierr ) : strerror( c->err );
+}
+
+/* give the next id of a connection to a remote channel, bound by the writer
+   now and on every new connection; return false if memory is exhausted.
+   The connection must be locked */
+static int node_conn_bind (nodeconn *c, const char *remote, uint32_t *id)
+{
+  char *name = strdup( remote );
+  char **names = ( name == NULL ) ? NULL : (char **)realloc( c->names,
+    ( c->nnames + 1 ) * sizeof( char * ));
+  if ( names == NULL ) {
+    free( name );
+    return FALSE;
+  }
+  c->names = names;
+  *id = c->nnames;
+  c->names[c->nnames++] = name;
+  cnd_signal( &c->cond );
+  return TRUE;
+}
+
+/*********************
+ * channel functions *
+ *********************/
+
+/* continue sending 'ctx' / 2 values to a channel; 'ctx' is odd once the
+   sender started the connection again */
+static int lpnode_send_k (lua_State *L, int status, lua_KContext ctx)
+{
+  int n = (int)( ctx / 2 );
+  nodechan *c = (nodechan *)lpobj_test( L, n + 2 );
+  waitq *q = node_waitq( c );
+  nodequeue *out = ( c->conn != NULL ) ? &c->conn->out : &c->in;
+  int bad = 0;
+  lpmsg *msg = lpmsg_encode( L, 2, n + 1, &bad );
+
+  mtx_lock( &q->mutex );
+  luaproc_unblock( L, q );
+
+  if ( msg == NULL ) {
+    mtx_unlock( &q->mutex );
+    lua_pushnil( L );
+    if ( bad > 0 ) {
+      lua_pushfstring( L, "failed to send value of unsupported type '%s'",
+        luaL_typename( L, bad ));
+    } else {
+      lua_pushstring( L, "not enough memory" );
+    }
+    return 2;
+  }
+
+  if ( c->closed ) {
+    mtx_unlock( &q->mutex );
+    lpmsg_release( msg );
+    lua_pushnil( L );
+    lua_pushfstring( L, "channel '%s' destroyed while waiting for receiver",
+      lua_tostring( L, 1 ));
+    return 2;
+  }
+
+  if ( c->conn != NULL && !c->conn->connected ) {
+    /* the first send after a failure connects again, then waits for it */
+    if ( !c->conn->running && ( ctx & 1 ) == 0 ) {
+      node_conn_start( c->conn );
+      ctx |= 1;
+    }
+    lpmsg_release( msg );
+    if ( c->conn->running ) {
+      return luaproc_block( L, q, 0, ctx, lpnode_send_k );
+    }
+    mtx_unlock( &q->mutex );
+    lua_pushnil( L );
+    lua_pushfstring( L, "connection to '%s' failed: %s", c->conn->address,
+      node_conn_strerror( c->conn ));
+    return 2;
+  }
+
+  if ( out->count < out->cap ) {
+    queue_push( out, c->id, msg );
+    if ( c->conn != NULL ) {
+      cnd_signal( &c->conn->cond );
+    } else if ( out->count == 1 ) {  /* receivers wait on an empty queue */
+      waitq_wake( q );
+    }
+    mtx_unlock( &q->mutex );
+    lua_pushboolean( L, TRUE );
+    return 1;
+  }
+
+  /* the queue is full */
+  lpmsg_release( msg );
+  return luaproc_block( L, q, 0, ctx, lpnode_send_k );
+}
+
+/* continue receiving a message from an exported channel */
+static int lpnode_receive_k (lua_State *L, int status, lua_KContext ctx)
+{
+  nodechan *c = (nodechan *)lpobj_test( L, 3 );
+
+  mtx_lock( &c->wq.mutex );
+  luaproc_unblock( L, &c->wq );
+
+  if ( c->in.count > 0 ) {
+    /* wake the senders and readers waiting for room */
+    if ( c->in.count == c->in.cap ) {
+      waitq_wake( &c->wq );
+    }
+    nodeitem it = queue_pop( &c->in );
+    mtx_unlock( &c->wq.mutex );
+    int n = lpmsg_decode( L, it.msg );
+    lpmsg_release( it.msg );
+    if ( n < 0 ) {
+      lua_pushnil( L );
+      lua_pushstring( L, "not enough space in the stack" );
+      return 2;
+    }
+    return n;
+  }
+
+  if ( c->closed ) {
+    mtx_unlock( &c->wq.mutex );
+    lua_pushnil( L );
+    lua_pushfstring( L, "channel '%s' destroyed while waiting for sender",
+      lua_tostring( L, 1 ));
+    return 2;
+  }
+
+  if ( lua_toboolean( L, 2 )) {  /* asynchronous receive */
+    mtx_unlock( &c->wq.mutex );
+    lua_pushnil( L );
+    lua_pushfstring( L, "no messages on channel '%s'", lua_tostring( L, 1 ));
+    return 2;
+  }
+
+  return luaproc_block( L, &c->wq, 0, ctx, lpnode_receive_k );
+}
+
+/* push a channel for the rest of an operation, or nil and an error message
+   if it does not exist; return false if not found */
+static int node_push (lua_State *L, const char *name)
+{
+  nodechan *c = node_get( name );
+  if ( c == NULL ) {
+    lua_pushnil( L );
+    lua_pushfstring( L, "channel '%s' does not exist", name );
+    return FALSE;
+  }
+  lpobj_push( L, &c->obj );
+  lpobj_release( &c->obj );
+  return TRUE;
+}
+
+/* start accepting connections from other nodes on "host:port" or
+   "unix:path"; return true and the port of a tcp socket, or nil and an
+   error message */
+static int lpnode_listen (lua_State *L)
+{
+  const char *address = luaL_checkstring( L, 1 );
+  int backlog = (int)luaL_optinteger( L, 2, 128 );
+  int fd = -1, err = 0, port = 0;
+  char *path = NULL;
+
+  if ( strncmp( address, "unix:", 5 ) == 0 ) {
+    struct sockaddr_un sa;
+    if ( !node_unixaddr( &sa, address )) {
+      err = ENAMETOOLONG;
+    } else if (( fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 )) < 0 ) {
+      err = errno;
+    } else if ( bind( fd, (struct sockaddr *)&sa, sizeof( sa )) != 0
+      || listen( fd, backlog ) != 0 )
+    {
+      err = errno;
+      close( fd );
+      fd = -1;
+    } else if (( path = strdup( sa.sun_path )) == NULL ) {
+      err = ENOMEM;
+      unlink( sa.sun_path );
+      close( fd );
+      fd = -1;
+    }
+  } else {
+    struct addrinfo *res = node_resolve( L, address );
+    if ( res == NULL ) {
+      return 2;
+    }
+    int one = 1;
+    for ( struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next ) {
+      fd = socket( ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+        ai->ai_protocol );
+      if ( fd < 0 ) {
+        err = errno;
+        continue;
+      }
+      setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ));
+      if ( bind( fd, ai->ai_addr, ai->ai_addrlen ) == 0 &&
+           listen( fd, backlog ) == 0 ) {
+        break;
+      }
+      err = errno;
+      close( fd );
+      fd = -1;
+    }
+    freeaddrinfo( res );
+    struct sockaddr_storage sa;
+    socklen_t salen = sizeof( sa );
+    if ( fd >= 0 && getsockname( fd, (struct sockaddr *)&sa, &salen ) == 0 ) {
+      if ( sa.ss_family == AF_INET ) {
+        port = ntohs( ((struct sockaddr_in *)&sa)->sin_port );
+      } else if ( sa.ss_family == AF_INET6 ) {
+        port = ntohs( ((struct sockaddr_in6 *)&sa)->sin6_port );
+      }
+    }
+  }
+  if ( fd < 0 ) {
+    lua_pushnil( L );
+    lua_pushfstring( L, "cannot listen on '%s': %s", address,
+      strerror( err ));
+    return 2;
+  }
+
+  nodelistener *l = (nodelistener *)malloc( sizeof( nodelistener ));
+  if ( l == NULL ) {
+    err = ENOMEM;
+  } else {
+    l->fd = fd;
+    l->path = path;
+    mtx_lock( &mutex_node_list );
+    if ( thrd_create( &l->acceptor, node_acceptor, l ) == thrd_success ) {
+      l->next = listeners;
+      listeners = l;
+    } else {
+      free( l );
+      l = NULL;
+      err = EAGAIN;
+    }
+    mtx_unlock( &mutex_node_list );
+  }
+  if ( l == NULL ) {
+    if ( path != NULL ) {
+      unlink( path );
+      free( path );
+    }
+    close( fd );
+    lua_pushnil( L );
+    lua_pushfstring( L, "cannot listen on '%s': %s", address,
+      strerror( err ));
+    return 2;
+  }
+
+  lua_pushboolean( L, TRUE );
+  if ( port > 0 ) {
+    lua_pushinteger( L, port );
+    return 2;
+  }
+  return 1;
+}
+
+/**********************
+ * exported functions *
+ **********************/
+
+/* send the values after the channel name at index 1 */
+int lpnode_send (lua_State *L)
+{
+  const char *name = luaL_checkstring( L, 1 );
+  int n = lua_gettop( L ) - 1;
+  if ( !node_push( L, name )) {
+    return 2;
+  }
+  return lpnode_send_k( L, LUA_OK, n * 2 );
+}
+
+/* receive a message from the channel named at index 1 */
+int lpnode_receive (lua_State *L)
+{
+  const char *name = luaL_checkstring( L, 1 );
+  lua_settop( L, 2 );
+  if ( !node_push( L, name )) {
+    return 2;
+  }
+  nodechan *c = (nodechan *)lpobj_test( L, 3 );
+  if ( c->conn != NULL ) {
+    lua_pushnil( L );
+    lua_pushfstring( L, "channel '%s' is imported, messages are received "
+      "by its node", name );
+    return 2;
+  }
+  return lpnode_receive_k( L, LUA_OK, 0 );
+}
+
+/* register a new channel (name at index 1); 'conn' is NULL for an exported
+   channel */
+static int node_chan_new (lua_State *L, nodeconn *conn, uint32_t id)
+{
+  const char *name = lua_tostring( L, 1 );
+  nodechan *c = (nodechan *)malloc( sizeof( nodechan ));
+  if ( c == NULL || !queue_init( &c->in, ( conn == NULL ) ?
+    LUAPROC_NODE_QUEUE_MAX : 0 ))
+  {
+    free( c );
+    lua_pushnil( L );
+    lua_pushliteral( L, "not enough memory" );
+    return 2;
+  }
+  lpobj_init( &c->obj, &lpnode_chan_type );
+  waitq_init( &c->wq );
+  c->closed = FALSE;
+  c->conn = conn;
+  c->id = id;
+
+  mtx_lock( &mutex_node_list );
+  lua_getglobal( nodels, LUAPROC_NODE_TABLE );
+  lua_getfield( nodels, -1, name );
+  int exists = !lua_isnil( nodels, -1 );
+  lua_pop( nodels, 1 );
+  if ( !exists ) {
+    lua_pushlightuserdata( nodels, c );
+    lua_setfield( nodels, -2, name );
+  }
+  lua_pop( nodels, 1 );
+  mtx_unlock( &mutex_node_list );
+
+  if ( exists ) {  /* created meanwhile */
+    lpobj_release( &c->obj );
+    lua_pushnil( L );
+    lua_pushfstring( L, "channel '%s' already exists", name );
+    return 2;
+  }
+  lua_pushboolean( L, TRUE );
+  return 1;
+}
+
+/* continue creating an imported channel once its connection (index 6) is
+   connected or failed */
+static int lpnode_create_k (lua_State *L, int status, lua_KContext ctx)
+{
+  nodeconn *conn = (nodeconn *)lua_touserdata( L, 6 );
+  const char *remote = lua_isnil( L, 5 ) ? lua_tostring( L, 1 )
+                                         : lua_tostring( L, 5 );
+
+  mtx_lock( &conn->wq.mutex );
+  luaproc_unblock( L, &conn->wq );
+  if ( !conn->connected ) {
+    if ( conn->running ) {
+      return luaproc_block( L, &conn->wq, 0, ctx, lpnode_create_k );
+    }
+    mtx_unlock( &conn->wq.mutex );
+    lua_pushnil( L );
+    lua_pushfstring( L, "cannot connect to '%s': %s", conn->address,
+      node_conn_strerror( conn ));
+    return 2;
+  }
+  uint32_t id;
+  int bound = node_conn_bind( conn, remote, &id );
+  mtx_unlock( &conn->wq.mutex );
+  if ( !bound ) {
+    lua_pushnil( L );
+    lua_pushliteral( L, "not enough memory" );
+    return 2;
+  }
+  return node_chan_new( L, conn, id );
+}
+
+/* create a channel (name at index 1) with the options at index 2 */
+int lpnode_create (lua_State *L)
+{
+  const char *name = luaL_checkstring( L, 1 );
+  lua_settop( L, 2 );
+  lua_getfield( L, 2, "export" );
+  int exported = lua_toboolean( L, -1 );
+  lua_getfield( L, 2, "import" );
+  const char *address = lua_tostring( L, -1 );
+  lua_getfield( L, 2, "remote" );
+  if ( exported == ( address != NULL )) {
+    luaL_error( L, "channel options need either 'export' or an 'import' "
+      "address" );
+  }
+  if ( !lua_isnil( L, -1 ) && !lua_isstring( L, -1 )) {
+    luaL_error( L, "option 'remote' must be a string" );
+  }
+
+  if ( lpnode_exists( name )) {
+    lua_pushnil( L );
+    lua_pushfstring( L, "channel '%s' already exists", name );
+    return 2;
+  }
+  if ( exported ) {
+    return node_chan_new( L, NULL, 0 );
+  }
+
+  /* the writer connects, the caller waits without holding its worker */
+  nodeconn *conn = node_conn_get( address );
+  if ( conn == NULL ) {
+    lua_pushnil( L );
+    lua_pushliteral( L, "not enough memory" );
+    return 2;
+  }
+  lua_pushlightuserdata( L, conn );
+  mtx_lock( &conn->wq.mutex );
+  node_conn_start( conn );
+  mtx_unlock( &conn->wq.mutex );
+  return lpnode_create_k( L, LUA_OK, 0 );
+}
+
+/* destroy the channel named at index 1 */
+int lpnode_destroy (lua_State *L)
+{
+  const char *name = luaL_checkstring( L, 1 );
+
+  mtx_lock( &mutex_node_list );
+  lua_getglobal( nodels, LUAPROC_NODE_TABLE );
+  lua_getfield( nodels, -1, name );
+  nodechan *c = (nodechan *)lua_touserdata( nodels, -1 );
+  lua_pop( nodels, 1 );
+  if ( c != NULL ) {
+    lua_pushnil( nodels );
+    lua_setfield( nodels, -2, name );
+  }
+  lua_pop( nodels, 1 );
+  mtx_unlock( &mutex_node_list );
+
+  if ( c == NULL ) {
+    lua_pushnil( L );
+    lua_pushfstring( L, "channel '%s' does not exist", name );
+    return 2;
+  }
+  node_close( c );
+  lua_pushboolean( L, TRUE );
+  return 1;
+}
+
+/* return true if a node channel exists */
+int lpnode_exists (const char *name)
+{
+  mtx_lock( &mutex_node_list );
+  lua_getglobal( nodels, LUAPROC_NODE_TABLE );
+  lua_getfield( nodels, -1, name );
+  int exists = !lua_isnil( nodels, -1 );
+  lua_pop( nodels, 2 );
+  mtx_unlock( &mutex_node_list );
+  return exists;
+}
+
+/* initialize node channels table */
+void lpnode_init (void)
+{
+  mtx_init( &mutex_node_list, mtx_plain );
+  nodeclosing = FALSE;
+  nodels = luaL_newstate();
+  lua_newtable( nodels );
+  lua_setglobal( nodels, LUAPROC_NODE_TABLE );
+  lua_newtable( nodels );
+  lua_setglobal( nodels, LUAPROC_CONN_TABLE );
+}
+
+/* stop listening, flush connections and destroy node channels table */
+void lpnode_close (void)
+{
+  mtx_lock( &mutex_node_list );
+  nodeclosing = TRUE;
+  mtx_unlock( &mutex_node_list );
+
+  /* stop accepting connections */
+  while ( listeners != NULL ) {
+    nodelistener *l = listeners;
+    listeners = l->next;
+    shutdown( l->fd, SHUT_RDWR );
+    thrd_join( l->acceptor, NULL );
+    close( l->fd );
+    if ( l->path != NULL ) {
+      unlink( l->path );
+      free( l->path );
+    }
+    free( l );
+  }
+
+  /* stop reading connections from other nodes; readers still look up
+     channels in the table, so it is walked under the lock, and closing the
+     channels releases a reader waiting for room in one */
+  mtx_lock( &mutex_node_list );
+  for ( nodepeer *p = peers; p != NULL; p = p->next ) {
+    if ( p->fd >= 0 ) {
+      shutdown( p->fd, SHUT_RDWR );
+    }
+  }
+
+  /* close channels, which drops the messages still arriving */
+  lua_getglobal( nodels, LUAPROC_NODE_TABLE );
+  lua_pushnil( nodels );
+  while ( lua_next( nodels, -2 ) != 0 ) {
+    node_close( (nodechan *)lua_touserdata( nodels, -1 ));
+    /* pop value, leave key for next iteration */
+    lua_pop( nodels, 1 );
+  }
+  lua_pop( nodels, 1 );
+  /* readers still running find no channels from now on */
+  lua_newtable( nodels );
+  lua_setglobal( nodels, LUAPROC_NODE_TABLE );
+  mtx_unlock( &mutex_node_list );
+
+  while ( peers != NULL ) {
+    nodepeer *p = peers;
+    peers = p->next;
+    thrd_join( p->reader, NULL );
+    free( p );
+  }
+
+  /* write the frames still queued and close connections; a writer stuck
+     on a node that does not read has its socket shut down */
+  lua_getglobal( nodels, LUAPROC_CONN_TABLE );
+  lua_pushnil( nodels );
+  while ( lua_next( nodels, -2 ) != 0 ) {
+    nodeconn *c = (nodeconn *)lua_touserdata( nodels, -1 );
+    timespec t = lpaux_time_period( LUAPROC_NODE_FLUSH_TIMEOUT );
+    mtx_lock( &c->wq.mutex );
+    c->stop = TRUE;
+    cnd_signal( &c->cond );
+    while ( c->running &&
+      cnd_timedwait( &c->wq.cond, &c->wq.mutex, &t ) != thrd_timedout ) {
+    }
+    if ( c->running && c->fd >= 0 ) {
+      shutdown( c->fd, SHUT_RDWR );
+    }
+    mtx_unlock( &c->wq.mutex );
+    if ( c->started ) {
+      thrd_join( c->writer, NULL );
+    }
+    node_conn_free( c );
+    lua_pop( nodels, 1 );
+  }
+  lua_pop( nodels, 1 );
+
+  lua_close( nodels );
+  mtx_destroy( &mutex_node_list );
+}
@@ -0,0 +1,49 @@
+/*
+** channels between luaproc nodes over tcp and unix domain sockets
+** See Copyright Notice in luaproc.h
+*/
+
+#ifndef _LUA_LUAPROC_NODE_H_
+#define _LUA_LUAPROC_NODE_H_
+
+#include <lua.h>
+#include <lauxlib.h>
+
+/* number of messages an exported channel or a connection holds */
+#define LUAPROC_NODE_QUEUE_MAX 1024
+
+/* largest frame accepted from another node */
+#define LUAPROC_NODE_MAX_FRAME ( 64 << 20 )
+
+/* seconds a connection has to write its queued frames at exit */
+#define LUAPROC_NODE_FLUSH_TIMEOUT 5.0
+
+/* node functions of the luaproc library */
+extern const luaL_Reg lpnode_funcs[];
+
+/***********************
+ * function prototypes *
+ **********************/
+
+/* initialize node channels table */
+void lpnode_init( void );
+
+/* stop listening, flush connections and destroy node channels table */
+void lpnode_close( void );
+
+/* return true if a node channel exists */
+int lpnode_exists( const char *name );
+
+/* create a channel (name at index 1) with the options at index 2 */
+int lpnode_create( lua_State *L );
+
+/* destroy the channel named at index 1 */
+int lpnode_destroy( lua_State *L );
+
+/* send the values after the channel name at index 1 */
+int lpnode_send( lua_State *L );
+
+/* receive a message from the channel named at index 1 */
+int lpnode_receive( lua_State *L );
+
+#endif
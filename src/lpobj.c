@@ -0,0 +1,102 @@
+/*
+** shared objects of lua processes
+** See Copyright Notice in luaproc.h
+*/
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "lpcompat.h"
+#include "lpobj.h"
+
+#define OBJ_MARKER 0x0b1ec7ed
+
+/* userdata referencing a shared object */
+typedef struct {
+  int marker;
+  lpobject *obj;
+} lpobj_udata;
+
+/* initialize object header with one reference */
+void lpobj_init (lpobject *obj, const lpobject_type *type)
+{
+  obj->type = type;
+  atomic_init( &obj->refs, 1 );
+}
+
+/* add a reference */
+void lpobj_retain (lpobject *obj)
+{
+  atomic_fetch_add( &obj->refs, 1 );
+}
+
+/* remove a reference, destroy object when it was the last one */
+void lpobj_release (lpobject *obj)
+{
+  if ( atomic_fetch_sub( &obj->refs, 1 ) == 1 ) {
+    obj->type->destroy( obj );
+  }
+}
+
+/* release the reference held by a userdata */
+static int lpobj_gc (lua_State *L)
+{
+  lpobj_udata *u = (lpobj_udata *)lua_touserdata( L, 1 );
+  if ( u->obj != NULL ) {
+    lpobj_release( u->obj );
+    u->obj = NULL;
+  }
+  return 0;
+}
+
+static int lpobj_tostring (lua_State *L)
+{
+  lpobj_udata *u = (lpobj_udata *)lua_touserdata( L, 1 );
+  lua_pushfstring( L, "%s: %p", u->obj->type->name, (void *)u->obj );
+  return 1;
+}
+
+/* push a new userdata referencing the object */
+void lpobj_push (lua_State *L, lpobject *obj)
+{
+  lpobj_udata *u = (lpobj_udata *)lua_newuserdata( L, sizeof( lpobj_udata ));
+  u->marker = OBJ_MARKER;
+  u->obj = NULL;
+  /* metatables are created on first use in each lua state */
+  if ( luaL_newmetatable( L, obj->type->name )) {
+    lua_newtable( L );
+    luaL_setfuncs( L, obj->type->methods, 0 );
+    lpcompat_wrapfuncs( L, -1 );
+    lua_setfield( L, -2, "__index" );
+    lua_pushcfunction( L, lpobj_gc );
+    lua_setfield( L, -2, "__gc" );
+    lua_pushcfunction( L, lpobj_tostring );
+    lua_setfield( L, -2, "__tostring" );
+  }
+  lua_setmetatable( L, -2 );
+  lpobj_retain( obj );
+  u->obj = obj;
+}
+
+/* return the object referenced by a userdata or NULL */
+lpobject *lpobj_test (lua_State *L, int idx)
+{
+  if ( lua_type( L, idx ) != LUA_TUSERDATA
+    || lua_rawlen( L, idx ) != sizeof( lpobj_udata ))
+  {
+    return NULL;
+  }
+  lpobj_udata *u = (lpobj_udata *)lua_touserdata( L, idx );
+  return ( u->marker == OBJ_MARKER ) ? u->obj : NULL;
+}
+
+/* return the object referenced by a userdata of the given type or raise an
+   error */
+lpobject *lpobj_check (lua_State *L, int idx, const lpobject_type *type)
+{
+  lpobject *obj = lpobj_test( L, idx );
+  if ( obj == NULL || obj->type != type ) {
+    luaL_argerror( L, idx, lua_pushfstring( L, "%s expected", type->name ));
+  }
+  return obj;
+}
@@ -0,0 +1,55 @@
+/*
+** shared objects of lua processes
+** See Copyright Notice in luaproc.h
+*/
+
+#ifndef _LUA_LUAPROC_OBJ_H_
+#define _LUA_LUAPROC_OBJ_H_
+
+#include <stdatomic.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+/*******************
+ * structure types *
+ ******************/
+
+typedef struct stlpobject lpobject;  /* reference counted shared object */
+
+/* type of a shared object */
+typedef struct {
+  const char *name;                  /* metatable name */
+  const luaL_Reg *methods;           /* methods available from lua */
+  void (*destroy)( lpobject *obj );  /* free object when not referenced */
+} lpobject_type;
+
+/* header of every shared object */
+struct stlpobject {
+  const lpobject_type *type;
+  atomic_int refs;
+};
+
+/***********************
+ * function prototypes *
+ **********************/
+
+/* initialize object header with one reference */
+void lpobj_init( lpobject *obj, const lpobject_type *type );
+
+/* add a reference */
+void lpobj_retain( lpobject *obj );
+
+/* remove a reference, destroy object when it was the last one */
+void lpobj_release( lpobject *obj );
+
+/* push a new userdata referencing the object */
+void lpobj_push( lua_State *L, lpobject *obj );
+
+/* return the object referenced by a userdata or NULL */
+lpobject *lpobj_test( lua_State *L, int idx );
+
+/* return the object referenced by a userdata of the given type or raise an
+   error */
+lpobject *lpobj_check( lua_State *L, int idx, const lpobject_type *type );
+
+#endif
@@ -4,12 +4,17 @@
 */
 
 #include <threads.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
 
+#include "lpcompat.h"
 #include "lpsched.h"
 #include "luaproc.h"
 #include "lpaux.h"
@@ -20,27 +25,30 @@
 
 #if (LUA_VERSION_NUM == 503)
 #define luaproc_resume(L, from, nargs, nout) lua_resume (L, from, nargs)
-#else
+#else  /* lua 5.4, and luajit through lpcompat.h */
 #define luaproc_resume(L, from, nargs, nout) lua_resume (L, from, nargs, nout)
 #endif
 
+/* hint the processor that the worker is busy-waiting */
+#if defined(__x86_64__) || defined(__i386__)
+#define sched_cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define sched_cpu_relax() __asm__ __volatile__( "yield" )
+#else
+#define sched_cpu_relax() ((void)0)
+#endif
+
 
 /********************
  * global variables *
  *******************/
 
-/* ready process list */
-list ready_lp_list;
-
 /* ready process queue access mutex */
 mtx_t mutex_sched;  // destroy!!
 
 /* active luaproc count access mutex */
 mtx_t mutex_lp_count;
 
-/* wake worker up conditional variable */
-cnd_t cond_wakeup_worker;
-
 /* no active luaproc conditional variable */
 cnd_t cond_no_active_lp;
 
@@ -48,122 +56,475 @@ cnd_t cond_no_active_lp;
 static lua_State *workerls = NULL;
 
 int lpcount = 0;         /* number of active luaprocs */
-int workerscount = 0;    /* number of active workers */
-int destroyworkers = 0;  /* number of workers to destroy */
+
+/* worker thread, protected by 'mutex_sched' except for the handoff fields
+   which belong to the worker thread; idle workers may take 'runnext' */
+typedef struct stlpworker
+{
+  int id;            /* slot in the workers of its pool */
+  lppool *pool;
+  cnd_t cond;        /* wakes the worker up when parked */
+  int parked;
+  int spinning;
+  int signaled;      /* woken up and not running yet */
+  list local;        /* ready processes preferring this worker */
+  int localrun;      /* processes taken from 'local' in a row */
+  _Atomic(luaproc *) runnext;  /* process woken by the running one */
+  int runnextcount;  /* consecutive direct handoffs */
+} lpworker;
+
+/* worker pool with its own ready queue and workers, protected by
+   'mutex_sched' except for 'readycount' */
+struct stlppool
+{
+  list ready;               /* ready processes shared by the pool workers */
+  atomic_int readycount;    /* length of all ready queues of the pool */
+  lpworker **workers;       /* by id, a destroyed worker leaves its slot
+                               empty */
+  int workerslots;
+  int workerscount;         /* number of active workers */
+  int destroyworkers;       /* number of workers to destroy */
+  int spinningworkers;      /* workers spinning before they park */
+  int parkedworkers;        /* workers waiting on their condition */
+  int pendingwakeups;       /* signals not yet consumed by a worker */
+  char name[];
+};
+
+/* pools, the default one first; they live until the workers are joined */
+static lppool **pools = NULL;
+static int npools = 0;
+static lppool *defaultpool = NULL;
+
+/* number of polls an idle worker makes before parking */
+static atomic_int spinlimit = LUAPROC_SCHED_DEFAULT_SPIN;
 
 /* sleeping processes */
 list sleep_list;
 
+/* timers ticking into channels and the thread delivering their ticks,
+   started with the first timer, protected by 'mutex_sched' */
+static timerlist timer_list;
+static cnd_t cond_timer;        /* timer armed or shutdown */
+static thrd_t timerthread;
+static int timerrunning = FALSE;
+static int timerstop = FALSE;
+
+/* deterministic mode: processes are resumed by the thread driving them in
+   the order of a seeded generator, protected by 'mutex_sched' */
+static int deterministic = FALSE;
+static list detready;
+static uint64_t detstate;
+
+/* worker of the current thread, NULL on other threads */
+static _Thread_local lpworker *curworker = NULL;
+
+/* blocking pool: processes waiting for a pool thread and pool threads,
+   protected by 'mutex_blocking' */
+static mtx_t mutex_blocking;
+static cnd_t cond_blocking;       /* new process or shutdown */
+static cnd_t cond_blocking_exit;  /* a pool thread exited */
+static list blocking_list;
+static int blockingthreads = 0;   /* all pool threads */
+static int blockingidle = 0;      /* pool threads waiting for processes */
+static int blockingstop = FALSE;
+static int rtthreads = 0;         /* threads of real-time processes */
+
+/* threads of the blocking pool and of real-time processes that have exited
+   or are exiting, joined when the next thread is created and when the
+   workers are joined, protected by 'mutex_blocking' */
+static thrd_t *exitedthreads = NULL;
+static int nexited = 0;
+static int exitedslots = 0;
+
+/* thread of a real-time process, the handoff fields are protected by
+   'mutex_sched' */
+struct stlprtworker
+{
+  cnd_t cond;      /* wakes the thread up when the process is ready */
+  int ready;
+  int priority;    /* SCHED_FIFO priority or 0 */
+  timespec spin;   /* busy-waiting before the end of a sleep */
+  luaproc *lp;
+};
+
 /***********************
  * register prototypes *
  ***********************/
 
 static void sched_dec_lpcount (void);
 static void sched_sleep_activate (void);
+static void sched_timer_activate (void);
+static lppool *sched_pool (luaproc *lp);
+static void sched_ready_insert (luaproc *lp);
+static luaproc *sched_ready_remove (lpworker *self, int steal);
+static void sched_wake (lppool *pool, lpworker *w);
+static void sched_wake_all (lppool *pool);
+static void sched_signal_worker (lppool *pool);
+static int sched_others_ready (lpworker *self);
+static luaproc *sched_take_proc (lpworker *self);
+static int sched_resume (luaproc *lp, int *nresults);
+static void sched_settle (luaproc *lp, int procstat, int nresults);
+static int sched_cancel_settled (luaproc *lp);
+static void sched_signal_timer (void);
+static int timermain (void *args);
+static int blockingmain (void *args);
+static int rtmain (void *args);
+static void sched_thread_exit (void);
+static void sched_reap_threads (void);
 
 /*******************************
  * worker thread main function *
  *******************************/
 
-/* worker thread main function */
-int workermain (void *args)
+/*
+  wait until instructed to wake up (because there's work to do or because
+  workers must be destroyed) and take a process from the ready queues
+*/
+static luaproc *sched_take_proc (lpworker *self)
 {
-  /* main worker loop */
-  while ( TRUE ) {
-    /*
-      wait until instructed to wake up (because there's work to do
-      or because workers must be destroyed)
-    */
-    mtx_lock( &mutex_sched );
-    while ( list_count( &ready_lp_list ) == 0 && destroyworkers <= 0 ) {
-      if ( list_count ( &sleep_list ) == 0 ) {
-        cnd_wait( &cond_wakeup_worker, &mutex_sched );
-      } else {
-        // wait for specific time moment
-        cnd_timedwait( &cond_wakeup_worker, &mutex_sched, 
-          list_time_next( &sleep_list ));
-        sched_sleep_activate();
+  lppool *pool = self->pool;
+  /* busy workers give up their cache here when asked to */
+  if ( luaproc_cache_stale() ) {
+    luaproc_collect_recycled();
+  }
+  mtx_lock( &mutex_sched );
+  luaproc *lp = NULL;
+  int spun = FALSE;
+  double steal = 0;  /* when processes preferring busy workers can be taken */
+  while ( pool->destroyworkers <= 0 && ( lp = sched_ready_remove( self,
+    steal > 0 && lpaux_time_now() >= steal )) == NULL )
+  {
+    /* poll the ready queues for a while before going to sleep; work queued
+       meanwhile is picked up without a wakeup signal */
+    int limit = atomic_load( &spinlimit );
+    if ( !spun && limit > 0 ) {
+      spun = TRUE;
+      self->spinning = TRUE;
+      pool->spinningworkers++;
+      mtx_unlock( &mutex_sched );
+      for ( int i = 0; i < limit && atomic_load( &pool->readycount ) == 0;
+            i++ ) {
+        sched_cpu_relax();
       }
+      mtx_lock( &mutex_sched );
+      pool->spinningworkers--;
+      self->spinning = FALSE;
+      continue;
     }
 
-    if ( destroyworkers > 0 ) {  /* check whether workers should be destroyed */
-
-      destroyworkers--; /* decrease workers to be destroyed count */
-      workerscount--; /* decrease active workers count */
+    /* spend idle time on the garbage of recycled lua processes */
+    if ( luaproc_get_dirty() > 0 || luaproc_cache_stale() ) {
+      mtx_unlock( &mutex_sched );
+      luaproc_collect_recycled();
+      mtx_lock( &mutex_sched );
+      continue;
+    }
 
-      /* remove worker from workers table */
-      lua_getglobal( workerls, LUAPROC_SCHED_WORKERS_TABLE );
-      lua_pushlightuserdata( workerls, (void *)thrd_current( ));
-      lua_pushnil( workerls );
-      lua_rawset( workerls, -3 );
-      lua_pop( workerls, 1 );
+    /* give busy workers some time before taking their processes */
+    if ( !sched_others_ready( self )) {
+      steal = 0;
+    } else if ( steal == 0 ) {
+      steal = lpaux_time_now() + LUAPROC_SCHED_STEAL_DELAY;
+    }
+    timespec stealtime;
+    timespec *deadline = NULL;
+    if ( list_count( &sleep_list ) > 0 ) {
+      deadline = list_time_next( &sleep_list );
+    }
+    if ( steal > 0 ) {
+      stealtime = lpaux_time_period( steal );
+      if ( deadline == NULL || lpaux_time_cmp( &stealtime, deadline ) < 0 ) {
+        deadline = &stealtime;
+      }
+    }
 
-      cnd_signal( &cond_wakeup_worker );  /* wake other workers up */
-      mtx_unlock( &mutex_sched );
-      thrd_exit( 0 );  /* destroy itself */
+    self->parked = TRUE;
+    pool->parkedworkers++;
+    if ( deadline == NULL ) {
+      cnd_wait( &self->cond, &mutex_sched );
+    } else {
+      cnd_timedwait( &self->cond, &mutex_sched, deadline );
+    }
+    pool->parkedworkers--;
+    self->parked = FALSE;
+    if ( self->signaled ) {
+      self->signaled = FALSE;
+      pool->pendingwakeups--;
     }
+    if ( list_count( &sleep_list ) > 0 ) {
+      sched_sleep_activate();
+    }
+    spun = FALSE;
+  }
 
-    /* remove lua process from the ready queue */
-    luaproc* lp = list_remove( &ready_lp_list );
-    mtx_unlock( &mutex_sched );
+  /* check whether workers should be destroyed */
+  if ( pool->destroyworkers > 0 ) {
 
-    /* execute the lua code specified in the lua process struct */
-    int nresults = 0;
-    int procstat = luaproc_resume(
-      luaproc_get_state( lp ), NULL, luaproc_get_numargs( lp ), &nresults );
-    /* reset the process argument count */
-    luaproc_set_numargs( lp, 0 );
+    pool->destroyworkers--; /* decrease workers to be destroyed count */
+    pool->workerscount--; /* decrease active workers count */
+
+    /* remove worker from workers table */
+    lua_getglobal( workerls, LUAPROC_SCHED_WORKERS_TABLE );
+    lua_pushlightuserdata( workerls, (void *)thrd_current( ));
+    lua_pushnil( workerls );
+    lua_rawset( workerls, -3 );
+    lua_pop( workerls, 1 );
 
-    /* has the lua process sucessfully finished its execution? */
-    if ( procstat == 0 ) {
-      luaproc_set_status( lp, LUAPROC_STATUS_FINISHED );
-      luaproc_recycle_insert( lp );  /* try to recycle finished lua process */
-      sched_dec_lpcount();  /* decrease active lua process count */
+    /* processes preferring this worker go to the shared queue */
+    luaproc *p;
+    while (( p = list_remove( &self->local )) != NULL ) {
+      list_insert( &pool->ready, p );
     }
+    pool->workers[self->id] = NULL;
+    sched_signal_worker( pool );
+    mtx_unlock( &mutex_sched );
+
+    /* finished processes kept by this worker go to the recycle list */
+    luaproc_cache_flush();
+    cnd_destroy( &self->cond );
+    free( self );
+    thrd_exit( 0 );  /* destroy itself */
+  }
+
+  mtx_unlock( &mutex_sched );
+
+  return lp;
+}
+
+/* resume a lua process unless its group was cancelled, in which case it
+   fails with a "cancelled" error instead */
+static int sched_resume (luaproc *lp, int *nresults)
+{
+  if ( luaproc_is_cancelled( lp )) {
+    lua_pushstring( luaproc_get_state( lp ), "cancelled" );
+    return LUA_ERRRUN;
+  }
+  int procstat = luaproc_resume(
+    luaproc_get_state( lp ), NULL, luaproc_get_numargs( lp ), nresults );
+  /* reset the process argument count */
+  luaproc_set_numargs( lp, 0 );
+  return procstat;
+}
 
-    /* has the lua process yielded? */
-    else if ( procstat == LUA_YIELD ) {
+/* handle a resumed lua process according to how it stopped */
+static void sched_settle (luaproc *lp, int procstat, int nresults)
+{
+  /* has the lua process sucessfully finished its execution? */
+  if ( procstat == 0 ) {
+    luaproc_set_status( lp, LUAPROC_STATUS_FINISHED );
+    /* hand results to the process handle and try to recycle the process */
+    luaproc_finish( lp, nresults );
+    sched_dec_lpcount();  /* decrease active lua process count */
+  }
 
-      /* yield attempting to send a message */
-      if ( luaproc_get_status( lp ) == LUAPROC_STATUS_BLOCKED_SEND ) {
+  /* has the lua process yielded? */
+  else if ( procstat == LUA_YIELD ) {
+
+    /* yield attempting to send a message; the process of a cancelled
+       group is not queued, the cancel has looked at the channel already
+       or it sees the process there */
+    if ( luaproc_get_status( lp ) == LUAPROC_STATUS_BLOCKED_SEND ) {
+      channel *chan = luaproc_get_channel( lp );
+      if ( luaproc_is_cancelled( lp )) {
+        sched_queue_proc( lp );
+      } else {
         luaproc_queue_sender( lp );  /* queue lua process on channel */
-        /* unlock channel */
-        luaproc_unlock_channel( luaproc_get_channel( lp ));
       }
+      /* unlock channel */
+      luaproc_unlock_channel( chan );
+    }
 
-      /* yield attempting to receive a message */
-      else if ( luaproc_get_status( lp ) == LUAPROC_STATUS_BLOCKED_RECV ) {
+    /* yield attempting to receive a message */
+    else if ( luaproc_get_status( lp ) == LUAPROC_STATUS_BLOCKED_RECV ) {
+      channel *chan = luaproc_get_channel( lp );
+      if ( luaproc_is_cancelled( lp )) {
+        sched_queue_proc( lp );
+      } else {
         luaproc_queue_receiver( lp );  /* queue lua process on channel */
-        /* unlock channel */
-        luaproc_unlock_channel( luaproc_get_channel( lp ));
       }
+      /* unlock channel */
+      luaproc_unlock_channel( chan );
+    }
 
-      /* sleep */
-      else if ( luaproc_get_status( lp ) == LUAPROC_STATUS_BLOCKED_SLEEP ) {
-        mtx_lock( &mutex_sched );
+    /* sleep */
+    else if ( luaproc_get_status( lp ) == LUAPROC_STATUS_BLOCKED_SLEEP ) {
+      mtx_lock( &mutex_sched );
+      if ( !sched_cancel_settled( lp )) {
         list_time_insert( &sleep_list, lp );
-        mtx_unlock( &mutex_sched );
+        luaproc_set_parked( lp, TRUE );
+        sched_signal_timer();
       }
+      mtx_unlock( &mutex_sched );
+    }
 
-      /* yield on explicit coroutine.yield call */
-      else {
-        /* re-insert the job at the end of the ready process queue */
+    /* wait on a shared object, possibly with a deadline */
+    else if ( luaproc_get_status( lp ) == LUAPROC_STATUS_BLOCKED_WAIT ) {
+      if ( luaproc_is_timed( lp ) || luaproc_is_cancellable( lp )) {
         mtx_lock( &mutex_sched );
-        list_insert( &ready_lp_list, lp );
+        if ( !sched_cancel_settled( lp )) {
+          if ( luaproc_is_timed( lp )) {
+            list_time_insert( &sleep_list, lp );
+            sched_signal_timer();
+          }
+          luaproc_set_parked( lp, TRUE );
+        }
         mtx_unlock( &mutex_sched );
       }
+      /* queue and unlock the wait queue; a cancelled process leaves it
+         before its state is closed */
+      luaproc_queue_waiter( lp );
     }
 
-    /* or was there an error executing the lua process? */
+    /* yield on explicit coroutine.yield call */
     else {
-      /* print error message */
+      /* re-insert the job at the end of the ready process queue */
+      mtx_lock( &mutex_sched );
+      sched_ready_insert( lp );
+      lppool *pool = sched_pool( lp );
+      if ( curworker == NULL || curworker->pool != pool ) {
+        sched_signal_worker( pool );
+      }
+      mtx_unlock( &mutex_sched );
+    }
+  }
+
+  /* or was there an error executing the lua process? */
+  else {
+    /* print error message, cancelled processes end quietly */
+    if ( !luaproc_is_cancelled( lp )) {
       fprintf( stderr, "close lua_State (error: %s)\n",
         luaL_checkstring( luaproc_get_state( lp ), -1 ));
-      lua_close( luaproc_get_state( lp ));  /* close lua state */
-      sched_dec_lpcount();  /* decrease active lua process count */
     }
+    luaproc_drop_wait( lp );  /* a cancelled process may still wait */
+    luaproc_fail( lp );  /* pass error message to the process handle */
+    lua_close( luaproc_get_state( lp ));  /* close lua state */
+    sched_dec_lpcount();  /* decrease active lua process count */
   }
+}
 
+/* worker thread main function */
+int workermain (void *args)
+{
+  lpworker *self = (lpworker *)args;
+  curworker = self;
+  luaproc_cache_enable();
+
+  /* main worker loop */
+  while ( TRUE ) {
+    /* resume the process handed off by the previous one, bounding the chain
+       so that a ping-pong pair does not starve the ready queue */
+    luaproc *lp = atomic_exchange( &self->runnext, NULL );
+    if ( lp != NULL && self->runnextcount < LUAPROC_SCHED_RUNNEXT_MAX ) {
+      self->runnextcount++;
+    } else {
+      if ( lp != NULL ) {  /* handoff budget exhausted, queue it */
+        sched_queue_proc( lp );
+      }
+      self->runnextcount = 0;
+      lp = sched_take_proc( self );
+    }
+    luaproc_set_worker( lp, self->id );
+
+    /* execute the lua code specified in the lua process struct */
+    int nresults = 0;
+    int procstat = sched_resume( lp, &nresults );
+    sched_settle( lp, procstat, nresults );
+  }
+
+  return 0;
+}
+
+/*******************************
+ * blocking pool main function *
+ *******************************/
+
+/* run processes of the blocking pool; a process that blocks on luaproc
+   objects continues on the workers; exit after being idle for a while */
+static int blockingmain (void *args)
+{
+  mtx_lock( &mutex_blocking );
+  while ( TRUE ) {
+    luaproc *lp = list_remove( &blocking_list );
+    if ( lp == NULL ) {
+      if ( blockingstop ) {
+        break;
+      }
+      timespec t = lpaux_time_period(
+        lpaux_time_now() + LUAPROC_SCHED_BLOCKING_IDLE );
+      blockingidle++;
+      int r = cnd_timedwait( &cond_blocking, &mutex_blocking, &t );
+      blockingidle--;
+      if ( r == thrd_timedout && list_count( &blocking_list ) == 0 ) {
+        break;
+      }
+      continue;
+    }
+    mtx_unlock( &mutex_blocking );
+
+    int nresults = 0;
+    int procstat = sched_resume( lp, &nresults );
+    sched_settle( lp, procstat, nresults );
+
+    mtx_lock( &mutex_blocking );
+  }
+  sched_thread_exit();
+  blockingthreads--;
+  cnd_signal( &cond_blocking_exit );
+  mtx_unlock( &mutex_blocking );
+  return 0;
+}
+
+/*****************************
+ * real-time thread function *
+ *****************************/
+
+/* run a real-time process on its own thread; its sleeps end on absolute
+   deadlines of the monotonic clock, spinning for the last part, instead of
+   going through the sleep list */
+static int rtmain (void *args)
+{
+  lprtworker *rt = (lprtworker *)args;
+  luaproc *lp = rt->lp;
+
+  /* the policy needs privileges, without them the thread runs as usual */
+  if ( rt->priority > 0 ) {
+    struct sched_param param;
+    param.sched_priority = rt->priority;
+    pthread_setschedparam( pthread_self(), SCHED_FIFO, &param );
+  }
+
+  while ( TRUE ) {
+    mtx_lock( &mutex_sched );
+    while ( !rt->ready ) {
+      cnd_wait( &rt->cond, &mutex_sched );
+    }
+    rt->ready = FALSE;
+    mtx_unlock( &mutex_sched );
+
+    int nresults = 0;
+    int procstat = sched_resume( lp, &nresults );
+    while ( procstat == LUA_YIELD &&
+            luaproc_get_status( lp ) == LUAPROC_STATUS_BLOCKED_SLEEP ) {
+      lpaux_time_sleep_until( luaproc_get_wake_up( lp ), &rt->spin );
+      luaproc_set_status( lp, LUAPROC_STATUS_READY );
+      procstat = sched_resume( lp, &nresults );
+    }
+    if ( procstat != LUA_YIELD ) {
+      /* the process may be recycled as a normal one */
+      luaproc_set_rt( lp, NULL );
+      sched_settle( lp, procstat, nresults );
+      break;
+    }
+    sched_settle( lp, procstat, nresults );
+  }
+
+  cnd_destroy( &rt->cond );
+  free( rt );
+  mtx_lock( &mutex_blocking );
+  sched_thread_exit();
+  rtthreads--;
+  cnd_signal( &cond_blocking_exit );
+  mtx_unlock( &mutex_blocking );
   return 0;
 }
 
@@ -183,6 +544,307 @@ static void sched_dec_lpcount (void)
   mtx_unlock( &mutex_lp_count );
 }
 
+/* record the calling thread as exiting, to be joined by another one;
+   mutex_blocking must be locked! */
+static void sched_thread_exit (void)
+{
+  if ( nexited == exitedslots ) {
+    int n = ( exitedslots > 0 ) ? exitedslots * 2 : 8;
+    thrd_t *t = (thrd_t *)realloc( exitedthreads, n * sizeof( thrd_t ));
+    if ( t == NULL ) {
+      thrd_detach( thrd_current( ));  /* nobody can join it */
+      return;
+    }
+    exitedthreads = t;
+    exitedslots = n;
+  }
+  exitedthreads[nexited++] = thrd_current();
+}
+
+/* join the threads that have exited; mutex_blocking must be locked! */
+static void sched_reap_threads (void)
+{
+  while ( nexited > 0 ) {
+    thrd_join( exitedthreads[--nexited], NULL );
+  }
+}
+
+/* pool running a lua process */
+static lppool *sched_pool (luaproc *lp)
+{
+  lppool *pool = luaproc_get_pool( lp );
+  return ( pool != NULL ) ? pool : defaultpool;
+}
+
+/* worker preferred by a lua process in its pool, if it exists; mutex_sched
+   must be locked! */
+static lpworker *sched_preferred (lppool *pool, luaproc *lp)
+{
+  int affinity = luaproc_get_affinity( lp );
+  if ( affinity < 0 || pool->workerscount == 0 ) {
+    return NULL;
+  }
+  int id = affinity % pool->workerscount;
+  return ( id < pool->workerslots ) ? pool->workers[id] : NULL;
+}
+
+/* insert lua process in the ready queue of its preferred worker or in the
+   shared one of its pool, mutex_sched must be locked! */
+static void sched_ready_insert (luaproc *lp)
+{
+  /* a real-time process is resumed by its own thread */
+  lprtworker *rt = luaproc_get_rt( lp );
+  if ( rt != NULL ) {
+    rt->ready = TRUE;
+    cnd_signal( &rt->cond );
+    return;
+  }
+  if ( deterministic ) {
+    list_insert( &detready, lp );
+    return;
+  }
+  lppool *pool = sched_pool( lp );
+  lpworker *w = sched_preferred( pool, lp );
+  if ( w == NULL ) {
+    list_insert( &pool->ready, lp );
+  } else {
+    list_insert( &w->local, lp );
+    /* the worker of this thread gets to it when the running process stops;
+       a busy worker may let a parked one take it after a while */
+    if ( w != curworker && !w->spinning && !w->signaled ) {
+      sched_wake( pool, w );
+    }
+  }
+  atomic_fetch_add( &pool->readycount, 1 );
+}
+
+/* remove a lua process from the ready queues of the pool, own queue first
+   but giving the shared queue a turn now and then; a worker only takes the
+   processes preferring other workers when they have a backlog or when
+   'steal' is set. mutex_sched must be locked! */
+static luaproc *sched_ready_remove (lpworker *self, int steal)
+{
+  lppool *pool = self->pool;
+  luaproc *lp = NULL;
+  if ( list_count( &self->local ) > 0 && ( list_count( &pool->ready ) == 0
+    || self->localrun < LUAPROC_SCHED_LOCAL_BATCH ))
+  {
+    lp = list_remove( &self->local );
+    self->localrun++;
+  } else if (( lp = list_remove( &pool->ready )) != NULL ) {
+    self->localrun = 0;
+  } else {
+    for ( int i = 0; i < pool->workerslots && lp == NULL; i++ ) {
+      lpworker *w = pool->workers[i];
+      if ( w != NULL && w != self
+        && list_count( &w->local ) > ( steal ? 0 : 1 ))
+      {
+        lp = list_remove( &w->local );
+      }
+    }
+    /* a handoff the running process of a busy worker has not given way to
+       yet; it is not counted as ready */
+    for ( int i = 0; i < pool->workerslots && lp == NULL && steal; i++ ) {
+      lpworker *w = pool->workers[i];
+      if ( w != NULL && w != self
+        && ( lp = atomic_exchange( &w->runnext, NULL )) != NULL )
+      {
+        return lp;
+      }
+    }
+  }
+  if ( lp != NULL ) {
+    atomic_fetch_sub( &pool->readycount, 1 );
+  }
+  return lp;
+}
+
+/* return true if other workers of the pool have processes waiting for them,
+   mutex_sched must be locked! */
+static int sched_others_ready (lpworker *self)
+{
+  lppool *pool = self->pool;
+  for ( int i = 0; i < pool->workerslots; i++ ) {
+    lpworker *w = pool->workers[i];
+    if ( w != NULL && w != self && ( list_count( &w->local ) > 0
+      || atomic_load( &w->runnext ) != NULL ))
+    {
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/* wake a parked worker of the pool up, 'w' if it is parked or else any
+   other one; mutex_sched must be locked! */
+static void sched_wake (lppool *pool, lpworker *w)
+{
+  if ( w == NULL || !w->parked || w->signaled ) {
+    w = NULL;
+    for ( int i = 0; i < pool->workerslots && w == NULL
+      && pool->parkedworkers > pool->pendingwakeups; i++ )
+    {
+      lpworker *c = pool->workers[i];
+      if ( c != NULL && c->parked && !c->signaled ) {
+        w = c;
+      }
+    }
+    if ( w == NULL ) {
+      return;
+    }
+  }
+  w->signaled = TRUE;
+  pool->pendingwakeups++;
+  cnd_signal( &w->cond );
+}
+
+/* wake all parked workers of the pool up, mutex_sched must be locked! */
+static void sched_wake_all (lppool *pool)
+{
+  for ( int i = 0; i < pool->workerslots; i++ ) {
+    lpworker *w = pool->workers[i];
+    if ( w != NULL && w->parked && !w->signaled ) {
+      sched_wake( pool, w );
+    }
+  }
+}
+
+/* wake a parked worker of the pool up, unless the processes in its shared
+   queue are already covered by spinning workers and by signals in flight;
+   mutex_sched must be locked! */
+static void sched_signal_worker (lppool *pool)
+{
+  int awake = pool->spinningworkers + pool->pendingwakeups;
+  if ( pool->parkedworkers > pool->pendingwakeups
+    && list_count( &pool->ready ) > awake )
+  {
+    sched_wake( pool, NULL );
+  }
+}
+
+/* wake a parked worker of any pool to recompute its timed wait after a
+   process was inserted in the sleep list from outside the workers;
+   mutex_sched must be locked */
+static void sched_signal_timer (void)
+{
+  if ( curworker != NULL ) {
+    return;
+  }
+  for ( int i = 0; i < npools; i++ ) {
+    if ( pools[i]->parkedworkers > pools[i]->pendingwakeups ) {
+      sched_wake( pools[i], NULL );
+      return;
+    }
+  }
+}
+
+/* create a worker thread in the first free slot of the pool, mutex_sched
+   must be locked! */
+static int sched_create_worker (lppool *pool)
+{
+  int id = 0;
+  while ( id < pool->workerslots && pool->workers[id] != NULL ) {
+    id++;
+  }
+  if ( id == pool->workerslots ) {
+    int n = ( pool->workerslots > 0 ) ? 2 * pool->workerslots : 4;
+    lpworker **slots = (lpworker **)realloc( pool->workers,
+      n * sizeof( lpworker * ));
+    if ( slots == NULL ) {
+      return LUAPROC_SCHED_PTHREAD_ERROR;
+    }
+    for ( int i = pool->workerslots; i < n; i++ ) {
+      slots[i] = NULL;
+    }
+    pool->workers = slots;
+    pool->workerslots = n;
+  }
+
+  lpworker *w = (lpworker *)malloc( sizeof( lpworker ));
+  if ( w == NULL ) {
+    return LUAPROC_SCHED_PTHREAD_ERROR;
+  }
+  w->id = id;
+  w->pool = pool;
+  cnd_init( &w->cond );
+  w->parked = FALSE;
+  w->spinning = FALSE;
+  w->signaled = FALSE;
+  list_init( &w->local );
+  w->localrun = 0;
+  atomic_init( &w->runnext, NULL );
+  w->runnextcount = 0;
+
+  thrd_t worker;
+  if ( thrd_create( &worker, workermain, w ) != thrd_success ) {
+    cnd_destroy( &w->cond );
+    free( w );
+    return LUAPROC_SCHED_PTHREAD_ERROR;
+  }
+  pool->workers[id] = w;
+
+  /* store worker thread id in a table */
+  lua_getglobal( workerls, LUAPROC_SCHED_WORKERS_TABLE );
+  lua_pushlightuserdata( workerls, (void *)worker );
+  lua_pushboolean( workerls, TRUE );
+  lua_rawset( workerls, -3 );
+  lua_pop( workerls, 1 );
+
+  pool->workerscount++; /* increase active workers count */
+  return LUAPROC_SCHED_OK;
+}
+
+/* create a pool without workers, mutex_sched must be locked! */
+static lppool *sched_create_pool (const char *name)
+{
+  lppool **slots = (lppool **)realloc( pools,
+    ( npools + 1 ) * sizeof( lppool * ));
+  if ( slots == NULL ) {
+    return NULL;
+  }
+  pools = slots;
+  lppool *pool = (lppool *)malloc( sizeof( lppool ) + strlen( name ) + 1 );
+  if ( pool == NULL ) {
+    return NULL;
+  }
+  list_init( &pool->ready );
+  atomic_init( &pool->readycount, 0 );
+  pool->workers = NULL;
+  pool->workerslots = 0;
+  pool->workerscount = 0;
+  pool->destroyworkers = 0;
+  pool->spinningworkers = 0;
+  pool->parkedworkers = 0;
+  pool->pendingwakeups = 0;
+  strcpy( pool->name, name );
+  pools[npools++] = pool;
+  return pool;
+}
+
+/* create or destroy workers of a pool to get 'numworkers', mutex_sched must
+   be locked! */
+static int sched_resize_pool (lppool *pool, int numworkers)
+{
+  /* pools keep no workers in deterministic mode */
+  if ( deterministic ) {
+    return LUAPROC_SCHED_OK;
+  }
+  /* keep workers about to be destroyed, then create additional ones */
+  while ( pool->workerscount - pool->destroyworkers < numworkers ) {
+    if ( pool->destroyworkers > 0 ) {
+      pool->destroyworkers--;
+    } else if ( sched_create_worker( pool ) != LUAPROC_SCHED_OK ) {
+      return LUAPROC_SCHED_PTHREAD_ERROR;
+    }
+  }
+  /* destroy existing workers, counting those already leaving */
+  if ( pool->workerscount - pool->destroyworkers > numworkers ) {
+    pool->destroyworkers = pool->workerscount - numworkers;
+    sched_wake_all( pool );
+  }
+  return LUAPROC_SCHED_OK;
+}
+
 /**********************
  * exported functions *
  **********************/
@@ -195,113 +857,343 @@ void sched_inc_lpcount (void)
   mtx_unlock( &mutex_lp_count );
 }
 
+/* increase active lua process count by 'n' */
+void sched_add_lpcount (int n)
+{
+  mtx_lock( &mutex_lp_count );
+  lpcount += n;
+  mtx_unlock( &mutex_lp_count );
+}
+
 /* local scheduler initialization */
 int sched_init (void)
 {
   /* thread elements */
   mtx_init(&mutex_sched, mtx_plain);
   mtx_init(&mutex_lp_count, mtx_plain);
-  cnd_init(&cond_wakeup_worker);
   cnd_init(&cond_no_active_lp);
 
-  /* initialize ready process list */
-  list_init( &ready_lp_list );
-
   list_init( &sleep_list );
+  timerlist_init( &timer_list );
+  cnd_init( &cond_timer );
+  timerstop = FALSE;
+
+  /* initialize blocking pool, its threads are created on demand */
+  mtx_init( &mutex_blocking, mtx_plain );
+  cnd_init( &cond_blocking );
+  cnd_init( &cond_blocking_exit );
+  list_init( &blocking_list );
+  blockingthreads = 0;
+  blockingidle = 0;
+  blockingstop = FALSE;
+  rtthreads = 0;
 
   /* initialize workers table and lua_State used to store it */
   workerls = luaL_newstate();
   lua_newtable( workerls );
   lua_setglobal( workerls, LUAPROC_SCHED_WORKERS_TABLE );
 
-  /* get ready to access worker threads table */
-  lua_getglobal( workerls, LUAPROC_SCHED_WORKERS_TABLE );
+  /* create the default pool with the default number of worker threads */
+  mtx_lock( &mutex_sched );
+  defaultpool = sched_create_pool( LUAPROC_SCHED_DEFAULT_POOL );
+  if ( defaultpool == NULL || sched_resize_pool( defaultpool,
+         LUAPROC_SCHED_DEFAULT_WORKER_THREADS ) != LUAPROC_SCHED_OK ) {
+    mtx_unlock( &mutex_sched );
+    return LUAPROC_SCHED_PTHREAD_ERROR;
+  }
+  mtx_unlock( &mutex_sched );
 
-  /* create default number of initial worker threads */
-  thrd_t worker;
-  for (int i = 0; i < LUAPROC_SCHED_DEFAULT_WORKER_THREADS; i++ ) {
+  return LUAPROC_SCHED_OK;
+}
 
-    if ( thrd_create( &worker, workermain, NULL ) != thrd_success ) {
-      lua_pop( workerls, 1 ); /* pop workers table from stack */
-      return LUAPROC_SCHED_PTHREAD_ERROR;
+/* return a pool by name or NULL if it does not exist, mutex_sched must be
+   locked! */
+static lppool *sched_lookup_pool (const char *name)
+{
+  for ( int i = 0; i < npools; i++ ) {
+    if ( strcmp( pools[i]->name, name ) == 0 ) {
+      return pools[i];
     }
-
-    /* store worker thread id in a table */
-    lua_pushlightuserdata( workerls, (void *)worker );
-    lua_pushboolean( workerls, TRUE );
-    lua_rawset( workerls, -3 );
-
-    workerscount++; /* increase active workers count */
   }
+  return NULL;
+}
 
-  lua_pop( workerls, 1 ); /* pop workers table from stack */
+/* return a pool by name or NULL if it does not exist */
+lppool *sched_find_pool (const char *name)
+{
+  mtx_lock( &mutex_sched );
+  lppool *pool = sched_lookup_pool( name );
+  mtx_unlock( &mutex_sched );
+  return pool;
+}
 
+/* create a pool of 'numworkers' workers */
+int sched_new_pool (const char *name, int numworkers)
+{
+  mtx_lock( &mutex_sched );
+  if ( sched_lookup_pool( name ) != NULL ) {
+    mtx_unlock( &mutex_sched );
+    return LUAPROC_SCHED_POOL_ERROR;
+  }
+  lppool *pool = sched_create_pool( name );
+  if ( pool == NULL || sched_resize_pool( pool,
+         numworkers ) != LUAPROC_SCHED_OK ) {
+    mtx_unlock( &mutex_sched );
+    return LUAPROC_SCHED_PTHREAD_ERROR;
+  }
+  mtx_unlock( &mutex_sched );
   return LUAPROC_SCHED_OK;
 }
 
-/* set number of active workers */
-int sched_set_numworkers (int numworkers)
+/* set number of active workers of a pool, NULL for the default one */
+int sched_set_numworkers (lppool *pool, int numworkers)
 {
   mtx_lock( &mutex_sched );
+  int r = sched_resize_pool(( pool != NULL ) ? pool : defaultpool,
+    numworkers );
+  mtx_unlock( &mutex_sched );
 
-  /* calculate delta between existing workers and set number of workers */
-  int delta = numworkers - workerscount;
+  return r;
+}
 
-  /* create additional workers */
-  if ( numworkers > workerscount ) {
+/* return the number of active workers of a pool, NULL for the default
+   one */
+int sched_get_numworkers (lppool *pool)
+{
+  mtx_lock( &mutex_sched );
+  if ( pool == NULL ) {
+    pool = defaultpool;
+  }
+  int numworkers = pool->workerscount - pool->destroyworkers;
+  mtx_unlock( &mutex_sched );
 
-    /* get ready to access worker threads table */
-    lua_getglobal( workerls, LUAPROC_SCHED_WORKERS_TABLE );
+  return numworkers;
+}
 
-    /* create additional workers */
-    thrd_t worker;
-    for (int i = 0; i < delta; i++ ) {
+/* insert lua process in ready queue */
+void sched_queue_proc (luaproc *lp)
+{
+  mtx_lock( &mutex_sched );
+  sched_ready_insert( lp );  /* add process to ready queue */
+  /* set process status ready */
+  luaproc_set_status( lp, LUAPROC_STATUS_READY );
+  /* wake worker up if nobody is going to look */
+  sched_signal_worker( sched_pool( lp ));
+  mtx_unlock( &mutex_sched );
+}
 
-      if ( thrd_create( &worker, workermain, NULL ) != thrd_success ) {
-        mtx_unlock( &mutex_sched );
-        lua_pop( workerls, 1 ); /* pop workers table from stack */
-        return LUAPROC_SCHED_PTHREAD_ERROR;
-      }
+/* wake a parked worker up to use its idle time, e.g. for collecting the
+   garbage of recycled lua processes */
+void sched_signal_idle (void)
+{
+  mtx_lock( &mutex_sched );
+  if ( defaultpool->parkedworkers > defaultpool->pendingwakeups ) {
+    sched_wake( defaultpool, NULL );
+  }
+  mtx_unlock( &mutex_sched );
+}
 
-      /* store worker thread id in a table */
-      lua_pushlightuserdata( workerls, (void *)worker );
-      lua_pushboolean( workerls, TRUE );
-      lua_rawset( workerls, -3 );
+/* wake every parked worker up to do background work, e.g. to give up the
+   recycled lua processes it keeps */
+void sched_signal_all (void)
+{
+  mtx_lock( &mutex_sched );
+  for ( int i = 0; i < npools; i++ ) {
+    sched_wake_all( pools[i] );
+  }
+  mtx_unlock( &mutex_sched );
+}
 
-      workerscount++; /* increase active workers count */
+/* insert lua processes in the ready queues at once */
+void sched_queue_procs (luaproc **lps, int n)
+{
+  mtx_lock( &mutex_sched );
+  for ( int i = 0; i < n; i++ ) {
+    sched_ready_insert( lps[i] );
+    luaproc_set_status( lps[i], LUAPROC_STATUS_READY );
+  }
+  /* wake as many parked workers as the shared queues can keep busy */
+  for ( int i = 0; i < npools; i++ ) {
+    lppool *pool = pools[i];
+    while ( pool->parkedworkers > pool->pendingwakeups
+      && list_count( &pool->ready ) > pool->spinningworkers
+           + pool->pendingwakeups )
+    {
+      sched_wake( pool, NULL );
     }
+  }
+  mtx_unlock( &mutex_sched );
+}
 
-    lua_pop( workerls, 1 ); /* pop workers table from stack */
+/* hand a woken lua process to the current worker, which resumes it as soon
+   as the running process blocks or yields; other threads and processes
+   preferring a worker queue it */
+void sched_queue_next (luaproc *lp)
+{
+  lpworker *self = curworker;
+  if ( self == NULL || luaproc_get_affinity( lp ) >= 0 ||
+       luaproc_get_rt( lp ) != NULL || sched_pool( lp ) != self->pool ) {
+    sched_queue_proc( lp );
+    return;
   }
-  /* destroy existing workers */
-  else if ( numworkers < workerscount ) {
-    destroyworkers = destroyworkers + numworkers;
+  luaproc_set_status( lp, LUAPROC_STATUS_READY );
+  /* a previously handed off process goes to the ready queue */
+  luaproc *prev = atomic_exchange( &self->runnext, lp );
+  if ( prev != NULL ) {
+    sched_queue_proc( prev );
+    return;
+  }
+  /* if the running process keeps its worker, an idle worker takes the
+     handoff over after the steal delay; make sure one is looking */
+  lppool *pool = self->pool;
+  mtx_lock( &mutex_sched );
+  if ( pool->parkedworkers > pool->pendingwakeups
+    && pool->spinningworkers == 0 )
+  {
+    sched_wake( pool, NULL );
   }
+  mtx_unlock( &mutex_sched );
+}
 
+/* make a lua process waiting on a wait queue ready, unless its deadline has
+   already done so */
+void sched_wakeup (luaproc *lp)
+{
+  mtx_lock( &mutex_sched );
+  if ( luaproc_get_status( lp ) == LUAPROC_STATUS_BLOCKED_WAIT ) {
+    if ( luaproc_is_timed( lp )) {
+      list_remove_node( &sleep_list, lp );
+    }
+    luaproc_set_parked( lp, FALSE );
+    luaproc_set_status( lp, LUAPROC_STATUS_READY );
+    sched_ready_insert( lp );
+    sched_signal_worker( sched_pool( lp ));
+  }
   mtx_unlock( &mutex_sched );
+}
 
-  return LUAPROC_SCHED_OK;
+/* make a lua process ready instead of blocking it if its group was
+   cancelled; mutex_sched must be locked! */
+static int sched_cancel_settled (luaproc *lp)
+{
+  if ( !luaproc_is_cancelled( lp )) {
+    return FALSE;
+  }
+  luaproc_set_status( lp, LUAPROC_STATUS_READY );
+  sched_ready_insert( lp );
+  sched_signal_worker( sched_pool( lp ));
+  return TRUE;
 }
 
-/* return the number of active workers */
-int sched_get_numworkers (void)
+/* make a sleeping or waiting lua process of a cancelled group ready, so
+   that it fails; a waiting one is removed from its wait queue then */
+void sched_cancel (luaproc *lp)
 {
   mtx_lock( &mutex_sched );
-  int numworkers = workerscount;
+  if ( luaproc_is_parked( lp )) {
+    if ( luaproc_get_status( lp ) == LUAPROC_STATUS_BLOCKED_SLEEP ||
+         luaproc_is_timed( lp )) {
+      list_remove_node( &sleep_list, lp );
+    }
+    luaproc_set_parked( lp, FALSE );
+    sched_cancel_settled( lp );
+  }
   mtx_unlock( &mutex_sched );
+}
 
-  return numworkers;
+/* arm a timer for its next tick; ticks are delivered by a thread of their
+   own, so that they are on time even when all workers are busy, except in
+   deterministic mode where the driving thread delivers them */
+void sched_timer_add (lptimer *t)
+{
+  mtx_lock( &mutex_sched );
+  timerlist_insert( &timer_list, t );
+  if ( !deterministic && !timerrunning && !timerstop ) {
+    if ( thrd_create( &timerthread, timermain, NULL ) == thrd_success ) {
+      timerrunning = TRUE;
+    }
+  }
+  cnd_signal( &cond_timer );
+  mtx_unlock( &mutex_sched );
 }
 
-/* insert lua process in ready queue */
-void sched_queue_proc (luaproc *lp)
+/* disarm a timer, return false if it is not armed (e.g. it is ticking) */
+int sched_timer_cancel (lptimer *t)
 {
   mtx_lock( &mutex_sched );
-  list_insert( &ready_lp_list, lp );  /* add process to ready queue */
-  /* set process status ready */
-  luaproc_set_status( lp, LUAPROC_STATUS_READY );
-  cnd_signal( &cond_wakeup_worker );  /* wake worker up */
+  int armed = timerlist_remove_node( &timer_list, t );
   mtx_unlock( &mutex_sched );
+  return armed;
+}
+
+/* run process on a thread of the blocking pool, creating a thread if all
+   are busy */
+int sched_queue_blocking (luaproc *lp)
+{
+  if ( sched_is_deterministic() ) {
+    return LUAPROC_SCHED_PTHREAD_ERROR;
+  }
+  mtx_lock( &mutex_blocking );
+  sched_reap_threads();
+  if ( blockingidle <= list_count( &blocking_list ) &&
+       blockingthreads < LUAPROC_SCHED_BLOCKING_MAX ) {
+    thrd_t thread;
+    if ( thrd_create( &thread, blockingmain, NULL ) == thrd_success ) {
+      blockingthreads++;
+    } else if ( blockingthreads == 0 ) {
+      mtx_unlock( &mutex_blocking );
+      return LUAPROC_SCHED_PTHREAD_ERROR;
+    }
+  }
+  list_insert( &blocking_list, lp );
+  cnd_signal( &cond_blocking );
+  mtx_unlock( &mutex_blocking );
+  return LUAPROC_SCHED_OK;
+}
+
+/* run process on a thread of its own until it finishes */
+int sched_queue_realtime (luaproc *lp, int priority, double spin)
+{
+  if ( sched_is_deterministic() ) {
+    return LUAPROC_SCHED_PTHREAD_ERROR;
+  }
+  lprtworker *rt = (lprtworker *)malloc( sizeof( lprtworker ));
+  if ( rt == NULL ) {
+    return LUAPROC_SCHED_PTHREAD_ERROR;
+  }
+  cnd_init( &rt->cond );
+  rt->ready = TRUE;
+  rt->priority = priority;
+  rt->spin = lpaux_time_period( spin );
+  rt->lp = lp;
+  luaproc_set_rt( lp, rt );
+  luaproc_set_status( lp, LUAPROC_STATUS_READY );
+
+  mtx_lock( &mutex_blocking );
+  sched_reap_threads();
+  thrd_t thread;
+  if ( thrd_create( &thread, rtmain, rt ) != thrd_success ) {
+    mtx_unlock( &mutex_blocking );
+    luaproc_set_rt( lp, NULL );
+    cnd_destroy( &rt->cond );
+    free( rt );
+    return LUAPROC_SCHED_PTHREAD_ERROR;
+  }
+  rtthreads++;
+  mtx_unlock( &mutex_blocking );
+  return LUAPROC_SCHED_OK;
+}
+
+/* set number of polls an idle worker makes before parking */
+void sched_set_spin (int spin)
+{
+  atomic_store( &spinlimit, spin );
+}
+
+/* return number of polls an idle worker makes before parking */
+int sched_get_spin (void)
+{
+  return atomic_load( &spinlimit );
 }
 
 /* check sleep process, wake up if need,
@@ -309,11 +1201,58 @@ void sched_queue_proc (luaproc *lp)
 static void sched_sleep_activate (void)
 {
   timespec current;
-  timespec_get(&current, TIME_UTC);
+  lpaux_time_utc( &current );
   luaproc* p;
   while(( p = list_time_ready ( &sleep_list, &current )) != NULL ) {
-    /* activate */
-    list_insert( &ready_lp_list, p );
+    /* activate; a process waiting on a wait queue has timed out */
+    luaproc_set_parked( p, FALSE );
+    luaproc_set_status( p, LUAPROC_STATUS_READY );
+    sched_ready_insert( p );
+    /* processes of other pools are left to their workers */
+    lppool *pool = sched_pool( p );
+    if ( curworker == NULL || pool != curworker->pool ) {
+      sched_signal_worker( pool );
+    }
+  }
+  /* this worker takes one process, let the others help with the rest */
+  if ( curworker != NULL && list_count( &curworker->pool->ready ) > 1 ) {
+    sched_signal_worker( curworker->pool );
+  }
+}
+
+/* timer thread main function: sleep until the next tick is due and deliver
+   it, until the library is closed */
+static int timermain (void *args)
+{
+  (void)args;
+  mtx_lock( &mutex_sched );
+  while ( !timerstop ) {
+    timespec *tick = deterministic ? NULL : timerlist_next( &timer_list );
+    if ( tick == NULL ) {
+      cnd_wait( &cond_timer, &mutex_sched );
+    } else {
+      timespec due = *tick;
+      cnd_timedwait( &cond_timer, &mutex_sched, &due );
+    }
+    if ( !deterministic && !timerstop ) {
+      sched_timer_activate();
+    }
+  }
+  mtx_unlock( &mutex_sched );
+  return 0;
+}
+
+/* deliver the due ticks of timers; mutex_sched must be locked! it is
+   released while a tick is delivered, since waking receivers takes it */
+static void sched_timer_activate (void)
+{
+  timespec current;
+  lpaux_time_utc( &current );
+  lptimer *t;
+  while (( t = timerlist_ready( &timer_list, &current )) != NULL ) {
+    mtx_unlock( &mutex_sched );
+    luaproc_timer_fire( t );
+    mtx_lock( &mutex_sched );
   }
 }
 
@@ -329,6 +1268,40 @@ void sched_join_workers (void)
   /* wait for all running lua processes to finish */
   sched_wait();
 
+  /* stop idle threads of the blocking pool, real-time threads are leaving
+     with their finished processes */
+  mtx_lock( &mutex_blocking );
+  blockingstop = TRUE;
+  cnd_broadcast( &cond_blocking );
+  while ( blockingthreads > 0 || rtthreads > 0 ) {
+    cnd_wait( &cond_blocking_exit, &mutex_blocking );
+  }
+  /* the counts drop right before the threads return, wait until they have
+     left the library */
+  sched_reap_threads();
+  free( exitedthreads );
+  exitedthreads = NULL;
+  exitedslots = 0;
+  mtx_unlock( &mutex_blocking );
+
+  /* stop the timer thread, ticks are not delivered from now on */
+  mtx_lock( &mutex_sched );
+  timerstop = TRUE;
+  cnd_signal( &cond_timer );
+  int joiner = timerrunning;
+  timerrunning = FALSE;
+  /* leave deterministic mode, so that a reopened library runs on workers
+     and on the real clock */
+  if ( deterministic ) {
+    deterministic = FALSE;
+    list_init( &detready );
+    lpaux_time_set( NULL );
+  }
+  mtx_unlock( &mutex_sched );
+  if ( joiner ) {
+    thrd_join( timerthread, NULL );
+  }
+
   /* initialize new state and create table to copy worker ids */
   lua_newtable( L );
   lua_setglobal( L, wtb );
@@ -350,11 +1323,11 @@ void sched_join_workers (void)
   /* pop workers copy table name from stack */
   lua_pop( L, 1 );
 
-  /* set all workers to be destroyed */
-  destroyworkers = workerscount;
-
-  /* wake workers up */
-  cnd_signal( &cond_wakeup_worker );
+  /* set all workers to be destroyed and wake them up */
+  for ( int i = 0; i < npools; i++ ) {
+    pools[i]->destroyworkers = pools[i]->workerscount;
+    sched_wake_all( pools[i] );
+  }
   mtx_unlock( &mutex_sched );
 
   /* join with worker threads (read ids from local table copy ) */
@@ -367,19 +1340,40 @@ void sched_join_workers (void)
   }
   lua_pop( L, 1 );
 
+  /* channels go away with the library, and so do their timers */
+  lptimer *t;
+  while (( t = timerlist_remove( &timer_list )) != NULL ) {
+    luaproc_timer_free( t );
+  }
+
   lua_close( workerls );
   lua_close( L );
+  for ( int i = 0; i < npools; i++ ) {
+    free( pools[i]->workers );
+    free( pools[i] );
+  }
+  free( pools );
+  pools = NULL;
+  npools = 0;
+  defaultpool = NULL;
 
   /* destroy thread elements */
   mtx_destroy(&mutex_sched);
   mtx_destroy(&mutex_lp_count);
-  cnd_destroy(&cond_wakeup_worker);
   cnd_destroy(&cond_no_active_lp);
+  cnd_destroy( &cond_timer );
 }
 
 /* wait until there are no more active lua processes and active workers. */
 void sched_wait (void)
 {
+  /* in deterministic mode the waiting thread runs the processes; those
+     blocked for good are left behind */
+  if ( sched_is_deterministic() ) {
+    while ( sched_det_step( NULL ))
+      ;
+    return;
+  }
   /* wait until there are not more active lua processes */
   mtx_lock( &mutex_lp_count );
   if( lpcount != 0 ) {
@@ -387,3 +1381,99 @@ void sched_wait (void)
   }
   mtx_unlock( &mutex_lp_count );
 }
+
+/**********************
+ * deterministic mode *
+ **********************/
+
+/* next value of the seeded generator (xorshift64*), mutex_sched must be
+   locked! */
+static uint64_t sched_det_random (void)
+{
+  detstate ^= detstate >> 12;
+  detstate ^= detstate << 25;
+  detstate ^= detstate >> 27;
+  return detstate * 0x2545F4914F6CDD1DULL;
+}
+
+/* stop the workers and let the calling thread run the processes in an order
+   given by 'seed', on a virtual clock starting at zero */
+int sched_set_deterministic (unsigned long long seed)
+{
+  mtx_lock( &mutex_lp_count );
+  int busy = ( lpcount > 0 );
+  mtx_unlock( &mutex_lp_count );
+  if ( busy ) {
+    return LUAPROC_SCHED_BUSY_ERROR;
+  }
+
+  mtx_lock( &mutex_sched );
+  if ( !deterministic ) {
+    list_init( &detready );
+    deterministic = TRUE;
+    /* idle workers leave at once */
+    for ( int i = 0; i < npools; i++ ) {
+      pools[i]->destroyworkers = pools[i]->workerscount;
+      sched_wake_all( pools[i] );
+    }
+  }
+  detstate = seed * 0x9E3779B97F4A7C15ULL + 1;
+  if ( detstate == 0 ) {
+    detstate = 1;
+  }
+  timespec zero = { 0, 0 };
+  lpaux_time_set( &zero );
+  mtx_unlock( &mutex_sched );
+  return LUAPROC_SCHED_OK;
+}
+
+/* return true in deterministic mode */
+int sched_is_deterministic (void)
+{
+  mtx_lock( &mutex_sched );
+  int det = deterministic;
+  mtx_unlock( &mutex_sched );
+  return det;
+}
+
+/* resume one of the ready processes on the calling thread; with none ready,
+   move the virtual clock to the next sleeping process or tick, but not past
+   'limit' (if not NULL). return false if nothing happened */
+int sched_det_step (timespec *limit)
+{
+  mtx_lock( &mutex_sched );
+  int n = list_count( &detready );
+  if ( n == 0 ) {
+    timespec *next = NULL;
+    if ( list_count( &sleep_list ) > 0 ) {
+      next = list_time_next( &sleep_list );
+    }
+    timespec *tick = timerlist_next( &timer_list );
+    if ( tick != NULL &&
+         ( next == NULL || lpaux_time_cmp( tick, next ) < 0 )) {
+      next = tick;
+    }
+    if ( next == NULL ||
+         ( limit != NULL && lpaux_time_cmp( next, limit ) > 0 )) {
+      if ( limit != NULL ) {
+        lpaux_time_set( limit );
+      }
+      mtx_unlock( &mutex_sched );
+      return FALSE;
+    }
+    timespec now = *next;
+    lpaux_time_set( &now );
+    sched_sleep_activate();
+    sched_timer_activate();
+    mtx_unlock( &mutex_sched );
+    return TRUE;
+  }
+
+  luaproc *lp = list_nth( &detready, (int)( sched_det_random() % n ));
+  mtx_unlock( &mutex_sched );
+
+  int nresults = 0;
+  int procstat = sched_resume( lp, &nresults );
+  sched_settle( lp, procstat, nresults );
+  return TRUE;
+}
@@ -15,6 +15,8 @@
 /* scheduler function return constants */
 #define	LUAPROC_SCHED_OK                 0
 #define LUAPROC_SCHED_PTHREAD_ERROR     -1
+#define LUAPROC_SCHED_POOL_ERROR        -2
+#define LUAPROC_SCHED_BUSY_ERROR        -3
 
 /*************************************
  * default number of initial workers *
@@ -23,6 +25,31 @@
 /* scheduler default number of worker threads */
 #define LUAPROC_SCHED_DEFAULT_WORKER_THREADS 1
 
+/* name of the pool running processes without the 'pool' option */
+#define LUAPROC_SCHED_DEFAULT_POOL "default"
+
+/* polls an idle worker makes before parking (0 parks immediately) */
+#define LUAPROC_SCHED_DEFAULT_SPIN 0
+
+/* consecutive direct handoffs before a worker serves the ready queue */
+#define LUAPROC_SCHED_RUNNEXT_MAX 32
+
+/* processes a worker takes from its own queue before serving the shared
+   one when both have work */
+#define LUAPROC_SCHED_LOCAL_BATCH 4
+
+/* seconds an idle worker leaves a process to the busy worker it prefers */
+#define LUAPROC_SCHED_STEAL_DELAY 0.001
+
+/* maximum number of threads of the blocking pool */
+#define LUAPROC_SCHED_BLOCKING_MAX 64
+
+/* seconds an idle thread of the blocking pool waits before exiting */
+#define LUAPROC_SCHED_BLOCKING_IDLE 5.0
+
+/* seconds a real-time process spins before the end of its sleep */
+#define LUAPROC_SCHED_RT_SPIN 0.0001
+
 /***********************
  * function prototypes *
  **********************/
@@ -35,11 +62,50 @@ void sched_join_workers( void );
 void sched_wait( void );
 /* move process to ready queue (ie, schedule process) */
 void sched_queue_proc( luaproc *lp );
+/* move processes to ready queues at once */
+void sched_queue_procs( luaproc **lps, int n );
+/* resume woken process next on the current worker (ie, direct handoff) */
+void sched_queue_next( luaproc *lp );
+/* move process waiting on a wait queue to ready queue */
+void sched_wakeup( luaproc *lp );
+/* make a sleeping or waiting process of a cancelled group ready */
+void sched_cancel( luaproc *lp );
+/* wake a parked worker to do background work */
+void sched_signal_idle( void );
+/* wake every parked worker of every pool to do background work */
+void sched_signal_all( void );
+/* arm a timer for its next tick */
+void sched_timer_add( lptimer *t );
+/* disarm a timer, return false if it is not armed (e.g. it is ticking) */
+int sched_timer_cancel( lptimer *t );
+/* run process on a thread of the blocking pool */
+int sched_queue_blocking( luaproc *lp );
+/* run process on its own real-time thread; 'priority' is a SCHED_FIFO
+   priority or 0 for the normal policy */
+int sched_queue_realtime( luaproc *lp, int priority, double spin );
 /* increase active luaproc count */
 void sched_inc_lpcount( void );
-/* set number of active workers (creates and destroys accordingly) */
-int sched_set_numworkers( int numworkers );
-/* return the number of active workers */
-int sched_get_numworkers( void );
+/* increase active luaproc count by n */
+void sched_add_lpcount( int n );
+/* set number of active workers of a pool, NULL for the default one
+   (creates and destroys accordingly) */
+int sched_set_numworkers( lppool *pool, int numworkers );
+/* return the number of active workers of a pool, NULL for the default one */
+int sched_get_numworkers( lppool *pool );
+/* create a pool with its own ready queue and workers */
+int sched_new_pool( const char *name, int numworkers );
+/* return a pool by name or NULL if it does not exist */
+lppool *sched_find_pool( const char *name );
+/* stop the workers and run processes on the calling thread in a seeded
+   order on a virtual clock */
+int sched_set_deterministic( unsigned long long seed );
+/* return true in deterministic mode */
+int sched_is_deterministic( void );
+/* run one ready process or move the virtual clock, not past 'limit' */
+int sched_det_step( struct timespec *limit );
+/* set number of polls an idle worker makes before parking */
+void sched_set_spin( int spin );
+/* return number of polls an idle worker makes before parking */
+int sched_get_spin( void );
 
 #endif
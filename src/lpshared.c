@@ -0,0 +1,587 @@
+/*
+** shared key-value stores
+** See Copyright Notice in luaproc.h
+*/
+
+#include <threads.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "lpcompat.h"
+#include "lpobj.h"
+#include "lpmsg.h"
+#include "lpshared.h"
+
+#define FALSE 0
+#define TRUE  !FALSE
+#define LUAPROC_SHARED_TABLE "sharedtb"
+#define SHARED_MIN_BUCKETS 8
+
+/*******************
+ * structure types *
+ ******************/
+
+/* key and value, both encoded as messages of one value */
+typedef struct stentry {
+  struct stentry *next;
+  uint32_t hash;
+  lpmsg *key;
+  lpmsg *value;
+} entry;
+
+/* part of a store with its own lock */
+typedef struct {
+  mtx_t mutex;
+  entry **buckets;
+  size_t nbuckets;
+  size_t count;
+} shard;
+
+/* store, referenced by the stores table and by userdata */
+typedef struct {
+  lpobject obj;
+  shard shards[LUAPROC_SHARED_SHARDS];
+} store;
+
+/********************
+ * global variables *
+ *******************/
+
+/* stores table mutex */
+static mtx_t mutex_shared_list;
+
+/* lua_State used to store stores hash table */
+static lua_State *sharedls = NULL;
+
+/***********************
+ * register prototypes *
+ ***********************/
+
+static int lpshared_open( lua_State *L );
+static int lpshared_get( lua_State *L );
+static int lpshared_set( lua_State *L );
+static int lpshared_cas( lua_State *L );
+static int lpshared_incr( lua_State *L );
+static int lpshared_delete( lua_State *L );
+static void lpshared_destroy( lpobject *obj );
+
+/* shared store functions of the luaproc library */
+const luaL_Reg lpshared_funcs[] = {
+  { "shared", lpshared_open },
+  { NULL, NULL }
+};
+
+/* store methods */
+static const luaL_Reg lpshared_store_funcs[] = {
+  { "get", lpshared_get },
+  { "set", lpshared_set },
+  { "cas", lpshared_cas },
+  { "incr", lpshared_incr },
+  { "delete", lpshared_delete },
+  { NULL, NULL }
+};
+
+/* store type */
+static const lpobject_type lpshared_type = {
+  "luaproc.shared", lpshared_store_funcs, lpshared_destroy
+};
+
+/*******************
+ * entry functions *
+ *******************/
+
+/* FNV-1a hash of an encoded key */
+static uint32_t shared_hash (const lpmsg *key)
+{
+  uint32_t h = 2166136261u;
+  for ( size_t i = 0; i < key->size; i++ ) {
+    h = ( h ^ (unsigned char)key->data[i] ) * 16777619u;
+  }
+  return h;
+}
+
+/* select shard of a hash */
+static shard *shared_shard (store *st, uint32_t hash)
+{
+  return &st->shards[hash % LUAPROC_SHARED_SHARDS];
+}
+
+/* return the link to the entry of a key or to the end of its bucket; the
+   shard must be locked */
+static entry **shared_find (shard *sh, lpmsg *key, uint32_t hash)
+{
+  entry **ptr = &sh->buckets[( hash / LUAPROC_SHARED_SHARDS ) % sh->nbuckets];
+  for ( ; *ptr != NULL; ptr = &(*ptr)->next ) {
+    if ( (*ptr)->hash == hash && (*ptr)->key->size == key->size &&
+         lpmsg_equal( (*ptr)->key, key )) {
+      break;
+    }
+  }
+  return ptr;
+}
+
+/* double the number of buckets of a shard; on lack of memory keep longer
+   chains */
+static void shared_grow (shard *sh)
+{
+  size_t n = sh->nbuckets * 2;
+  entry **buckets = (entry **)calloc( n, sizeof( entry * ));
+  if ( buckets == NULL ) {
+    return;
+  }
+  for ( size_t i = 0; i < sh->nbuckets; i++ ) {
+    entry *e = sh->buckets[i];
+    while ( e != NULL ) {
+      entry *next = e->next;
+      size_t b = ( e->hash / LUAPROC_SHARED_SHARDS ) % n;
+      e->next = buckets[b];
+      buckets[b] = e;
+      e = next;
+    }
+  }
+  free( sh->buckets );
+  sh->buckets = buckets;
+  sh->nbuckets = n;
+}
+
+/* insert a new entry at the link returned by shared_find; return FALSE if
+   memory is exhausted */
+static int shared_insert (shard *sh, entry **ptr, lpmsg *key, uint32_t hash,
+  lpmsg *value)
+{
+  entry *e = (entry *)malloc( sizeof( entry ));
+  if ( e == NULL ) {
+    return FALSE;
+  }
+  e->next = NULL;
+  e->hash = hash;
+  e->key = key;
+  e->value = value;
+  *ptr = e;
+  if ( ++sh->count > sh->nbuckets * 2 ) {
+    shared_grow( sh );
+  }
+  return TRUE;
+}
+
+/* unlink the entry at 'ptr' and return it */
+static entry *shared_unlink (shard *sh, entry **ptr)
+{
+  entry *e = *ptr;
+  *ptr = e->next;
+  sh->count--;
+  return e;
+}
+
+/* free an unlinked entry */
+static void shared_free (entry *e)
+{
+  lpmsg_release( e->key );
+  lpmsg_release( e->value );
+  free( e );
+}
+
+/* check the type of a value argument, nil is allowed */
+static void shared_checkvalue (lua_State *L, int arg)
+{
+  switch ( lua_type( L, arg )) {
+    case LUA_TNONE:
+    case LUA_TNIL:
+    case LUA_TBOOLEAN:
+    case LUA_TNUMBER:
+    case LUA_TSTRING:
+      return;
+    default:
+      luaL_argerror( L, arg, "unsupported value type" );
+  }
+}
+
+/* check the key argument; floats with integer values are replaced by
+   integers, so 1 and 1.0 are the same key, like in lua tables */
+static void shared_checkkey (lua_State *L, int arg)
+{
+  luaL_argcheck( L, !lua_isnoneornil( L, arg ), arg, "key is nil" );
+  shared_checkvalue( L, arg );
+  if ( lua_type( L, arg ) == LUA_TNUMBER && !lua_isinteger( L, arg )) {
+    lua_Number n = lua_tonumber( L, arg );
+    lua_Integer i;
+    luaL_argcheck( L, n == n, arg, "key is NaN" );
+    if ( lua_numbertointeger( n, &i ) && (lua_Number)i == n ) {
+      lua_pushinteger( L, i );
+      lua_replace( L, arg );
+    }
+  }
+}
+
+/* encode a checked argument, nil is encoded as NULL; return FALSE if
+   memory is exhausted */
+static int shared_encode (lua_State *L, int arg, lpmsg **msg)
+{
+  int bad;
+  if ( lua_isnoneornil( L, arg )) {
+    *msg = NULL;
+    return TRUE;
+  }
+  *msg = lpmsg_encode( L, arg, arg, &bad );
+  return *msg != NULL;
+}
+
+/* release a message if there is one */
+static void shared_release (lpmsg *msg)
+{
+  if ( msg != NULL ) {
+    lpmsg_release( msg );
+  }
+}
+
+/* push nil and an error message for exhausted memory */
+static int shared_nomem (lua_State *L)
+{
+  lua_pushnil( L );
+  lua_pushstring( L, "not enough memory" );
+  return 2;
+}
+
+/*******************
+ * store functions *
+ *******************/
+
+/* destroy a store when it is not referenced anymore */
+static void lpshared_destroy (lpobject *obj)
+{
+  store *st = (store *)obj;
+  for ( int i = 0; i < LUAPROC_SHARED_SHARDS; i++ ) {
+    shard *sh = &st->shards[i];
+    for ( size_t b = 0; b < sh->nbuckets; b++ ) {
+      entry *e = sh->buckets[b];
+      while ( e != NULL ) {
+        entry *next = e->next;
+        shared_free( e );
+        e = next;
+      }
+    }
+    free( sh->buckets );
+    mtx_destroy( &sh->mutex );
+  }
+  free( st );
+}
+
+/* create an empty store */
+static store *shared_new (void)
+{
+  store *st = (store *)malloc( sizeof( store ));
+  if ( st == NULL ) {
+    return NULL;
+  }
+  for ( int i = 0; i < LUAPROC_SHARED_SHARDS; i++ ) {
+    shard *sh = &st->shards[i];
+    sh->buckets = (entry **)calloc( SHARED_MIN_BUCKETS, sizeof( entry * ));
+    if ( sh->buckets == NULL ) {
+      while ( --i >= 0 ) {
+        free( st->shards[i].buckets );
+        mtx_destroy( &st->shards[i].mutex );
+      }
+      free( st );
+      return NULL;
+    }
+    mtx_init( &sh->mutex, mtx_plain );
+    sh->nbuckets = SHARED_MIN_BUCKETS;
+    sh->count = 0;
+  }
+  lpobj_init( &st->obj, &lpshared_type );
+  return st;
+}
+
+/* return the value of a key or nil */
+static int lpshared_get (lua_State *L)
+{
+  store *st = (store *)lpobj_check( L, 1, &lpshared_type );
+  shared_checkkey( L, 2 );
+  lpmsg *key;
+  if ( !shared_encode( L, 2, &key )) {
+    return shared_nomem( L );
+  }
+  uint32_t hash = shared_hash( key );
+  shard *sh = shared_shard( st, hash );
+
+  mtx_lock( &sh->mutex );
+  entry **ptr = shared_find( sh, key, hash );
+  lpmsg *value = NULL;
+  if ( *ptr != NULL ) {
+    value = (*ptr)->value;
+    lpmsg_retain( value );
+  }
+  mtx_unlock( &sh->mutex );
+  lpmsg_release( key );
+
+  if ( value == NULL ) {
+    lua_pushnil( L );
+    return 1;
+  }
+  /* decode outside of the lock, pushing a string can raise an error */
+  lua_settop( L, 0 );
+  lpmsg_decode( L, value );
+  lpmsg_release( value );
+  return 1;
+}
+
+/* replace the value of a key (NULL removes the key); takes the references
+   of key and value; the shard must be locked */
+static int shared_store (shard *sh, entry **ptr, lpmsg *key, uint32_t hash,
+  lpmsg *value, entry **old)
+{
+  *old = NULL;
+  if ( value == NULL ) {
+    if ( *ptr != NULL ) {
+      *old = shared_unlink( sh, ptr );
+    }
+    lpmsg_release( key );
+  } else if ( *ptr != NULL ) {
+    lpmsg *prev = (*ptr)->value;
+    (*ptr)->value = value;
+    lpmsg_release( key );
+    lpmsg_release( prev );
+  } else if ( !shared_insert( sh, ptr, key, hash, value )) {
+    lpmsg_release( key );
+    lpmsg_release( value );
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* set the value of a key; nil removes the key */
+static int lpshared_set (lua_State *L)
+{
+  store *st = (store *)lpobj_check( L, 1, &lpshared_type );
+  shared_checkkey( L, 2 );
+  shared_checkvalue( L, 3 );
+  lpmsg *key, *value;
+  if ( !shared_encode( L, 2, &key )) {
+    return shared_nomem( L );
+  }
+  if ( !shared_encode( L, 3, &value )) {
+    lpmsg_release( key );
+    return shared_nomem( L );
+  }
+  uint32_t hash = shared_hash( key );
+  shard *sh = shared_shard( st, hash );
+  entry *old;
+
+  mtx_lock( &sh->mutex );
+  int ok = shared_store( sh, shared_find( sh, key, hash ), key, hash, value,
+    &old );
+  mtx_unlock( &sh->mutex );
+
+  if ( old != NULL ) {
+    shared_free( old );
+  }
+  if ( !ok ) {
+    return shared_nomem( L );
+  }
+  lua_pushboolean( L, TRUE );
+  return 1;
+}
+
+/* set the value of a key if its current value equals the expected one (nil
+   for a missing key); return true if the value was set */
+static int lpshared_cas (lua_State *L)
+{
+  store *st = (store *)lpobj_check( L, 1, &lpshared_type );
+  shared_checkkey( L, 2 );
+  shared_checkvalue( L, 3 );
+  shared_checkvalue( L, 4 );
+  lpmsg *key, *expected, *value;
+  if ( !shared_encode( L, 2, &key )) {
+    return shared_nomem( L );
+  }
+  if ( !shared_encode( L, 3, &expected )) {
+    lpmsg_release( key );
+    return shared_nomem( L );
+  }
+  if ( !shared_encode( L, 4, &value )) {
+    lpmsg_release( key );
+    shared_release( expected );
+    return shared_nomem( L );
+  }
+  uint32_t hash = shared_hash( key );
+  shard *sh = shared_shard( st, hash );
+  entry *old = NULL;
+  int ok = TRUE;
+
+  mtx_lock( &sh->mutex );
+  entry **ptr = shared_find( sh, key, hash );
+  int match;
+  if ( *ptr == NULL || expected == NULL ) {
+    match = ( *ptr == NULL && expected == NULL );
+  } else {
+    match = lpmsg_equal( (*ptr)->value, expected );
+  }
+  if ( match ) {
+    ok = shared_store( sh, ptr, key, hash, value, &old );
+  }
+  mtx_unlock( &sh->mutex );
+
+  if ( !match ) {
+    lpmsg_release( key );
+    shared_release( value );
+  }
+  shared_release( expected );
+  if ( old != NULL ) {
+    shared_free( old );
+  }
+  if ( !ok ) {
+    return shared_nomem( L );
+  }
+  lua_pushboolean( L, match );
+  return 1;
+}
+
+/* add a number (1 by default) to the value of a key (0 if missing); return
+   the new value */
+static int lpshared_incr (lua_State *L)
+{
+  store *st = (store *)lpobj_check( L, 1, &lpshared_type );
+  shared_checkkey( L, 2 );
+  if ( lua_isnoneornil( L, 3 )) {
+    lua_settop( L, 2 );
+    lua_pushinteger( L, 1 );
+  }
+  luaL_checknumber( L, 3 );
+  lua_settop( L, 3 );
+  lpmsg *key;
+  if ( !shared_encode( L, 2, &key )) {
+    return shared_nomem( L );
+  }
+  uint32_t hash = shared_hash( key );
+  shard *sh = shared_shard( st, hash );
+  lpmsg *value = NULL;
+  entry *old = NULL;
+  int ok = TRUE;
+
+  mtx_lock( &sh->mutex );
+  entry **ptr = shared_find( sh, key, hash );
+  lua_Integer i = 0;
+  lua_Number n = 0;
+  int kind = ( *ptr == NULL ) ? 1 : lpmsg_tonumber( (*ptr)->value, &i, &n );
+  if ( kind != 0 ) {
+    /* pushing numbers does not allocate memory, so no errors with the lock */
+    if ( kind == 1 && lua_isinteger( L, 3 )) {
+      lua_pushinteger( L, (lua_Integer)( (lua_Unsigned)i +
+        (lua_Unsigned)lua_tointeger( L, 3 )));
+    } else {
+      lua_pushnumber( L, ( kind == 1 ? (lua_Number)i : n ) +
+        lua_tonumber( L, 3 ));
+    }
+    if ( shared_encode( L, 4, &value )) {
+      ok = shared_store( sh, ptr, key, hash, value, &old );
+      key = NULL;
+    } else {
+      ok = FALSE;
+    }
+  }
+  mtx_unlock( &sh->mutex );
+
+  shared_release( key );
+  if ( old != NULL ) {
+    shared_free( old );
+  }
+  if ( kind == 0 ) {
+    lua_pushnil( L );
+    lua_pushstring( L, "value is not a number" );
+    return 2;
+  }
+  if ( !ok ) {
+    return shared_nomem( L );
+  }
+  return 1;
+}
+
+/* remove a key; return true if it was present */
+static int lpshared_delete (lua_State *L)
+{
+  store *st = (store *)lpobj_check( L, 1, &lpshared_type );
+  shared_checkkey( L, 2 );
+  lpmsg *key;
+  if ( !shared_encode( L, 2, &key )) {
+    return shared_nomem( L );
+  }
+  uint32_t hash = shared_hash( key );
+  shard *sh = shared_shard( st, hash );
+  entry *old = NULL;
+
+  mtx_lock( &sh->mutex );
+  entry **ptr = shared_find( sh, key, hash );
+  if ( *ptr != NULL ) {
+    old = shared_unlink( sh, ptr );
+  }
+  mtx_unlock( &sh->mutex );
+
+  lpmsg_release( key );
+  if ( old != NULL ) {
+    shared_free( old );
+  }
+  lua_pushboolean( L, old != NULL );
+  return 1;
+}
+
+/*********************
+ * library functions *
+ *********************/
+
+/* return the store of a name, creating it on first use */
+static int lpshared_open (lua_State *L)
+{
+  const char *name = luaL_checkstring( L, 1 );
+
+  mtx_lock( &mutex_shared_list );
+  lua_getglobal( sharedls, LUAPROC_SHARED_TABLE );
+  lua_getfield( sharedls, -1, name );
+  store *st = (store *)lua_touserdata( sharedls, -1 );
+  lua_pop( sharedls, 1 );
+  if ( st == NULL && ( st = shared_new()) != NULL ) {
+    /* the stores table keeps the first reference */
+    lua_pushlightuserdata( sharedls, st );
+    lua_setfield( sharedls, -2, name );
+  }
+  lua_pop( sharedls, 1 );
+  if ( st != NULL ) {
+    lpobj_retain( &st->obj );
+  }
+  mtx_unlock( &mutex_shared_list );
+
+  if ( st == NULL ) {
+    return shared_nomem( L );
+  }
+  lpobj_push( L, &st->obj );
+  lpobj_release( &st->obj );
+  return 1;
+}
+
+/**********************
+ * exported functions *
+ **********************/
+
+/* initialize stores table */
+void lpshared_init (void)
+{
+  mtx_init( &mutex_shared_list, mtx_plain );
+  sharedls = luaL_newstate();
+  lua_newtable( sharedls );
+  lua_setglobal( sharedls, LUAPROC_SHARED_TABLE );
+}
+
+/* release remaining stores and destroy stores table */
+void lpshared_close (void)
+{
+  lua_getglobal( sharedls, LUAPROC_SHARED_TABLE );
+  lua_pushnil( sharedls );
+  while ( lua_next( sharedls, -2 ) != 0 ) {
+    lpobj_release( (lpobject *)lua_touserdata( sharedls, -1 ));
+    /* pop value, leave key for next iteration */
+    lua_pop( sharedls, 1 );
+  }
+  lua_close( sharedls );
+  mtx_destroy( &mutex_shared_list );
+}
@@ -0,0 +1,28 @@
+/*
+** shared key-value stores
+** See Copyright Notice in luaproc.h
+*/
+
+#ifndef _LUA_LUAPROC_SHARED_H_
+#define _LUA_LUAPROC_SHARED_H_
+
+#include <lua.h>
+#include <lauxlib.h>
+
+/* number of independently locked shards of a store */
+#define LUAPROC_SHARED_SHARDS 16
+
+/* shared store functions of the luaproc library */
+extern const luaL_Reg lpshared_funcs[];
+
+/***********************
+ * function prototypes *
+ **********************/
+
+/* initialize stores table */
+void lpshared_init( void );
+
+/* release remaining stores and destroy stores table */
+void lpshared_close( void );
+
+#endif
@@ -0,0 +1,716 @@
+/*
+** channels on shared memory between luaproc instances
+** See Copyright Notice in luaproc.h
+*/
+
+#define _GNU_SOURCE
+
+#include <threads.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "lpcompat.h"
+#include "luaproc.h"
+#include "lpaux.h"
+#include "lpobj.h"
+#include "lpmsg.h"
+#include "lpshm.h"
+
+#define FALSE 0
+#define TRUE  !FALSE
+#define LUAPROC_SHM_TABLE "shmtb"
+
+/* marks an initialized ring buffer */
+#define SHM_MAGIC 0x6c707369
+
+/* milliseconds to wait for another instance to initialize a ring buffer */
+#define SHM_OPEN_WAIT 1000
+
+/*******************
+ * structure types *
+ ******************/
+
+/*
+  ring buffer at the start of the shared memory object; messages are framed
+  by their size in 4 bytes. 'lock' is a robust process shared mutex of
+  'head' and 'tail', so that an instance dying with it does not lock the
+  others out; 'seq' changes after every read and write so that waiting
+  instances can sleep on it
+*/
+typedef struct {
+  atomic_uint magic;     /* set once the ring buffer is initialized */
+  uint32_t capacity;     /* bytes of 'data' */
+  pthread_mutex_t lock;
+  atomic_uint seq;
+  atomic_uint sleepers;  /* helper threads sleeping on 'seq' */
+  uint64_t head;         /* bytes written */
+  uint64_t tail;         /* bytes read */
+  char data[];
+} shmring;
+
+/* channel of this instance on a ring buffer */
+typedef struct {
+  lpobject obj;
+  waitq wq;              /* also protects the fields below */
+  cnd_t helpcond;        /* wakes the helper when there are waiters */
+  int waiters;           /* lua processes and states waiting */
+  int closed;            /* destroyed with delchannel */
+  int stop;              /* helper must exit */
+  thrd_t helper;         /* wakes waiters when the ring buffer changes */
+  shmring *ring;
+  size_t maplen;
+  int fd;
+  char *path;
+} shmchan;
+
+/********************
+ * global variables *
+ *******************/
+
+/* channels table mutex */
+static mtx_t mutex_shm_list;
+
+/* lua_State used to store channels hash table */
+static lua_State *shmls = NULL;
+
+/***********************
+ * register prototypes *
+ ***********************/
+
+static void lpshm_chan_destroy( lpobject *obj );
+
+static const luaL_Reg lpshm_chan_funcs[] = {
+  { NULL, NULL }
+};
+
+static const lpobject_type lpshm_chan_type = {
+  "luaproc.shmchannel", lpshm_chan_funcs, lpshm_chan_destroy
+};
+
+/***************
+ * ring buffer *
+ ***************/
+
+static void shm_futex_wait (atomic_uint *addr, unsigned int val)
+{
+  syscall( SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0 );
+}
+
+static void shm_futex_wake (atomic_uint *addr, int n)
+{
+  syscall( SYS_futex, addr, FUTEX_WAKE, n, NULL, NULL, 0 );
+}
+
+/* initialize the lock of a new ring buffer; return 0 or an error number */
+static int ring_lock_init (shmring *r)
+{
+  pthread_mutexattr_t attr;
+  int err = pthread_mutexattr_init( &attr );
+  if ( err != 0 ) {
+    return err;
+  }
+  if (( err = pthread_mutexattr_setpshared( &attr,
+    PTHREAD_PROCESS_SHARED )) == 0 &&
+      ( err = pthread_mutexattr_setrobust( &attr,
+    PTHREAD_MUTEX_ROBUST )) == 0 )
+  {
+    err = pthread_mutex_init( &r->lock, &attr );
+  }
+  pthread_mutexattr_destroy( &attr );
+  return err;
+}
+
+/* lock a ring buffer shared with other instances; the lock of an instance
+   that died holding it is taken over, the ring is consistent since 'head'
+   and 'tail' move only after a message is copied */
+static void ring_lock (shmring *r)
+{
+  if ( pthread_mutex_lock( &r->lock ) == EOWNERDEAD ) {
+    pthread_mutex_consistent( &r->lock );
+  }
+}
+
+static void ring_unlock (shmring *r)
+{
+  pthread_mutex_unlock( &r->lock );
+}
+
+/* tell waiting instances that the ring buffer changed */
+static void ring_notify (shmring *r)
+{
+  atomic_fetch_add( &r->seq, 1 );
+  if ( atomic_load( &r->sleepers ) > 0 ) {
+    shm_futex_wake( &r->seq, INT_MAX );
+  }
+}
+
+/* copy bytes into the ring buffer at position 'pos' */
+static void ring_put (shmring *r, uint64_t pos, const void *src, size_t n)
+{
+  size_t off = pos % r->capacity;
+  size_t first = ( n < r->capacity - off ) ? n : r->capacity - off;
+  memcpy( r->data + off, src, first );
+  memcpy( r->data, (const char *)src + first, n - first );
+}
+
+/* copy bytes out of the ring buffer at position 'pos' */
+static void ring_get (shmring *r, uint64_t pos, void *dst, size_t n)
+{
+  size_t off = pos % r->capacity;
+  size_t first = ( n < r->capacity - off ) ? n : r->capacity - off;
+  memcpy( dst, r->data + off, first );
+  memcpy( (char *)dst + first, r->data, n - first );
+}
+
+/* write a message; return 1 if written, 0 if the ring buffer is full and -1
+   if the message can never fit */
+static int ring_write (shmring *r, const lpmsg *msg)
+{
+  uint32_t len = (uint32_t)msg->size;
+  if ( msg->size > r->capacity - sizeof( len )) {
+    return -1;
+  }
+  ring_lock( r );
+  if ( r->capacity - ( r->head - r->tail ) < sizeof( len ) + len ) {
+    ring_unlock( r );
+    return 0;
+  }
+  ring_put( r, r->head, &len, sizeof( len ));
+  ring_put( r, r->head + sizeof( len ), msg->data, len );
+  r->head += sizeof( len ) + len;
+  ring_unlock( r );
+  return 1;
+}
+
+/* read the oldest message; return 1 if read, 0 if the ring buffer is empty
+   and -1 if the message was invalid or memory ran out */
+static int ring_read (shmring *r, lpmsg **msg)
+{
+  uint32_t len;
+  ring_lock( r );
+  if ( r->head == r->tail ) {
+    ring_unlock( r );
+    return 0;
+  }
+  /* the frame comes from another process: a length past the written data
+     would read outside the ring, so the corrupted contents are dropped */
+  if ( r->head - r->tail < sizeof( len )) {
+    r->tail = r->head;
+    ring_unlock( r );
+    *msg = NULL;
+    return -1;
+  }
+  ring_get( r, r->tail, &len, sizeof( len ));
+  uint64_t pos = r->tail + sizeof( len );
+  if ( len > r->head - pos || len > r->capacity ) {
+    r->tail = r->head;
+    ring_unlock( r );
+    *msg = NULL;
+    return -1;
+  }
+  size_t off = pos % r->capacity;
+  if ( off + len <= r->capacity ) {  /* contiguous, no extra copy */
+    *msg = lpmsg_new( r->data + off, len );
+  } else {
+    char *buf = (char *)malloc( len );
+    *msg = NULL;
+    if ( buf != NULL ) {
+      ring_get( r, pos, buf, len );
+      *msg = lpmsg_new( buf, len );
+      free( buf );
+    }
+  }
+  r->tail = pos + len;
+  ring_unlock( r );
+  return ( *msg != NULL ) ? 1 : -1;
+}
+
+/*****************
+ * helper thread *
+ *****************/
+
+/* wake the waiters of the channel whenever the ring buffer changes; sleep
+   while nobody waits */
+static int shm_helper (void *arg)
+{
+  shmchan *c = (shmchan *)arg;
+  shmring *r = c->ring;
+  unsigned int seen = atomic_load( &r->seq );
+
+  mtx_lock( &c->wq.mutex );
+  while ( !c->stop ) {
+    if ( c->waiters == 0 ) {
+      cnd_wait( &c->helpcond, &c->wq.mutex );
+      continue;
+    }
+    /* the waiters checked the ring buffer with the lock held, so a change
+       seen here happened after or is already known to them */
+    unsigned int s = atomic_load( &r->seq );
+    if ( s != seen ) {
+      seen = s;
+      waitq_wake( &c->wq );
+      continue;
+    }
+    mtx_unlock( &c->wq.mutex );
+    atomic_fetch_add( &r->sleepers, 1 );
+    if ( atomic_load( &r->seq ) == s ) {
+      shm_futex_wait( &r->seq, s );
+    }
+    atomic_fetch_sub( &r->sleepers, 1 );
+    mtx_lock( &c->wq.mutex );
+  }
+  mtx_unlock( &c->wq.mutex );
+  return 0;
+}
+
+/********************
+ * channel handling *
+ ********************/
+
+/* map a ring buffer, creating and initializing the shared memory object if
+   it does not exist; return NULL and set 'err' if failed */
+static shmchan *shm_open_chan (const char *path, size_t size, int *err)
+{
+  int created = TRUE;
+  int fd = shm_open( path, O_RDWR | O_CREAT | O_EXCL, 0600 );
+  if ( fd < 0 && errno == EEXIST ) {
+    created = FALSE;
+    fd = shm_open( path, O_RDWR, 0 );
+  }
+  if ( fd < 0 ) {
+    *err = errno;
+    return NULL;
+  }
+
+  size_t len = sizeof( shmring ) + size;
+  if ( created ) {
+    if ( ftruncate( fd, len ) != 0 ) {
+      *err = errno;
+      close( fd );
+      shm_unlink( path );
+      return NULL;
+    }
+  } else {
+    /* the creator may not have sized the object yet */
+    struct stat st;
+    timespec pause = lpaux_time_period( 0.001 );
+    for ( int i = 0; fstat( fd, &st ) == 0
+      && (size_t)st.st_size <= sizeof( shmring ); i++ )
+    {
+      if ( i == SHM_OPEN_WAIT ) {
+        close( fd );
+        *err = EINVAL;
+        return NULL;
+      }
+      thrd_sleep( &pause, NULL );
+    }
+    len = st.st_size;
+  }
+
+  shmring *r = mmap( NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  if ( r == MAP_FAILED ) {
+    *err = errno;
+    close( fd );
+    if ( created ) {
+      shm_unlink( path );
+    }
+    return NULL;
+  }
+
+  if ( created ) {
+    r->capacity = (uint32_t)size;
+    if (( *err = ring_lock_init( r )) != 0 ) {
+      munmap( r, len );
+      close( fd );
+      shm_unlink( path );
+      return NULL;
+    }
+    atomic_init( &r->seq, 0 );
+    atomic_init( &r->sleepers, 0 );
+    r->head = 0;
+    r->tail = 0;
+    atomic_store( &r->magic, SHM_MAGIC );
+  } else {
+    timespec pause = lpaux_time_period( 0.001 );
+    for ( int i = 0; atomic_load( &r->magic ) != SHM_MAGIC; i++ ) {
+      if ( i == SHM_OPEN_WAIT ) {
+        break;
+      }
+      thrd_sleep( &pause, NULL );
+    }
+    if ( atomic_load( &r->magic ) != SHM_MAGIC
+      || sizeof( shmring ) + r->capacity > len )
+    {
+      munmap( r, len );
+      close( fd );
+      *err = EINVAL;
+      return NULL;
+    }
+  }
+
+  shmchan *c = (shmchan *)malloc( sizeof( shmchan ));
+  char *p = strdup( path );
+  if ( c == NULL || p == NULL ) {
+    free( c );
+    free( p );
+    munmap( r, len );
+    close( fd );
+    *err = ENOMEM;
+    return NULL;
+  }
+  lpobj_init( &c->obj, &lpshm_chan_type );
+  waitq_init( &c->wq );
+  cnd_init( &c->helpcond );
+  c->waiters = 0;
+  c->closed = FALSE;
+  c->stop = FALSE;
+  c->ring = r;
+  c->maplen = len;
+  c->fd = fd;
+  c->path = p;
+  if ( thrd_create( &c->helper, shm_helper, c ) != thrd_success ) {
+    cnd_destroy( &c->helpcond );
+    waitq_destroy( &c->wq );
+    free( p );
+    free( c );
+    munmap( r, len );
+    close( fd );
+    *err = EAGAIN;
+    return NULL;
+  }
+  return c;
+}
+
+/* destroy a channel when it is not referenced anymore */
+static void lpshm_chan_destroy (lpobject *obj)
+{
+  shmchan *c = (shmchan *)obj;
+  mtx_lock( &c->wq.mutex );
+  c->stop = TRUE;
+  cnd_signal( &c->helpcond );
+  mtx_unlock( &c->wq.mutex );
+  /* interrupt the helper if it sleeps on the ring buffer */
+  ring_notify( c->ring );
+  thrd_join( c->helper, NULL );
+
+  munmap( c->ring, c->maplen );
+  close( c->fd );
+  cnd_destroy( &c->helpcond );
+  waitq_destroy( &c->wq );
+  free( c->path );
+  free( c );
+}
+
+/* return a referenced channel (if not found, return null) */
+static shmchan *shm_get (const char *name)
+{
+  mtx_lock( &mutex_shm_list );
+  lua_getglobal( shmls, LUAPROC_SHM_TABLE );
+  lua_getfield( shmls, -1, name );
+  shmchan *c = (shmchan *)lua_touserdata( shmls, -1 );
+  lua_pop( shmls, 2 );
+  if ( c != NULL ) {
+    lpobj_retain( &c->obj );
+  }
+  mtx_unlock( &mutex_shm_list );
+  return c;
+}
+
+/* close a channel removed from the channels table and wake its waiters */
+static void shm_close (shmchan *c)
+{
+  mtx_lock( &c->wq.mutex );
+  c->closed = TRUE;
+  waitq_wake( &c->wq );
+  mtx_unlock( &c->wq.mutex );
+  lpobj_release( &c->obj );  /* reference of the channels table */
+}
+
+/* get ready to block on a channel, the channel must be locked */
+static void shm_wait (shmchan *c)
+{
+  if ( c->waiters++ == 0 ) {
+    cnd_signal( &c->helpcond );
+  }
+}
+
+/* continue sending 'ctx' values to a channel */
+static int lpshm_send_k (lua_State *L, int status, lua_KContext ctx)
+{
+  int n = (int)ctx;
+  shmchan *c = (shmchan *)lpobj_test( L, n + 2 );
+  int bad = 0;
+  lpmsg *msg = lpmsg_encode( L, 2, n + 1, &bad );
+
+  mtx_lock( &c->wq.mutex );
+  luaproc_unblock( L, &c->wq );
+  if ( status == LUA_YIELD ) {
+    c->waiters--;
+  }
+
+  if ( msg == NULL ) {
+    mtx_unlock( &c->wq.mutex );
+    lua_pushnil( L );
+    if ( bad > 0 ) {
+      lua_pushfstring( L, "failed to send value of unsupported type '%s'",
+        luaL_typename( L, bad ));
+    } else {
+      lua_pushstring( L, "not enough memory" );
+    }
+    return 2;
+  }
+
+  if ( c->closed ) {
+    mtx_unlock( &c->wq.mutex );
+    lpmsg_release( msg );
+    lua_pushnil( L );
+    lua_pushfstring( L, "channel '%s' destroyed while waiting for receiver",
+      lua_tostring( L, 1 ));
+    return 2;
+  }
+
+  int ret = ring_write( c->ring, msg );
+  lpmsg_release( msg );
+  if ( ret != 0 ) {
+    mtx_unlock( &c->wq.mutex );
+    if ( ret < 0 ) {
+      lua_pushnil( L );
+      lua_pushfstring( L, "message too large for channel '%s'",
+        lua_tostring( L, 1 ));
+      return 2;
+    }
+    ring_notify( c->ring );
+    lua_pushboolean( L, TRUE );
+    return 1;
+  }
+
+  /* the ring buffer is full */
+  shm_wait( c );
+  return luaproc_block( L, &c->wq, 0, ctx, lpshm_send_k );
+}
+
+/* continue receiving a message from a channel */
+static int lpshm_receive_k (lua_State *L, int status, lua_KContext ctx)
+{
+  shmchan *c = (shmchan *)lpobj_test( L, 3 );
+
+  mtx_lock( &c->wq.mutex );
+  luaproc_unblock( L, &c->wq );
+  if ( status == LUA_YIELD ) {
+    c->waiters--;
+  }
+
+  lpmsg *msg = NULL;
+  int ret = ring_read( c->ring, &msg );
+  if ( ret != 0 ) {
+    mtx_unlock( &c->wq.mutex );
+    ring_notify( c->ring );
+    if ( ret < 0 ) {
+      lua_pushnil( L );
+      lua_pushstring( L, "failed to receive message" );
+      return 2;
+    }
+    int n = lpmsg_decode( L, msg );
+    lpmsg_release( msg );
+    if ( n < 0 ) {
+      lua_pushnil( L );
+      lua_pushstring( L, "not enough space in the stack" );
+      return 2;
+    }
+    return n;
+  }
+
+  if ( c->closed ) {
+    mtx_unlock( &c->wq.mutex );
+    lua_pushnil( L );
+    lua_pushfstring( L, "channel '%s' destroyed while waiting for sender",
+      lua_tostring( L, 1 ));
+    return 2;
+  }
+
+  if ( lua_toboolean( L, 2 )) {  /* asynchronous receive */
+    mtx_unlock( &c->wq.mutex );
+    lua_pushnil( L );
+    lua_pushfstring( L, "no messages on channel '%s'", lua_tostring( L, 1 ));
+    return 2;
+  }
+
+  shm_wait( c );
+  return luaproc_block( L, &c->wq, 0, ctx, lpshm_receive_k );
+}
+
+/* push a channel for the rest of an operation, or nil and an error message
+   if it does not exist; return false if not found */
+static int shm_push (lua_State *L, const char *name)
+{
+  shmchan *c = shm_get( name );
+  if ( c == NULL ) {
+    lua_pushnil( L );
+    lua_pushfstring( L, "channel '%s' does not exist", name );
+    return FALSE;
+  }
+  lpobj_push( L, &c->obj );
+  lpobj_release( &c->obj );
+  return TRUE;
+}
+
+/**********************
+ * exported functions *
+ **********************/
+
+/* send the values after the channel name at index 1 */
+int lpshm_send (lua_State *L)
+{
+  const char *name = luaL_checkstring( L, 1 );
+  int n = lua_gettop( L ) - 1;
+  if ( !shm_push( L, name )) {
+    return 2;
+  }
+  return lpshm_send_k( L, LUA_OK, n );
+}
+
+/* receive a message from the channel named at index 1 */
+int lpshm_receive (lua_State *L)
+{
+  const char *name = luaL_checkstring( L, 1 );
+  lua_settop( L, 2 );
+  if ( !shm_push( L, name )) {
+    return 2;
+  }
+  return lpshm_receive_k( L, LUA_OK, 0 );
+}
+
+/* create a channel (name at index 1) with the options at index 2 */
+int lpshm_create (lua_State *L)
+{
+  const char *name = luaL_checkstring( L, 1 );
+  lua_getfield( L, 2, "shm" );
+  const char *path = lua_tostring( L, -1 );
+  if ( path == NULL ) {
+    luaL_error( L, "option 'shm' must be a string" );
+  }
+  lua_getfield( L, 2, "size" );
+  lua_Integer size = LUAPROC_SHM_DEFAULT_SIZE;
+  if ( !lua_isnil( L, -1 )) {
+    int isnum;
+    size = lua_tointegerx( L, -1, &isnum );
+    if ( !isnum || size < LUAPROC_SHM_MIN_SIZE || size > INT32_MAX ) {
+      luaL_error( L, "option 'size' must be an integer from %d to %d",
+        LUAPROC_SHM_MIN_SIZE, INT32_MAX );
+    }
+  }
+  lua_pop( L, 1 );
+
+  if ( lpshm_exists( name )) {
+    lua_pushnil( L );
+    lua_pushfstring( L, "channel '%s' already exists", name );
+    return 2;
+  }
+
+  int err = 0;
+  shmchan *c = shm_open_chan( path, (size_t)size, &err );
+  if ( c == NULL ) {
+    lua_pushnil( L );
+    lua_pushfstring( L, "cannot open '%s': %s", path, strerror( err ));
+    return 2;
+  }
+
+  mtx_lock( &mutex_shm_list );
+  lua_getglobal( shmls, LUAPROC_SHM_TABLE );
+  lua_getfield( shmls, -1, name );
+  int exists = !lua_isnil( shmls, -1 );
+  lua_pop( shmls, 1 );
+  if ( !exists ) {
+    lua_pushlightuserdata( shmls, c );
+    lua_setfield( shmls, -2, name );
+  }
+  lua_pop( shmls, 1 );
+  mtx_unlock( &mutex_shm_list );
+
+  if ( exists ) {  /* created meanwhile */
+    lpobj_release( &c->obj );
+    lua_pushnil( L );
+    lua_pushfstring( L, "channel '%s' already exists", name );
+    return 2;
+  }
+  lua_pushboolean( L, TRUE );
+  return 1;
+}
+
+/* destroy the channel named at index 1 and remove its shared memory
+   object; other instances keep the ring buffer they have open */
+int lpshm_destroy (lua_State *L)
+{
+  const char *name = luaL_checkstring( L, 1 );
+
+  mtx_lock( &mutex_shm_list );
+  lua_getglobal( shmls, LUAPROC_SHM_TABLE );
+  lua_getfield( shmls, -1, name );
+  shmchan *c = (shmchan *)lua_touserdata( shmls, -1 );
+  lua_pop( shmls, 1 );
+  if ( c != NULL ) {
+    lua_pushnil( shmls );
+    lua_setfield( shmls, -2, name );
+  }
+  lua_pop( shmls, 1 );
+  mtx_unlock( &mutex_shm_list );
+
+  if ( c == NULL ) {
+    lua_pushnil( L );
+    lua_pushfstring( L, "channel '%s' does not exist", name );
+    return 2;
+  }
+  shm_unlink( c->path );
+  shm_close( c );
+  lua_pushboolean( L, TRUE );
+  return 1;
+}
+
+/* return true if a shared memory channel exists */
+int lpshm_exists (const char *name)
+{
+  mtx_lock( &mutex_shm_list );
+  lua_getglobal( shmls, LUAPROC_SHM_TABLE );
+  lua_getfield( shmls, -1, name );
+  int exists = !lua_isnil( shmls, -1 );
+  lua_pop( shmls, 2 );
+  mtx_unlock( &mutex_shm_list );
+  return exists;
+}
+
+/* initialize shared memory channels table */
+void lpshm_init (void)
+{
+  mtx_init( &mutex_shm_list, mtx_plain );
+  shmls = luaL_newstate();
+  lua_newtable( shmls );
+  lua_setglobal( shmls, LUAPROC_SHM_TABLE );
+}
+
+/* close remaining channels and destroy channels table; their shared memory
+   objects are left for other instances */
+void lpshm_close (void)
+{
+  lua_getglobal( shmls, LUAPROC_SHM_TABLE );
+  lua_pushnil( shmls );
+  while ( lua_next( shmls, -2 ) != 0 ) {
+    shm_close( (shmchan *)lua_touserdata( shmls, -1 ));
+    /* pop value, leave key for next iteration */
+    lua_pop( shmls, 1 );
+  }
+  lua_close( shmls );
+  mtx_destroy( &mutex_shm_list );
+}
@@ -0,0 +1,43 @@
+/*
+** channels on shared memory between luaproc instances
+** See Copyright Notice in luaproc.h
+*/
+
+#ifndef _LUA_LUAPROC_SHM_H_
+#define _LUA_LUAPROC_SHM_H_
+
+#include <lua.h>
+#include <lauxlib.h>
+
+/* default number of bytes of the ring buffer of a channel */
+#define LUAPROC_SHM_DEFAULT_SIZE 65536
+
+/* smallest ring buffer of a channel */
+#define LUAPROC_SHM_MIN_SIZE 64
+
+/***********************
+ * function prototypes *
+ **********************/
+
+/* initialize shared memory channels table */
+void lpshm_init( void );
+
+/* close remaining channels and destroy channels table */
+void lpshm_close( void );
+
+/* return true if a shared memory channel exists */
+int lpshm_exists( const char *name );
+
+/* create a channel (name at index 1) with the options at index 2 */
+int lpshm_create( lua_State *L );
+
+/* destroy the channel named at index 1 */
+int lpshm_destroy( lua_State *L );
+
+/* send the values after the channel name at index 1 */
+int lpshm_send( lua_State *L );
+
+/* receive a message from the channel named at index 1 */
+int lpshm_receive( lua_State *L );
+
+#endif
@@ -0,0 +1,467 @@
+/*
+** synchronization objects of lua processes
+** See Copyright Notice in luaproc.h
+*/
+
+#include <threads.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "lpcompat.h"
+#include "luaproc.h"
+#include "lpaux.h"
+#include "lpobj.h"
+#include "lpsync.h"
+
+#define FALSE 0
+#define TRUE  !FALSE
+
+/*******************
+ * structure types *
+ ******************/
+
+/* header of objects lua processes can wait on */
+typedef struct {
+  lpobject obj;
+  waitq wq;     /* also protects the object fields */
+} waitable;
+
+/* counting semaphore */
+typedef struct {
+  waitable w;
+  lua_Integer count;
+} semaphore;
+
+/* wait group, waits for a counter to drop to zero */
+typedef struct {
+  waitable w;
+  lua_Integer count;
+} waitgroup;
+
+/* cyclic barrier for a fixed number of processes */
+typedef struct {
+  waitable w;
+  int parties;
+  int waiting;
+  unsigned int phase;  /* number of completed phases */
+} barrier;
+
+/* atomic integer */
+typedef struct {
+  lpobject obj;
+  _Atomic lua_Integer value;
+} atomicint;
+
+/***********************
+ * register prototypes *
+ ***********************/
+
+static int lpsync_semaphore( lua_State *L );
+static int lpsync_waitgroup( lua_State *L );
+static int lpsync_barrier( lua_State *L );
+static int lpsync_atomic( lua_State *L );
+
+static int lpsync_sem_acquire( lua_State *L );
+static int lpsync_sem_tryacquire( lua_State *L );
+static int lpsync_sem_release( lua_State *L );
+static int lpsync_sem_count( lua_State *L );
+static int lpsync_wg_add( lua_State *L );
+static int lpsync_wg_done( lua_State *L );
+static int lpsync_wg_wait( lua_State *L );
+static int lpsync_wg_count( lua_State *L );
+static int lpsync_bar_wait( lua_State *L );
+static int lpsync_atom_get( lua_State *L );
+static int lpsync_atom_set( lua_State *L );
+static int lpsync_atom_add( lua_State *L );
+static int lpsync_atom_cas( lua_State *L );
+
+static void lpsync_waitable_destroy( lpobject *obj );
+static void lpsync_atom_destroy( lpobject *obj );
+
+/* synchronization functions of the luaproc library */
+const luaL_Reg lpsync_funcs[] = {
+  { "semaphore", lpsync_semaphore },
+  { "waitgroup", lpsync_waitgroup },
+  { "barrier", lpsync_barrier },
+  { "atomic", lpsync_atomic },
+  { NULL, NULL }
+};
+
+/* semaphore methods */
+static const luaL_Reg lpsync_sem_funcs[] = {
+  { "acquire", lpsync_sem_acquire },
+  { "tryacquire", lpsync_sem_tryacquire },
+  { "release", lpsync_sem_release },
+  { "count", lpsync_sem_count },
+  { NULL, NULL }
+};
+
+/* wait group methods */
+static const luaL_Reg lpsync_wg_funcs[] = {
+  { "add", lpsync_wg_add },
+  { "done", lpsync_wg_done },
+  { "wait", lpsync_wg_wait },
+  { "count", lpsync_wg_count },
+  { NULL, NULL }
+};
+
+/* barrier methods */
+static const luaL_Reg lpsync_bar_funcs[] = {
+  { "wait", lpsync_bar_wait },
+  { NULL, NULL }
+};
+
+/* atomic integer methods */
+static const luaL_Reg lpsync_atom_funcs[] = {
+  { "get", lpsync_atom_get },
+  { "set", lpsync_atom_set },
+  { "add", lpsync_atom_add },
+  { "cas", lpsync_atom_cas },
+  { NULL, NULL }
+};
+
+static const lpobject_type lpsync_sem_type = {
+  "luaproc.semaphore", lpsync_sem_funcs, lpsync_waitable_destroy
+};
+
+static const lpobject_type lpsync_wg_type = {
+  "luaproc.waitgroup", lpsync_wg_funcs, lpsync_waitable_destroy
+};
+
+static const lpobject_type lpsync_bar_type = {
+  "luaproc.barrier", lpsync_bar_funcs, lpsync_waitable_destroy
+};
+
+static const lpobject_type lpsync_atom_type = {
+  "luaproc.atomic", lpsync_atom_funcs, lpsync_atom_destroy
+};
+
+/***********************
+ * auxiliary functions *
+ ***********************/
+
+/* allocate an object with a wait queue */
+static waitable *lpsync_waitable_new (lua_State *L, size_t size,
+  const lpobject_type *type)
+{
+  waitable *w = (waitable *)malloc( size );
+  if ( w == NULL ) {
+    luaL_error( L, "not enough memory" );
+  }
+  lpobj_init( &w->obj, type );
+  waitq_init( &w->wq );
+  return w;
+}
+
+/* destroy an object with a wait queue */
+static void lpsync_waitable_destroy (lpobject *obj)
+{
+  waitq_destroy( &((waitable *)obj)->wq );
+  free( obj );
+}
+
+/* destroy an atomic integer */
+static void lpsync_atom_destroy (lpobject *obj)
+{
+  free( obj );
+}
+
+/* push a new object, the userdata holds its only reference */
+static int lpsync_push (lua_State *L, lpobject *obj)
+{
+  lpobj_push( L, obj );
+  lpobj_release( obj );
+  return 1;
+}
+
+/* unlock a wait queue, push nil and "timeout" */
+static int lpsync_timeout (lua_State *L, waitq *q)
+{
+  mtx_unlock( &q->mutex );
+  lua_pushnil( L );
+  lua_pushstring( L, "timeout" );
+  return 2;
+}
+
+/***********************
+ * semaphore functions *
+ ***********************/
+
+/* create a semaphore with 'n' units (0 by default) */
+static int lpsync_semaphore (lua_State *L)
+{
+  lua_Integer n = luaL_optinteger( L, 1, 0 );
+  luaL_argcheck( L, n >= 0, 1, "negative count" );
+  semaphore *s = (semaphore *)lpsync_waitable_new( L, sizeof( semaphore ),
+    &lpsync_sem_type );
+  s->count = n;
+  return lpsync_push( L, &s->w.obj );
+}
+
+/* continue acquiring a unit */
+static int lpsync_sem_acquire_k (lua_State *L, int status, lua_KContext ctx)
+{
+  semaphore *s = (semaphore *)lpobj_test( L, 1 );
+  int deadline = ( lua_gettop( L ) >= 2 ) ? 2 : 0;
+
+  mtx_lock( &s->w.wq.mutex );
+  luaproc_unblock( L, &s->w.wq );
+  if ( s->count > 0 ) {
+    s->count--;
+    mtx_unlock( &s->w.wq.mutex );
+    lua_pushboolean( L, TRUE );
+    return 1;
+  }
+  if ( lpaux_expired( L, deadline )) {
+    return lpsync_timeout( L, &s->w.wq );
+  }
+  return luaproc_block( L, &s->w.wq, deadline, ctx, lpsync_sem_acquire_k );
+}
+
+/* take a unit, waiting until one is released or the timeout expires */
+static int lpsync_sem_acquire (lua_State *L)
+{
+  lpobj_check( L, 1, &lpsync_sem_type );
+  lpaux_deadline( L, 2 );
+  return lpsync_sem_acquire_k( L, LUA_OK, 0 );
+}
+
+/* take a unit if available, without waiting */
+static int lpsync_sem_tryacquire (lua_State *L)
+{
+  semaphore *s = (semaphore *)lpobj_check( L, 1, &lpsync_sem_type );
+  mtx_lock( &s->w.wq.mutex );
+  int ok = ( s->count > 0 );
+  if ( ok ) {
+    s->count--;
+  }
+  mtx_unlock( &s->w.wq.mutex );
+  lua_pushboolean( L, ok );
+  return 1;
+}
+
+/* return 'n' units (1 by default) and wake as many waiting processes */
+static int lpsync_sem_release (lua_State *L)
+{
+  semaphore *s = (semaphore *)lpobj_check( L, 1, &lpsync_sem_type );
+  lua_Integer n = luaL_optinteger( L, 2, 1 );
+  luaL_argcheck( L, n > 0, 2, "count must be positive" );
+  mtx_lock( &s->w.wq.mutex );
+  if ( n > LUA_MAXINTEGER - s->count ) {
+    mtx_unlock( &s->w.wq.mutex );
+    return luaL_error( L, "semaphore counter overflow" );
+  }
+  s->count += n;
+  lua_Integer i = 0;
+  do {  /* the main state is not queued, but always signaled */
+    waitq_wake_one( &s->w.wq );
+  } while ( ++i < n && s->w.wq.head != NULL );
+  mtx_unlock( &s->w.wq.mutex );
+  return 0;
+}
+
+/* return the number of available units */
+static int lpsync_sem_count (lua_State *L)
+{
+  semaphore *s = (semaphore *)lpobj_check( L, 1, &lpsync_sem_type );
+  mtx_lock( &s->w.wq.mutex );
+  lua_Integer n = s->count;
+  mtx_unlock( &s->w.wq.mutex );
+  lua_pushinteger( L, n );
+  return 1;
+}
+
+/************************
+ * wait group functions *
+ ************************/
+
+/* create a wait group with a zero counter */
+static int lpsync_waitgroup (lua_State *L)
+{
+  waitgroup *g = (waitgroup *)lpsync_waitable_new( L, sizeof( waitgroup ),
+    &lpsync_wg_type );
+  g->count = 0;
+  return lpsync_push( L, &g->w.obj );
+}
+
+/* add 'n' to the counter of a wait group; wake waiting processes when it
+   drops to zero */
+static int lpsync_wg_change (lua_State *L, waitgroup *g, lua_Integer n)
+{
+  mtx_lock( &g->w.wq.mutex );
+  /* the counter is not negative, so only an increment can overflow */
+  if ( n > 0 && n > LUA_MAXINTEGER - g->count ) {
+    mtx_unlock( &g->w.wq.mutex );
+    return luaL_error( L, "wait group counter overflow" );
+  }
+  if ( g->count + n < 0 ) {
+    mtx_unlock( &g->w.wq.mutex );
+    return luaL_error( L, "negative wait group counter" );
+  }
+  g->count += n;
+  if ( g->count == 0 ) {
+    waitq_wake( &g->w.wq );
+  }
+  mtx_unlock( &g->w.wq.mutex );
+  return 0;
+}
+
+/* add 'n' (1 by default) to the counter */
+static int lpsync_wg_add (lua_State *L)
+{
+  waitgroup *g = (waitgroup *)lpobj_check( L, 1, &lpsync_wg_type );
+  return lpsync_wg_change( L, g, luaL_optinteger( L, 2, 1 ));
+}
+
+/* decrement the counter */
+static int lpsync_wg_done (lua_State *L)
+{
+  waitgroup *g = (waitgroup *)lpobj_check( L, 1, &lpsync_wg_type );
+  return lpsync_wg_change( L, g, -1 );
+}
+
+/* continue waiting for the counter to drop to zero */
+static int lpsync_wg_wait_k (lua_State *L, int status, lua_KContext ctx)
+{
+  waitgroup *g = (waitgroup *)lpobj_test( L, 1 );
+  int deadline = ( lua_gettop( L ) >= 2 ) ? 2 : 0;
+
+  mtx_lock( &g->w.wq.mutex );
+  luaproc_unblock( L, &g->w.wq );
+  if ( g->count == 0 ) {
+    mtx_unlock( &g->w.wq.mutex );
+    lua_pushboolean( L, TRUE );
+    return 1;
+  }
+  if ( lpaux_expired( L, deadline )) {
+    return lpsync_timeout( L, &g->w.wq );
+  }
+  return luaproc_block( L, &g->w.wq, deadline, ctx, lpsync_wg_wait_k );
+}
+
+/* wait until the counter drops to zero or the timeout expires */
+static int lpsync_wg_wait (lua_State *L)
+{
+  lpobj_check( L, 1, &lpsync_wg_type );
+  lpaux_deadline( L, 2 );
+  return lpsync_wg_wait_k( L, LUA_OK, 0 );
+}
+
+/* return the counter */
+static int lpsync_wg_count (lua_State *L)
+{
+  waitgroup *g = (waitgroup *)lpobj_check( L, 1, &lpsync_wg_type );
+  mtx_lock( &g->w.wq.mutex );
+  lua_Integer n = g->count;
+  mtx_unlock( &g->w.wq.mutex );
+  lua_pushinteger( L, n );
+  return 1;
+}
+
+/*********************
+ * barrier functions *
+ *********************/
+
+/* create a barrier for 'n' processes */
+static int lpsync_barrier (lua_State *L)
+{
+  lua_Integer n = luaL_checkinteger( L, 1 );
+  luaL_argcheck( L, n > 0 && n <= INT_MAX, 1, "invalid number of parties" );
+  barrier *b = (barrier *)lpsync_waitable_new( L, sizeof( barrier ),
+    &lpsync_bar_type );
+  b->parties = (int)n;
+  b->waiting = 0;
+  b->phase = 0;
+  return lpsync_push( L, &b->w.obj );
+}
+
+/* continue waiting for the phase 'ctx' to complete */
+static int lpsync_bar_wait_k (lua_State *L, int status, lua_KContext ctx)
+{
+  barrier *b = (barrier *)lpobj_test( L, 1 );
+
+  mtx_lock( &b->w.wq.mutex );
+  luaproc_unblock( L, &b->w.wq );
+  if ( b->phase != (unsigned int)ctx ) {
+    mtx_unlock( &b->w.wq.mutex );
+    lua_pushboolean( L, FALSE );
+    return 1;
+  }
+  return luaproc_block( L, &b->w.wq, 0, ctx, lpsync_bar_wait_k );
+}
+
+/* wait for all the parties; return true for the last one to arrive */
+static int lpsync_bar_wait (lua_State *L)
+{
+  barrier *b = (barrier *)lpobj_check( L, 1, &lpsync_bar_type );
+  lua_settop( L, 1 );
+
+  mtx_lock( &b->w.wq.mutex );
+  if ( ++b->waiting == b->parties ) {  /* complete the phase */
+    b->waiting = 0;
+    b->phase++;
+    waitq_wake( &b->w.wq );
+    mtx_unlock( &b->w.wq.mutex );
+    lua_pushboolean( L, TRUE );
+    return 1;
+  }
+  return luaproc_block( L, &b->w.wq, 0, (lua_KContext)b->phase,
+    lpsync_bar_wait_k );
+}
+
+/****************************
+ * atomic integer functions *
+ ****************************/
+
+/* create an atomic integer (0 by default) */
+static int lpsync_atomic (lua_State *L)
+{
+  lua_Integer v = luaL_optinteger( L, 1, 0 );
+  atomicint *a = (atomicint *)malloc( sizeof( atomicint ));
+  if ( a == NULL ) {
+    return luaL_error( L, "not enough memory" );
+  }
+  lpobj_init( &a->obj, &lpsync_atom_type );
+  atomic_init( &a->value, v );
+  return lpsync_push( L, &a->obj );
+}
+
+/* return the value */
+static int lpsync_atom_get (lua_State *L)
+{
+  atomicint *a = (atomicint *)lpobj_check( L, 1, &lpsync_atom_type );
+  lua_pushinteger( L, atomic_load( &a->value ));
+  return 1;
+}
+
+/* set the value, return the previous one */
+static int lpsync_atom_set (lua_State *L)
+{
+  atomicint *a = (atomicint *)lpobj_check( L, 1, &lpsync_atom_type );
+  lua_pushinteger( L, atomic_exchange( &a->value, luaL_checkinteger( L, 2 )));
+  return 1;
+}
+
+/* add 'n' (1 by default), return the new value */
+static int lpsync_atom_add (lua_State *L)
+{
+  atomicint *a = (atomicint *)lpobj_check( L, 1, &lpsync_atom_type );
+  lua_Integer n = luaL_optinteger( L, 2, 1 );
+  lua_Unsigned prev = (lua_Unsigned)atomic_fetch_add( &a->value, n );
+  lua_pushinteger( L, (lua_Integer)( prev + (lua_Unsigned)n ));
+  return 1;
+}
+
+/* set the value if it equals 'expected'; return true if it was set */
+static int lpsync_atom_cas (lua_State *L)
+{
+  atomicint *a = (atomicint *)lpobj_check( L, 1, &lpsync_atom_type );
+  lua_Integer expected = luaL_checkinteger( L, 2 );
+  lua_Integer v = luaL_checkinteger( L, 3 );
+  lua_pushboolean( L,
+    atomic_compare_exchange_strong( &a->value, &expected, v ));
+  return 1;
+}
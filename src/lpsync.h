@@ -0,0 +1,15 @@
+/*
+** synchronization objects of lua processes
+** See Copyright Notice in luaproc.h
+*/
+
+#ifndef _LUA_LUAPROC_SYNC_H_
+#define _LUA_LUAPROC_SYNC_H_
+
+#include <lua.h>
+#include <lauxlib.h>
+
+/* synchronization functions of the luaproc library */
+extern const luaL_Reg lpsync_funcs[];
+
+#endif
@@ -0,0 +1,436 @@
+/*
+** publish/subscribe topics
+** See Copyright Notice in luaproc.h
+*/
+
+#include <threads.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "lpcompat.h"
+#include "luaproc.h"
+#include "lpobj.h"
+#include "lpmsg.h"
+#include "lptopic.h"
+
+#define FALSE 0
+#define TRUE  !FALSE
+#define LUAPROC_TOPICS_TABLE "topictb"
+
+/*******************
+ * structure types *
+ ******************/
+
+typedef struct sttopic topic;
+typedef struct stsubscriber subscriber;
+
+/* topic, referenced by the topics table and by its subscribers */
+struct sttopic {
+  mtx_t mutex;        /* protects the subscriber list */
+  atomic_int refs;
+  int closed;         /* removed from the topics table */
+  subscriber *subs;
+};
+
+/* subscriber with a bounded queue of messages */
+struct stsubscriber {
+  lpobject obj;
+  waitq wq;           /* also protects the queue */
+  topic *tp;
+  subscriber *next;
+  lpmsg **queue;      /* ring buffer */
+  int size;
+  int head;
+  int count;
+  lua_Integer dropped;  /* messages dropped because the queue was full */
+  int closed;
+};
+
+/********************
+ * global variables *
+ *******************/
+
+/* topics table mutex */
+static mtx_t mutex_topic_list;
+
+/* lua_State used to store topics hash table */
+static lua_State *topicls = NULL;
+
+/***********************
+ * register prototypes *
+ ***********************/
+
+static int lptopic_new( lua_State *L );
+static int lptopic_delete( lua_State *L );
+static int lptopic_subscribe( lua_State *L );
+static int lptopic_publish( lua_State *L );
+static int lptopic_sub_receive( lua_State *L );
+static int lptopic_sub_unsubscribe( lua_State *L );
+static int lptopic_sub_dropped( lua_State *L );
+static void lptopic_sub_destroy( lpobject *obj );
+
+/* topic functions of the luaproc library */
+const luaL_Reg lptopic_funcs[] = {
+  { "newtopic", lptopic_new },
+  { "deltopic", lptopic_delete },
+  { "subscribe", lptopic_subscribe },
+  { "publish", lptopic_publish },
+  { NULL, NULL }
+};
+
+/* subscriber methods */
+static const luaL_Reg lptopic_sub_funcs[] = {
+  { "receive", lptopic_sub_receive },
+  { "unsubscribe", lptopic_sub_unsubscribe },
+  { "dropped", lptopic_sub_dropped },
+  { NULL, NULL }
+};
+
+/* subscriber type */
+static const lpobject_type lptopic_sub_type = {
+  "luaproc.subscriber", lptopic_sub_funcs, lptopic_sub_destroy
+};
+
+/*******************
+ * topic functions *
+ *******************/
+
+/* remove a reference to a topic, free it when it was the last one */
+static void topic_release (topic *tp)
+{
+  if ( atomic_fetch_sub( &tp->refs, 1 ) == 1 ) {
+    mtx_destroy( &tp->mutex );
+    free( tp );
+  }
+}
+
+/* return a referenced topic (if not found, return null) */
+static topic *topic_get (const char *name)
+{
+  mtx_lock( &mutex_topic_list );
+  lua_getglobal( topicls, LUAPROC_TOPICS_TABLE );
+  lua_getfield( topicls, -1, name );
+  topic *tp = (topic *)lua_touserdata( topicls, -1 );
+  lua_pop( topicls, 2 );
+  if ( tp != NULL ) {
+    atomic_fetch_add( &tp->refs, 1 );
+  }
+  mtx_unlock( &mutex_topic_list );
+  return tp;
+}
+
+/* close a topic removed from the topics table and wake its subscribers */
+static void topic_close (topic *tp)
+{
+  mtx_lock( &tp->mutex );
+  tp->closed = TRUE;
+  for ( subscriber *sub = tp->subs; sub != NULL; sub = sub->next ) {
+    mtx_lock( &sub->wq.mutex );
+    sub->closed = TRUE;
+    waitq_wake( &sub->wq );
+    mtx_unlock( &sub->wq.mutex );
+  }
+  tp->subs = NULL;
+  mtx_unlock( &tp->mutex );
+  topic_release( tp );  /* reference of the topics table */
+}
+
+/* remove a subscriber from the list of its topic */
+static void topic_unlink (topic *tp, subscriber *sub)
+{
+  mtx_lock( &tp->mutex );
+  for ( subscriber **ptr = &tp->subs; *ptr != NULL; ptr = &(*ptr)->next ) {
+    if ( *ptr == sub ) {
+      *ptr = sub->next;
+      break;
+    }
+  }
+  mtx_unlock( &tp->mutex );
+}
+
+/************************
+ * subscriber functions *
+ ************************/
+
+/* destroy a subscriber when it is not referenced anymore */
+static void lptopic_sub_destroy (lpobject *obj)
+{
+  subscriber *sub = (subscriber *)obj;
+  topic_unlink( sub->tp, sub );
+  topic_release( sub->tp );
+  for ( int i = 0; i < sub->count; i++ ) {
+    lpmsg_release( sub->queue[( sub->head + i ) % sub->size] );
+  }
+  free( sub->queue );
+  waitq_destroy( &sub->wq );
+  free( sub );
+}
+
+/* continue receiving a message */
+static int lptopic_sub_receive_k (lua_State *L, int status, lua_KContext ctx)
+{
+  subscriber *sub = (subscriber *)lpobj_test( L, 1 );
+
+  mtx_lock( &sub->wq.mutex );
+  luaproc_unblock( L, &sub->wq );
+
+  if ( sub->count > 0 ) {  /* take the oldest message */
+    lpmsg *msg = sub->queue[sub->head];
+    sub->head = ( sub->head + 1 ) % sub->size;
+    sub->count--;
+    mtx_unlock( &sub->wq.mutex );
+    int n = lpmsg_decode( L, msg );
+    lpmsg_release( msg );
+    if ( n < 0 ) {
+      lua_pushnil( L );
+      lua_pushstring( L, "not enough space in the stack" );
+      return 2;
+    }
+    return n;
+  }
+
+  if ( sub->closed ) {
+    mtx_unlock( &sub->wq.mutex );
+    lua_pushnil( L );
+    lua_pushstring( L, "topic closed" );
+    return 2;
+  }
+
+  if ( lua_toboolean( L, 2 )) {  /* asynchronous receive */
+    mtx_unlock( &sub->wq.mutex );
+    lua_pushnil( L );
+    lua_pushstring( L, "no messages" );
+    return 2;
+  }
+
+  return luaproc_block( L, &sub->wq, 0, ctx, lptopic_sub_receive_k );
+}
+
+/* receive the oldest message of the subscriber queue */
+static int lptopic_sub_receive (lua_State *L)
+{
+  lpobj_check( L, 1, &lptopic_sub_type );
+  lua_settop( L, 2 );
+  return lptopic_sub_receive_k( L, LUA_OK, 0 );
+}
+
+/* stop receiving messages */
+static int lptopic_sub_unsubscribe (lua_State *L)
+{
+  subscriber *sub = (subscriber *)lpobj_check( L, 1, &lptopic_sub_type );
+  topic_unlink( sub->tp, sub );
+  mtx_lock( &sub->wq.mutex );
+  sub->closed = TRUE;
+  waitq_wake( &sub->wq );
+  mtx_unlock( &sub->wq.mutex );
+  return 0;
+}
+
+/* return the number of messages dropped because the queue was full */
+static int lptopic_sub_dropped (lua_State *L)
+{
+  subscriber *sub = (subscriber *)lpobj_check( L, 1, &lptopic_sub_type );
+  mtx_lock( &sub->wq.mutex );
+  lua_Integer dropped = sub->dropped;
+  mtx_unlock( &sub->wq.mutex );
+  lua_pushinteger( L, dropped );
+  return 1;
+}
+
+/*********************
+ * library functions *
+ *********************/
+
+/* create a new topic */
+static int lptopic_new (lua_State *L)
+{
+  const char *name = luaL_checkstring( L, 1 );
+
+  mtx_lock( &mutex_topic_list );
+  lua_getglobal( topicls, LUAPROC_TOPICS_TABLE );
+  lua_getfield( topicls, -1, name );
+  int exists = !lua_isnil( topicls, -1 );
+  lua_pop( topicls, 1 );
+
+  topic *tp = NULL;
+  if ( !exists && ( tp = (topic *)malloc( sizeof( topic ))) != NULL ) {
+    mtx_init( &tp->mutex, mtx_plain );
+    atomic_init( &tp->refs, 1 );  /* reference of the topics table */
+    tp->closed = FALSE;
+    tp->subs = NULL;
+    lua_pushlightuserdata( topicls, tp );
+    lua_setfield( topicls, -2, name );
+  }
+  lua_pop( topicls, 1 );
+  mtx_unlock( &mutex_topic_list );
+
+  if ( tp == NULL ) {
+    lua_pushnil( L );
+    if ( exists ) {
+      lua_pushfstring( L, "topic '%s' already exists", name );
+    } else {
+      lua_pushstring( L, "not enough memory" );
+    }
+    return 2;
+  }
+  lua_pushboolean( L, TRUE );
+  return 1;
+}
+
+/* destroy a topic; its subscribers keep the queued messages */
+static int lptopic_delete (lua_State *L)
+{
+  const char *name = luaL_checkstring( L, 1 );
+
+  mtx_lock( &mutex_topic_list );
+  lua_getglobal( topicls, LUAPROC_TOPICS_TABLE );
+  lua_getfield( topicls, -1, name );
+  topic *tp = (topic *)lua_touserdata( topicls, -1 );
+  lua_pop( topicls, 1 );
+  if ( tp != NULL ) {
+    lua_pushnil( topicls );
+    lua_setfield( topicls, -2, name );
+  }
+  lua_pop( topicls, 1 );
+  mtx_unlock( &mutex_topic_list );
+
+  if ( tp == NULL ) {
+    lua_pushnil( L );
+    lua_pushfstring( L, "topic '%s' does not exist", name );
+    return 2;
+  }
+  topic_close( tp );
+  lua_pushboolean( L, TRUE );
+  return 1;
+}
+
+/* subscribe to a topic; return a subscriber with its own message queue */
+static int lptopic_subscribe (lua_State *L)
+{
+  const char *name = luaL_checkstring( L, 1 );
+  lua_Integer size = luaL_optinteger( L, 2, LUAPROC_TOPIC_DEFAULT_QUEUE );
+  luaL_argcheck( L, size > 0 &&
+    size <= (lua_Integer)( INT_MAX / sizeof( lpmsg * )), 2,
+    "queue size must be positive" );
+
+  topic *tp = topic_get( name );
+  if ( tp == NULL ) {
+    lua_pushnil( L );
+    lua_pushfstring( L, "topic '%s' does not exist", name );
+    return 2;
+  }
+
+  subscriber *sub = (subscriber *)malloc( sizeof( subscriber ));
+  lpmsg **queue = (lpmsg **)malloc( (size_t)size * sizeof( lpmsg * ));
+  if ( sub == NULL || queue == NULL ) {
+    free( sub );
+    free( queue );
+    topic_release( tp );
+    lua_pushnil( L );
+    lua_pushstring( L, "not enough memory" );
+    return 2;
+  }
+  lpobj_init( &sub->obj, &lptopic_sub_type );
+  waitq_init( &sub->wq );
+  sub->tp = tp;  /* keeps the reference taken by topic_get */
+  sub->queue = queue;
+  sub->size = (int)size;
+  sub->head = 0;
+  sub->count = 0;
+  sub->dropped = 0;
+  sub->closed = FALSE;
+
+  mtx_lock( &tp->mutex );
+  sub->closed = tp->closed;
+  if ( !tp->closed ) {
+    sub->next = tp->subs;
+    tp->subs = sub;
+  }
+  mtx_unlock( &tp->mutex );
+
+  lpobj_push( L, &sub->obj );
+  lpobj_release( &sub->obj );  /* the userdata holds the only reference */
+  return 1;
+}
+
+/* encode a message once and queue it for every subscriber of a topic;
+   return the number of subscribers */
+static int lptopic_publish (lua_State *L)
+{
+  const char *name = luaL_checkstring( L, 1 );
+
+  topic *tp = topic_get( name );
+  if ( tp == NULL ) {
+    lua_pushnil( L );
+    lua_pushfstring( L, "topic '%s' does not exist", name );
+    return 2;
+  }
+
+  int bad;
+  lpmsg *msg = lpmsg_encode( L, 2, lua_gettop( L ), &bad );
+  if ( msg == NULL ) {
+    topic_release( tp );
+    lua_pushnil( L );
+    if ( bad != 0 ) {
+      lua_pushfstring( L, "failed to publish value of unsupported type '%s'",
+        luaL_typename( L, bad ));
+    } else {
+      lua_pushstring( L, "not enough memory" );
+    }
+    return 2;
+  }
+
+  lua_Integer n = 0;
+  mtx_lock( &tp->mutex );
+  for ( subscriber *sub = tp->subs; sub != NULL; sub = sub->next ) {
+    mtx_lock( &sub->wq.mutex );
+    if ( sub->count == sub->size ) {  /* full queue, drop the oldest */
+      lpmsg_release( sub->queue[sub->head] );
+      sub->head = ( sub->head + 1 ) % sub->size;
+      sub->count--;
+      sub->dropped++;
+    }
+    lpmsg_retain( msg );
+    sub->queue[( sub->head + sub->count ) % sub->size] = msg;
+    sub->count++;
+    waitq_wake( &sub->wq );
+    mtx_unlock( &sub->wq.mutex );
+    n++;
+  }
+  mtx_unlock( &tp->mutex );
+
+  lpmsg_release( msg );
+  topic_release( tp );
+  lua_pushinteger( L, n );
+  return 1;
+}
+
+/**********************
+ * exported functions *
+ **********************/
+
+/* initialize topics table */
+void lptopic_init (void)
+{
+  mtx_init( &mutex_topic_list, mtx_plain );
+  topicls = luaL_newstate();
+  lua_newtable( topicls );
+  lua_setglobal( topicls, LUAPROC_TOPICS_TABLE );
+}
+
+/* close remaining topics and destroy topics table */
+void lptopic_close (void)
+{
+  lua_getglobal( topicls, LUAPROC_TOPICS_TABLE );
+  lua_pushnil( topicls );
+  while ( lua_next( topicls, -2 ) != 0 ) {
+    topic_close( (topic *)lua_touserdata( topicls, -1 ));
+    /* pop value, leave key for next iteration */
+    lua_pop( topicls, 1 );
+  }
+  lua_close( topicls );
+  mtx_destroy( &mutex_topic_list );
+}
@@ -0,0 +1,28 @@
+/*
+** publish/subscribe topics
+** See Copyright Notice in luaproc.h
+*/
+
+#ifndef _LUA_LUAPROC_TOPIC_H_
+#define _LUA_LUAPROC_TOPIC_H_
+
+#include <lua.h>
+#include <lauxlib.h>
+
+/* default number of messages a subscriber queue holds */
+#define LUAPROC_TOPIC_DEFAULT_QUEUE 16
+
+/* topic functions of the luaproc library */
+extern const luaL_Reg lptopic_funcs[];
+
+/***********************
+ * function prototypes *
+ **********************/
+
+/* initialize topics table */
+void lptopic_init( void );
+
+/* close remaining topics and destroy topics table */
+void lptopic_close( void );
+
+#endif
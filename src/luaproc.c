@@ -4,20 +4,50 @@
 */
 
 #include <threads.h>
+#include <stdatomic.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
 
+#include "lpcompat.h"
 #include "luaproc.h"
 #include "lpsched.h"
 #include "lpaux.h"
+#include "lpobj.h"
+#include "lpmsg.h"
+#include "lptopic.h"
+#include "lpshared.h"
+#include "lpsync.h"
+#include "lpio.h"
+#include "lpmapfile.h"
+#include "lpshm.h"
+#include "lpnode.h"
 
 #define FALSE 0
 #define TRUE  !FALSE
 #define LUAPROC_CHANNELS_TABLE "channeltb"
+#define LUAPROC_CHANNELS_LIVE "channellive"
 #define LUAPROC_RECYCLE_MAX 0
+#define LUAPROC_RECYCLE_CACHE 8
+#define LUAPROC_RECYCLE_BATCH 4
 #define RATE_MARKER 0xdecada42
+#define HANDLE_RUNNING  0
+#define HANDLE_FINISHED 1
+#define HANDLE_FAILED   2
+#define GC_DEFAULT      0
+#define GC_INCREMENTAL  1
+#define GC_GENERATIONAL 2
+
+/* default parameters of the incremental collector */
+#define LUAPROC_GC_PAUSE 200
+#if (LUA_VERSION_NUM < 504)
+#define LUAPROC_GC_STEPMUL 200
+#else
+#define LUAPROC_GC_STEPMUL 100
+#endif
 
 
 #define requiref( L, modname, f, glob ) \
@@ -44,8 +74,26 @@ static mtx_t mutex_recycle_list;
 /* recycled lua process list */
 static list recycle_list;
 
-/* maximum lua processes to recycle */
-static int recyclemax = LUAPROC_RECYCLE_MAX;
+/* recycled lua processes waiting for a full collection by an idle worker,
+   protected by 'mutex_recycle_list' like 'recycle_list' */
+static list recycle_dirty;
+static atomic_int dirtycount = 0;
+
+/* maximum lua processes to recycle, set under 'mutex_recycle_list' */
+static atomic_int recyclemax = LUAPROC_RECYCLE_MAX;
+
+/* recycled lua processes in the lists and in the caches of the workers,
+   kept up to 'recyclemax' */
+static atomic_int recycled = 0;
+
+/* version of the worker caches; a worker whose cache is older moves it to
+   the recycle lists, e.g. after the limit was lowered */
+static atomic_int cachegen = 0;
+
+/* code run once in every new lua state and its version, set under
+   'mutex_recycle_list' */
+static lpmsg *initcode = NULL;
+static atomic_int initgen = 0;
 
 /* lua_State used to store channel hash table */
 static lua_State *chanls = NULL;
@@ -60,12 +108,25 @@ cnd_t cond_mainls_sendrecv;
 /* main state communication mutex */
 static mtx_t mutex_mainls;
 
+/* times the main state was woken from a channel, protected by
+   'mutex_mainls' */
+static unsigned int mainwakes = 0;
+
+/* next worker preferred by processes started near an unscheduled one */
+static atomic_uint nextaffinity = 0;
+
 /***********************
  * register prototypes *
  ***********************/
 
 static void luaproc_openlualibs( lua_State *L );
+static void luaproc_openlite( lua_State *L );
+static void luaproc_reset_globals( lua_State *L );
+static void luaproc_reset_gc( luaproc *lp );
+static luaproc *luaproc_getself( lua_State *L );
 static int luaproc_create_newproc( lua_State *L );
+static int luaproc_spawn( lua_State *L );
+static int luaproc_blocking( lua_State *L );
 static int luaproc_wait( lua_State *L );
 static int luaproc_send( lua_State *L );
 static int luaproc_receive( lua_State *L );
@@ -73,27 +134,67 @@ static int luaproc_create_channel( lua_State *L );
 static int luaproc_destroy_channel( lua_State *L );
 static int luaproc_set_numworkers( lua_State *L );
 static int luaproc_get_numworkers( lua_State *L );
+static int luaproc_new_pool( lua_State *L );
+static int luaproc_deterministic( lua_State *L );
+static int luaproc_footprint( lua_State *L );
+static int luaproc_set_spin( lua_State *L );
+static int luaproc_get_spin( lua_State *L );
 static int luaproc_recycle_set( lua_State *L );
+static int luaproc_set_init( lua_State *L );
 static int luaproc_sleep( lua_State* L );
 static int luaproc_period( lua_State* L );
 static int luaproc_broadcast (lua_State* L);
 static int luaproc_isopen (lua_State* L);
+static int luaproc_ticker( lua_State *L );
+static int luaproc_after( lua_State *L );
+static int luaproc_map( lua_State *L );
+static int luaproc_reduce( lua_State *L );
+static int luaproc_handle_join( lua_State *L );
+static int luaproc_handle_status( lua_State *L );
+static void luaproc_handle_destroy( lpobject *obj );
+static int luaproc_create_group( lua_State *L );
+static int luaproc_group_wait( lua_State *L );
+static int luaproc_group_cancel( lua_State *L );
+static int luaproc_group_count( lua_State *L );
+static void luaproc_group_destroy( lpobject *obj );
 LUALIB_API int luaopen_luaproc( lua_State *L );
 static int luaproc_loadlib( lua_State *L );
+static int luaproc_opencoroutine( lua_State *L );
 
 /***********
  * structs *
  ***********/
 
+typedef struct stlphandle lphandle;
+typedef struct stlpgroup lpgroup;
+
 /* lua process */
 struct stluaproc
 {
   lua_State *lstate;
+  lua_State *blocked;  /* thread blocked on a channel: the state itself or
+                          one of its coroutines */
   int status;
   int args;
   timespec wake_up;
   channel *chan;
   luaproc *next;
+  waitq *wq;          /* wait queue the process is blocked on */
+  luaproc *waitnext;  /* next process in the wait queue */
+  int timed;          /* wait has a deadline */
+  lphandle *handle;   /* handle receiving the results */
+  lpgroup *group;     /* group the process belongs to */
+  luaproc *grpprev;   /* members of the group, protected by its queue */
+  luaproc *grpnext;
+  int parked;         /* queued on a wait queue or the sleep list by the
+                         scheduler, protected by 'mutex_sched' */
+  atomic_int affinity;  /* preferred worker or -1 */
+  atomic_int worker;    /* worker that resumed the process last or -1 */
+  int initgen;          /* version of the init code run in the state */
+  int gcset;            /* collector changed by the process options */
+  lprtworker *rt;       /* thread of a real-time process or NULL */
+  lppool *pool;         /* pool running the process, NULL for the default */
+  int lite;             /* state of the lite profile, closed when done */
 };
 
 /* communication channel */
@@ -103,19 +204,120 @@ struct stchannel
   list recv;
   mtx_t mutex;
   cnd_t can_be_used;
+  lptimer *timer;     /* timer ticking into the channel or NULL */
+  int ticked;         /* a tick waits for a receiver */
+  timespec ticktime;  /* time the waiting tick was due */
+  int missed;         /* ticks dropped since the last received one */
+};
+
+/* timer ticking into a channel; it is armed in the scheduler and referenced
+   by its channel, both under the channel lock */
+struct stlptimer
+{
+  timespec due;     /* time of the next tick */
+  timespec period;  /* zero for a single tick */
+  lptimer *next;
+  char name[];      /* channel name */
 };
 
 typedef struct 
 {
   int marker;
-  timespec time;
+  timespec time;         /* last deadline (monotonic clock) */
   timespec period;
-
+  lua_Integer periods;   /* completed sleeps */
+  lua_Integer overruns;  /* deadlines passed before the sleep */
+  double jitter;         /* lateness of the last wakeup */
+  double maxjitter;
+  double sumjitter;
 } lprate;
 
+/* value returned by a finished process, kept by its handle */
+typedef struct stlpvalue lpvalue;
+struct stlpvalue
+{
+  int type;    /* lua type, unsupported types are kept by type only */
+  int isint;   /* number is an integer */
+  union {
+    int b;
+    lua_Integer i;
+    lua_Number n;
+    lpobject *obj;  /* shared object, NULL for other userdata */
+    struct { char *data; size_t len; } s;
+    struct { lpvalue *items; lua_Integer count; } t;  /* array part */
+  } u;
+};
+
+/* process handle */
+struct stlphandle
+{
+  lpobject obj;
+  waitq wq;
+  int status;        /* HANDLE_RUNNING, HANDLE_FINISHED or HANDLE_FAILED */
+  int arrays;        /* keep returned tables as arrays (map chunks) */
+  luaproc *proc;     /* running process, for affinity hints */
+  lpvalue *results;  /* results of the finished process */
+  int nresults;
+  char *error;       /* error message of a failed process */
+};
+
+/* process group */
+struct stlpgroup
+{
+  lpobject obj;
+  waitq wq;
+  int count;              /* unfinished processes */
+  luaproc *members;       /* unfinished processes, protected by 'wq' */
+  atomic_int cancelled;
+};
+
+/* options of a new lua process */
+typedef struct
+{
+  lpgroup *group;
+  int affinity;    /* preferred worker or -1 */
+  int gcmode;      /* GC_DEFAULT, GC_INCREMENTAL or GC_GENERATIONAL */
+  int gcpause;     /* collector parameters or -1 */
+  int gcstepmul;
+  int realtime;    /* run on a real-time thread */
+  int priority;    /* SCHED_FIFO priority or 0 */
+  double spin;     /* seconds spinning before the end of a sleep */
+  lppool *pool;    /* pool of workers or NULL for the default one */
+  int lite;        /* create a state of the lite profile */
+} lpoptions;
+
+/* finished lua processes kept by a worker thread for the processes it
+   creates next, used without locking; 'dirty' ones still hold the garbage
+   of the finished process */
+typedef struct
+{
+  int enabled;  /* only worker threads keep a cache */
+  int gen;      /* 'cachegen' when the cache was last checked */
+  list clean;
+  list dirty;
+} lpcache;
+
+static _Thread_local lpcache workercache;
+
+/* continuation of a wait of the main state, run again after each wakeup
+   that does not let it finish (see luaproc_block) */
+typedef struct stmainwait mainwait;
+struct stmainwait
+{
+  lua_State *L;
+  waitq *q;
+  lua_KFunction k;
+  lua_KContext ctx;
+  int again;       /* the continuation blocked on the queue again */
+  mainwait *prev;  /* wait of an outer continuation */
+};
+
+static _Thread_local mainwait *mainwaiting = NULL;
+
 /* luaproc function registration array */
 static const struct luaL_Reg luaproc_funcs[] = {
   { "newproc", luaproc_create_newproc },
+  { "spawn", luaproc_spawn },
   { "wait", luaproc_wait },
   { "send", luaproc_send },
   { "receive", luaproc_receive },
@@ -123,14 +325,51 @@ static const struct luaL_Reg luaproc_funcs[] = {
   { "delchannel", luaproc_destroy_channel },
   { "setnumworkers", luaproc_set_numworkers },
   { "getnumworkers", luaproc_get_numworkers },
+  { "newpool", luaproc_new_pool },
+  { "deterministic", luaproc_deterministic },
+  { "footprint", luaproc_footprint },
+  { "setspin", luaproc_set_spin },
+  { "getspin", luaproc_get_spin },
   { "recycle", luaproc_recycle_set },
+  { "setinit", luaproc_set_init },
   { "sleep", luaproc_sleep },
   { "period", luaproc_period },
   { "broadcast", luaproc_broadcast },
   { "isopen", luaproc_isopen },
+  { "ticker", luaproc_ticker },
+  { "after", luaproc_after },
+  { "map", luaproc_map },
+  { "reduce", luaproc_reduce },
+  { "blocking", luaproc_blocking },
+  { "group", luaproc_create_group },
+  { NULL, NULL }
+};
+
+/* process handle methods */
+static const struct luaL_Reg luaproc_handle_funcs[] = {
+  { "join", luaproc_handle_join },
+  { "status", luaproc_handle_status },
+  { NULL, NULL }
+};
+
+/* process handle type */
+static const lpobject_type luaproc_handle_type = {
+  "luaproc.process", luaproc_handle_funcs, luaproc_handle_destroy
+};
+
+/* process group methods */
+static const struct luaL_Reg luaproc_group_funcs[] = {
+  { "wait", luaproc_group_wait },
+  { "cancel", luaproc_group_cancel },
+  { "count", luaproc_group_count },
   { NULL, NULL }
 };
 
+/* process group type */
+static const lpobject_type luaproc_group_type = {
+  "luaproc.group", luaproc_group_funcs, luaproc_group_destroy
+};
+
 /******************
  * list functions *
  ******************/
@@ -161,6 +400,30 @@ luaproc *list_remove (list *l)
   }
 }
 
+/* remove and return the lua process at position n (from 0) in a list */
+luaproc *list_nth (list *l, int n)
+{
+  luaproc *prev = NULL;
+  luaproc *lp = l->head;
+  for ( ; n > 0 && lp != NULL; n-- ) {
+    prev = lp;
+    lp = lp->next;
+  }
+  if ( lp == NULL ) {
+    return NULL;
+  }
+  if ( prev == NULL ) {
+    l->head = lp->next;
+  } else {
+    prev->next = lp->next;
+  }
+  if ( l->tail == lp ) {
+    l->tail = prev;
+  }
+  l->nodes--;
+  return lp;
+}
+
 /* return a list's node count */
 int list_count (list *l)
 {
@@ -221,10 +484,206 @@ luaproc* list_time_ready (list* l, timespec* current)
   return NULL;
 }
 
+/* remove a given lua process from a list, return false if not found */
+int list_remove_node (list *l, luaproc *lp)
+{
+  luaproc *prev = NULL;
+  for ( luaproc *ptr = l->head; ptr != NULL; prev = ptr, ptr = ptr->next ) {
+    if ( ptr == lp ) {
+      if ( prev == NULL ) {
+        l->head = lp->next;
+      } else {
+        prev->next = lp->next;
+      }
+      if ( l->tail == lp ) {
+        l->tail = prev;
+      }
+      l->nodes--;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/************************
+ * timer list functions *
+ ************************/
+
+/* initialize an empty timer list */
+void timerlist_init (timerlist *l)
+{
+  l->head = NULL;
+  l->nodes = 0;
+}
+
+/* insert a timer sorted by the time of its next tick */
+void timerlist_insert (timerlist *l, lptimer *t)
+{
+  lptimer **ptr = &l->head;
+  while ( *ptr != NULL && lpaux_time_cmp( &(*ptr)->due, &t->due ) <= 0 ) {
+    ptr = &(*ptr)->next;
+  }
+  t->next = *ptr;
+  *ptr = t;
+  l->nodes++;
+}
+
+/* remove and return the first timer of a list */
+lptimer *timerlist_remove (timerlist *l)
+{
+  lptimer *t = l->head;
+  if ( t != NULL ) {
+    l->head = t->next;
+    l->nodes--;
+  }
+  return t;
+}
+
+/* get the time of the next tick or NULL */
+timespec *timerlist_next (timerlist *l)
+{
+  return ( l->head == NULL ) ? NULL : &l->head->due;
+}
+
+/* remove and return a timer whose tick is due, or NULL */
+lptimer *timerlist_ready (timerlist *l, timespec *current)
+{
+  if ( l->head != NULL && lpaux_time_cmp( &l->head->due, current ) < 1 ) {
+    return timerlist_remove( l );
+  }
+  return NULL;
+}
+
+/* remove a given timer from a list, return false if not found */
+int timerlist_remove_node (timerlist *l, lptimer *t)
+{
+  for ( lptimer **ptr = &l->head; *ptr != NULL; ptr = &(*ptr)->next ) {
+    if ( *ptr == t ) {
+      *ptr = t->next;
+      l->nodes--;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/************************
+ * wait queue functions *
+ ************************/
+
+/* initialize a wait queue */
+void waitq_init (waitq *q)
+{
+  mtx_init( &q->mutex, mtx_plain );
+  cnd_init( &q->cond );
+  q->wakes = 0;
+  q->head = NULL;
+  q->tail = NULL;
+}
+
+/* destroy a wait queue */
+void waitq_destroy (waitq *q)
+{
+  mtx_destroy( &q->mutex );
+  cnd_destroy( &q->cond );
+}
+
+/* append a lua process to a wait queue */
+static void waitq_insert (waitq *q, luaproc *lp)
+{
+  if ( q->head == NULL ) {
+    q->head = lp;
+  } else {
+    q->tail->waitnext = lp;
+  }
+  q->tail = lp;
+  lp->waitnext = NULL;
+}
+
+/* remove a lua process from a wait queue, if it is there */
+static void waitq_remove (waitq *q, luaproc *lp)
+{
+  luaproc *prev = NULL;
+  for ( luaproc *ptr = q->head; ptr != NULL;
+        prev = ptr, ptr = ptr->waitnext ) {
+    if ( ptr == lp ) {
+      if ( prev == NULL ) {
+        q->head = lp->waitnext;
+      } else {
+        prev->waitnext = lp->waitnext;
+      }
+      if ( q->tail == lp ) {
+        q->tail = prev;
+      }
+      return;
+    }
+  }
+}
+
+/* wake every lua process waiting on a queue, the queue must be locked */
+void waitq_wake (waitq *q)
+{
+  luaproc *lp = q->head;
+  q->head = q->tail = NULL;
+  while ( lp != NULL ) {
+    luaproc *next = lp->waitnext;
+    sched_wakeup( lp );
+    lp = next;
+  }
+  q->wakes++;
+  cnd_broadcast( &q->cond );
+}
+
+/* wake one lua process waiting on a queue, the queue must be locked */
+void waitq_wake_one (waitq *q)
+{
+  luaproc *lp = q->head;
+  if ( lp != NULL ) {
+    q->head = lp->waitnext;
+    if ( q->head == NULL ) {
+      q->tail = NULL;
+    }
+    sched_wakeup( lp );
+  }
+  /* the main state checks the object again, so waking it costs little */
+  q->wakes++;
+  cnd_broadcast( &q->cond );
+}
+
 /*********************
  * channel functions *
  *********************/
 
+/* record whether a channel is in the channels table, so that it can be
+   found by its address; mutex_channel_list must be locked */
+static void channel_unlocked_setlive (channel *chan, int live)
+{
+  lua_getglobal( chanls, LUAPROC_CHANNELS_LIVE );
+  lua_pushlightuserdata( chanls, chan );
+  if ( live ) {
+    lua_pushboolean( chanls, TRUE );
+  } else {
+    lua_pushnil( chanls );
+  }
+  lua_rawset( chanls, -3 );
+  lua_pop( chanls, 1 );
+}
+
+/* return true if a channel is in the channels table; mutex_channel_list
+   must be locked */
+static int channel_unlocked_live (channel *chan)
+{
+  if ( chan == NULL ) {
+    return FALSE;
+  }
+  lua_getglobal( chanls, LUAPROC_CHANNELS_LIVE );
+  lua_pushlightuserdata( chanls, chan );
+  lua_rawget( chanls, -2 );
+  int live = lua_toboolean( chanls, -1 );
+  lua_pop( chanls, 2 );
+  return live;
+}
+
 /* create a new channel and insert it into channels table */
 static channel *channel_create (const char *cname)
 {
@@ -236,12 +695,16 @@ static channel *channel_create (const char *cname)
   channel* chan = (channel *)lua_newuserdata( chanls, sizeof( channel ));
   lua_setfield( chanls, -2, cname );
   lua_pop( chanls, 1 );  /* remove channel table from stack */
+  channel_unlocked_setlive( chan, TRUE );
 
   /* initialize channel struct */
   list_init( &chan->send );
   list_init( &chan->recv );
   mtx_init( &chan->mutex, mtx_plain );
   cnd_init( &chan->can_be_used );
+  chan->timer = NULL;
+  chan->ticked = FALSE;
+  chan->missed = 0;
 
   /* release exclusive access to channels list */
   mtx_unlock( &mutex_channel_list );
@@ -292,6 +755,82 @@ static channel *channel_locked_get (const char *chname)
   return chan;
 }
 
+/* lock a channel known by its address, like channel_locked_get; return
+   null if it was destroyed */
+static channel *channel_locked_live (channel *chan)
+{
+  mtx_lock( &mutex_channel_list );
+  int live;
+  while (( live = channel_unlocked_live( chan ))
+    && mtx_trylock( &chan->mutex ) != 0 )
+  {
+    cnd_wait( &chan->can_be_used, &mutex_channel_list );
+  }
+  mtx_unlock( &mutex_channel_list );
+  return live ? chan : NULL;
+}
+
+/* push the message of a tick that was due at 'due': its time, how late it
+   is received (both in seconds, see lpaux_time_now) and the number of ticks
+   dropped before it */
+static int channel_push_tick (lua_State *L, channel *chan, timespec *due)
+{
+  double t = due->tv_sec + due->tv_nsec * 1E-9;
+  lua_pushnumber( L, t );
+  lua_pushnumber( L, lpaux_time_now() - t );
+  lua_pushinteger( L, chan->missed );
+  return 3;
+}
+
+/* wake the main state blocked on a channel */
+static void luaproc_main_wake (void)
+{
+  mtx_lock( &mutex_mainls );
+  mainwakes++;
+  cnd_signal( &cond_mainls_sendrecv );
+  mtx_unlock( &mutex_mainls );
+}
+
+/* queue the main state on a locked channel and block it until a process
+   matches its operation; in deterministic mode it runs the processes
+   meanwhile, raising an error if none of them can wake it */
+static int luaproc_main_block (lua_State *L, channel *chan, int send)
+{
+  mtx_lock( &mutex_mainls );
+  unsigned int seen = mainwakes;
+  mtx_unlock( &mutex_mainls );
+  mainlp.chan = chan;
+  mainlp.blocked = L;
+  if ( send ) {
+    luaproc_queue_sender( &mainlp );
+  } else {
+    luaproc_queue_receiver( &mainlp );
+  }
+  luaproc_unlock_channel( chan );
+
+  int det = sched_is_deterministic();
+  mtx_lock( &mutex_mainls );
+  while ( mainwakes == seen ) {
+    if ( !det ) {
+      cnd_wait( &cond_mainls_sendrecv, &mutex_mainls );
+      continue;
+    }
+    mtx_unlock( &mutex_mainls );
+    int stepped = sched_det_step( NULL );
+    mtx_lock( &mutex_mainls );
+    if ( !stepped && mainwakes == seen ) {
+      mtx_unlock( &mutex_mainls );
+      mtx_lock( &chan->mutex );
+      list_remove_node( &chan->send, &mainlp );
+      list_remove_node( &chan->recv, &mainlp );
+      luaproc_unlock_channel( chan );
+      return luaL_error( L, "deadlock: no process can wake the main state" );
+    }
+  }
+  mtx_unlock( &mutex_mainls );
+  return mainlp.args;
+}
+
 /********************************
  * exported auxiliary functions *
  ********************************/
@@ -309,133 +848,933 @@ void luaproc_unlock_channel (channel *chan)
   mtx_unlock( &mutex_channel_list );
 }
 
-/* insert lua process in recycle list */
-void luaproc_recycle_insert (luaproc *lp)
+/* deliver the tick of a timer to its channel and arm it again or free it */
+void luaproc_timer_fire (lptimer *t)
 {
-  /* get exclusive access to recycled lua processes list */
-  mtx_lock( &mutex_recycle_list );
+  channel *chan = channel_locked_get( t->name );
+  if ( chan == NULL || chan->timer != t ) {
+    /* the channel was destroyed while the tick was being delivered */
+    if ( chan != NULL ) {
+      luaproc_unlock_channel( chan );
+    }
+    luaproc_timer_free( t );
+    return;
+  }
 
-  /* is recycle list full? */
-  if ( list_count( &recycle_list ) >= recyclemax ) {
-    /* destroy state */
-    lua_close( luaproc_get_state( lp ));
+  if ( list_count( &chan->recv ) > 0 ) {
+    /* every waiting receiver gets the tick */
+    luaproc *dst;
+    while (( dst = list_remove( &chan->recv )) != NULL ) {
+      dst->args = channel_push_tick( dst->blocked, chan, &t->due );
+      if ( dst == &mainlp ) {
+        luaproc_main_wake();
+      } else {
+        sched_queue_proc( dst );
+      }
+    }
+    chan->missed = 0;
   } else {
-    /* insert lua process in recycle list */
-    list_insert( &recycle_list, lp );
+    /* the channel keeps the latest tick for the next receiver */
+    if ( chan->ticked && chan->missed < INT_MAX ) {
+      chan->missed++;
+    }
+    chan->ticked = TRUE;
+    chan->ticktime = t->due;
   }
 
-  /* release exclusive access to recycled lua processes list */
-  mtx_unlock( &mutex_recycle_list );
+  if ( t->period.tv_sec == 0 && t->period.tv_nsec == 0 ) {
+    chan->timer = NULL;
+    luaproc_timer_free( t );
+  } else {
+    /* ticks stay on the grid of the first one; those already past, because
+       the timer thread was late, are counted as missed (saturating) */
+    lpaux_time_inc( &t->due, &t->period );
+    timespec now;
+    lpaux_time_utc( &now );
+    if ( lpaux_time_cmp( &t->due, &now ) < 1 ) {
+      double period = t->period.tv_sec + t->period.tv_nsec * 1E-9;
+      double late = ( now.tv_sec - t->due.tv_sec ) +
+                    ( now.tv_nsec - t->due.tv_nsec ) * 1E-9;
+      double n = late / period;
+      int skip = ( n < INT_MAX - 1 ) ? (int)n + 1 : INT_MAX;
+      timespec d = lpaux_time_period( skip * period );
+      lpaux_time_inc( &t->due, &d );
+      chan->missed = ( skip >= INT_MAX - chan->missed ) ? INT_MAX :
+        chan->missed + skip;
+    }
+    sched_timer_add( t );
+  }
+  luaproc_unlock_channel( chan );
 }
 
-/* queue a lua process that tried to send a message */
-void luaproc_queue_sender (luaproc *lp)
+/* free a timer */
+void luaproc_timer_free (lptimer *t)
 {
-  list_insert( &lp->chan->send, lp );
+  free( t );
 }
 
-/* queue a lua process that tried to receive a message */
-void luaproc_queue_receiver (luaproc *lp)
+/* count a lua process as recycled, unless 'recyclemax' are already */
+static int luaproc_recycled_add (void)
 {
-  list_insert( &lp->chan->recv, lp );
+  int n = atomic_load( &recycled );
+  do {
+    if ( n >= atomic_load( &recyclemax )) {
+      return FALSE;
+    }
+  } while ( !atomic_compare_exchange_weak( &recycled, &n, n + 1 ));
+  return TRUE;
 }
 
-/********************************
- * internal auxiliary functions *
- ********************************/
-static void luaproc_loadbuffer (
-  lua_State *parent, luaproc *lp, const char *code, size_t len)
+/* close a recycled lua process */
+static void luaproc_recycled_close (luaproc *lp)
 {
-  /* load lua process' lua code */
-  int ret = luaL_loadbuffer( lp->lstate, code, len, code );
+  atomic_fetch_sub( &recycled, 1 );
+  lua_close( lp->lstate );
+}
 
-  /* in case of errors, close lua_State and push error to parent */
-  if ( ret != 0 ) {
-    lua_pushstring( parent, lua_tostring( lp->lstate, -1 ));
-    lua_close( lp->lstate );
-    luaL_error( parent, lua_tostring( parent, -1 ));
-  }
+/* return the number of lua processes in the cache of the current worker */
+static int luaproc_cache_count (void)
+{
+  return list_count( &workercache.clean ) + list_count( &workercache.dirty );
 }
 
-/* get elements betwee Lua states */
-static int copy_data (lua_State* Lfrom, lua_State* Lto, int ind)
+/* move up to 'n' lua processes from the cache of the current worker to the
+   recycle lists at once, uncollected ones first so that idle workers can
+   collect them; those over the limit or with an old init code are closed */
+static void luaproc_cache_spill (int n)
 {
-  const char* str = NULL;
-  size_t len = 0;
+  list stale;
+  list_init( &stale );
+  int dirty = 0;
 
-  switch ( lua_type( Lfrom, ind )) {
-    case LUA_TBOOLEAN:
-      lua_pushboolean( Lto, lua_toboolean( Lfrom, ind ));
-      break;
-    case LUA_TNUMBER:
-      copynumber( Lto, Lfrom, ind );
-      break;
-    case LUA_TSTRING: {
-      str = lua_tolstring( Lfrom, ind, &len );
-      lua_pushlstring( Lto, str, len );
-      break;
+  /* get exclusive access to recycled lua processes list */
+  mtx_lock( &mutex_recycle_list );
+  for ( int i = 0; i < n; i++ ) {
+    list *to = &recycle_dirty;
+    luaproc *lp = list_remove( &workercache.dirty );
+    if ( lp == NULL ) {
+      to = &recycle_list;
+      lp = list_remove( &workercache.clean );
     }
-    case LUA_TNIL:
-      lua_pushnil( Lto );
+    if ( lp == NULL ) {
       break;
-    default: /* value type not supported: table, function, userdata, etc. */
-      return FALSE;
+    }
+    if ( atomic_load( &recycled ) > recyclemax || lp->initgen != initgen ) {
+      atomic_fetch_sub( &recycled, 1 );
+      list_insert( &stale, lp );
+    } else {
+      list_insert( to, lp );
+      dirty += ( to == &recycle_dirty );
+    }
+  }
+  atomic_fetch_add( &dirtycount, dirty );
+  /* release exclusive access to recycled lua processes list */
+  mtx_unlock( &mutex_recycle_list );
+
+  luaproc *lp;
+  while (( lp = list_remove( &stale )) != NULL ) {
+    lua_close( lp->lstate );
+  }
+  if ( dirty > 0 ) {
+    sched_signal_idle();
   }
-  return TRUE;
 }
 
-/* copies values between lua states' stacks */
-static int luaproc_copyvalues (lua_State *Lfrom, lua_State *Lto)
+/* keep a finished lua process in the cache of the current worker, making
+   room by moving a batch to the recycle lists; return FALSE if the current
+   thread is not a worker or the process can not be kept */
+static int luaproc_cache_insert (luaproc *lp)
 {
-  int n = lua_gettop( Lfrom );
-
-  /* ensure there is space in the receiver's stack */
-  if ( lua_checkstack( Lto, n ) == 0 ) {
-    lua_pushnil( Lto );
-    lua_pushstring( Lto, "not enough space in the stack" );
-    lua_pushnil( Lfrom );
-    lua_pushstring( Lfrom, "not enough space in the receiver's stack" );
+  if ( !workercache.enabled || lp->initgen != atomic_load( &initgen )) {
     return FALSE;
   }
-
-  /* test each value's type and, if it's supported, copy value */
-  for ( int i = 2; i <= n; i++ ) {
-    if ( !copy_data( Lfrom, Lto, i )) {
-      lua_settop( Lto, 1 );
-      lua_pushnil( Lto );
-      lua_pushfstring( Lto, "failed to receive value of unsupported type '%s'",
-        luaL_typename( Lfrom, i ));
-      lua_pushnil( Lfrom );
-      lua_pushfstring( Lfrom, "failed to send value of unsupported type '%s'",
-        luaL_typename( Lfrom, i ));
-      return FALSE;
-    }
+  if ( luaproc_cache_count() >= LUAPROC_RECYCLE_CACHE ) {
+    luaproc_cache_spill( LUAPROC_RECYCLE_BATCH );
+  }
+  if ( !luaproc_recycled_add() ) {
+    return FALSE;
   }
+  list_insert( &workercache.dirty, lp );
   return TRUE;
 }
 
-/* return the lua process associated with a given lua state */
-static luaproc *luaproc_getself (lua_State *L)
+/* take up to 'n' lua processes from the cache of the current worker,
+   collected ones first; return the number taken */
+static int luaproc_cache_take (luaproc **lps, int n)
 {
-  lua_getfield( L, LUA_REGISTRYINDEX, "LUAPROC_LP_UDATA" );
+  int i = 0;
+  while ( i < n ) {
+    luaproc *lp = list_remove( &workercache.clean );
+    if ( lp == NULL && ( lp = list_remove( &workercache.dirty )) == NULL ) {
+      break;
+    }
+    if ( lp->initgen != atomic_load( &initgen )) {
+      luaproc_recycled_close( lp );  /* ran the previous init code */
+    } else {
+      atomic_fetch_sub( &recycled, 1 );
+      lps[i++] = lp;
+    }
+  }
+  return i;
+}
+
+/* keep finished lua processes of the current thread, a worker, in a cache
+   of its own */
+void luaproc_cache_enable (void)
+{
+  list_init( &workercache.clean );
+  list_init( &workercache.dirty );
+  workercache.gen = atomic_load( &cachegen );
+  workercache.enabled = TRUE;
+}
+
+/* move the cache of the current thread to the recycle lists */
+void luaproc_cache_flush (void)
+{
+  if ( workercache.enabled ) {
+    workercache.enabled = FALSE;
+    luaproc_cache_spill( luaproc_cache_count() );
+  }
+}
+
+/* return true if the cache of the current worker must be moved to the
+   recycle lists */
+int luaproc_cache_stale (void)
+{
+  return workercache.enabled &&
+    workercache.gen != atomic_load( &cachegen );
+}
+
+/* ask every worker to move its cache to the recycle lists */
+static void luaproc_cache_flush_all (void)
+{
+  atomic_fetch_add( &cachegen, 1 );
+  sched_signal_all();
+}
+
+/* insert lua process in recycle list */
+void luaproc_recycle_insert (luaproc *lp)
+{
+  /* lite states are cheaper to create than to keep */
+  if ( lp->lite ) {
+    lua_close( luaproc_get_state( lp ));
+    return;
+  }
+
+  /* drop leftover results and globals of the finished process */
+  luaproc_reset_globals( lp->lstate );
+  luaproc_reset_gc( lp );
+
+  /* the next process created on this worker reuses the state while its
+     memory is still in the processor cache */
+  if ( luaproc_cache_insert( lp )) {
+    return;
+  }
+
+  /* get exclusive access to recycled lua processes list */
+  mtx_lock( &mutex_recycle_list );
+
+  /* is recycle list full or did the state run an old init code? */
+  int collect = FALSE;
+  if ( lp->initgen != initgen || !luaproc_recycled_add() ) {
+    /* destroy state */
+    lua_close( luaproc_get_state( lp ));
+  } else {
+    /* insert lua process in recycle list, an idle worker collects the
+       garbage of the finished process */
+    list_insert( &recycle_dirty, lp );
+    atomic_fetch_add( &dirtycount, 1 );
+    collect = TRUE;
+  }
+
+  /* release exclusive access to recycled lua processes list */
+  mtx_unlock( &mutex_recycle_list );
+
+  if ( collect ) {
+    sched_signal_idle();
+  }
+}
+
+/* return the number of recycled lua processes waiting for a collection,
+   including those in the cache of the current worker */
+int luaproc_get_dirty (void)
+{
+  return atomic_load( &dirtycount ) + list_count( &workercache.dirty );
+}
+
+/* run a full collection on a recycled lua process, out of the way of
+   running processes; a worker asked to give up its cache does it first */
+void luaproc_collect_recycled (void)
+{
+  if ( luaproc_cache_stale() ) {
+    workercache.gen = atomic_load( &cachegen );
+    luaproc_cache_spill( luaproc_cache_count() );
+    return;
+  }
+
+  /* the cache of the current worker first, without locking */
+  luaproc *cached = list_remove( &workercache.dirty );
+  if ( cached != NULL ) {
+    lua_gc( cached->lstate, LUA_GCCOLLECT, 0 );
+    list_insert( &workercache.clean, cached );
+    return;
+  }
+
+  mtx_lock( &mutex_recycle_list );
+  luaproc *lp = list_remove( &recycle_dirty );
+  if ( lp != NULL ) {
+    atomic_fetch_sub( &dirtycount, 1 );
+  }
+  mtx_unlock( &mutex_recycle_list );
+  if ( lp == NULL ) {
+    return;
+  }
+
+  lua_gc( lp->lstate, LUA_GCCOLLECT, 0 );
+
+  mtx_lock( &mutex_recycle_list );
+  if ( atomic_load( &recycled ) > recyclemax || lp->initgen != initgen ) {
+    luaproc_recycled_close( lp );
+  } else {
+    list_insert( &recycle_list, lp );
+  }
+  mtx_unlock( &mutex_recycle_list );
+}
+
+/* queue a lua process that waits on a shared object and unlock the queue */
+void luaproc_queue_waiter (luaproc *lp)
+{
+  waitq_insert( lp->wq, lp );
+  mtx_unlock( &lp->wq->mutex );
+}
+
+/* return true if a waiting lua process has a deadline */
+int luaproc_is_timed (luaproc *lp)
+{
+  return lp->timed;
+}
+
+/* wait for a wakeup of a locked wait queue in the main state and unlock
+   the queue */
+static void luaproc_main_wait (lua_State *L, waitq *q, int deadline)
+{
+  /* in deterministic mode the main state runs the processes until the
+     object is woken or the deadline is reached on the virtual clock */
+  if ( sched_is_deterministic() ) {
+    unsigned int seen = q->wakes;
+    timespec t;
+    if ( deadline != 0 ) {
+      t = lpaux_time_period( lua_tonumber( L, deadline ));
+    }
+    int woken = FALSE;
+    while ( !woken ) {
+      mtx_unlock( &q->mutex );
+      int stepped = sched_det_step(( deadline != 0 ) ? &t : NULL );
+      mtx_lock( &q->mutex );
+      woken = ( q->wakes != seen );
+      if ( !stepped && !woken ) {
+        if ( deadline != 0 ) {
+          break;
+        }
+        mtx_unlock( &q->mutex );
+        luaL_error( L, "deadlock: no process can wake the main state" );
+      }
+    }
+    mtx_unlock( &q->mutex );
+    return;
+  }
+  /* the main state waits on its own thread */
+  if ( deadline != 0 ) {
+    timespec t = lpaux_time_period( lua_tonumber( L, deadline ));
+    cnd_timedwait( &q->cond, &q->mutex, &t );
+  } else {
+    cnd_wait( &q->cond, &q->mutex );
+  }
+  mtx_unlock( &q->mutex );
+}
+
+/* run the continuation of the innermost wait of the main state */
+static int luaproc_main_resume (lua_State *L)
+{
+  mainwait *w = mainwaiting;
+  return w->k( L, LUA_YIELD, w->ctx );
+}
+
+/* block the main state on a locked wait queue; the continuation runs in a
+   loop, with the whole stack, until it does not block on the queue again */
+static int luaproc_main_block_on (lua_State *L, waitq *q, int deadline,
+                               lua_KContext ctx, lua_KFunction k)
+{
+  luaproc_main_wait( L, q, deadline );
+
+  /* called again by the continuation: keep the stack and tell the loop */
+  mainwait *w = mainwaiting;
+  if ( w != NULL && w->L == L && w->q == q && w->k == k ) {
+    w->ctx = ctx;
+    w->again = TRUE;
+    return lua_gettop( L );
+  }
+
+  mainwait self = { L, q, k, ctx, FALSE, w };
+  mainwaiting = &self;
+  do {
+    self.again = FALSE;
+    int n = lua_gettop( L );
+    lua_pushcfunction( L, luaproc_main_resume );
+    lua_insert( L, 1 );
+    if ( lua_pcall( L, n, LUA_MULTRET, 0 ) != LUA_OK ) {
+      mainwaiting = self.prev;
+      return lua_error( L );
+    }
+  } while ( self.again );
+  mainwaiting = self.prev;
+  return lua_gettop( L );
+}
+
+/* block the caller on a locked wait queue */
+int luaproc_block (lua_State *L, waitq *q, int deadline, lua_KContext ctx,
+                   lua_KFunction k)
+{
+  luaproc *self = luaproc_getself( L );
+
+  if ( self == NULL ) {
+    return luaproc_main_block_on( L, q, deadline, ctx, k );
+  }
+
+  /* a lua process is queued by the scheduler after it yields */
+  self->status = LUAPROC_STATUS_BLOCKED_WAIT;
+  self->wq = q;
+  self->timed = ( deadline != 0 );
+  if ( self->timed ) {
+    self->wake_up = lpaux_time_period( lua_tonumber( L, deadline ));
+  }
+  /* yield. wait queue will be unlocked by the scheduler */
+  return lua_yieldk( L, 0, ctx, k );
+}
+
+/* remove the caller from a locked wait queue after a wakeup or a timeout */
+void luaproc_unblock (lua_State *L, waitq *q)
+{
+  luaproc *self = luaproc_getself( L );
+  if ( self != NULL ) {
+    waitq_remove( q, self );
+    self->wq = NULL;
+  }
+}
+
+/* remove a lua process that is not going to be resumed, e.g. cancelled,
+   from the wait queue it is blocked on */
+void luaproc_drop_wait (luaproc *lp)
+{
+  waitq *q = lp->wq;
+  if ( q != NULL ) {
+    lp->wq = NULL;
+    mtx_lock( &q->mutex );
+    waitq_remove( q, lp );
+    mtx_unlock( &q->mutex );
+  }
+}
+
+/* remove a finished or failed lua process from its group */
+static void luaproc_group_leave (luaproc *lp)
+{
+  lpgroup *g = lp->group;
+  if ( g == NULL ) {
+    return;
+  }
+  lp->group = NULL;
+  mtx_lock( &g->wq.mutex );
+  if ( lp->grpprev == NULL ) {
+    g->members = lp->grpnext;
+  } else {
+    lp->grpprev->grpnext = lp->grpnext;
+  }
+  if ( lp->grpnext != NULL ) {
+    lp->grpnext->grpprev = lp->grpprev;
+  }
+  if ( --g->count == 0 ) {
+    waitq_wake( &g->wq );
+  }
+  mtx_unlock( &g->wq.mutex );
+  lpobj_release( &g->obj );
+}
+
+/* return true if the group of a lua process was cancelled */
+int luaproc_is_cancelled (luaproc *lp)
+{
+  return lp->group != NULL && atomic_load( &lp->group->cancelled );
+}
+
+/* return true if a lua process belongs to a group, i.e. it may be
+   cancelled */
+int luaproc_is_cancellable (luaproc *lp)
+{
+  return lp->group != NULL;
+}
+
+/* keep a value of a lua state, tables as arrays if 'arrays' is set; return
+   FALSE if memory is exhausted */
+static int luaproc_value_keep (lua_State *L, int idx, lpvalue *v, int arrays)
+{
+  v->type = lua_type( L, idx );
+  switch ( v->type ) {
+    case LUA_TBOOLEAN:
+      v->u.b = lua_toboolean( L, idx );
+      break;
+    case LUA_TNUMBER:
+      v->isint = lua_isinteger( L, idx );
+      if ( v->isint ) {
+        v->u.i = lua_tointeger( L, idx );
+      } else {
+        v->u.n = lua_tonumber( L, idx );
+      }
+      break;
+    case LUA_TSTRING: {
+      size_t len;
+      const char *str = lua_tolstring( L, idx, &len );
+      if (( v->u.s.data = malloc( len + 1 )) == NULL ) {
+        v->type = LUA_TNIL;
+        return FALSE;
+      }
+      memcpy( v->u.s.data, str, len + 1 );
+      v->u.s.len = len;
+      break;
+    }
+    case LUA_TUSERDATA:
+      /* shared objects are passed by reference */
+      v->u.obj = lpobj_test( L, idx );
+      if ( v->u.obj != NULL ) {
+        lpobj_retain( v->u.obj );
+      }
+      break;
+    case LUA_TTABLE: {
+      if ( !arrays ) {
+        break;
+      }
+      lua_Integer n = lua_rawlen( L, idx );
+      v->u.t.count = 0;
+      v->u.t.items = (lpvalue *)calloc( n > 0 ? n : 1, sizeof( lpvalue ));
+      if ( v->u.t.items == NULL ) {
+        return FALSE;
+      }
+      for ( lua_Integer i = 1; i <= n; i++ ) {
+        lua_rawgeti( L, idx, i );
+        int ok = luaproc_value_keep( L, lua_gettop( L ), &v->u.t.items[i - 1],
+          FALSE );
+        lua_pop( L, 1 );
+        v->u.t.count = i;
+        if ( !ok ) {
+          return FALSE;
+        }
+      }
+      break;
+    }
+    default:  /* not supported: function, thread, light userdata */
+      break;
+  }
+  return TRUE;
+}
+
+/* free the values kept by 'luaproc_value_keep' */
+static void luaproc_values_free (lpvalue *vs, lua_Integer n)
+{
+  if ( vs == NULL ) {
+    return;
+  }
+  for ( lua_Integer i = 0; i < n; i++ ) {
+    lpvalue *v = &vs[i];
+    if ( v->type == LUA_TSTRING ) {
+      free( v->u.s.data );
+    } else if ( v->type == LUA_TUSERDATA && v->u.obj != NULL ) {
+      lpobj_release( v->u.obj );
+    } else if ( v->type == LUA_TTABLE ) {
+      luaproc_values_free( v->u.t.items, v->u.t.count );
+    }
+  }
+  free( vs );
+}
+
+/* push a kept value; return FALSE if its type is not supported */
+static int luaproc_value_push (lua_State *L, const lpvalue *v)
+{
+  switch ( v->type ) {
+    case LUA_TNIL:
+      lua_pushnil( L );
+      break;
+    case LUA_TBOOLEAN:
+      lua_pushboolean( L, v->u.b );
+      break;
+    case LUA_TNUMBER:
+      if ( v->isint ) {
+        lua_pushinteger( L, v->u.i );
+      } else {
+        lua_pushnumber( L, v->u.n );
+      }
+      break;
+    case LUA_TSTRING:
+      lua_pushlstring( L, v->u.s.data, v->u.s.len );
+      break;
+    case LUA_TUSERDATA:
+      if ( v->u.obj == NULL ) {
+        return FALSE;
+      }
+      lpobj_push( L, v->u.obj );
+      break;
+    default: /* value type not supported: table, function, other userdata */
+      return FALSE;
+  }
+  return TRUE;
+}
+
+/* pass results of a finished lua process to its handle and recycle it; the
+   results are copied so that the state is reused before the handle goes */
+void luaproc_finish (luaproc *lp, int nresults)
+{
+  luaproc_group_leave( lp );
+  lphandle *h = lp->handle;
+  if ( h == NULL ) {
+    luaproc_recycle_insert( lp );
+    return;
+  }
+  lp->handle = NULL;
+
+  lua_State *L = lp->lstate;
+  int first = lua_gettop( L ) - nresults + 1;
+  lpvalue *results = NULL;
+  int ok = TRUE;
+  if ( nresults > 0 ) {
+    results = (lpvalue *)calloc( nresults, sizeof( lpvalue ));
+    ok = ( results != NULL );
+    for ( int i = 0; ok && i < nresults; i++ ) {
+      ok = luaproc_value_keep( L, first + i, &results[i], h->arrays );
+    }
+    if ( !ok ) {
+      luaproc_values_free( results, nresults );
+      results = NULL;
+    }
+  }
+  luaproc_recycle_insert( lp );
+
+  mtx_lock( &h->wq.mutex );
+  h->proc = NULL;
+  if ( ok ) {
+    h->results = results;
+    h->nresults = nresults;
+    h->status = HANDLE_FINISHED;
+  } else {
+    if (( h->error = malloc( sizeof( "not enough memory" ))) != NULL ) {
+      strcpy( h->error, "not enough memory" );
+    }
+    h->status = HANDLE_FAILED;
+  }
+  waitq_wake( &h->wq );
+  mtx_unlock( &h->wq.mutex );
+  lpobj_release( &h->obj );
+}
+
+/* pass the error of a failed lua process to its handle */
+void luaproc_fail (luaproc *lp)
+{
+  luaproc_group_leave( lp );
+  lphandle *h = lp->handle;
+  if ( h == NULL ) {
+    return;
+  }
+  lp->handle = NULL;
+  size_t len = 0;
+  const char *msg = lua_tolstring( lp->lstate, -1, &len );
+  mtx_lock( &h->wq.mutex );
+  h->proc = NULL;
+  if ( msg != NULL && ( h->error = malloc( len + 1 )) != NULL ) {
+    memcpy( h->error, msg, len + 1 );
+  }
+  h->status = HANDLE_FAILED;
+  waitq_wake( &h->wq );
+  mtx_unlock( &h->wq.mutex );
+  lpobj_release( &h->obj );
+}
+
+/* queue a lua process that tried to send a message */
+void luaproc_queue_sender (luaproc *lp)
+{
+  list_insert( &lp->chan->send, lp );
+}
+
+/* queue a lua process that tried to receive a message */
+void luaproc_queue_receiver (luaproc *lp)
+{
+  list_insert( &lp->chan->recv, lp );
+}
+
+/********************************
+ * internal auxiliary functions *
+ ********************************/
+static void luaproc_loadbuffer (
+  lua_State *parent, luaproc *lp, const char *code, size_t len)
+{
+  /* load lua process' lua code */
+  int ret = luaL_loadbuffer( lp->lstate, code, len, code );
+
+  /* in case of errors, close lua_State and push error to parent */
+  if ( ret != 0 ) {
+    lua_pushstring( parent, lua_tostring( lp->lstate, -1 ));
+    lua_close( lp->lstate );
+    luaL_error( parent, lua_tostring( parent, -1 ));
+  }
+}
+
+/* load lua process' lua code without raising errors; on failure, push nil
+   and the error message on the parent and return false */
+static int luaproc_load (
+  lua_State *parent, luaproc *lp, const char *code, size_t len)
+{
+  if ( luaL_loadbuffer( lp->lstate, code, len, code ) != 0 ) {
+    lua_pushnil( parent );
+    lua_pushstring( parent, lua_tostring( lp->lstate, -1 ));
+    lua_pop( lp->lstate, 1 );
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* get elements betwee Lua states */
+static int copy_data (lua_State* Lfrom, lua_State* Lto, int ind)
+{
+  const char* str = NULL;
+  size_t len = 0;
+
+  switch ( lua_type( Lfrom, ind )) {
+    case LUA_TBOOLEAN:
+      lua_pushboolean( Lto, lua_toboolean( Lfrom, ind ));
+      break;
+    case LUA_TNUMBER:
+      copynumber( Lto, Lfrom, ind );
+      break;
+    case LUA_TSTRING: {
+      str = lua_tolstring( Lfrom, ind, &len );
+      lua_pushlstring( Lto, str, len );
+      break;
+    }
+    case LUA_TNIL:
+      lua_pushnil( Lto );
+      break;
+    case LUA_TUSERDATA: {
+      /* shared objects are passed by reference */
+      lpobject *obj = lpobj_test( Lfrom, ind );
+      if ( obj == NULL ) {
+        return FALSE;
+      }
+      lpobj_push( Lto, obj );
+      break;
+    }
+    default: /* value type not supported: table, function, other userdata */
+      return FALSE;
+  }
+  return TRUE;
+}
+
+/* copies values between lua states' stacks */
+static int luaproc_copyvalues (lua_State *Lfrom, lua_State *Lto)
+{
+  int n = lua_gettop( Lfrom );
+
+  /* ensure there is space in the receiver's stack */
+  if ( lua_checkstack( Lto, n ) == 0 ) {
+    lua_pushnil( Lto );
+    lua_pushstring( Lto, "not enough space in the stack" );
+    lua_pushnil( Lfrom );
+    lua_pushstring( Lfrom, "not enough space in the receiver's stack" );
+    return FALSE;
+  }
+
+  /* test each value's type and, if it's supported, copy value */
+  for ( int i = 2; i <= n; i++ ) {
+    if ( !copy_data( Lfrom, Lto, i )) {
+      lua_settop( Lto, 1 );
+      lua_pushnil( Lto );
+      lua_pushfstring( Lto, "failed to receive value of unsupported type '%s'",
+        luaL_typename( Lfrom, i ));
+      lua_pushnil( Lfrom );
+      lua_pushfstring( Lfrom, "failed to send value of unsupported type '%s'",
+        luaL_typename( Lfrom, i ));
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+/* return the lua process associated with a given lua state */
+static luaproc *luaproc_getself (lua_State *L)
+{
+  lua_getfield( L, LUA_REGISTRYINDEX, "LUAPROC_LP_UDATA" );
   luaproc* lp = (luaproc *)lua_touserdata( L, -1 );
   lua_pop( L, 1 );
 
   return lp;
 }
 
-/* create new lua process */
-static luaproc *luaproc_new (lua_State *L)
+/* run the init code in a new lua state and remember its globals; push an
+   error message and return FALSE if the init code failed */
+static int luaproc_init_state (lua_State *L, luaproc *lp)
+{
+  lua_State *ls = lp->lstate;
+
+  mtx_lock( &mutex_recycle_list );
+  lpmsg *init = initcode;
+  if ( init != NULL ) {
+    lpmsg_retain( init );
+  }
+  lp->initgen = initgen;
+  mtx_unlock( &mutex_recycle_list );
+
+  if ( init != NULL ) {
+    size_t len;
+    lpmsg_decode( ls, init );
+    lpmsg_release( init );
+    const char *code = lua_tolstring( ls, -1, &len );
+    int ret = luaL_loadbuffer( ls, code, len, "=init" );
+    if ( ret == 0 ) {
+      ret = lua_pcall( ls, 0, 0, 0 );
+    }
+    if ( ret != 0 ) {
+      const char *msg = lua_tostring( ls, -1 );
+      lua_pushfstring( L, "init failed: %s",
+        msg != NULL ? msg : "(error object is not a string)" );
+      return FALSE;
+    }
+    lua_settop( ls, 0 );
+  }
+
+  /* globals of every process using the state start from this copy, lite
+     states are not reused */
+  if ( lp->lite ) {
+    return TRUE;
+  }
+  lua_newtable( ls );
+  lua_pushglobaltable( ls );
+  lua_pushnil( ls );
+  while ( lua_next( ls, -2 ) != 0 ) {
+    lua_pushvalue( ls, -2 );
+    lua_insert( ls, -2 );
+    lua_rawset( ls, -5 );
+  }
+  lua_pop( ls, 1 );
+  lua_setfield( ls, LUA_REGISTRYINDEX, "LUAPROC_GLOBALS" );
+  return TRUE;
+}
+
+/* clear the stack and restore the globals a new lua state had after its
+   init code; changes inside tables such as modules are kept */
+static void luaproc_reset_globals (lua_State *L)
+{
+  lua_settop( L, 0 );
+  lua_getfield( L, LUA_REGISTRYINDEX, "LUAPROC_GLOBALS" );
+  if ( !lua_istable( L, 1 )) {
+    lua_settop( L, 0 );
+    return;
+  }
+  lua_pushglobaltable( L );
+
+  /* remove globals created by the previous process */
+  lua_pushnil( L );
+  while ( lua_next( L, 2 ) != 0 ) {
+    lua_pop( L, 1 );
+    lua_pushvalue( L, -1 );
+    lua_rawget( L, 1 );
+    if ( lua_isnil( L, -1 )) {
+      lua_pushvalue( L, -2 );
+      lua_pushnil( L );
+      lua_rawset( L, 2 );
+    }
+    lua_pop( L, 1 );
+  }
+
+  /* restore the others */
+  lua_pushnil( L );
+  while ( lua_next( L, 1 ) != 0 ) {
+    lua_pushvalue( L, -2 );
+    lua_insert( L, -2 );
+    lua_rawset( L, 2 );
+  }
+  lua_settop( L, 0 );
+}
+
+/* set the collector of a lua process as requested by its options */
+static void luaproc_set_gc (luaproc *lp, const lpoptions *opt)
+{
+  if ( opt->gcmode == GC_DEFAULT && opt->gcpause < 0 && opt->gcstepmul < 0 ) {
+    return;
+  }
+  lua_State *ls = lp->lstate;
+#if (LUA_VERSION_NUM < 504)
+  if ( opt->gcpause >= 0 ) {
+    lua_gc( ls, LUA_GCSETPAUSE, opt->gcpause );
+  }
+  if ( opt->gcstepmul >= 0 ) {
+    lua_gc( ls, LUA_GCSETSTEPMUL, opt->gcstepmul );
+  }
+#else
+  /* zero keeps a parameter unchanged */
+  lua_gc( ls, LUA_GCINC, opt->gcpause > 0 ? opt->gcpause : 0,
+    opt->gcstepmul > 0 ? opt->gcstepmul : 0, 0 );
+  if ( opt->gcmode == GC_GENERATIONAL ) {
+    lua_gc( ls, LUA_GCGEN, 0, 0 );
+  }
+#endif
+  lp->gcset = TRUE;
+}
+
+/* restore the default collector of a lua state used by a process */
+static void luaproc_reset_gc (luaproc *lp)
+{
+  if ( !lp->gcset ) {
+    return;
+  }
+#if (LUA_VERSION_NUM < 504)
+  lua_gc( lp->lstate, LUA_GCSETPAUSE, LUAPROC_GC_PAUSE );
+  lua_gc( lp->lstate, LUA_GCSETSTEPMUL, LUAPROC_GC_STEPMUL );
+#else
+  lua_gc( lp->lstate, LUA_GCINC, LUAPROC_GC_PAUSE, LUAPROC_GC_STEPMUL, 0 );
+#endif
+  lp->gcset = FALSE;
+}
+
+/* create the state of a new lua process without running the init code; a
+   lite one starts with the base library only */
+static luaproc *luaproc_new_state (int lite)
 {
   lua_State *lpst = luaL_newstate();  /* create new lua state */
 
   /* store the lua process in its own lua state */
   luaproc* lp = (luaproc *)lua_newuserdata( lpst, sizeof( struct stluaproc ));
   lua_setfield( lpst, LUA_REGISTRYINDEX, "LUAPROC_LP_UDATA" );
-  luaproc_openlualibs( lpst );  /* load standard libraries and luaproc */
-  /* register luaproc's own functions */
-  requiref( lpst, "luaproc", luaproc_loadlib, TRUE );
+  lp->lite = lite;
+  if ( lite ) {
+    luaproc_openlite( lpst );
+  } else {
+    luaproc_openlualibs( lpst );  /* load standard libraries and luaproc */
+    /* register luaproc's own functions */
+    requiref( lpst, "luaproc", luaproc_loadlib, TRUE );
+  }
   lp->lstate = lpst;  /* insert created lua state into lua process struct */
+  lp->blocked = lpst;
+  lp->gcset = FALSE;
+  return lp;
+}
+
+/* create new lua process and run the init code once in its state */
+static luaproc *luaproc_new (lua_State *L, int lite)
+{
+  luaproc *lp = luaproc_new_state( lite );
+  if ( luaproc_init_state( L, lp ) == FALSE ) {
+    lua_close( lp->lstate );
+    return NULL;
+  }
+
+  /* shrink the stack and drop the garbage of the setup */
+  if ( lite ) {
+    lua_gc( lp->lstate, LUA_GCCOLLECT, 0 );
+  }
 
   return lp;
 }
@@ -452,18 +1791,151 @@ static int luaproc_join_workers (lua_State *L)
   cnd_destroy(&cond_mainls_sendrecv);
 
   lua_close( chanls );
+  if ( initcode != NULL ) {
+    lpmsg_release( initcode );
+    initcode = NULL;
+  }
+  lptopic_close();
+  lpnode_close();
+  lpshm_close();
+  lpshared_close();
+  lpio_close();
   return 0;
 }
 
+/* buffer for lua_dump; it is initialized on the first write, because an
+   initialized buffer can take the top of the stack from the function */
+typedef struct {
+  int init;
+  luaL_Buffer b;
+} lpdumpbuf;
+
 /* writer function for lua_dump */
 static int luaproc_buff_writer (
   lua_State *L, const void *buff, size_t size, void *ud)
 {
-  (void)L;
-  luaL_addlstring( (luaL_Buffer *)ud, (const char *)buff, size );
+  lpdumpbuf *d = (lpdumpbuf *)ud;
+  if ( !d->init ) {
+    d->init = TRUE;
+    luaL_buffinit( L, &d->b );
+  }
+  luaL_addlstring( &d->b, (const char *)buff, size );
   return 0;
 }
 
+/* push the binary string of the function on top of the stack; return the
+   status of lua_dump */
+static int luaproc_dump (lua_State *L)
+{
+  lpdumpbuf d;
+  d.init = FALSE;
+  int ret = lua_dump( L, luaproc_buff_writer, &d, FALSE );
+  if ( ret == 0 ) {
+    if ( !d.init ) {
+      luaL_buffinit( L, &d.b );
+    }
+    luaL_pushresult( &d.b );
+  }
+  return ret;
+}
+
+/* take 'n' lua processes from the recycle list at once and create the
+   missing ones, all of them for lite processes; return FALSE and push nil
+   and an error message if failed */
+static int luaproc_acquire_batch (lua_State *L, luaproc **lps, int n,
+                                  int lite)
+{
+  int i = 0;
+
+  /* take as many recycled lua processes as there are, from the cache of
+     the current worker first and collected ones first */
+  if ( !lite ) {
+    i = luaproc_cache_take( lps, n );
+  }
+  if ( !lite && i < n ) {
+    /* refill the cache of the current worker in the same pass */
+    int refill = workercache.enabled ? LUAPROC_RECYCLE_BATCH : 0;
+    int taken = i;
+    luaproc *lp;
+    /* get exclusive access to recycled lua processes list */
+    mtx_lock( &mutex_recycle_list );
+    while ( i < n && ( lps[i] = list_remove( &recycle_list )) != NULL ) {
+      i++;
+    }
+    while ( i < n && ( lps[i] = list_remove( &recycle_dirty )) != NULL ) {
+      atomic_fetch_sub( &dirtycount, 1 );
+      i++;
+    }
+    atomic_fetch_sub( &recycled, i - taken );
+    for ( ; refill > 0 && ( lp = list_remove( &recycle_list )) != NULL;
+          refill-- ) {
+      list_insert( &workercache.clean, lp );
+    }
+    for ( ; refill > 0 && ( lp = list_remove( &recycle_dirty )) != NULL;
+          refill-- ) {
+      atomic_fetch_sub( &dirtycount, 1 );
+      list_insert( &workercache.dirty, lp );
+    }
+    /* release exclusive access to recycled lua processes list */
+    mtx_unlock( &mutex_recycle_list );
+  }
+
+  /* create the remaining lua processes */
+  for ( ; i < n; i++ ) {
+    if (( lps[i] = luaproc_new( L, lite )) == NULL ) {
+      for ( int j = 0; j < i; j++ ) {
+        luaproc_recycle_insert( lps[j] );
+      }
+      lua_pushnil( L );
+      lua_insert( L, -2 );
+      return FALSE;
+    }
+  }
+
+  /* init lua processes */
+  for ( i = 0; i < n; i++ ) {
+    luaproc *lp = lps[i];
+    lp->status = LUAPROC_STATUS_IDLE;
+    lp->args   = 0;
+    lp->blocked = lp->lstate;
+    lp->chan   = NULL;
+    lp->wq     = NULL;
+    lp->parked = FALSE;
+    lp->handle = NULL;
+    lp->group  = NULL;
+    atomic_store( &lp->affinity, -1 );
+    atomic_store( &lp->worker, -1 );
+    lp->rt = NULL;
+    lp->pool = NULL;
+  }
+  return TRUE;
+}
+
+/* take a lua process from the recycle list or create a new one; return
+   NULL and push nil and an error message if failed */
+static luaproc *luaproc_acquire (lua_State *L, int lite)
+{
+  luaproc *lp;
+  if ( luaproc_acquire_batch( L, &lp, 1, lite ) == FALSE ) {
+    return NULL;
+  }
+  return lp;
+}
+
+/* recycle lua processes that were not scheduled, dropping their handles */
+static void luaproc_discard (luaproc **lps, int n)
+{
+  for ( int i = 0; i < n; i++ ) {
+    lphandle *h = lps[i]->handle;
+    if ( h != NULL ) {
+      lps[i]->handle = NULL;
+      h->proc = NULL;
+      lpobj_release( &h->obj );
+    }
+    luaproc_recycle_insert( lps[i] );
+  }
+}
+
 /* copy arguments of the process function */
 static int copy_arguments (lua_State* L, luaproc* p)
 {
@@ -494,7 +1966,9 @@ static int luaproc_copyupvalues (
          (_ENV) from the source state Lfrom. in case so, push in the stack of
          the destination state Lto its own global environment to be set as the
          corresponding upvalue; otherwise, treat it as a regular non-supported
-         upvalue type. */
+         upvalue type. luajit keeps the environment out of the upvalues, as
+         lua 5.1 does, and a function loaded in Lto already has its globals,
+         but an upvalue holding _G is still mapped this way. */
       if (lua_type( Lfrom, -1 ) == LUA_TTABLE ) {
         lua_pushglobaltable( Lfrom );
         int equal = lua_compare( Lfrom, -1, -2, LUA_OPEQ );
@@ -527,6 +2001,12 @@ static int luaproc_copyupvalues (
 /* set maximum number of lua processes in the recycle list */
 static int luaproc_recycle_set (lua_State *L)
 {
+  /* without a parameter, return the number of recycled lua processes */
+  if ( lua_isnoneornil( L, 1 )) {
+    lua_pushinteger( L, atomic_load( &recycled ));
+    return 1;
+  }
+
   /* validate parameter is a non negative number */
   lua_Integer max = luaL_checkinteger( L, 1 );
   luaL_argcheck( L, max >= 0, 1, "recycle limit must be positive" );
@@ -537,42 +2017,226 @@ static int luaproc_recycle_set (lua_State *L)
   recyclemax = max;  /* set maximum number */
 
   /* remove extra nodes and destroy each lua processes */
-  while ( list_count( &recycle_list ) > recyclemax ) {
-    luaproc* lp = list_remove( &recycle_list );
-    lua_close( lp->lstate );
+  while ( atomic_load( &recycled ) > recyclemax &&
+    list_count( &recycle_list ) + list_count( &recycle_dirty ) > 0 )
+  {
+    luaproc* lp = list_remove( &recycle_dirty );
+    if ( lp != NULL ) {
+      atomic_fetch_sub( &dirtycount, 1 );
+    } else {
+      lp = list_remove( &recycle_list );
+    }
+    luaproc_recycled_close( lp );
+  }
+  int flush = ( atomic_load( &recycled ) > recyclemax );
+  /* release exclusive access to recycled lua processes list */
+  mtx_unlock( &mutex_recycle_list );
+
+  /* the rest is in the caches of the workers, even idle ones */
+  if ( flush ) {
+    luaproc_cache_flush_all();
+  }
+
+  return 0;
+}
+
+/* set the code run once in every new lua state, nil removes it; recycled
+   states that ran the previous code are discarded */
+static int luaproc_set_init (lua_State *L)
+{
+  int t = lua_type( L, 1 );
+  luaL_argcheck( L, t == LUA_TFUNCTION || t == LUA_TSTRING || t == LUA_TNIL,
+    1, "function, string or nil expected" );
+  lua_settop( L, 1 );
+
+  lpmsg *init = NULL;
+  if ( t != LUA_TNIL ) {
+    if ( t == LUA_TFUNCTION ) {
+      int d = luaproc_dump( L );
+      if ( d != 0 ) {
+        lua_pushnil( L );
+        lua_pushfstring( L, "error %d dumping function to binary string", d );
+        return 2;
+      }
+    } else {
+      lua_pushvalue( L, 1 );
+    }
+
+    /* report syntax errors now rather than in every new process */
+    size_t len;
+    const char *code = lua_tolstring( L, 2, &len );
+    if ( luaL_loadbuffer( L, code, len, "=init" ) != 0 ) {
+      lua_pushnil( L );
+      lua_insert( L, -2 );
+      return 2;
+    }
+
+    int bad;
+    init = lpmsg_encode( L, 2, 2, &bad );
+    if ( init == NULL ) {
+      lua_pushnil( L );
+      lua_pushstring( L, "not enough memory" );
+      return 2;
+    }
+  }
+
+  /* get exclusive access to recycled lua processes list */
+  mtx_lock( &mutex_recycle_list );
+  lpmsg *prev = initcode;
+  initcode = init;
+  initgen++;
+  list stale;
+  list_init( &stale );
+  luaproc *lp;
+  while (( lp = list_remove( &recycle_list )) != NULL ) {
+    list_insert( &stale, lp );
+  }
+  while (( lp = list_remove( &recycle_dirty )) != NULL ) {
+    atomic_fetch_sub( &dirtycount, 1 );
+    list_insert( &stale, lp );
   }
   /* release exclusive access to recycled lua processes list */
   mtx_unlock( &mutex_recycle_list );
 
-  return 0;
+  while (( lp = list_remove( &stale )) != NULL ) {
+    luaproc_recycled_close( lp );
+  }
+  /* the caches hold states with the previous code as well */
+  luaproc_cache_flush_all();
+  if ( prev != NULL ) {
+    lpmsg_release( prev );
+  }
+  lua_pushboolean( L, TRUE );
+  return 1;
+}
+
+/* wait until there are no more active lua processes */
+static int luaproc_wait (lua_State *L)
+{
+  sched_wait();
+  return 0;
+}
+
+/* return the pool named at 'idx', NULL for the default one */
+static lppool *luaproc_checkpool (lua_State *L, int idx)
+{
+  const char *name = luaL_optstring( L, idx, NULL );
+  if ( name == NULL ) {
+    return NULL;
+  }
+  lppool *pool = sched_find_pool( name );
+  luaL_argcheck( L, pool != NULL, idx, "unknown pool" );
+  return pool;
+}
+
+/* set number of workers of a pool (creates or destroys accordingly) */
+static int luaproc_set_numworkers (lua_State *L)
+{
+  /* validate parameter is a positive number */
+  lua_Integer numworkers = luaL_checkinteger( L, 1 );
+  luaL_argcheck( L, numworkers > 0 && numworkers <= INT_MAX, 1,
+    "number of workers must be positive" );
+  lppool *pool = luaproc_checkpool( L, 2 );
+
+  /* set number of threads; signal error on failure */
+  if ( sched_set_numworkers( pool, (int)numworkers ) ==
+       LUAPROC_SCHED_PTHREAD_ERROR ) {
+    luaL_error( L, "failed to create worker" );
+  }
+
+  return 0;
+}
+
+/* return the number of active workers of a pool */
+static int luaproc_get_numworkers (lua_State *L)
+{
+  lua_pushnumber( L, sched_get_numworkers( luaproc_checkpool( L, 1 )));
+  return 1;
+}
+
+/* return the bytes used by a new idle lua process of a profile, "full"
+   (the default) or "lite"; the init code is not run, as it is user code */
+static int luaproc_footprint (lua_State *L)
+{
+  static const char *const profiles[] = { "full", "lite", NULL };
+  int lite = luaL_checkoption( L, 1, "full", profiles );
+  luaproc *lp = luaproc_new_state( lite );
+  lua_State *ls = lp->lstate;
+  lua_gc( ls, LUA_GCCOLLECT, 0 );
+  lua_Integer bytes = (lua_Integer)lua_gc( ls, LUA_GCCOUNT, 0 ) * 1024 +
+    lua_gc( ls, LUA_GCCOUNTB, 0 );
+  lua_close( ls );
+  lua_pushinteger( L, bytes );
+  return 1;
 }
 
-/* wait until there are no more active lua processes */
-static int luaproc_wait (lua_State *L)
+/* run the processes on the calling thread in an order given by a seed, on
+   a virtual clock */
+static int luaproc_deterministic (lua_State *L)
 {
-  sched_wait();
-  return 0;
+  lua_Integer seed = luaL_optinteger( L, 1, 0 );
+  if ( sched_set_deterministic( (unsigned long long)seed ) !=
+       LUAPROC_SCHED_OK ) {
+    lua_pushnil( L );
+    lua_pushstring( L, "lua processes are running" );
+    return 2;
+  }
+  lua_pushboolean( L, TRUE );
+  return 1;
 }
 
-/* set number of workers (creates or destroys accordingly) */
-static int luaproc_set_numworkers (lua_State *L)
+/* create a named pool of workers with its own ready queue */
+static int luaproc_new_pool (lua_State *L)
 {
-  /* validate parameter is a positive number */
-  lua_Integer numworkers = luaL_checkinteger( L, -1 );
-  luaL_argcheck( L, numworkers > 0, 1, "number of workers must be positive" );
+  const char *name = luaL_checkstring( L, 1 );
+  lua_Integer numworkers = luaL_checkinteger( L, 2 );
+  luaL_argcheck( L, numworkers > 0 && numworkers <= INT_MAX, 2,
+    "number of workers must be positive" );
 
-  /* set number of threads; signal error on failure */
-  if ( sched_set_numworkers( numworkers ) == LUAPROC_SCHED_PTHREAD_ERROR ) {
-    luaL_error( L, "failed to create worker" );
+  int r = sched_new_pool( name, (int)numworkers );
+  if ( r != LUAPROC_SCHED_OK ) {
+    lua_pushnil( L );
+    lua_pushstring( L, ( r == LUAPROC_SCHED_POOL_ERROR ) ?
+      "pool already exists" : "failed to create worker" );
+    return 2;
   }
+  lua_pushboolean( L, TRUE );
+  return 1;
+}
 
+/* set number of polls an idle worker makes before parking */
+static int luaproc_set_spin (lua_State *L)
+{
+  lua_Integer spin = luaL_checkinteger( L, 1 );
+  luaL_argcheck( L, spin >= 0 && spin <= INT_MAX, 1,
+    "spin count must be non negative" );
+  sched_set_spin( (int)spin );
   return 0;
 }
 
-/* return the number of active workers */
-static int luaproc_get_numworkers (lua_State *L)
+/* return number of polls an idle worker makes before parking */
+static int luaproc_get_spin (lua_State *L)
+{
+  lua_pushinteger( L, sched_get_spin() );
+  return 1;
+}
+
+/* return statistics of a period object */
+static int luaproc_period_stats (lua_State *L)
 {
-  lua_pushnumber( L, sched_get_numworkers() );
+  lprate *rate = (lprate *)luaL_checkudata( L, 1, "luaproc.period" );
+  lua_createtable( L, 0, 5 );
+  lua_pushinteger( L, rate->periods );
+  lua_setfield( L, -2, "periods" );
+  lua_pushinteger( L, rate->overruns );
+  lua_setfield( L, -2, "overruns" );
+  lua_pushnumber( L, rate->jitter );
+  lua_setfield( L, -2, "jitter" );
+  lua_pushnumber( L, rate->maxjitter );
+  lua_setfield( L, -2, "maxjitter" );
+  lua_pushnumber( L, ( rate->periods > 0 ) ?
+    rate->sumjitter / (double)rate->periods : 0.0 );
+  lua_setfield( L, -2, "meanjitter" );
   return 1;
 }
 
@@ -586,105 +2250,513 @@ static int luaproc_period (lua_State* L)
   /* initialize */
   rate->marker = RATE_MARKER;
   rate->period = lpaux_time_period( v );
-  timespec_get( &rate->time, TIME_UTC );
+  lpaux_time_mono( &rate->time );
+  rate->periods = 0;
+  rate->overruns = 0;
+  rate->jitter = 0.0;
+  rate->maxjitter = 0.0;
+  rate->sumjitter = 0.0;
+
+  /* metatable is shared by the period objects of a state */
+  if ( luaL_newmetatable( L, "luaproc.period" )) {
+    lua_newtable( L );
+    lua_pushcfunction( L, luaproc_period_stats );
+    lua_setfield( L, -2, "stats" );
+    lua_setfield( L, -2, "__index" );
+  }
+  lua_setmetatable( L, -2 );
 
   return 1;
 }
 
+/* measure how late a period object has woken up */
+static void luaproc_period_woken (lprate *rate)
+{
+  timespec t;
+  lpaux_time_mono( &t );
+  double late = (double)( t.tv_sec - rate->time.tv_sec ) +
+    (double)( t.tv_nsec - rate->time.tv_nsec ) * 1E-9;
+  rate->jitter = late;
+  if ( late > rate->maxjitter ) {
+    rate->maxjitter = late;
+  }
+  rate->sumjitter += late;
+  rate->periods++;
+}
+
+/* continuation of a lua process sleeping for a period object */
+static int luaproc_sleep_k (lua_State *L, int status, lua_KContext ctx)
+{
+  luaproc_period_woken( (lprate *)lua_touserdata( L, 1 ));
+  return 0;
+}
+
 /* stop execution for some time */
 static int luaproc_sleep (lua_State* L)
 {
-  timespec dur;
+  timespec curr, deadline;
+  lprate *rate = NULL;
   int lt = lua_type( L, 1 );
+  lpaux_time_mono( &curr );
 
   if ( lt == LUA_TNUMBER ) {
     double v = lua_tonumber( L, 1 );
     luaL_argcheck( L, v > 0, 1, "period must be positive" );
-    dur = lpaux_time_period( v );
+    deadline = lpaux_time_period( v );
+    lpaux_time_inc( &deadline, &curr );
 
   } else if ( lt == LUA_TUSERDATA ) {
-    lprate* rate = (lprate*) lua_touserdata( L, 1 );
+    rate = (lprate*) lua_touserdata( L, 1 );
     luaL_argcheck( L, rate->marker == RATE_MARKER, 1, "unexpected argument" );
-    /* find period */
-    timespec curr;
-    timespec_get( &curr, TIME_UTC );
+    /* find period, counting the deadlines already passed */
+    lpaux_time_inc( &rate->time, &rate->period );
     while ( lpaux_time_cmp( &rate->time, &curr ) < 1 ) {
       lpaux_time_inc( &rate->time, &rate->period );
+      rate->overruns++;
     }
-    dur = rate->time;
-    lpaux_time_dec( &dur, &curr );
+    deadline = rate->time;
+    lua_settop( L, 1 );
 
   } else {
     luaL_error( L, "unexpected argument" );
   }
 
-  if ( L == mainlp.lstate ) {
-    thrd_sleep(&dur, NULL);
+  /* the main state, or any of its coroutines, sleeps on its own thread */
+  luaproc* self = luaproc_getself( L );
+  if ( self == NULL ) {
+    if ( sched_is_deterministic() ) {
+      /* run the processes up to the deadline on the virtual clock */
+      while ( sched_det_step( &deadline ))
+        ;
+    } else {
+      lpaux_time_sleep_until( &deadline, NULL );
+    }
+    if ( rate != NULL ) {
+      luaproc_period_woken( rate );
+    }
     return 0;
+  }
+
+  /* a real-time process sleeps on its thread until the monotonic deadline,
+     the others are woken by the scheduler */
+  if ( self->rt != NULL ) {
+    self->wake_up = deadline;
   } else {
-    luaproc* self = luaproc_getself( L );
-    if ( self != NULL ) {  // ???
-      timespec_get( &self->wake_up, TIME_UTC );
-      lpaux_time_inc( &self->wake_up, &dur );
-      self->status = LUAPROC_STATUS_BLOCKED_SLEEP;
+    lpaux_time_dec( &deadline, &curr );
+    lpaux_time_utc( &self->wake_up );
+    lpaux_time_inc( &self->wake_up, &deadline );
+  }
+  self->status = LUAPROC_STATUS_BLOCKED_SLEEP;
+  if ( rate != NULL ) {
+    return lua_yieldk( L, 0, 0, luaproc_sleep_k );
+  }
+  return lua_yield( L, 0 );
+}
+
+/* create a handle for a new lua process */
+static lphandle *luaproc_handle_new (luaproc *lp)
+{
+  lphandle *h = (lphandle *)malloc( sizeof( lphandle ));
+  if ( h == NULL ) {
+    return NULL;
+  }
+  /* the only reference belongs to the process until it finishes */
+  lpobj_init( &h->obj, &luaproc_handle_type );
+  waitq_init( &h->wq );
+  h->status = HANDLE_RUNNING;
+  h->arrays = FALSE;
+  h->proc = lp;
+  h->results = NULL;
+  h->nresults = 0;
+  h->error = NULL;
+  lp->handle = h;
+  return h;
+}
+
+/* destroy a process handle and the results it keeps */
+static void luaproc_handle_destroy (lpobject *obj)
+{
+  lphandle *h = (lphandle *)obj;
+  luaproc_values_free( h->results, h->nresults );
+  free( h->error );
+  waitq_destroy( &h->wq );
+  free( h );
+}
+
+/* push results of a finished process, the handle must be locked */
+static int luaproc_handle_results (lua_State *L, lphandle *h)
+{
+  if ( h->status == HANDLE_FAILED ) {
+    lua_pushnil( L );
+    lua_pushstring( L, h->error != NULL ? h->error : "process failed" );
+    return 2;
+  }
+  if ( lua_checkstack( L, h->nresults + 1 ) == 0 ) {
+    lua_pushnil( L );
+    lua_pushstring( L, "not enough space in the stack" );
+    return 2;
+  }
+  lua_pushboolean( L, TRUE );
+  for ( int i = 0; i < h->nresults; i++ ) {
+    if ( !luaproc_value_push( L, &h->results[i] )) {
+      lua_pushnil( L );
+      lua_pushfstring( L, "failed to return value of unsupported type '%s'",
+        lua_typename( L, h->results[i].type ));
+      return 2;
     }
-    return lua_yield( L, 0 );
   }
+  return h->nresults + 1;
 }
 
-/* create and schedule a new lua process */
-static int luaproc_create_newproc (lua_State *L)
+/* continue waiting for a process to finish */
+static int luaproc_handle_join_k (lua_State *L, int status, lua_KContext ctx)
+{
+  lphandle *h = (lphandle *)lpobj_test( L, 1 );
+  int deadline = ( lua_gettop( L ) >= 2 ) ? 2 : 0;
+
+  mtx_lock( &h->wq.mutex );
+  luaproc_unblock( L, &h->wq );
+  if ( h->status != HANDLE_RUNNING ) {
+    int n = luaproc_handle_results( L, h );
+    mtx_unlock( &h->wq.mutex );
+    return n;
+  }
+  if ( lpaux_expired( L, deadline )) {
+    mtx_unlock( &h->wq.mutex );
+    lua_pushnil( L );
+    lua_pushstring( L, "timeout" );
+    return 2;
+  }
+  return luaproc_block( L, &h->wq, deadline, ctx, luaproc_handle_join_k );
+}
+
+/* wait for a process to finish and return true and its results, or nil and
+   an error message */
+static int luaproc_handle_join (lua_State *L)
+{
+  lpobj_check( L, 1, &luaproc_handle_type );
+  lpaux_deadline( L, 2 );
+  return luaproc_handle_join_k( L, LUA_OK, 0 );
+}
+
+/* return the status of a process: "running", "finished" or "failed" */
+static int luaproc_handle_status (lua_State *L)
+{
+  lphandle *h = (lphandle *)lpobj_check( L, 1, &luaproc_handle_type );
+  mtx_lock( &h->wq.mutex );
+  int status = h->status;
+  mtx_unlock( &h->wq.mutex );
+  lua_pushstring( L, status == HANDLE_RUNNING ? "running"
+                   : status == HANDLE_FINISHED ? "finished" : "failed" );
+  return 1;
+}
+
+/******************
+ * group functions *
+ ******************/
+
+/* create a process group */
+static int luaproc_create_group (lua_State *L)
+{
+  lpgroup *g = (lpgroup *)malloc( sizeof( lpgroup ));
+  if ( g == NULL ) {
+    lua_pushnil( L );
+    lua_pushstring( L, "not enough memory" );
+    return 2;
+  }
+  lpobj_init( &g->obj, &luaproc_group_type );
+  waitq_init( &g->wq );
+  g->count = 0;
+  g->members = NULL;
+  atomic_init( &g->cancelled, FALSE );
+  lpobj_push( L, &g->obj );
+  lpobj_release( &g->obj );
+  return 1;
+}
+
+/* destroy a process group, its processes hold references until they end */
+static void luaproc_group_destroy (lpobject *obj)
+{
+  lpgroup *g = (lpgroup *)obj;
+  waitq_destroy( &g->wq );
+  free( g );
+}
+
+/* continue waiting for the processes of a group to end */
+static int luaproc_group_wait_k (lua_State *L, int status, lua_KContext ctx)
+{
+  lpgroup *g = (lpgroup *)lpobj_test( L, 1 );
+  int deadline = ( lua_gettop( L ) >= 2 ) ? 2 : 0;
+
+  mtx_lock( &g->wq.mutex );
+  luaproc_unblock( L, &g->wq );
+  if ( g->count == 0 ) {
+    mtx_unlock( &g->wq.mutex );
+    lua_pushboolean( L, TRUE );
+    return 1;
+  }
+  if ( lpaux_expired( L, deadline )) {
+    mtx_unlock( &g->wq.mutex );
+    lua_pushnil( L );
+    lua_pushstring( L, "timeout" );
+    return 2;
+  }
+  return luaproc_block( L, &g->wq, deadline, ctx, luaproc_group_wait_k );
+}
+
+/* wait until all the processes of a group have ended; return true, or nil
+   and an error message */
+static int luaproc_group_wait (lua_State *L)
+{
+  lpobj_check( L, 1, &luaproc_group_type );
+  lpaux_deadline( L, 2 );
+  return luaproc_group_wait_k( L, LUA_OK, 0 );
+}
+
+/* add lua processes to a group before they are scheduled */
+static void luaproc_group_join (lpgroup *g, luaproc **lps, int n)
+{
+  mtx_lock( &g->wq.mutex );
+  g->count += n;
+  for ( int i = 0; i < n; i++ ) {
+    luaproc *lp = lps[i];
+    lpobj_retain( &g->obj );
+    lp->group = g;
+    lp->grpprev = NULL;
+    lp->grpnext = g->members;
+    if ( g->members != NULL ) {
+      g->members->grpprev = lp;
+    }
+    g->members = lp;
+  }
+  mtx_unlock( &g->wq.mutex );
+}
+
+/* make the processes of a group queued on a locked channel list ready, so
+   that they fail when resumed */
+static void luaproc_group_cancel_list (lpgroup *g, list *l)
+{
+  list keep;
+  list_init( &keep );
+  luaproc *lp;
+  while (( lp = list_remove( l )) != NULL ) {
+    if ( lp->group == g ) {
+      sched_queue_proc( lp );
+    } else {
+      list_insert( &keep, lp );
+    }
+  }
+  *l = keep;
+}
+
+/* stop the processes of a group: running ones when they block or yield,
+   blocked ones at once; they fail with a "cancelled" error */
+static int luaproc_group_cancel (lua_State *L)
+{
+  lpgroup *g = (lpgroup *)lpobj_check( L, 1, &luaproc_group_type );
+  atomic_store( &g->cancelled, TRUE );
+
+  /* the scheduler does not queue members on channels from now on; take
+     those already queued out of the channel they last blocked on, which is
+     looked up by address since it may be gone (a stale one is harmless,
+     only members of the group are taken out), and wake those sleeping or
+     waiting on other objects */
+  mtx_lock( &g->wq.mutex );
+  for ( luaproc *lp = g->members; lp != NULL; lp = lp->grpnext ) {
+    channel *chan = channel_locked_live( lp->chan );
+    if ( chan != NULL ) {
+      luaproc_group_cancel_list( g, &chan->send );
+      luaproc_group_cancel_list( g, &chan->recv );
+      luaproc_unlock_channel( chan );
+    }
+    sched_cancel( lp );
+  }
+  mtx_unlock( &g->wq.mutex );
+  return 0;
+}
+
+/* return the number of unfinished processes of a group */
+static int luaproc_group_count (lua_State *L)
+{
+  lpgroup *g = (lpgroup *)lpobj_check( L, 1, &luaproc_group_type );
+  mtx_lock( &g->wq.mutex );
+  int n = g->count;
+  mtx_unlock( &g->wq.mutex );
+  lua_pushinteger( L, n );
+  return 1;
+}
+
+/* return the worker preferred by the running process of a handle, which
+   keeps running there if it had no preference; -1 if it has finished */
+static int luaproc_handle_affinity (lphandle *h)
+{
+  mtx_lock( &h->wq.mutex );
+  int affinity = -1;
+  luaproc *lp = h->proc;
+  if ( lp != NULL ) {
+    affinity = atomic_load( &lp->affinity );
+    if ( affinity < 0 ) {
+      affinity = atomic_load( &lp->worker );
+      if ( affinity < 0 ) {  /* not resumed yet, pick the next worker */
+        affinity = (int)( atomic_fetch_add( &nextaffinity, 1 ) % INT_MAX );
+      }
+      atomic_store( &lp->affinity, affinity );
+    }
+  }
+  mtx_unlock( &h->wq.mutex );
+  return affinity;
+}
+
+/* read a non negative integer option of a new lua process, -1 if unset */
+static int luaproc_option_int (lua_State *L, int idx, const char *name)
+{
+  int value = -1;
+  lua_getfield( L, idx, name );
+  if ( !lua_isnil( L, -1 )) {
+    int isnum;
+    lua_Integer v = lua_tointegerx( L, -1, &isnum );
+    if ( !isnum || v < 0 || v > INT_MAX ) {
+      luaL_error( L, "option '%s' must be a non negative integer", name );
+    }
+    value = (int)v;
+  }
+  lua_pop( L, 1 );
+  return value;
+}
+
+/* read the options table of a new lua process at 'idx', if there is one,
+   and remove it from the stack */
+static void luaproc_options (lua_State *L, int idx, lpoptions *opt)
+{
+  opt->group = NULL;
+  opt->affinity = -1;
+  opt->gcmode = GC_DEFAULT;
+  opt->gcpause = -1;
+  opt->gcstepmul = -1;
+  opt->realtime = FALSE;
+  opt->priority = 0;
+  opt->spin = LUAPROC_SCHED_RT_SPIN;
+  opt->pool = NULL;
+  opt->lite = FALSE;
+  if ( lua_type( L, idx ) != LUA_TTABLE ) {
+    return;
+  }
+  lua_getfield( L, idx, "gc" );
+  if ( !lua_isnil( L, -1 )) {
+    const char *mode = lua_tostring( L, -1 );
+    if ( mode != NULL && strcmp( mode, "incremental" ) == 0 ) {
+      opt->gcmode = GC_INCREMENTAL;
+    } else if ( mode != NULL && strcmp( mode, "generational" ) == 0 ) {
+#if (LUA_VERSION_NUM < 504)
+      luaL_error( L, "generational collector requires Lua 5.4" );
+#endif
+      opt->gcmode = GC_GENERATIONAL;
+    } else {
+      luaL_error( L, "option 'gc' must be 'incremental' or 'generational'" );
+    }
+  }
+  lua_pop( L, 1 );
+  opt->gcpause = luaproc_option_int( L, idx, "pause" );
+  opt->gcstepmul = luaproc_option_int( L, idx, "stepmul" );
+  lua_getfield( L, idx, "worker" );
+  if ( !lua_isnil( L, -1 )) {
+    int isnum;
+    lua_Integer k = lua_tointegerx( L, -1, &isnum );
+    if ( !isnum || k < 1 ) {
+      luaL_error( L, "option 'worker' must be a positive integer" );
+    }
+    opt->affinity = (int)(( k - 1 ) % INT_MAX );
+  }
+  lua_pop( L, 1 );
+  lua_getfield( L, idx, "near" );
+  if ( !lua_isnil( L, -1 )) {
+    lpobject *obj = lpobj_test( L, -1 );
+    if ( obj == NULL || obj->type != &luaproc_handle_type ) {
+      luaL_error( L, "option 'near' must be a process handle" );
+    }
+    opt->affinity = luaproc_handle_affinity( (lphandle *)obj );
+  }
+  lua_pop( L, 1 );
+  lua_getfield( L, idx, "group" );
+  if ( !lua_isnil( L, -1 )) {
+    lpobject *obj = lpobj_test( L, -1 );
+    if ( obj == NULL || obj->type != &luaproc_group_type ) {
+      luaL_error( L, "option 'group' must be a process group" );
+    }
+    opt->group = (lpgroup *)obj;
+  }
+  lua_pop( L, 1 );
+  lua_getfield( L, idx, "realtime" );
+  opt->realtime = lua_toboolean( L, -1 );
+  lua_pop( L, 1 );
+  opt->priority = luaproc_option_int( L, idx, "priority" );
+  if ( opt->priority > 99 ) {
+    luaL_error( L, "option 'priority' must be an integer from 0 to 99" );
+  }
+  if ( opt->priority < 0 ) {
+    opt->priority = 0;
+  }
+  lua_getfield( L, idx, "spin" );
+  if ( !lua_isnil( L, -1 )) {
+    int isnum;
+    opt->spin = lua_tonumberx( L, -1, &isnum );
+    if ( !isnum || opt->spin < 0 || opt->spin > 1 ) {
+      luaL_error( L, "option 'spin' must be a number of seconds up to 1" );
+    }
+  }
+  lua_pop( L, 1 );
+  lua_getfield( L, idx, "pool" );
+  if ( !lua_isnil( L, -1 )) {
+    const char *name = lua_tostring( L, -1 );
+    opt->pool = ( name != NULL ) ? sched_find_pool( name ) : NULL;
+    if ( opt->pool == NULL ) {
+      luaL_error( L, "option 'pool' must be the name of a pool" );
+    }
+  }
+  lua_pop( L, 1 );
+  lua_getfield( L, idx, "lite" );
+  opt->lite = lua_toboolean( L, -1 );
+  lua_pop( L, 1 );
+  lua_remove( L, idx );
+}
+
+/* create a new lua process from the function (or code) and arguments on
+   the stack and push its handle; return NULL and push nil and an error
+   message if failed */
+static luaproc *luaproc_create (lua_State *L, lpoptions *opt)
 {
   luaproc *lp = NULL;
+  luaproc_options( L, 2, opt );
 
   /* check function argument type - must be function or string; in case it is
      a function, dump it into a binary string */
   int lt = lua_type( L, 1 );
   if ( lt == LUA_TFUNCTION ) {
     lua_rotate( L, 1, -1 );  /* function to the top */
-    luaL_Buffer buff;
-    luaL_buffinit( L, &buff );
-    int d = lua_dump( L, luaproc_buff_writer, &buff, FALSE );
+    int d = luaproc_dump( L );
     if ( d != 0 ) {
       lua_pushnil( L );
       lua_pushfstring( L, "error %d dumping function to binary string", d );
-      return 2;
+      return NULL;
     }
-    luaL_pushresult( &buff );
     lua_insert( L, 1 );
   } else if ( lt != LUA_TSTRING ) {
     lua_pushnil( L );
     lua_pushfstring( L, "cannot use '%s' to create a new process",
       luaL_typename( L, 1 ));
-    return 2;
+    return NULL;
   }
 
   /* get pointer to code string */
   size_t len;
   const char* code = lua_tolstring( L, 1, &len );
 
-  /* get exclusive access to recycled lua processes list */
-  mtx_lock( &mutex_recycle_list );
-
-  /* check if a lua process can be recycled */
-  if ( recyclemax > 0 ) {
-    lp = list_remove( &recycle_list );
-    /* otherwise create a new lua process */
-    if ( lp == NULL ) {
-      lp = luaproc_new( L );
-    }
-  } else {
-    lp = luaproc_new( L );
+  /* take a recycled lua process or create a new one */
+  lp = luaproc_acquire( L, opt->lite );
+  if ( lp == NULL ) {
+    return NULL;
   }
 
-  /* release exclusive access to recycled lua processes list */
-  mtx_unlock( &mutex_recycle_list );
-
-  /* init lua process */
-  lp->status = LUAPROC_STATUS_IDLE;
-  lp->args   = 0;
-  lp->chan   = NULL;
-
   /* load code in lua process */
   luaproc_loadbuffer( L, lp, code, len );
 
@@ -695,29 +2767,176 @@ static int luaproc_create_newproc (lua_State *L)
       || copy_arguments(L, lp) == FALSE ) 
     {
       luaproc_recycle_insert( lp );
-      return 2;
+      return NULL;
     }
     lua_pop( L, 1 );
   }
 
+  /* create the handle returned to the caller */
+  lphandle *h = luaproc_handle_new( lp );
+  if ( h == NULL ) {
+    luaproc_recycle_insert( lp );
+    lua_pushnil( L );
+    lua_pushstring( L, "not enough memory" );
+    return NULL;
+  }
+  lpobj_push( L, &h->obj );
+  atomic_store( &lp->affinity, opt->affinity );
+  lp->pool = opt->pool;
+  luaproc_set_gc( lp, opt );
+
+  /* join the group */
+  if ( opt->group != NULL ) {
+    luaproc_group_join( opt->group, &lp, 1 );
+  }
+
+  return lp;
+}
+
+/* create and schedule a new lua process */
+static int luaproc_create_newproc (lua_State *L)
+{
+  lpoptions opt;
+  luaproc *lp = luaproc_create( L, &opt );
+  if ( lp == NULL ) {
+    return 2;
+  }
+
   sched_inc_lpcount();   /* increase active lua process count */
-  sched_queue_proc( lp );  /* schedule lua process for execution */
-  lua_pushboolean( L, TRUE );
+  /* schedule lua process for execution; without a thread of its own a
+     real-time process runs on the workers */
+  if ( !opt.realtime || sched_queue_realtime( lp, opt.priority,
+         opt.spin ) != LUAPROC_SCHED_OK ) {
+    sched_queue_proc( lp );
+  }
+
+  return 1;
+}
+
+/* create 'n' lua processes running the same function, each one called with
+   its index followed by the arguments, and schedule them at once; return a
+   table with their handles */
+static int luaproc_spawn (lua_State *L)
+{
+  lua_Integer n = luaL_checkinteger( L, 1 );
+  luaL_argcheck( L, n >= 0 && n <= INT_MAX / (lua_Integer)sizeof( luaproc * ),
+    1, "invalid number of processes" );
+  luaL_checktype( L, 2, LUA_TFUNCTION );
+  lua_remove( L, 1 );
+  lpoptions opt;
+  luaproc_options( L, 2, &opt );
+  int nargs = lua_gettop( L ) - 1;
+
+  /* dump the function once for all processes */
+  lua_pushvalue( L, 1 );
+  int d = luaproc_dump( L );
+  if ( d != 0 ) {
+    lua_pushnil( L );
+    lua_pushfstring( L, "error %d dumping function to binary string", d );
+    return 2;
+  }
+  lua_remove( L, -2 );
+  size_t len;
+  const char *code = lua_tolstring( L, -1, &len );
+
+  luaproc **lps = (luaproc **)lua_newuserdata( L, n * sizeof( luaproc * ));
+  lua_createtable( L, (int)n, 0 );
+  int handles = lua_gettop( L );
+  if ( luaproc_acquire_batch( L, lps, (int)n, opt.lite ) == FALSE ) {
+    return 2;
+  }
+
+  for ( int i = 0; i < n; i++ ) {
+    luaproc *lp = lps[i];
+    if ( !luaproc_load( L, lp, code, len )) {
+      luaproc_discard( lps, (int)n );
+      return 2;
+    }
+    lua_pushvalue( L, 1 );
+    if ( luaproc_copyupvalues( L, lp->lstate, -1 ) == FALSE ) {
+      luaproc_discard( lps, (int)n );
+      return 2;
+    }
+
+    /* the index goes before the arguments */
+    lua_pushinteger( lp->lstate, i + 1 );
+    for ( int a = 2; a <= nargs + 1; a++ ) {
+      if ( !copy_data( L, lp->lstate, a )) {
+        luaproc_discard( lps, (int)n );
+        lua_pushnil( L );
+        lua_pushfstring( L, "failed to copy arg of unsupported type '%s'",
+          luaL_typename( L, a ));
+        return 2;
+      }
+    }
+    lp->args = nargs + 1;
+
+    if ( luaproc_handle_new( lp ) == NULL ) {
+      luaproc_discard( lps, (int)n );
+      lua_pushnil( L );
+      lua_pushstring( L, "not enough memory" );
+      return 2;
+    }
+    lpobj_push( L, &lp->handle->obj );
+    lua_rawseti( L, handles, i + 1 );
+    atomic_store( &lp->affinity, opt.affinity );
+    lp->pool = opt.pool;
+    luaproc_set_gc( lp, &opt );
+  }
+
+  /* join the group */
+  if ( opt.group != NULL && n > 0 ) {
+    luaproc_group_join( opt.group, lps, (int)n );
+  }
+
+  sched_add_lpcount( (int)n );  /* increase active lua process count */
+  if ( opt.realtime ) {
+    /* each real-time process gets a thread */
+    for ( int i = 0; i < n; i++ ) {
+      if ( sched_queue_realtime( lps[i], opt.priority,
+             opt.spin ) != LUAPROC_SCHED_OK ) {
+        sched_queue_proc( lps[i] );
+      }
+    }
+  } else {
+    sched_queue_procs( lps, (int)n );  /* schedule all lua processes */
+  }
 
+  lua_pushvalue( L, handles );
   return 1;
 }
 
+/* run a function on the blocking pool and wait for it like join does */
+static int luaproc_blocking (lua_State *L)
+{
+  lpoptions opt;
+  luaproc *lp = luaproc_create( L, &opt );
+  if ( lp == NULL ) {
+    return 2;
+  }
+
+  sched_inc_lpcount();   /* increase active lua process count */
+  if ( sched_queue_blocking( lp ) != LUAPROC_SCHED_OK ) {
+    sched_queue_proc( lp );  /* no pool thread, run it on a worker */
+  }
+
+  /* keep only the handle for the continuation; it may be the only value
+     on the stack, when the function had no arguments */
+  lua_insert( L, 1 );
+  lua_settop( L, 1 );
+  return luaproc_handle_join_k( L, LUA_OK, 0 );
+}
+
 /* send a message to a lua process */
 static int luaproc_send (lua_State *L)
 {
   const char *chname = luaL_checkstring( L, 1 );
   channel* chan = channel_locked_get( chname );
 
-  /* if channel is not found, return an error to lua */
+  /* if channel is not found, try channels of nodes and on shared memory,
+     which return an error to lua if there is none */
   if ( chan == NULL ) {
-    lua_pushnil( L );
-    lua_pushfstring( L, "channel '%s' does not exist", chname );
-    return 2;
+    return lpnode_exists( chname ) ? lpnode_send( L ) : lpshm_send( L );
   }
 
   /* remove first lua process, if any, from channel's receive list */
@@ -725,17 +2944,15 @@ static int luaproc_send (lua_State *L)
 
   if ( dstlp != NULL ) { /* found a receiver? */
     /* try to move values between lua states' stacks */
-    int ret = luaproc_copyvalues( L, dstlp->lstate );
+    int ret = luaproc_copyvalues( L, dstlp->blocked );
     /* -1 because channel name is on the stack */
-    dstlp->args = lua_gettop( dstlp->lstate ) - 1;
-    if ( dstlp->lstate == mainlp.lstate ) {
+    dstlp->args = lua_gettop( dstlp->blocked ) - 1;
+    if ( dstlp == &mainlp ) {
       /* if sending process is the parent (main) Lua state, unblock it */
-      mtx_lock( &mutex_mainls );
-      cnd_signal( &cond_mainls_sendrecv );
-      mtx_unlock( &mutex_mainls );
+      luaproc_main_wake();
     } else {
-      /* schedule receiving lua process for execution */
-      sched_queue_proc( dstlp );
+      /* receiving lua process runs next on this worker */
+      sched_queue_next( dstlp );
     }
     /* unlock channel access */
     luaproc_unlock_channel( chan );
@@ -747,22 +2964,15 @@ static int luaproc_send (lua_State *L)
     }
 
   } else {
-    if ( L == mainlp.lstate ) {
+    luaproc* self = luaproc_getself( L );
+    if ( self == NULL ) {
       /* sending process is the parent (main) Lua state - block it */
-      mainlp.chan = chan;
-      luaproc_queue_sender( &mainlp );
-      luaproc_unlock_channel( chan );
-      mtx_lock( &mutex_mainls );
-      cnd_wait( &cond_mainls_sendrecv, &mutex_mainls );
-      mtx_unlock( &mutex_mainls );
-      return mainlp.args;
-    } else {
-      /* sending process is a standard luaproc - set status, block and yield */
-      luaproc* self = luaproc_getself( L );
-      if ( self != NULL ) {
-        self->status = LUAPROC_STATUS_BLOCKED_SEND;
-        self->chan   = chan;
-      }
+      return luaproc_main_block( L, chan, TRUE );
+    } else {
+      /* sending process is a standard luaproc - set status, block and yield */
+      self->status = LUAPROC_STATUS_BLOCKED_SEND;
+      self->chan   = chan;
+      self->blocked = L;
       /* yield. channel will be unlocked by the scheduler */
       return lua_yield( L, lua_gettop( L ));
     }
@@ -779,11 +2989,10 @@ static int luaproc_receive (lua_State *L)
   int nargs = lua_gettop( L );
 
   channel* chan = channel_locked_get( chname );
-  /* if channel is not found, return an error to Lua */
+  /* if channel is not found, try channels of nodes and on shared memory,
+     which return an error to Lua if there is none */
   if ( chan == NULL ) {
-    lua_pushnil( L );
-    lua_pushfstring( L, "channel '%s' does not exist", chname );
-    return 2;
+    return lpnode_exists( chname ) ? lpnode_receive( L ) : lpshm_receive( L );
   }
 
   /* remove first lua process, if any, from channels' send list */
@@ -791,21 +3000,19 @@ static int luaproc_receive (lua_State *L)
 
   if ( srclp != NULL ) {  /* found a sender? */
     /* try to move values between lua states' stacks */
-    int ret = luaproc_copyvalues( srclp->lstate, L );
+    int ret = luaproc_copyvalues( srclp->blocked, L );
     if ( ret == TRUE ) { /* was receive successful? */
-      lua_pushboolean( srclp->lstate, TRUE );
+      lua_pushboolean( srclp->blocked, TRUE );
       srclp->args = 1;
     } else {  /* nil and error_msg already in stack */
       srclp->args = 2;
     }
-    if ( srclp->lstate == mainlp.lstate ) {
+    if ( srclp == &mainlp ) {
       /* if sending process is the parent (main) Lua state, unblock it */
-      mtx_lock( &mutex_mainls );
-      cnd_signal( &cond_mainls_sendrecv );
-      mtx_unlock( &mutex_mainls );
+      luaproc_main_wake();
     } else {
-      /* otherwise, schedule process for execution */
-      sched_queue_proc( srclp );
+      /* otherwise, sending process runs next on this worker */
+      sched_queue_next( srclp );
     }
     /* unlock channel access */
     luaproc_unlock_channel( chan );
@@ -813,6 +3020,13 @@ static int luaproc_receive (lua_State *L)
        to the receive function when returning its results */
     return lua_gettop( L ) - nargs;
 
+  } else if ( chan->ticked ) {  /* a timer ticked while nobody received */
+    chan->ticked = FALSE;
+    int n = channel_push_tick( L, chan, &chan->ticktime );
+    chan->missed = 0;
+    luaproc_unlock_channel( chan );
+    return n;
+
   } else {  /* otherwise test if receive was synchronous or asynchronous */
     if ( lua_toboolean( L, 2 )) { /* asynchronous receive */
       /* unlock channel access */
@@ -822,23 +3036,16 @@ static int luaproc_receive (lua_State *L)
       lua_pushfstring( L, "no senders waiting on channel '%s'", chname );
       return 2;
     } else { /* synchronous receive */
-      if ( L == mainlp.lstate ) {
+      luaproc* self = luaproc_getself( L );
+      if ( self == NULL ) {
         /*  receiving process is the parent (main) Lua state - block it */
-        mainlp.chan = chan;
-        luaproc_queue_receiver( &mainlp );
-        luaproc_unlock_channel( chan );
-        mtx_lock( &mutex_mainls );
-        cnd_wait( &cond_mainls_sendrecv, &mutex_mainls );
-        mtx_unlock( &mutex_mainls );
-        return mainlp.args;
+        return luaproc_main_block( L, chan, FALSE );
       } else {
         /* receiving process is a standard luaproc - set status, block and
            yield */
-        luaproc* self = luaproc_getself( L );
-        if ( self != NULL ) {
-          self->status = LUAPROC_STATUS_BLOCKED_RECV;
-          self->chan   = chan;
-        }
+        self->status = LUAPROC_STATUS_BLOCKED_RECV;
+        self->chan   = chan;
+        self->blocked = L;
         /* yield. channel will be unlocked by the scheduler */
         return lua_yield( L, lua_gettop( L ));
       }
@@ -852,7 +3059,7 @@ static int luaproc_isopen (lua_State* L)
   const char *chname = luaL_checkstring( L, 1 );
   channel* chan = channel_locked_get( chname );
   if ( chan == NULL ) {
-    lua_pushboolean( L, FALSE );
+    lua_pushboolean( L, lpnode_exists( chname ) || lpshm_exists( chname ));
   } else {
     luaproc_unlock_channel( chan );
     lua_pushboolean( L, TRUE );
@@ -875,12 +3082,10 @@ static int luaproc_broadcast (lua_State* L)
   int success = FALSE;
   while ( list_count( &chan->recv )) {
     luaproc* dst = list_remove( &chan->recv );
-    int ret = luaproc_copyvalues( L, dst->lstate );
-    dst->args = lua_gettop( dst->lstate ) - 1;
-    if ( dst->lstate == mainlp.lstate ) {
-      mtx_lock( &mutex_mainls );
-      cnd_signal( &cond_mainls_sendrecv );
-      mtx_unlock( &mutex_mainls );
+    int ret = luaproc_copyvalues( L, dst->blocked );
+    dst->args = lua_gettop( dst->blocked ) - 1;
+    if ( dst == &mainlp ) {
+      luaproc_main_wake();
     } else {
       sched_queue_proc( dst );
     }
@@ -903,6 +3108,72 @@ static int luaproc_broadcast (lua_State* L)
   return 2;
 }
 
+/* attach a timer with the first tick after 'delay' seconds and then one
+   every 'period' seconds (none if zero) to a channel, which is created if
+   it does not exist */
+static int luaproc_timer_create (lua_State *L, double delay, double period)
+{
+  const char *chname = luaL_checkstring( L, 1 );
+  channel *chan = channel_locked_get( chname );
+  if ( chan == NULL ) {
+    if ( lpnode_exists( chname ) || lpshm_exists( chname )) {
+      lua_pushnil( L );
+      lua_pushfstring( L, "channel '%s' is not a local channel", chname );
+      return 2;
+    }
+    channel_create( chname );
+    if (( chan = channel_locked_get( chname )) == NULL ) {
+      lua_pushnil( L );
+      lua_pushfstring( L, "channel '%s' does not exist", chname );
+      return 2;
+    }
+  }
+  if ( chan->timer != NULL ) {
+    luaproc_unlock_channel( chan );
+    lua_pushnil( L );
+    lua_pushfstring( L, "channel '%s' already has a timer", chname );
+    return 2;
+  }
+
+  size_t len = strlen( chname );
+  lptimer *t = (lptimer *)malloc( sizeof( lptimer ) + len + 1 );
+  if ( t == NULL ) {
+    luaproc_unlock_channel( chan );
+    lua_pushnil( L );
+    lua_pushstring( L, "not enough memory" );
+    return 2;
+  }
+  memcpy( t->name, chname, len + 1 );
+  lpaux_time_utc( &t->due );
+  timespec d = lpaux_time_period( delay );
+  lpaux_time_inc( &t->due, &d );
+  t->period = lpaux_time_period( period );
+  chan->timer = t;
+  chan->ticked = FALSE;
+  chan->missed = 0;
+  sched_timer_add( t );
+  luaproc_unlock_channel( chan );
+
+  lua_pushboolean( L, TRUE );
+  return 1;
+}
+
+/* deliver a tick to a channel every 'period' seconds */
+static int luaproc_ticker (lua_State *L)
+{
+  double period = luaL_checknumber( L, 2 );
+  luaL_argcheck( L, period > 0, 2, "period must be positive" );
+  return luaproc_timer_create( L, period, period );
+}
+
+/* deliver one tick to a channel after 'delay' seconds */
+static int luaproc_after (lua_State *L)
+{
+  double delay = luaL_checknumber( L, 2 );
+  luaL_argcheck( L, delay >= 0, 2, "delay must be non negative" );
+  return luaproc_timer_create( L, delay, 0 );
+}
+
 /* create a new channel */
 static int luaproc_create_channel (lua_State *L)
 {
@@ -916,6 +3187,16 @@ static int luaproc_create_channel (lua_State *L)
     lua_pushnil( L );
     lua_pushfstring( L, "channel '%s' already exists", chname );
     return 2;
+  } else if ( lpnode_exists( chname ) || lpshm_exists( chname )) {
+    lua_pushnil( L );
+    lua_pushfstring( L, "channel '%s' already exists", chname );
+    return 2;
+  } else if ( lua_istable( L, 2 )) {
+    /* channel on shared memory or between nodes */
+    lua_getfield( L, 2, "shm" );
+    int shm = !lua_isnil( L, -1 );
+    lua_pop( L, 1 );
+    return shm ? lpshm_create( L ) : lpnode_create( L );
   } else {  /* create channel */
     channel_create( chname );
     lua_pushboolean( L, TRUE );
@@ -947,10 +3228,9 @@ static int luaproc_destroy_channel (lua_State *L)
   if ( chan == NULL ) {  /* found channel? */
     /* release exclusive access to channels list */
     mtx_unlock( &mutex_channel_list );
-    /* return an error to lua */
-    lua_pushnil( L );
-    lua_pushfstring( L, "channel '%s' does not exist", chname );
-    return 2;
+    /* try channels of nodes and on shared memory, which return an error to
+       lua if there is none */
+    return lpnode_exists( chname ) ? lpnode_destroy( L ) : lpshm_destroy( L );
   }
 
   /* remove channel from table */
@@ -958,9 +3238,19 @@ static int luaproc_destroy_channel (lua_State *L)
   lua_pushnil( chanls );
   lua_setfield( chanls, -2, chname );
   lua_pop( chanls, 1 );
+  channel_unlocked_setlive( chan, FALSE );
 
   mtx_unlock( &mutex_channel_list );
 
+  /* stop the timer of the channel; a timer delivering a tick right now
+     finds the channel gone and frees itself */
+  if ( chan->timer != NULL ) {
+    if ( sched_timer_cancel( chan->timer )) {
+      luaproc_timer_free( chan->timer );
+    }
+    chan->timer = NULL;
+  }
+
   /*
      wake up workers there are waiting to use the channel.
      they will not find the channel, since it was removed,
@@ -985,11 +3275,16 @@ static int luaproc_destroy_channel (lua_State *L)
   }
   luaproc *lp = NULL;
   while (( lp = list_remove( blockedlp )) != NULL ) {
-    /* return an error to each process */
-    lua_pushnil( lp->lstate );
-    lua_pushstring( lp->lstate, lua_tostring( L, -1 ));
+    /* return an error to the thread of each process that blocked, which
+       may be one of its coroutines */
+    lua_pushnil( lp->blocked );
+    lua_pushstring( lp->blocked, lua_tostring( L, -1 ));
     lp->args = 2;
-    sched_queue_proc( lp ); /* schedule process for execution */
+    if ( lp == &mainlp ) {
+      luaproc_main_wake();
+    } else {
+      sched_queue_proc( lp ); /* schedule process for execution */
+    }
   }
 
   /* unlock channel mutex and destroy both mutex and condition */
@@ -1001,6 +3296,446 @@ static int luaproc_destroy_channel (lua_State *L)
   return 1;
 }
 
+/******************************
+ * parallel map and reduction *
+ ******************************/
+
+/* stack slots of luaproc.map and luaproc.reduce */
+#define PAR_FUNC    1  /* function */
+#define PAR_INPUT   2  /* input array */
+#define PAR_CODE    4  /* binary string of the function */
+#define PAR_HANDLES 5  /* handles of the processes, one per chunk */
+#define PAR_OUTPUT  6  /* results (per element for map, per chunk for reduce) */
+#define PAR_CHUNK   7  /* elements per chunk */
+#define PAR_SIZE    8  /* number of elements */
+#define PAR_ACC     9  /* accumulator of the reduction */
+
+/* continue applying a function to the elements of a chunk */
+static int luaproc_map_chunk_k (lua_State *L, int status, lua_KContext i)
+{
+  /* stack: function, input, count, output[, result for element i] */
+  if ( lua_gettop( L ) > 4 ) {
+    lua_rawseti( L, 4, i );
+  }
+  lua_Integer n = lua_tointeger( L, 3 );
+  for ( i = i + 1; i <= n; i++ ) {
+    lua_pushvalue( L, 1 );
+    lua_rawgeti( L, 2, i );
+    lua_callk( L, 1, 1, i, luaproc_map_chunk_k );
+    lua_rawseti( L, 4, i );
+  }
+  return 1;
+}
+
+/* main function of a map process: apply a function to a chunk */
+static int luaproc_map_chunk (lua_State *L)
+{
+  lua_settop( L, 3 );
+  lua_createtable( L, lua_tointeger( L, 3 ), 0 );
+  return luaproc_map_chunk_k( L, LUA_OK, 0 );
+}
+
+/* continue folding the elements of a chunk */
+static int luaproc_reduce_chunk_k (lua_State *L, int status, lua_KContext i)
+{
+  /* stack: function, input, count, accumulator[, result for element i] */
+  if ( lua_gettop( L ) > 4 ) {
+    lua_replace( L, 4 );
+  }
+  lua_Integer n = lua_tointeger( L, 3 );
+  for ( i = i + 1; i <= n; i++ ) {
+    lua_pushvalue( L, 1 );
+    lua_pushvalue( L, 4 );
+    lua_rawgeti( L, 2, i );
+    lua_callk( L, 2, 1, i, luaproc_reduce_chunk_k );
+    lua_replace( L, 4 );
+  }
+  return 1;
+}
+
+/* main function of a reduce process: fold a chunk, starting from its first
+   element */
+static int luaproc_reduce_chunk (lua_State *L)
+{
+  lua_settop( L, 3 );
+  lua_rawgeti( L, 2, 1 );
+  return luaproc_reduce_chunk_k( L, LUA_OK, 1 );
+}
+
+/* continue folding the results of the chunks, starting from the initial
+   value */
+static int luaproc_fold_k (lua_State *L, int status, lua_KContext j)
+{
+  if ( lua_gettop( L ) > PAR_ACC ) {
+    lua_replace( L, PAR_ACC );
+  }
+  lua_Integer nchunks = lua_rawlen( L, PAR_HANDLES );
+  for ( j = j + 1; j <= nchunks; j++ ) {
+    lua_pushvalue( L, PAR_FUNC );
+    lua_pushvalue( L, PAR_ACC );
+    lua_rawgeti( L, PAR_OUTPUT, j );
+    lua_callk( L, 2, 1, j, luaproc_fold_k );
+    lua_replace( L, PAR_ACC );
+  }
+  return 1;
+}
+
+/* copy the results of a finished chunk; the handle must be locked */
+static int luaproc_gather_chunk (lua_State *L, lphandle *h, lua_Integer j,
+                                 int reduce)
+{
+  if ( h->status == HANDLE_FAILED ) {
+    lua_pushnil( L );
+    lua_pushstring( L, h->error != NULL ? h->error : "process failed" );
+    return FALSE;
+  }
+
+  /* the chunk returns one value */
+  static const lpvalue none = { LUA_TNIL };
+  const lpvalue *v = ( h->nresults > 0 ) ? &h->results[h->nresults - 1]
+                                         : &none;
+
+  /* a reduction returns one value per chunk */
+  if ( reduce ) {
+    if ( !luaproc_value_push( L, v )) {
+      lua_pushnil( L );
+      lua_pushfstring( L, "failed to return value of unsupported type '%s'",
+        lua_typename( L, v->type ));
+      return FALSE;
+    }
+    lua_rawseti( L, PAR_OUTPUT, j );
+    return TRUE;
+  }
+
+  /* a map returns a table with one value per element */
+  lua_Integer chunk = lua_tointeger( L, PAR_CHUNK );
+  lua_Integer first = ( j - 1 ) * chunk;
+  lua_Integer n = lua_tointeger( L, PAR_SIZE ) - first;
+  if ( n > chunk ) {
+    n = chunk;
+  }
+  for ( lua_Integer i = 1; i <= n; i++ ) {
+    const lpvalue *item = ( v->type == LUA_TTABLE && i <= v->u.t.count )
+                          ? &v->u.t.items[i - 1] : &none;
+    if ( !luaproc_value_push( L, item )) {
+      lua_pushnil( L );
+      lua_pushfstring( L, "failed to return value of unsupported type '%s'",
+        lua_typename( L, item->type ));
+      return FALSE;
+    }
+    lua_rawseti( L, PAR_OUTPUT, first + i );
+  }
+  return TRUE;
+}
+
+/* wait for the chunks in order and collect their results */
+static int luaproc_gather_k (lua_State *L, int status, lua_KContext ctx)
+{
+  int reduce = ctx & 1;
+  lua_Integer nchunks = lua_rawlen( L, PAR_HANDLES );
+
+  for ( lua_Integer j = ctx >> 1; j <= nchunks; j++ ) {
+    lua_rawgeti( L, PAR_HANDLES, j );
+    lphandle *h = (lphandle *)lpobj_test( L, -1 );
+    lua_pop( L, 1 );  /* the handles table keeps it alive */
+
+    mtx_lock( &h->wq.mutex );
+    luaproc_unblock( L, &h->wq );
+    if ( h->status == HANDLE_RUNNING ) {
+      return luaproc_block( L, &h->wq, 0, j * 2 + reduce, luaproc_gather_k );
+    }
+    int ok = luaproc_gather_chunk( L, h, j, reduce );
+    mtx_unlock( &h->wq.mutex );
+    if ( !ok ) {
+      return 2;  /* nil and error message on the stack */
+    }
+  }
+
+  if ( reduce ) {
+    lua_pushvalue( L, 3 );  /* initial value */
+    return luaproc_fold_k( L, LUA_OK, 0 );
+  }
+  lua_pushvalue( L, PAR_OUTPUT );
+  return 1;
+}
+
+/* split an array in chunks and start a process for each of them */
+static int luaproc_parallel (lua_State *L, lua_Integer chunk, int reduce)
+{
+  lua_settop( L, 3 );
+  lua_Integer n = lua_rawlen( L, PAR_INPUT );
+  if ( chunk <= 0 ) {  /* by default, one chunk per worker */
+    lua_Integer workers = sched_get_numworkers( NULL );
+    if ( workers < 1 ) {  /* no workers in deterministic mode */
+      workers = 1;
+    }
+    chunk = ( n + workers - 1 ) / workers;
+    if ( chunk < 1 ) {
+      chunk = 1;
+    }
+  }
+
+  /* dump the function once for all the chunks */
+  lua_pushvalue( L, PAR_FUNC );
+  int d = luaproc_dump( L );
+  if ( d != 0 ) {
+    lua_pushnil( L );
+    lua_pushfstring( L, "error %d dumping function to binary string", d );
+    return 2;
+  }
+  lua_remove( L, -2 );
+  size_t len;
+  const char *code = lua_tolstring( L, PAR_CODE, &len );
+  lua_newtable( L );  /* handles */
+  lua_createtable( L, reduce ? 0 : n, 0 );  /* output */
+  lua_pushinteger( L, chunk );
+  lua_pushinteger( L, n );
+
+  for ( lua_Integer first = 1, j = 1; first <= n; first += chunk, j++ ) {
+    lua_Integer count = ( n - first + 1 < chunk ) ? n - first + 1 : chunk;
+
+    luaproc *lp = luaproc_acquire( L, FALSE );
+    if ( lp == NULL ) {
+      return 2;
+    }
+    lua_State *ls = lp->lstate;
+    if ( !luaproc_load( L, lp, code, len )) {
+      luaproc_recycle_insert( lp );
+      return 2;
+    }
+    lua_pushvalue( L, PAR_FUNC );
+    if ( luaproc_copyupvalues( L, ls, -1 ) == FALSE ) {
+      luaproc_recycle_insert( lp );
+      return 2;
+    }
+
+    /* arguments of the chunk process: function, chunk and its size */
+    lua_pushcfunction( ls, reduce ? luaproc_reduce_chunk : luaproc_map_chunk );
+    lua_insert( ls, 1 );
+    lua_createtable( ls, count, 0 );
+    for ( lua_Integer i = 0; i < count; i++ ) {
+      lua_rawgeti( L, PAR_INPUT, first + i );
+      if ( !copy_data( L, ls, -1 )) {
+        lua_pushnil( L );
+        lua_pushfstring( L, "failed to copy element of unsupported type '%s'",
+          luaL_typename( L, -2 ));
+        luaproc_recycle_insert( lp );
+        return 2;
+      }
+      lua_pop( L, 1 );
+      lua_rawseti( ls, -2, i + 1 );
+    }
+    lua_pushinteger( ls, count );
+    lp->args = 3;
+
+    lphandle *h = luaproc_handle_new( lp );
+    if ( h == NULL ) {
+      luaproc_recycle_insert( lp );
+      lua_pushnil( L );
+      lua_pushstring( L, "not enough memory" );
+      return 2;
+    }
+    h->arrays = !reduce;
+    lpobj_push( L, &h->obj );
+    lua_rawseti( L, PAR_HANDLES, j );
+
+    sched_inc_lpcount();
+    sched_queue_proc( lp );
+  }
+
+  return luaproc_gather_k( L, LUA_OK, 1 * 2 + reduce );
+}
+
+/* apply a function to each element of an array in parallel and return the
+   array of results */
+static int luaproc_map (lua_State *L)
+{
+  luaL_checktype( L, 1, LUA_TFUNCTION );
+  luaL_checktype( L, 2, LUA_TTABLE );
+  lua_Integer chunk = 0;
+  if ( !lua_isnoneornil( L, 3 )) {
+    luaL_checktype( L, 3, LUA_TTABLE );
+    lua_getfield( L, 3, "chunk" );
+    chunk = lua_tointeger( L, -1 );
+    luaL_argcheck( L, lua_isnil( L, -1 ) || chunk > 0, 3,
+      "chunk size must be positive" );
+    lua_pop( L, 1 );
+  }
+  return luaproc_parallel( L, chunk, FALSE );
+}
+
+/* fold the elements of an array in parallel with an associative function */
+static int luaproc_reduce (lua_State *L)
+{
+  luaL_checktype( L, 1, LUA_TFUNCTION );
+  luaL_checktype( L, 2, LUA_TTABLE );
+  luaL_checkany( L, 3 );
+  return luaproc_parallel( L, 0, TRUE );
+}
+
+/***********************************
+ * coroutines inside lua processes *
+ ***********************************/
+
+/*
+  a coroutine blocking on a channel, a sleep or a shared object yields up to
+  the resume call of its lua process, which does not return to lua but yields
+  the process in turn; when the process is woken, the resume call continues
+  the coroutine from where it blocked
+*/
+
+/* return true if a lua process yielded to block */
+static int luaproc_is_blocked (luaproc *lp)
+{
+  return lp->status == LUAPROC_STATUS_BLOCKED_SEND
+    || lp->status == LUAPROC_STATUS_BLOCKED_RECV
+    || lp->status == LUAPROC_STATUS_BLOCKED_SLEEP
+    || lp->status == LUAPROC_STATUS_BLOCKED_WAIT;
+}
+
+/* check that a coroutine can be resumed, raise an error otherwise */
+static void luaproc_co_check (lua_State *L, lua_State *co)
+{
+  lua_Debug ar;
+  if ( co == L || ( lua_status( co ) == LUA_OK
+    && lua_getstack( co, 0, &ar ) > 0 ))
+  {
+    luaL_error( L, "cannot resume non-suspended coroutine" );
+  }
+  if ( lua_status( co ) != LUA_YIELD && ( lua_status( co ) != LUA_OK
+    || lua_gettop( co ) == 0 ))
+  {
+    luaL_error( L, "cannot resume dead coroutine" );
+  }
+}
+
+static int luaproc_co_resume_k( lua_State *L, int status, lua_KContext ctx );
+
+/* resume a coroutine with 'nargs' values on its stack; 'wrap' tells whether
+   the caller is a function of coroutine.wrap */
+static int luaproc_co_run (lua_State *L, lua_State *co, int nargs, int wrap)
+{
+  int nres;
+#if (LUA_VERSION_NUM == 503)
+  int status = lua_resume( co, L, nargs );
+  nres = lua_gettop( co );
+#else
+  int status = lua_resume( co, L, nargs, &nres );
+#endif
+
+  if ( status == LUA_YIELD ) {
+    /* a blocked coroutine keeps its values for the channel operation */
+    luaproc *self = luaproc_getself( L );
+    if ( self != NULL && luaproc_is_blocked( self )) {
+      return lua_yieldk( L, 0, wrap, luaproc_co_resume_k );
+    }
+  }
+
+  if ( status == LUA_OK || status == LUA_YIELD ) {
+    if ( !lua_checkstack( L, nres + 1 )) {
+      lua_pop( co, nres );
+      luaL_error( L, "too many results to resume" );
+    }
+    lua_xmove( co, L, nres );
+    if ( wrap ) {
+      return nres;
+    }
+    lua_pushboolean( L, TRUE );
+    lua_insert( L, -( nres + 1 ));
+    return nres + 1;
+  }
+
+  /* the coroutine failed, move its error */
+  lua_xmove( co, L, 1 );
+  if ( wrap ) {
+    if ( lua_type( L, -1 ) == LUA_TSTRING ) {  /* add position information */
+      luaL_where( L, 1 );
+      lua_insert( L, -2 );
+      lua_concat( L, 2 );
+    }
+    return lua_error( L );
+  }
+  lua_pushboolean( L, FALSE );
+  lua_insert( L, -2 );
+  return 2;
+}
+
+/* continue a coroutine after its lua process was woken */
+static int luaproc_co_resume_k (lua_State *L, int status, lua_KContext ctx)
+{
+  lua_State *co = lua_tothread( L, 1 );
+  int nargs = 0;
+
+  /* the coroutine blocked on a channel gets the values left on its stack;
+     one between it and the process gets none */
+  luaproc *self = luaproc_getself( L );
+  if ( co == self->blocked ) {
+    nargs = self->args;
+    self->args = 0;
+    self->blocked = self->lstate;
+  }
+  return luaproc_co_run( L, co, nargs, (int)ctx );
+}
+
+/* coroutine.resume of lua processes */
+static int luaproc_co_resume (lua_State *L)
+{
+  lua_State *co = lua_tothread( L, 1 );
+  luaL_argcheck( L, co != NULL, 1, "coroutine expected" );
+  luaproc_co_check( L, co );
+  int nargs = lua_gettop( L ) - 1;
+  if ( !lua_checkstack( co, nargs )) {
+    return luaL_error( L, "too many arguments to resume" );
+  }
+  lua_xmove( L, co, nargs );
+  return luaproc_co_run( L, co, nargs, FALSE );
+}
+
+/* function returned by coroutine.wrap of lua processes */
+static int luaproc_co_wrapped (lua_State *L)
+{
+  lua_State *co = lua_tothread( L, lua_upvalueindex( 1 ));
+  luaproc_co_check( L, co );
+  int nargs = lua_gettop( L );
+  if ( !lua_checkstack( co, nargs )) {
+    return luaL_error( L, "too many arguments to resume" );
+  }
+  lua_xmove( L, co, nargs );
+  /* the continuation finds the coroutine at index 1, as for resume */
+  lua_pushvalue( L, lua_upvalueindex( 1 ));
+  lua_insert( L, 1 );
+  return luaproc_co_run( L, co, nargs, TRUE );
+}
+
+/* coroutine.wrap of lua processes */
+static int luaproc_co_wrap (lua_State *L)
+{
+  luaL_checktype( L, 1, LUA_TFUNCTION );
+  lua_State *co = lua_newthread( L );
+  lua_pushvalue( L, 1 );
+  lua_xmove( L, co, 1 );
+  lua_pushcclosure( L, luaproc_co_wrapped, 1 );
+  return 1;
+}
+
+/* open the coroutine library with resume and wrap that let coroutines block
+   their lua process */
+static int luaproc_opencoroutine (lua_State *L)
+{
+#ifdef LUAPROC_LUAJIT
+  lua_getglobal( L, "coroutine" );  /* part of the base library */
+#else
+  luaopen_coroutine( L );
+#endif
+  lua_pushcfunction( L, luaproc_co_resume );
+  lpcompat_wrap( L );
+  lua_setfield( L, -2, "resume" );
+  lua_pushcfunction( L, luaproc_co_wrap );
+  lpcompat_wrap( L );
+  lua_setfield( L, -2, "wrap" );
+  return 1;
+}
+
 /***********************
  * get'ers and set'ers *
  ***********************/
@@ -1032,7 +3767,8 @@ lua_State *luaproc_get_state (luaproc *lp)
 /* return the number of arguments expected by a lua process */
 int luaproc_get_numargs (luaproc *lp)
 {
-  return lp->args;
+  /* values for a blocked coroutine are passed on by the resume calls */
+  return ( lp->blocked == lp->lstate ) ? lp->args : 0;
 }
 
 /* set the number of arguments expected by a lua process */
@@ -1041,6 +3777,56 @@ void luaproc_set_numargs (luaproc *lp, int n)
   lp->args = n;
 }
 
+/* return the worker preferred by a lua process or -1 */
+int luaproc_get_affinity (luaproc *lp)
+{
+  return atomic_load_explicit( &lp->affinity, memory_order_relaxed );
+}
+
+/* record the worker resuming a lua process */
+void luaproc_set_worker (luaproc *lp, int worker)
+{
+  if ( atomic_load_explicit( &lp->worker, memory_order_relaxed ) != worker ) {
+    atomic_store_explicit( &lp->worker, worker, memory_order_relaxed );
+  }
+}
+
+/* return the thread of a real-time lua process or NULL */
+lprtworker *luaproc_get_rt (luaproc *lp)
+{
+  return lp->rt;
+}
+
+/* set the thread of a real-time lua process */
+void luaproc_set_rt (luaproc *lp, lprtworker *rt)
+{
+  lp->rt = rt;
+}
+
+/* return the pool running a lua process, NULL for the default one */
+lppool *luaproc_get_pool (luaproc *lp)
+{
+  return lp->pool;
+}
+
+/* return true if a blocked lua process was queued by the scheduler */
+int luaproc_is_parked (luaproc *lp)
+{
+  return lp->parked;
+}
+
+/* record whether a blocked lua process was queued by the scheduler */
+void luaproc_set_parked (luaproc *lp, int parked)
+{
+  lp->parked = parked;
+}
+
+/* return the time a sleeping lua process wakes up at */
+timespec *luaproc_get_wake_up (luaproc *lp)
+{
+  return &lp->wake_up;
+}
+
 /**********************************
  * register structs and functions *
  **********************************/
@@ -1055,9 +3841,21 @@ static void luaproc_reglualib (
   lua_pop( L, 2 );
 }
 
-static void luaproc_openlualibs (lua_State *L)
+/* open the base library */
+static void luaproc_openbase (lua_State *L)
 {
   requiref( L, "_G", luaopen_base, FALSE );
+#ifdef LUAPROC_LUAJIT
+  /* coroutine comes with the base library; jit is opened at once, as it
+     turns the compiler on */
+  lua_pop( L, luaproc_opencoroutine( L ));
+  requiref( L, "jit", luaopen_jit, TRUE );
+#endif
+}
+
+/* open the package library and pre-register the other libraries */
+static void luaproc_openpackage (lua_State *L)
+{
   requiref( L, "package", luaopen_package, TRUE );
   luaproc_reglualib( L, "io", luaopen_io );
   luaproc_reglualib( L, "os", luaopen_os );
@@ -1065,14 +3863,75 @@ static void luaproc_openlualibs (lua_State *L)
   luaproc_reglualib( L, "string", luaopen_string );
   luaproc_reglualib( L, "math", luaopen_math );
   luaproc_reglualib( L, "debug", luaopen_debug );
-  luaproc_reglualib( L, "coroutine", luaopen_coroutine );
+#ifdef LUAPROC_LUAJIT
+  luaproc_reglualib( L, "bit", luaopen_bit );
+  luaproc_reglualib( L, "ffi", luaopen_ffi );
+#else
+  luaproc_reglualib( L, "coroutine", luaproc_opencoroutine );
   luaproc_reglualib( L, "utf8", luaopen_utf8 );
+#endif
+  luaproc_reglualib( L, "luaproc", luaproc_loadlib );
+}
+
+static void luaproc_openlualibs (lua_State *L)
+{
+  luaproc_openbase( L );
+  luaproc_openpackage( L );
+}
+
+/* create the package library or the luaproc table of a lite lua state when
+   a missing global needs it */
+static int luaproc_lite_index (lua_State *L)
+{
+  if ( lua_type( L, 2 ) != LUA_TSTRING ) {
+    return 0;
+  }
+  const char *k = lua_tostring( L, 2 );
+  if ( strcmp( k, "require" ) == 0 || strcmp( k, "package" ) == 0 ) {
+    luaproc_openpackage( L );
+  } else if ( strcmp( k, "luaproc" ) == 0 ) {
+    requiref( L, "luaproc", luaproc_loadlib, TRUE );
+  } else {
+    return 0;
+  }
+  lua_rawget( L, 1 );
+  return 1;
+}
+
+/* open the base library of a lite lua state, the package library and the
+   luaproc table are created on first use; a metatable set on _G by the
+   user replaces the one doing it */
+static void luaproc_openlite (lua_State *L)
+{
+  luaproc_openbase( L );
+  lua_pushglobaltable( L );
+  lua_createtable( L, 0, 1 );
+  lua_pushcfunction( L, luaproc_lite_index );
+  lua_setfield( L, -2, "__index" );
+  lua_setmetatable( L, -2 );
+  lua_pop( L, 1 );
+}
+
+/* push a new table with luaproc functions */
+static void luaproc_newlib (lua_State *L)
+{
+  luaL_newlib( L, luaproc_funcs );
+  luaL_setfuncs( L, lptopic_funcs, 0 );
+  luaL_setfuncs( L, lpshared_funcs, 0 );
+  luaL_setfuncs( L, lpsync_funcs, 0 );
+  luaL_setfuncs( L, lpmapfile_funcs, 0 );
+  luaL_setfuncs( L, lpnode_funcs, 0 );
+  lua_newtable( L );
+  luaL_setfuncs( L, lpio_funcs, 0 );
+  lpcompat_wrapfuncs( L, -1 );
+  lua_setfield( L, -2, "io" );
+  lpcompat_wrapfuncs( L, -1 );
 }
 
 LUALIB_API int luaopen_luaproc (lua_State *L)
 {
   /* register luaproc functions */
-  luaL_newlib( L, luaproc_funcs );
+  luaproc_newlib( L );
 
   /* thread init */
   mtx_init(&mutex_channel_list, mtx_plain);
@@ -1082,16 +3941,32 @@ LUALIB_API int luaopen_luaproc (lua_State *L)
 
   /* wrap main state inside a lua process */
   mainlp.lstate = L;
+  mainlp.blocked = L;
   mainlp.status = LUAPROC_STATUS_IDLE;
   mainlp.args   = 0;
   mainlp.chan   = NULL;
   mainlp.next   = NULL;
-  /* initialize recycle list */
+  atomic_init( &mainlp.affinity, -1 );
+  atomic_init( &mainlp.worker, -1 );
+  mainlp.rt = NULL;
+  mainlp.pool = NULL;
+  /* initialize recycle lists */
   list_init( &recycle_list );
+  list_init( &recycle_dirty );
   /* initialize channels table and lua_State used to store it */
   chanls = luaL_newstate();
   lua_newtable( chanls );
   lua_setglobal( chanls, LUAPROC_CHANNELS_TABLE );
+  lua_newtable( chanls );
+  lua_setglobal( chanls, LUAPROC_CHANNELS_LIVE );
+  /* initialize topics table */
+  lptopic_init();
+  lpshm_init();
+  lpnode_init();
+  /* initialize shared stores table */
+  lpshared_init();
+  /* initialize input/output reactor */
+  lpio_init();
   /* create finalizer to join workers when Lua exits */
   lua_newuserdata( L, 0 );
   lua_setfield( L, LUA_REGISTRYINDEX, "LUAPROC_FINALIZER_UDATA" );
@@ -1115,7 +3990,7 @@ LUALIB_API int luaopen_luaproc (lua_State *L)
 static int luaproc_loadlib (lua_State *L)
 {
   /* register luaproc functions */
-  luaL_newlib( L, luaproc_funcs );
+  luaproc_newlib( L );
 
   return 1;
 }
@@ -6,6 +6,8 @@
 #ifndef _LUA_LUAPROC_H_
 #define _LUA_LUAPROC_H_
 
+#include <threads.h>
+
 /*************************************
  * execution status of lua processes *
  ************************************/
@@ -16,6 +18,7 @@
 #define LUAPROC_STATUS_BLOCKED_RECV   3
 #define LUAPROC_STATUS_FINISHED       4
 #define LUAPROC_STATUS_BLOCKED_SLEEP  5
+#define LUAPROC_STATUS_BLOCKED_WAIT   6
 
 /*******************
  * structure types *
@@ -27,6 +30,12 @@ typedef struct stluaproc luaproc; /* lua process */
 
 typedef struct stchannel channel; /* communication channel */
 
+typedef struct stlptimer lptimer; /* timer ticking into a channel */
+
+typedef struct stlprtworker lprtworker; /* thread of a real-time process */
+
+typedef struct stlppool lppool; /* pool of workers with its ready queue */
+
 /* linked (fifo) list */
 typedef struct stlist {
   luaproc *head;
@@ -34,6 +43,22 @@ typedef struct stlist {
   int nodes;
 } list;
 
+/* list of timers sorted by the time of their next tick */
+typedef struct sttimerlist {
+  lptimer *head;
+  int nodes;
+} timerlist;
+
+/* queue of lua processes waiting on a shared object */
+typedef struct stwaitq {
+  mtx_t mutex;     /* protects the queue and the state of the object */
+  cnd_t cond;      /* wakes the main state */
+  unsigned int wakes;  /* wakeups, seen by the main state driving the
+                          processes in deterministic mode */
+  luaproc *head;
+  luaproc *tail;
+} waitq;
+
 /***********************
  * function prototypes *
  **********************/
@@ -50,9 +75,48 @@ void luaproc_queue_sender( luaproc *lp );
 /* queue a lua process that tried to receive a message */
 void luaproc_queue_receiver( luaproc *lp );
 
+/* queue a lua process that waits on a shared object and unlock the queue */
+void luaproc_queue_waiter( luaproc *lp );
+
 /* add a lua process to the recycle list */
 void luaproc_recycle_insert( luaproc *lp );
 
+/* keep finished lua processes of the current worker thread in its cache */
+void luaproc_cache_enable( void );
+
+/* move the cache of the current worker thread to the recycle list */
+void luaproc_cache_flush( void );
+
+/* return true if the cache of the current worker thread must be moved to
+   the recycle list */
+int luaproc_cache_stale( void );
+
+/* return the number of recycled lua processes waiting for a collection */
+int luaproc_get_dirty( void );
+
+/* run a full collection on a recycled lua process */
+void luaproc_collect_recycled( void );
+
+/* pass results of a finished lua process to its handle, then recycle it */
+void luaproc_finish( luaproc *lp, int nresults );
+
+/* pass the error of a failed lua process to its handle */
+void luaproc_fail( luaproc *lp );
+
+/* return true if the group of a lua process was cancelled */
+int luaproc_is_cancelled( luaproc *lp );
+
+/* return true if a lua process belongs to a group, i.e. it may be
+   cancelled */
+int luaproc_is_cancellable( luaproc *lp );
+
+/* remove a lua process that is not going to be resumed from the wait queue
+   it is blocked on */
+void luaproc_drop_wait( luaproc *lp );
+
+/* return true if a waiting lua process has a deadline */
+int luaproc_is_timed( luaproc *lp );
+
 /* return a lua process' status */
 int luaproc_get_status( luaproc *lp );
 
@@ -68,6 +132,31 @@ int luaproc_get_numargs( luaproc *lp );
 /* set the number of arguments expected by a lua process */
 void luaproc_set_numargs( luaproc *lp, int n );
 
+/* return the worker preferred by a lua process or -1 */
+int luaproc_get_affinity( luaproc *lp );
+
+/* record the worker resuming a lua process */
+void luaproc_set_worker( luaproc *lp, int worker );
+
+/* return the thread of a real-time lua process or NULL */
+lprtworker *luaproc_get_rt( luaproc *lp );
+
+/* set the thread of a real-time lua process */
+void luaproc_set_rt( luaproc *lp, lprtworker *rt );
+
+/* return the pool running a lua process, NULL for the default one */
+lppool *luaproc_get_pool( luaproc *lp );
+
+/* return true if a blocked lua process was queued by the scheduler */
+int luaproc_is_parked( luaproc *lp );
+
+/* record whether a blocked lua process was queued by the scheduler */
+void luaproc_set_parked( luaproc *lp, int parked );
+
+/* return the time a sleeping lua process wakes up at; the monotonic clock
+   is used by real-time processes, TIME_UTC by the others */
+struct timespec *luaproc_get_wake_up( luaproc *lp );
+
 /* initialize an empty list */
 void list_init( list *l );
 
@@ -77,6 +166,9 @@ void list_insert( list *l, luaproc *lp );
 /* remove and return the first lua process in a list */
 luaproc* list_remove( list *l );
 
+/* remove and return the lua process at position n (from 0) in a list */
+luaproc *list_nth( list *l, int n );
+
 /* return a list's node count */
 int list_count( list *l );
 
@@ -89,6 +181,58 @@ struct timespec* list_time_next (list* l);
 /* get ready to wake up processes */
 luaproc* list_time_ready (list* l, struct timespec* current);
 
+/* remove a given lua process from a list, return false if not found */
+int list_remove_node( list *l, luaproc *lp );
+
+/* initialize an empty timer list */
+void timerlist_init( timerlist *l );
+
+/* insert a timer sorted by the time of its next tick */
+void timerlist_insert( timerlist *l, lptimer *t );
+
+/* remove and return the first timer of a list */
+lptimer *timerlist_remove( timerlist *l );
+
+/* get the time of the next tick or NULL */
+struct timespec *timerlist_next( timerlist *l );
+
+/* remove and return a timer whose tick is due, or NULL */
+lptimer *timerlist_ready( timerlist *l, struct timespec *current );
+
+/* remove a given timer from a list, return false if not found */
+int timerlist_remove_node( timerlist *l, lptimer *t );
+
+/* deliver the tick of a timer to its channel and arm it again or free it */
+void luaproc_timer_fire( lptimer *t );
+
+/* free a timer */
+void luaproc_timer_free( lptimer *t );
+
+/* initialize a wait queue */
+void waitq_init( waitq *q );
+
+/* destroy a wait queue */
+void waitq_destroy( waitq *q );
+
+/* wake every lua process waiting on a queue, the queue must be locked */
+void waitq_wake( waitq *q );
+
+/* wake one lua process waiting on a queue, the queue must be locked */
+void waitq_wake_one( waitq *q );
+
+/*
+   block the caller on a locked wait queue until woken or until the absolute
+   time (seconds, see lpaux_time_now) stored at stack index 'deadline' has
+   passed; zero means no deadline. the queue is unlocked while waiting and
+   the continuation 'k' is called afterwards without the lock. 'k' must lock
+   the queue and call luaproc_unblock before checking the object again.
+*/
+int luaproc_block( lua_State *L, waitq *q, int deadline, lua_KContext ctx,
+                   lua_KFunction k );
+
+/* remove the caller from a locked wait queue after a wakeup or a timeout */
+void luaproc_unblock( lua_State *L, waitq *q );
+
 /* }====================================================================== */
 
 
@@ -0,0 +1,58 @@
+luaproc = require "luaproc"
+
+-- create additional workers
+luaproc.setnumworkers( 3 )
+
+-- processes preferring the second worker
+local handles = {}
+for i = 1, 4 do
+  handles[i] = luaproc.newproc(function (i)
+    local s = 0
+    for k = 1, 100000 do s = s + k end
+    return i, s
+  end, {worker = 2}, i)
+end
+for i = 1, 4 do
+  print('worker 2', handles[i]:join())
+end
+
+-- a consumer next to its producer
+luaproc.newchannel('pipe')
+local producer = luaproc.newproc(function ()
+  for i = 1, 5 do luaproc.send('pipe', i) end
+  luaproc.send('pipe', nil)
+end)
+local consumer = luaproc.newproc(function ()
+  local sum = 0
+  while true do
+    local v = luaproc.receive('pipe')
+    if v == nil then return sum end
+    sum = sum + v
+  end
+end, {near = producer})
+print('consumer', consumer:join())
+print('producer', producer:join())
+
+-- a preferred worker beyond the number of workers wraps around
+print('wrap', luaproc.newproc(function () return 'ok' end, {worker = 10}):join())
+
+-- a bad preference
+print(pcall(luaproc.newproc, function () end, {worker = 0}))
+
+-- a process handed to a busy worker is taken over by an idle one
+luaproc.newchannel('wake')
+luaproc.newchannel('order')
+luaproc.newproc(function ()
+  luaproc.receive('wake')
+  luaproc.send('order', 'woken')
+end)
+luaproc.newproc(function ()
+  luaproc.sleep(0.1)  -- the receiver is waiting
+  luaproc.send('wake', true)
+  local clock = require('os').clock
+  local t = clock()
+  while clock() - t < 0.5 do end
+  luaproc.send('order', 'waker')
+end)
+print('first', luaproc.receive('order'))
+print('then', luaproc.receive('order'))
@@ -0,0 +1,26 @@
+luaproc = require "luaproc"
+
+-- one worker for all the processes
+luaproc.setnumworkers( 1 )
+
+-- blocking calls do not stop the worker
+luaproc.newproc(function ()
+  for i = 1, 3 do
+    print('tick', i)
+    luaproc.sleep(0.1)
+  end
+end)
+
+for i = 1, 2 do
+  luaproc.newproc(function (i)
+    print('blocking', i, luaproc.blocking(function (i, n)
+      local os = require 'os'
+      os.execute('sleep ' .. n)
+      return i * 10
+    end, i, 0.2))
+  end, i)
+end
+
+-- from the main state
+print('main', luaproc.blocking(function (a, b) return a + b end, 1, 2))
+print('error', luaproc.blocking(function () error('failed') end))
@@ -0,0 +1,79 @@
+luaproc = require "luaproc"
+
+luaproc.newchannel('tasks')
+luaproc.newchannel('results')
+
+-- one process running many coroutines that block on channels
+luaproc.newproc(function ()
+  local coroutine = require 'coroutine'
+  local tasks = {}
+  for i = 1, 100 do
+    tasks[i] = coroutine.wrap(function ()
+      local x = luaproc.receive('tasks')
+      luaproc.sleep(0.001)
+      luaproc.send('results', i, x * x)
+      return 'done'
+    end)
+  end
+  -- each call runs a task until it finishes, blocking the process meanwhile
+  for i = 1, #tasks do
+    assert(tasks[i]() == 'done')
+  end
+end)
+
+-- channels are synchronous: the tasks are fed by another process, since
+-- each task sends its result before the next one takes a task
+luaproc.newproc(function ()
+  for i = 1, 100 do
+    luaproc.send('tasks', i)
+  end
+end)
+local sum = 0
+for i = 1, 100 do
+  local id, sq = luaproc.receive('results')
+  sum = sum + sq
+end
+print('sum of squares', sum)
+
+-- plain yields still reach the caller, nested coroutines block as well
+local h = luaproc.newproc(function ()
+  local coroutine = require 'coroutine'
+  local gen = coroutine.wrap(function ()
+    for i = 1, 3 do
+      local inner = coroutine.create(function ()
+        return luaproc.receive('tasks')
+      end)
+      local ok, v = coroutine.resume(inner)
+      coroutine.yield(v)
+    end
+  end)
+  return gen() + gen() + gen()
+end)
+for i = 1, 3 do
+  luaproc.send('tasks', i * 10)
+end
+print('generator', h:join())
+
+-- coroutines of the main state
+local co = coroutine.wrap(function ()
+  luaproc.newproc(function () luaproc.send('results', 'from process') end)
+  return luaproc.receive('results')
+end)
+print(co())
+
+-- a coroutine blocked on a channel that is deleted gets the error
+luaproc.newchannel('doomed')
+local d = luaproc.newproc(function ()
+  local coroutine = require 'coroutine'
+  local string = require 'string'  -- gives strings their methods
+  local co = coroutine.create(function ()
+    local v, err = luaproc.receive('doomed')
+    return v, err
+  end)
+  local ok, v, err = coroutine.resume(co)
+  assert(ok and v == nil and err:find('destroyed'))
+  return err
+end)
+luaproc.sleep(0.1)
+luaproc.delchannel('doomed')
+print('deleted under coroutine', d:join())
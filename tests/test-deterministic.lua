@@ -0,0 +1,54 @@
+-- the same seed gives the same interleaving and the same virtual times
+
+luaproc = require "luaproc"
+
+assert(luaproc.deterministic(42))
+
+local function run()
+  luaproc.newchannel('log')
+  for i = 1, 4 do
+    luaproc.newproc(function (id)
+      local luaproc = require "luaproc"
+      local coroutine = require "coroutine"
+      for k = 1, 3 do
+        luaproc.send('log', id .. ':' .. k)
+        coroutine.yield()
+      end
+    end, i)
+  end
+  local order = {}
+  for i = 1, 12 do
+    order[#order + 1] = luaproc.receive('log')
+  end
+  luaproc.wait()
+  luaproc.delchannel('log')
+  return table.concat(order, ' ')
+end
+
+local first = run()
+assert(luaproc.deterministic(42))
+local second = run()
+print(first)
+assert(first == second)
+assert(luaproc.deterministic(7))
+print(run())
+
+-- sleeps take no real time, the clock jumps to the next wakeup
+assert(luaproc.deterministic(1))
+local t0 = os.time()
+local h = luaproc.newproc(function ()
+  local luaproc = require "luaproc"
+  local p = luaproc.period(10)
+  for i = 1, 100 do luaproc.sleep(p) end
+  local st = p:stats()
+  return st.periods, st.maxjitter
+end)
+local ok, periods, maxjitter = h:join()
+assert(ok and periods == 100 and maxjitter == 0)
+assert(os.time() - t0 < 5)
+
+-- nobody can answer the main state
+luaproc.newchannel('nobody')
+local ok, err = pcall(luaproc.receive, 'nobody')
+print(err)
+assert(not ok and err:find('deadlock'))
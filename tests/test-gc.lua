@@ -0,0 +1,32 @@
+luaproc = require "luaproc"
+
+-- keep states for reuse
+luaproc.recycle( 2 )
+
+-- a process making lots of garbage with a tuned collector
+local h = luaproc.newproc(function ()
+  local t = {}
+  for i = 1, 10000 do t[i % 100] = tostring(i) .. '!' end
+  return collectgarbage('count') > 0
+end, {gc = 'incremental', pause = 100, stepmul = 400})
+print('incremental', h:join())
+
+-- generational mode is available since Lua 5.4
+if _VERSION ~= 'Lua 5.3' then
+  local g = luaproc.newproc(function ()
+    local last
+    for i = 1, 10000 do last = {i} end
+    return last[1]
+  end, {gc = 'generational'})
+  print('generational', g:join())
+end
+
+-- let the idle worker collect the recycled states, then reuse them
+h, g = nil, nil
+collectgarbage()
+luaproc.sleep(0.1)
+print('reused', luaproc.newproc(function () return 'ok' end):join())
+
+-- bad options
+print(pcall(luaproc.newproc, function () end, {gc = 'stop'}))
+print(pcall(luaproc.newproc, function () end, {pause = -1}))
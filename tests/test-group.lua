@@ -0,0 +1,58 @@
+luaproc = require "luaproc"
+
+-- create additional workers
+luaproc.setnumworkers( 2 )
+
+-- two independent batches
+local g1, g2 = luaproc.group(), luaproc.group()
+
+for i = 1, 3 do
+  luaproc.newproc(function (i)
+    luaproc.sleep(0.1 * i)
+    print('batch 1', i)
+  end, {group = g1}, i)
+end
+
+local handles = {}
+for i = 1, 3 do
+  handles[i] = luaproc.newproc(function (i)
+    while true do luaproc.sleep(0.05) end
+  end, {group = g2}, i)
+end
+
+print('count', g1:count(), g2:count())
+print('wait g1', g1:wait())
+print('wait g2', g2:wait(0.1))
+
+-- cancel the endless batch
+g2:cancel()
+print('wait g2', g2:wait())
+print('join', handles[1]:join())
+
+-- code strings accept options too
+local g3 = luaproc.group()
+luaproc.newproc("print('code in group')", {group = g3})
+print('wait g3', g3:wait())
+
+-- cancel processes blocked on a channel and on an untimed wait
+luaproc.newchannel('never')
+local g4 = luaproc.group()
+local r = luaproc.newproc(function ()
+  return luaproc.receive('never')
+end, {group = g4})
+local sem = luaproc.semaphore(0)
+local w = luaproc.newproc(function (s)
+  s:acquire()
+end, {group = g4}, sem)
+local t = luaproc.newproc(function (s)
+  s:acquire(60)
+end, {group = g4}, sem)
+luaproc.sleep(0.1)
+g4:cancel()
+print('wait g4', g4:wait())
+print('join receiver', r:join())
+print('join waiter', w:join())
+print('join timed waiter', t:join())
+-- the semaphore is still usable after its waiters left
+sem:release()
+print('acquire', sem:acquire(0))
@@ -0,0 +1,32 @@
+luaproc = require "luaproc"
+
+-- keep states for reuse
+luaproc.recycle( 4 )
+
+-- heavy setup runs once per state
+print('setinit', luaproc.setinit(function ()
+  string = require "string"
+  initcount = (initcount or 0) + 1
+  helper = function (x) return string.rep('*', x) end
+end))
+
+for i = 1, 3 do
+  local h = luaproc.newproc(function (i)
+    -- globals of the previous process are gone
+    local clean = rawget(_G, 'leftover') == nil
+    leftover = i
+    return helper(i), initcount, clean
+  end, i)
+  print('run', i, h:join())
+end
+
+-- a syntax error is reported at once
+print(luaproc.setinit("this is not lua"))
+
+-- a failing init code fails the creation of processes
+luaproc.setinit("error('no setup')")
+print(luaproc.newproc(function () end))
+
+-- remove the init code
+print('reset', luaproc.setinit(nil))
+print('plain', luaproc.newproc(function () return rawget(_G, 'helper') end):join())
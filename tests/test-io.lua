@@ -0,0 +1,52 @@
+luaproc = require "luaproc"
+
+-- a single worker serves all the processes
+luaproc.setnumworkers( 1 )
+
+-- pipe between processes
+local r, w = luaproc.io.pipe()
+luaproc.newproc(function (r)
+  while true do
+    local s, err = r:read()
+    if s == nil then print('reader', err) break end
+    print('reader', s)
+  end
+end, r)
+luaproc.newproc(function (w)
+  for i = 1, 3 do
+    w:write('line ' .. i)
+    luaproc.sleep(0.1)
+  end
+  w:close()
+end, w)
+
+-- echo server on loopback
+local srv = assert(luaproc.io.listen('127.0.0.1', 0))
+local port = srv:port()
+local server = luaproc.newproc(function (srv)
+  for _ = 1, 2 do
+    local c = srv:accept()
+    luaproc.newproc(function (c)
+      while true do
+        local s = c:read()
+        if s == nil then break end
+        c:write(s)
+      end
+      c:close()
+    end, c)
+  end
+end, srv)
+
+for i = 1, 2 do
+  luaproc.newproc(function (port, i)
+    local c = assert(luaproc.io.connect('127.0.0.1', port))
+    c:write('hello ' .. i)
+    print('client', i, c:read())
+    c:close()
+  end, port, i)
+end
+
+server:join()
+-- nothing to read
+local r2, w2 = luaproc.io.pipe()
+print('timeout', r2:read(10, 0.1))
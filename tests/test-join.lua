@@ -0,0 +1,48 @@
+luaproc = require "luaproc"
+
+-- create an additional worker
+luaproc.setnumworkers( 2 )
+
+local function square (x)
+  luaproc.sleep(0.1)
+  return x * x, 'square'
+end
+
+local h = {}
+for i = 1, 5 do
+  h[i] = luaproc.newproc(square, i)
+end
+
+-- join from the main state
+for i = 1, 5 do
+  print(i, h[i]:join())
+end
+print(h[1]:status())
+
+-- join from a process, with timeout
+luaproc.newproc(function ()
+  local p = luaproc.newproc(function () luaproc.sleep(1.0) return 'late' end)
+  print('timed', p:join(0.1))
+  print('joined', p:join())
+end)
+
+-- failed process
+local f = luaproc.newproc(function () error('oops') end)
+print('failed', f:join())
+print(f:status())
+
+-- results are kept by the handle, the state is reused meanwhile
+luaproc.recycle(1)
+local early = luaproc.newproc(function () return 'early', 42, true end)
+assert(select(2, early:join()) == 'early')
+for i = 1, 10 do
+  assert(select(2, luaproc.newproc(function (x) return x end, i):join()) == i)
+end
+local ok, s, n, b = early:join()
+assert(ok and s == 'early' and n == 42 and b == true)
+
+-- a table can not be returned
+local t = luaproc.newproc(function () return {} end)
+local ok2, err = t:join()
+assert(ok2 == nil and err:find('table'))
+print('kept', s, n, b)
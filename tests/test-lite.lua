@@ -0,0 +1,42 @@
+-- many mostly idle processes with the lite profile
+
+luaproc = require "luaproc"
+
+local full, lite = luaproc.footprint(), luaproc.footprint('lite')
+print(string.format('bytes per idle process: full %d, lite %d', full, lite))
+assert(lite < full)
+
+-- the init code is user code, it is not run to measure a state
+luaproc.setinit('error("init ran")')
+assert(luaproc.footprint() == full)
+luaproc.setinit(nil)
+
+luaproc.setnumworkers(2)
+luaproc.newchannel('ready')
+luaproc.newchannel('go')
+
+-- actors wait on a channel; only the first use of luaproc builds its table
+local n = 1000
+local hs = luaproc.spawn(n, function (i)
+  luaproc.send('ready', i)
+  local v = luaproc.receive('go')
+  return v * 2
+end, {lite = true})
+
+for i = 1, n do luaproc.receive('ready') end
+for i = 1, n do luaproc.send('go', i) end
+local sum = 0
+for _, h in ipairs(hs) do
+  local ok, v = h:join()
+  assert(ok)
+  sum = sum + v
+end
+assert(sum == n * (n + 1))
+
+-- require and the standard libraries are still there on demand
+local h = luaproc.newproc(function ()
+  local string = require 'string'
+  return string.rep('a', 3), package ~= nil
+end, {lite = true})
+local ok, s, pkg = h:join()
+assert(ok and s == 'aaa' and pkg)
@@ -0,0 +1,36 @@
+luaproc = require "luaproc"
+
+-- run with luajit against luaproc built by 'make luajit'
+if not jit then
+  print('not LuaJIT')
+  return
+end
+
+luaproc.newchannel('results')
+
+-- blocking functions resume through their continuations
+local sem = luaproc.semaphore(0)
+luaproc.newproc(function (s)
+  local bit = require 'bit'
+  assert(s:acquire())
+  luaproc.sleep(0.01)
+  luaproc.send('results', jit.status(), bit.band(0xff, 0x0f), 2^53)
+end, sem)
+
+luaproc.sleep(0.05)
+sem:release()
+local on, b, big = luaproc.receive('results')
+assert(on == true and b == 15 and big == 2^53)
+
+-- coroutines block their process as with lua 5.4
+luaproc.newproc(function ()
+  local co = coroutine.wrap(function (x)
+    luaproc.sleep(0.01)
+    return x + 1
+  end)
+  luaproc.send('results', co(41))
+end)
+assert(luaproc.receive('results') == 42)
+
+luaproc.wait()
+print('done')
@@ -0,0 +1,32 @@
+luaproc = require "luaproc"
+
+-- create additional workers
+luaproc.setnumworkers( 4 )
+luaproc.recycle( 4 )
+
+local arr = {}
+for i = 1, 1000 do arr[i] = i end
+
+-- parallel map
+local sq = luaproc.map(function (x) return x * x end, arr)
+print('map', #sq, sq[1], sq[10], sq[1000])
+
+-- custom chunk size, upvalue
+local k = 3
+local tr = luaproc.map(function (x) return k * x end, arr, {chunk = 100})
+print('chunk', #tr, tr[1], tr[1000])
+
+-- parallel reduce
+print('sum', luaproc.reduce(function (a, b) return a + b end, arr, 0))
+print('empty', luaproc.reduce(function (a, b) return a + b end, {}, 42))
+
+-- map from a process
+luaproc.newproc(function ()
+  local s = luaproc.map(function (s)
+    return require('string').upper(s)
+  end, {'a', 'b', 'c'})
+  print('proc', s[1], s[2], s[3])
+end)
+
+-- error in function
+print('error', luaproc.map(function (x) error('bad ' .. x) end, {1}))
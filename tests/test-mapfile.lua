@@ -0,0 +1,49 @@
+luaproc = require "luaproc"
+
+-- create additional workers
+luaproc.setnumworkers( 4 )
+
+-- test file
+local path = os.tmpname()
+local f = io.open(path, 'w')
+for i = 1, 10000 do
+  f:write('line ', i, (i % 10 == 0) and ' error' or '', '\n')
+end
+f:close()
+
+local m = assert(luaproc.mapfile(path))
+print('size', m:size(), 'lines', m:count())
+
+-- processes take line aligned chunks of the same mapping
+local lines, errors = luaproc.atomic(), luaproc.atomic()
+local wg = luaproc.waitgroup()
+for i = 1, 4 do
+  wg:add()
+  luaproc.newproc(function (m, lines, errors, wg)
+    while true do
+      local off, len = m:next(4096)
+      if off == nil then break end
+      lines:add(m:count('\n', off, len))
+      -- scan the chunk without copying it
+      local pos, stop = off, off + len
+      while true do
+        local e = m:find('error', pos, stop - pos)
+        if e == nil then break end
+        errors:add()
+        pos = e + 5
+      end
+    end
+    wg:done()
+  end, m, lines, errors, wg)
+end
+wg:wait()
+print('parallel', lines:get(), errors:get())
+
+-- views
+print('read', m:read(0, 6))
+local n = 0
+for line in m:lines(0, 14) do n = n + 1; print('line', line) end
+m:rewind()
+print('next', m:next(1))
+print('missing', luaproc.mapfile(path .. '.missing'))
+os.remove(path)
@@ -0,0 +1,61 @@
+luaproc = require "luaproc"
+
+-- this instance is a node listening on any free local port
+local ok, port = luaproc.node('127.0.0.1:0')
+print('node', ok, port)
+
+-- messages of other nodes for 'jobs' arrive here
+assert(luaproc.newchannel('jobs', {export = true}))
+
+-- a channel sending to 'jobs' of the node at the port (this one, here)
+assert(luaproc.newchannel('remote', {import = '127.0.0.1:' .. port,
+                                     remote = 'jobs'}))
+
+-- sends are queued and written by the connection thread
+luaproc.newproc(function ()
+  for i = 1, 100 do
+    assert(luaproc.send('remote', 'job', i, i / 4, require('string').rep('x', i)))
+  end
+  luaproc.send('remote', 'done')
+end)
+
+local sum = 0
+while true do
+  local tag, i, q, s = luaproc.receive('jobs')
+  if tag == 'done' then break end
+  assert(q == i / 4 and #s == i)
+  sum = sum + i
+end
+print('sum', sum)
+
+-- imported channels only send
+print(luaproc.receive('remote', true))
+print('async', luaproc.receive('jobs', true))
+
+-- unix domain sockets
+local path = os.tmpname()
+os.remove(path)
+assert(luaproc.node('unix:' .. path))
+assert(luaproc.newchannel('local', {import = 'unix:' .. path, remote = 'jobs'}))
+luaproc.send('local', 'over unix')
+print(luaproc.receive('jobs'))
+
+-- bad addresses
+print(luaproc.newchannel('bad', {import = 'unix:' .. path .. '.none'}))
+print(pcall(luaproc.newchannel, 'bad', {}))
+
+-- a failed connection is opened again on the next use
+local later = path .. '.later'
+assert(not luaproc.newchannel('later', {import = 'unix:' .. later,
+                                        remote = 'jobs'}))
+assert(luaproc.node('unix:' .. later))
+assert(luaproc.newchannel('later', {import = 'unix:' .. later,
+                                    remote = 'jobs'}))
+luaproc.send('later', 'reconnected')
+print(luaproc.receive('jobs'))
+assert(luaproc.delchannel('later'))
+
+assert(luaproc.delchannel('remote'))
+assert(luaproc.delchannel('local'))
+assert(luaproc.delchannel('jobs'))
+print('open', luaproc.isopen('jobs'))
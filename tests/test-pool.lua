@@ -0,0 +1,47 @@
+-- interactive processes keep their latency while batch jobs flood a pool
+
+luaproc = require "luaproc"
+
+assert(luaproc.newpool('batch', 2))
+assert(luaproc.newpool('interactive', 1))
+assert(not luaproc.newpool('batch', 1))  -- names are unique
+assert(luaproc.getnumworkers('batch') == 2)
+assert(not pcall(luaproc.newproc, function () end, {pool='nopool'}))
+
+-- flood the batch pool
+local jobs = luaproc.spawn(16, function (i)
+  local x = 0
+  for k = 1, 5e6 do x = x + k end
+  return i
+end, {pool='batch'})
+
+-- the interactive process answers requests at once
+luaproc.newchannel('req')
+luaproc.newchannel('rep')
+luaproc.newproc(function ()
+  local luaproc = require "luaproc"
+  for i = 1, 10 do
+    luaproc.send('rep', luaproc.receive('req'))
+  end
+end, {pool='interactive'})
+
+local worst = 0
+for i = 1, 10 do
+  local t = os.clock()
+  luaproc.send('req', i)
+  assert(luaproc.receive('rep') == i)
+  worst = math.max(worst, os.clock() - t)
+end
+print('worst round trip', worst)
+
+for i, h in ipairs(jobs) do
+  local ok, r = h:join()
+  assert(ok and r == i)
+end
+
+-- pools are resized like the default one
+luaproc.setnumworkers(1, 'batch')
+assert(luaproc.getnumworkers('batch') == 1)
+luaproc.setnumworkers(3)
+luaproc.setnumworkers(2)
+assert(luaproc.getnumworkers() == 2)
@@ -0,0 +1,46 @@
+-- control loop on a real-time thread with jitter statistics
+
+luaproc = require "luaproc"
+
+luaproc.setnumworkers( 2 )
+
+-- keep the workers busy, the control loop does not depend on them
+luaproc.spawn(2, function ()
+  local x = 0
+  for i = 1, 2e7 do x = x + i end
+end)
+
+local h = luaproc.newproc(function ()
+  local luaproc = require "luaproc"
+  local p = luaproc.period(0.005)
+  for i = 1, 200 do
+    luaproc.sleep(p)
+  end
+  -- tables do not cross lua states, return the fields
+  local st = p:stats()
+  return st.periods, st.overruns, st.meanjitter, st.maxjitter
+end, {realtime=true, priority=10, spin=0.0002})
+
+local ok, periods, overruns, meanjitter, maxjitter = h:join()
+assert(ok, periods)
+local st = {periods = periods, overruns = overruns, meanjitter = meanjitter,
+  maxjitter = maxjitter}
+print(string.format('periods %d overruns %d jitter mean %.6f max %.6f',
+  st.periods, st.overruns, st.meanjitter, st.maxjitter))
+assert(st.periods == 200)
+assert(st.maxjitter >= 0 and st.meanjitter <= st.maxjitter)
+
+-- the same statistics on the workers and on the main state
+local p = luaproc.period(0.01)
+for i = 1, 20 do
+  luaproc.sleep(p)
+end
+local st = p:stats()
+print(string.format('main: periods %d overruns %d jitter mean %.6f max %.6f',
+  st.periods, st.overruns, st.meanjitter, st.maxjitter))
+assert(st.periods == 20)
+
+-- a late call skips the passed deadlines
+luaproc.sleep(0.035)
+luaproc.sleep(p)
+assert(p:stats().overruns >= 3)
@@ -0,0 +1,77 @@
+-- process churn on several workers reusing the states they finished
+
+luaproc = require "luaproc"
+
+luaproc.setnumworkers(4)
+luaproc.recycle(64)
+
+-- every process creates the next ones of its chain on its own worker; a
+-- counter in the registry survives in a recycled state, so the processes
+-- that ran on a reused state are counted as well
+local function churn (chains, depth)
+  local t0 = os.clock()
+  local hs = luaproc.spawn(chains, function (i, depth)
+    local n, reused = 0, 0
+    for d = 1, depth do
+      local h = luaproc.newproc(function (x)
+        local reg = require('debug').getregistry()
+        reg.RUNS = (reg.RUNS or 0) + 1
+        return x + 1, reg.RUNS
+      end, d)
+      local ok, v, runs = h:join()
+      assert(ok and v == d + 1)
+      n = n + 1
+      if runs > 1 then reused = reused + 1 end
+    end
+    return n, reused
+  end, {}, depth)
+  local total, reused = 0, 0
+  for _, h in ipairs(hs) do
+    local ok, n, r = h:join()
+    assert(ok)
+    total = total + n
+    reused = reused + r
+  end
+  return total, reused, os.clock() - t0
+end
+
+-- wait for the workers to trim the processes they keep
+local function settle (max)
+  local deadline = os.time() + 5
+  while luaproc.recycle() > max and os.time() < deadline do
+    luaproc.sleep(0.01)
+  end
+  return luaproc.recycle()
+end
+
+local total, reused = churn(8, 20)
+print('processes, reused', total, reused)
+assert(total == 160 and reused > 0)
+assert(luaproc.recycle() <= 64)
+
+-- a lower maximum holds for the worker caches too, idle workers included
+luaproc.recycle(2)
+assert(settle(2) <= 2)
+total, reused = churn(8, 20)
+assert(total == 160)
+assert(settle(2) <= 2)
+luaproc.recycle(64)
+
+-- states kept by the workers ran the old init code and are not reused
+luaproc.setinit('INIT = 2')
+local hs = luaproc.spawn(8, function ()
+  local h = luaproc.newproc(function () return INIT end)
+  return select(2, h:join())
+end)
+for _, h in ipairs(hs) do
+  local ok, v = h:join()
+  assert(ok and v == 2)
+end
+
+-- no recycling, the worker caches are emptied and states are not reused
+luaproc.recycle(0)
+assert(settle(0) == 0)
+total, reused = churn(8, 20)
+print('processes, reused', total, reused)
+assert(total == 160 and reused == 0)
+assert(luaproc.recycle() == 0)
@@ -0,0 +1,30 @@
+luaproc = require "luaproc"
+
+-- create additional workers
+luaproc.setnumworkers( 4 )
+
+local st = luaproc.shared 'cache'
+st:set('name', 'luaproc')
+st:set(1, true)
+print('get', st:get('name'), st:get(1.0), st:get('missing'))
+
+-- concurrent counters
+local handles = {}
+for i = 1, 4 do
+  handles[i] = luaproc.newproc(function ()
+    local st = luaproc.shared 'cache'
+    for _ = 1, 1000 do st:incr('count') end
+  end)
+end
+for i = 1, 4 do handles[i]:join() end
+print('count', st:get('count'))
+
+-- compare and swap
+print('cas', st:cas('name', 'luaproc', 'lp'), st:cas('name', 'luaproc', 'x'))
+print('cas new', st:cas('new', nil, 1), st:get('new'))
+print('incr float', st:incr('new', 0.5))
+print('incr string', st:incr('name'))
+
+-- delete
+print('delete', st:delete('name'), st:delete('name'), st:get('name'))
+print('unsupported', pcall(st.set, st, 'key', {}))
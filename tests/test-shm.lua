@@ -0,0 +1,47 @@
+luaproc = require "luaproc"
+
+-- a channel on shared memory under a name of its own, so that a segment left
+-- by an earlier run is not picked up; removed first in case it exists
+local name = '/luaproc-test-' .. os.tmpname():match('[^/]+$')
+if luaproc.newchannel('shm', {shm = name}) then
+  assert(luaproc.delchannel('shm'))
+end
+assert(luaproc.newchannel('shm', {shm = name, size = 4096}))
+print('open', luaproc.isopen('shm'))
+
+-- nothing to read yet
+print('async', luaproc.receive('shm', true))
+
+-- messages are buffered in the ring
+luaproc.newproc(function ()
+  for i = 1, 5 do luaproc.send('shm', 'msg', i, i * 0.5, i % 2 == 0) end
+end)
+for i = 1, 5 do print(luaproc.receive('shm')) end
+
+-- only scalar values can cross the ring
+print(luaproc.send('shm', {}))
+
+-- the name is taken
+print(luaproc.newchannel('shm'))
+
+-- another OS process opens the ring by its name and sends through it
+local lua = arg and arg[-1]
+if lua then
+  local code = string.format('package.cpath = %q; ' ..
+    'local luaproc = require "luaproc"; ' ..
+    'assert(luaproc.newchannel("shm", {shm = %q})); ' ..
+    'for i = 1, 3 do assert(luaproc.send("shm", "child", i)) end',
+    package.cpath, name)
+  assert(os.execute(string.format("%s -e '%s'", lua, code)))
+  for i = 1, 3 do
+    local tag, n = luaproc.receive('shm')
+    assert(tag == 'child' and n == i)
+  end
+  print('child', 'ok')
+else
+  print('child', 'skipped, interpreter unknown')
+end
+
+-- destroying the channel removes the name
+assert(luaproc.delchannel('shm'))
+print('open', luaproc.isopen('shm'))
@@ -0,0 +1,31 @@
+luaproc = require "luaproc"
+
+-- create additional workers
+luaproc.setnumworkers( 4 )
+
+-- a farm of processes, each one gets its index first
+local base = 100
+local handles = luaproc.spawn(8, function (i, step)
+  return i, base + i * step
+end, 10)
+
+print('spawned', #handles)
+for i, h in ipairs(handles) do
+  print('process', h:join())
+end
+
+-- options are the same as in newproc
+local g = luaproc.group()
+luaproc.newchannel('farm')
+luaproc.spawn(3, function (i)
+  luaproc.send('farm', i)
+end, {group = g})
+local sum = 0
+for i = 1, 3 do sum = sum + luaproc.receive('farm') end
+print('sum', sum, 'wait', g:wait())
+
+-- nothing to spawn
+print('empty', #luaproc.spawn(0, function () end))
+
+-- arguments are checked before anything runs
+print(luaproc.spawn(2, function () end, {}, {1, 2}))
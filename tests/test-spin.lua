@@ -0,0 +1,27 @@
+-- ping-pong between processes on different workers
+
+luaproc = require "luaproc"
+
+luaproc.setnumworkers( 2 )
+luaproc.setspin( 10000 )
+print('spin', luaproc.getspin())
+
+luaproc.newchannel('ping')
+luaproc.newchannel('pong')
+
+local N = 10000
+
+luaproc.newproc(function ()
+  for i = 1, N do
+    luaproc.send('ping', i)
+    luaproc.receive('pong')
+  end
+end)
+
+luaproc.newproc(function ()
+  for i = 1, N do
+    local v = luaproc.receive('ping')
+    luaproc.send('pong', v)
+  end
+  print('done', N)
+end)
@@ -0,0 +1,47 @@
+luaproc = require "luaproc"
+
+-- create additional workers
+luaproc.setnumworkers( 4 )
+
+local sem = luaproc.semaphore(2)
+local wg = luaproc.waitgroup()
+local bar = luaproc.barrier(4)
+local cnt = luaproc.atomic()
+
+-- at most 2 processes in the critical section
+local inside = luaproc.atomic()
+
+for i = 1, 4 do
+  wg:add()
+  luaproc.newproc(function (id, sem, wg, bar, cnt, inside)
+    for _ = 1, 10 do
+      sem:acquire()
+      local n = inside:add()
+      if n > 2 then print('semaphore failed', n) end
+      luaproc.sleep(0.001)
+      inside:add(-1)
+      sem:release()
+    end
+    -- phases
+    for phase = 1, 3 do
+      cnt:add()
+      if bar:wait() then print('phase', phase, cnt:get()) end
+      bar:wait()
+    end
+    wg:done()
+  end, i, sem, wg, bar, cnt, inside)
+end
+
+print('wait', wg:wait())
+print('count', cnt:get(), sem:count(), wg:count())
+
+-- timeouts and non blocking calls
+print('tryacquire', sem:tryacquire(), sem:tryacquire(), sem:tryacquire())
+print('acquire', sem:acquire(0.1))
+wg:add()
+print('wait', wg:wait(0.1))
+print('negative', pcall(wg.add, wg, -2))
+
+-- atomics
+print('set', cnt:set(5), cnt:get())
+print('cas', cnt:cas(5, 6), cnt:cas(5, 7), cnt:get())
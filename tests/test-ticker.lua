@@ -0,0 +1,59 @@
+-- ticks delivered by the scheduler, without a timer process
+
+luaproc = require "luaproc"
+
+luaproc.setnumworkers( 2 )
+
+assert(luaproc.ticker('tick', 0.1))
+assert(not luaproc.ticker('tick', 0.1))  -- one timer per channel
+
+-- processes waiting on the channel all get the tick
+luaproc.newproc(function ()
+  for i = 1, 3 do
+    local t, drift, missed = luaproc.receive('tick')
+    print('proc tick', i, drift, missed)
+  end
+end)
+
+local last
+for i = 1, 5 do
+  local t, drift, missed = luaproc.receive('tick')
+  print('main tick', i, string.format('%.6f', drift), missed)
+  assert(drift >= 0 and missed >= 0)
+  if last then
+    -- ticks are on a grid, possibly skipping missed ones
+    local n = (t - last) / 0.1
+    assert(math.abs(n - math.floor(n + 0.5)) < 1e-3)
+  end
+  last = t
+end
+
+-- a busy receiver finds the latest tick and the count of dropped ones
+luaproc.sleep(0.35)
+local t, drift, missed = luaproc.receive('tick')
+print('late tick', drift, missed)
+assert(missed >= 2)
+assert(luaproc.delchannel('tick'))
+
+-- single tick as a timeout
+assert(luaproc.after('timeout', 0.05))
+local t, drift = luaproc.receive('timeout')
+print('timeout', drift)
+assert(luaproc.delchannel('timeout'))
+
+-- ticks are on time while all the workers are busy
+assert(luaproc.newchannel('stop'))
+for i = 1, 2 do
+  luaproc.newproc(function ()
+    while not luaproc.receive('stop', true) do end
+  end)
+end
+assert(luaproc.after('busy', 0.05))
+local t, drift = luaproc.receive('busy')
+print('busy', drift)
+assert(drift < 0.2)
+for i = 1, 2 do luaproc.send('stop', true) end
+assert(luaproc.delchannel('busy'))
+
+luaproc.wait()
+print('done')
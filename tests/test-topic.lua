@@ -0,0 +1,42 @@
+luaproc = require "luaproc"
+
+-- create an additional worker
+luaproc.setnumworkers( 2 )
+
+luaproc.newtopic 't1'
+luaproc.newchannel 'ready'
+
+-- subscribers in processes
+for i = 1, 2 do
+  luaproc.newproc(function (id)
+    local sub = luaproc.subscribe 't1'
+    luaproc.send('ready', id)
+    while true do
+      local v, s = sub:receive()
+      if v == nil then break end
+      print('proc' .. id, v, s)
+    end
+  end, i)
+end
+luaproc.receive 'ready'
+luaproc.receive 'ready'
+
+-- subscriber with short queue in the main state
+local sub = luaproc.subscribe('t1', 2)
+
+for i = 1, 5 do
+  print('publish', luaproc.publish('t1', i, 'msg' .. i))
+end
+
+print('main', sub:receive())
+print('main', sub:receive())
+print('main', sub:receive(true))
+print('dropped', sub:dropped())
+
+sub:unsubscribe()
+print('after unsubscribe', luaproc.publish('t1', 6, 'msg6'))
+print('unsupported', luaproc.publish('t1', {}))
+
+luaproc.sleep(0.5)
+luaproc.deltopic 't1'
+print('closed', luaproc.publish('t1', 7))